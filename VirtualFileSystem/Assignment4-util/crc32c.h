@@ -0,0 +1,164 @@
+/*
+ * crc32c.h
+ *
+ * CRC-32C (Castagnoli), the checksum of the block checksum map.
+ * On x86 processors with SSE4.2 it is computed with the crc32
+ * instruction, 8 bytes at a time; elsewhere with a portable
+ * slicing-by-8 table. Both give the same results.
+ *
+ * crc32c_init must be called once before the first checksum and
+ * before any thread computes one.
+ */
+
+#ifndef CRC32C_H_
+#define CRC32C_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78u     /* reversed Castagnoli polynomial */
+
+static uint32_t crc32c_table[8][256];
+static int      crc32c_hw;          /* use the SSE4.2 crc32 instruction */
+
+/**
+ * CRC-32C with the portable slicing-by-8 table.
+ *
+ * @param crc the CRC of the preceding bytes, 0 to start
+ * @param buf the bytes
+ * @param len number of bytes
+ * @return the CRC of the preceding bytes and buf
+ */
+static uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+/**
+ * CRC-32C with the SSE4.2 crc32 instruction. Only called if the
+ * processor has it.
+ *
+ * @param crc the CRC of the preceding bytes, 0 to start
+ * @param buf the bytes
+ * @param len number of bytes
+ * @return the CRC of the preceding bytes and buf
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t)p & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+#endif
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return ~crc;
+}
+#endif
+
+/**
+ * Build the portable table and check for SSE4.2.
+ */
+static void crc32c_init(void)
+{
+    int i, j;
+    for (i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc32c_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++) {
+            uint32_t c = crc32c_table[j - 1][i];
+            crc32c_table[j][i] = crc32c_table[0][c & 0xff] ^ (c >> 8);
+        }
+    }
+#ifdef CRC32C_X86
+    crc32c_hw = __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+/**
+ * CRC-32C of a buffer, continuing from the CRC of preceding bytes.
+ *
+ * @param crc the CRC of the preceding bytes, 0 to start
+ * @param buf the bytes
+ * @param len number of bytes
+ * @return the CRC of the preceding bytes and buf
+ */
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+#ifdef CRC32C_X86
+    if (crc32c_hw)
+        return crc32c_sse42(crc, buf, len);
+#endif
+    return crc32c_sw(crc, buf, len);
+}
+
+/**
+ * Checksum of a file system block as kept in the checksum map:
+ * the CRC-32C of its block number and contents, never 0.
+ *
+ * @param blk the block number
+ * @param buf the block contents, FS_BLOCK_SIZE bytes
+ * @return the checksum
+ */
+static uint32_t crc32c_block(uint32_t blk, const void *buf)
+{
+    uint8_t le[4] = {blk & 0xff, (blk >> 8) & 0xff, (blk >> 16) & 0xff, blk >> 24};
+    uint32_t crc = crc32c(crc32c(0, le, 4), buf, FS_BLOCK_SIZE);
+    return crc != 0 ? crc : 1;
+}
+
+#endif /* CRC32C_H_ */
@@ -11,16 +11,30 @@ enum {
 	FS_MAGIC = 0x37363030		/* magic number for superblock */
 };
 
+/** superblock state: cleared at mount, set by a clean unmount */
+enum {FS_STATE_DIRTY = 0, FS_STATE_CLEAN = 1};
+
 /**
- *  Entry in a directory
+ * Entry in a directory. Entries have variable length, like ext2's:
+ * the rec_len of each entry is the distance to the next, and the
+ * entries of a block span it exactly. An entry with inode 0 is
+ * unused; removing an entry adds its space to the one before it,
+ * and a new entry takes the unused tail of an existing one. An
+ * empty directory block holds a single unused entry (or zeros).
  */
-enum {FS_FILENAME_SIZE = 28 };	/* max file name length */
+enum {FS_NAME_MAX = 255};		/* max file name length */
 struct fs_dirent {
-    uint32_t valid : 1;			/* entry valid flag */
-    uint32_t isDir : 1;			/* entry is directory flag */
-    uint32_t inode : 30;		/* entry inode */
-    char name[FS_FILENAME_SIZE];/* with trailing NUL */
-};								/* total 32 bytes */
+    uint32_t inode;				/* entry inode, 0 if unused */
+    uint16_t rec_len;			/* bytes from this entry to the next */
+    uint8_t  name_len;			/* bytes of name, no trailing NUL */
+    uint8_t  type;				/* FS_DT_* */
+    char name[];				/* name_len bytes */
+};								/* 8 bytes + name, padded to 4 */
+enum {FS_DT_UNKNOWN = 0, FS_DT_REG = 1, FS_DT_DIR = 2, FS_DT_LNK = 7};
+#define FS_DIRENT_LEN(name_len) ((sizeof(struct fs_dirent) + (name_len) + 3) & ~3)
+
+/** length of snapshot names, with trailing NUL */
+enum {FS_FILENAME_SIZE = 28 };
 
 /**
  * Superblock - holds file system parameters.
@@ -32,15 +46,105 @@ struct fs_super {
     uint32_t block_map_sz;		/* block map size in blocks */
     uint32_t num_blocks;		/* total blocks, including SB, bitmaps, inodes */
     uint32_t root_inode;		/* always inode 1 */
+    uint32_t state;				/* FS_STATE_CLEAN after a clean unmount */
+    uint32_t free_blocks;		/* free block count, valid if clean */
+    uint32_t free_inodes;		/* free inode count, valid if clean */
+    uint32_t refcount_map;		/* first block of refcount map, 0 if none */
+    uint32_t refcount_map_sz;	/* refcount map size in blocks */
+    uint32_t snap_table;		/* snapshot table block, 0 if none */
+    uint32_t csum_map;			/* first block of checksum map, 0 if none */
+    uint32_t csum_map_sz;		/* checksum map size in blocks */
+    uint32_t csum_flags;		/* FS_CSUM_* - blocks with checksums */
+    uint32_t scrub_cursor;		/* next block the scrubber verifies */
+    uint32_t dedup_map;			/* first block of dedup map, 0 if none */
+    uint32_t dedup_map_sz;		/* dedup map size in blocks */
+    uint32_t frag_map;			/* first block of fragment map, 0 if none */
+    uint32_t frag_map_sz;		/* fragment map size in blocks */
 
     /* pad out to an entire block */
-    char pad[FS_BLOCK_SIZE - 6 * sizeof(uint32_t)]; 
+    char pad[FS_BLOCK_SIZE - 20 * sizeof(uint32_t)]; 
+};								/* total FS_BLOCK_SIZE bytes */
+
+/**
+ * Refcount map - one 16-bit count per block of the extra references
+ * to it from files sharing it copy-on-write; 0 for blocks with one
+ * owner or none. Created by the first reflink copy.
+ */
+enum {REFS_PER_BLK = FS_BLOCK_SIZE / sizeof(uint16_t), FS_REFCOUNT_MAX = 0xfffe};
+
+/**
+ * Checksum map - one 32-bit CRC32C per block, of the block number
+ * (4 bytes, little-endian) followed by the block contents, with a
+ * result of 0 stored as 1. An entry of 0 means the block has no
+ * checksum: the superblock, the checksum map itself, free blocks,
+ * and data blocks unless FS_CSUM_DATA is set. Created by mkfs.
+ */
+enum {FS_CSUM_META = 0x1, FS_CSUM_DATA = 0x2};
+enum {CSUMS_PER_BLK = FS_BLOCK_SIZE / sizeof(uint32_t)};
+
+/**
+ * Dedup map - one 32-bit content hash per block, the CRC-32C of
+ * the block contents alone with a result of 0 stored as 1, for the
+ * data blocks that new writes may share; 0 for every other block.
+ * No two blocks have the same hash. Created by the first mount
+ * with -dedup or the first dedupe pass, and only trusted after a
+ * clean unmount.
+ */
+enum {HASHES_PER_BLK = FS_BLOCK_SIZE / sizeof(uint32_t)};
+
+/**
+ * Tail packing - the last partial block of a pointer-mapped file
+ * may be stored in FS_FRAG_SIZE-byte fragments of a block shared
+ * with the tails of other files. Its pointer slot then holds a
+ * fragment address: FS_BLK_FRAG, the fragment block number, the
+ * number of fragments less one and the first fragment. Bytes of
+ * the fragments past the end of the file are zero.
+ *
+ * Fragment map - one byte per block, the mask of its fragments in
+ * use; 0 for blocks that are not fragment blocks. Created by the
+ * first packed tail, and only trusted after a clean unmount.
+ */
+enum {FS_FRAG_SIZE = 128, FS_FRAGS_PER_BLK = FS_BLOCK_SIZE / FS_FRAG_SIZE};
+enum {FRAG_MASKS_PER_BLK = FS_BLOCK_SIZE};
+#define FS_BLK_FRAG          0x80000000u
+#define FS_FRAG_BLK_MAX      (1u << 25)
+#define FS_IS_FRAG(p)        (((uint32_t)(p) & FS_BLK_FRAG) && (uint32_t)(p) != FS_BLK_COMPRESSED)
+#define FS_FRAG_BLK(p)       (((uint32_t)(p) & ~FS_BLK_FRAG) >> 6)
+#define FS_FRAG_COUNT(p)     ((((uint32_t)(p) >> 3) & 7) + 1)
+#define FS_FRAG_FIRST(p)     ((uint32_t)(p) & 7)
+#define FS_FRAG_ADDR(blk, first, n) (FS_BLK_FRAG | (uint32_t)(blk) << 6 | ((n) - 1) << 3 | (first))
+
+/**
+ * Snapshots - the snapshot table block lists up to FS_SNAP_MAX
+ * read-only snapshots of the file system. A snapshot shares every
+ * block with the live file system until the live copy changes:
+ * before a block the snapshot still uses is overwritten in place,
+ * its old contents are copied to a new block and the pair is
+ * recorded in the snapshot's chain of exception blocks.
+ */
+enum {FS_SNAP_MAX = 16};
+struct fs_snapshot {
+    char name[FS_FILENAME_SIZE];/* with trailing NUL, empty if unused */
+    uint32_t ctime;				/* creation time */
+    uint32_t exc_blk;			/* first exception block, 0 if none */
+    uint32_t pad;
+};								/* total 40 bytes */
+
+enum {FS_SNAP_EXC_PER_BLK = (FS_BLOCK_SIZE - 2 * sizeof(uint32_t)) / (2 * sizeof(uint32_t))};
+struct fs_snap_exc {
+    uint32_t next;				/* next exception block, 0 at end */
+    uint32_t count;				/* entries in use */
+    struct {
+        uint32_t orig;			/* block as seen by the snapshot */
+        uint32_t copy;			/* block holding its contents */
+    } e[FS_SNAP_EXC_PER_BLK];
 };								/* total FS_BLOCK_SIZE bytes */
 
 /**
  * Inode - holds file entry information
  */
 enum {N_DIRECT = 6 };			/* number direct entries */
+enum {FS_XATTR_INLINE = 64};	/* bytes of extended attributes in an inode */
 struct fs_inode {
     uint16_t uid;				/* user ID of file owner */
     uint16_t gid;				/* group ID of file owner */
@@ -51,18 +155,139 @@ struct fs_inode {
     uint32_t direct[N_DIRECT];	/* direct block pointers */
     uint32_t indir_1;			/* single indirect block pointer */
     uint32_t indir_2;			/* double indirect block pointer */
-    uint32_t pad[3];            /* 64 bytes per inode */
-};								/* total 64 bytes */
+    uint32_t flags;				/* FS_FL_* inode flags */
+    uint32_t nlink;				/* directory entries naming it, 0 = 1 */
+    uint32_t xattr_blk;			/* extended attribute block, 0 if none */
+    uint8_t  xattr[FS_XATTR_INLINE];	/* extended attributes, see below */
+};								/* total 128 bytes */
+
+/**
+ * Inode flags
+ *   FS_FL_INLINE  - file data is stored in the inode itself, in the
+ *                   FS_INLINE_MAX bytes of direct[], indir_1 and indir_2
+ *   FS_FL_EXTENTS - blocks are mapped by an extent tree whose root
+ *                   replaces direct[], indir_1 and indir_2
+ *   FS_FL_COMPRESS - file data is stored in compressed clusters; on
+ *                   a directory, files created in it are compressed
+ *   FS_FL_TAIL    - the last block of the file is a packed tail
+ */
+enum {FS_FL_INLINE = 0x1, FS_FL_EXTENTS = 0x2, FS_FL_COMPRESS = 0x4, FS_FL_TAIL = 0x8};
+enum {FS_INLINE_MAX = (N_DIRECT + 2) * sizeof(uint32_t)};
+
+/**
+ * Symbolic links hold their target, size bytes with no trailing NUL.
+ * A target of up to FS_INLINE_MAX bytes is stored in the inode, with
+ * FS_FL_INLINE; a longer one, of up to FS_SYMLINK_MAX bytes, in the
+ * block at direct[0].
+ */
+enum {FS_SYMLINK_MAX = FS_BLOCK_SIZE - 1};
+
+/**
+ * Extended attributes. An inode keeps those that fit in its xattr[]
+ * area and the rest in the block at xattr_blk. Both hold a list of
+ * entries, each a struct fs_xattr followed by the name and value
+ * and padded to 4 bytes, ended by an entry with name_len 0 or by
+ * the end of the area. An xattr block starts with a header and is
+ * shared by all inodes whose block attributes are the same;
+ * refcount counts them.
+ */
+struct fs_xattr {
+    uint8_t  name_len;			/* bytes of name, 0 ends the list */
+    uint8_t  pad;
+    uint16_t value_len;			/* bytes of value */
+    char name[];				/* name, then value, no NULs */
+};
+#define FS_XATTR_LEN(name_len, value_len) \
+    ((sizeof(struct fs_xattr) + (name_len) + (value_len) + 3) & ~3)
+struct fs_xattr_header {
+    uint32_t magic;				/* FS_XATTR_MAGIC */
+    uint32_t refcount;			/* inodes sharing the block */
+    uint32_t pad[2];
+};
+enum {FS_XATTR_MAGIC = 0x78617472,	/* "xatr" */
+      FS_XATTR_BLOCK_SPACE = FS_BLOCK_SIZE - sizeof(struct fs_xattr_header)};
+
+/**
+ * Mode bit requesting an extent-mapped file from mknod or chmod.
+ * It is above the S_IFMT bits and is never stored in the inode.
+ * The kernel drops it, so it only works from the command line
+ * tool; a mounted file system sets the attribute user.x600.extents
+ * on an empty file instead.
+ */
+enum {FS_MODE_EXTENTS = 0200000};
+
+/**
+ * Mode bit requesting a compressed file (or a directory whose new
+ * files are compressed) from mknod, mkdir or chmod. Like
+ * FS_MODE_EXTENTS it is never stored in the inode and only works
+ * from the command line tool; a mounted file system is given
+ * -compress, or sets the attribute user.x600.compress on an empty
+ * file or a directory.
+ */
+enum {FS_MODE_COMPRESS = 0400000};
+
+/**
+ * Compressed files are pointer-mapped in clusters of FS_CLUSTER_BLKS
+ * logical blocks. A cluster that compresses into fewer blocks has
+ * FS_BLK_COMPRESSED in its first pointer slot, then the compressed
+ * blocks - an fs_cluster_hdr followed by the LZ4 stream - in the
+ * next slots, and holes in the rest. Other clusters are stored raw.
+ */
+enum {FS_CLUSTER_BLKS = 8};
+#define FS_BLK_COMPRESSED 0xffffffffu
+
+struct fs_cluster_hdr {
+    uint32_t clen;				/* bytes of LZ4 data that follow */
+    uint32_t ulen;				/* bytes of data they expand to */
+};
+
+/**
+ * Extent tree. Each node starts with a header; leaf nodes
+ * (depth 0) hold extents and index nodes hold child pointers,
+ * both sorted by logical block. The root node lives in the inode.
+ */
+struct fs_extent_header {
+    uint16_t magic;				/* FS_EXT_MAGIC */
+    uint16_t entries;			/* number of valid entries */
+    uint16_t max;				/* capacity of node */
+    uint16_t depth;				/* 0 for leaf nodes */
+};								/* total 8 bytes */
+
+struct fs_extent {
+    uint32_t logical;			/* first logical block */
+    uint32_t physical;			/* first physical block */
+    uint32_t len;				/* number of blocks */
+};								/* total 12 bytes */
+
+struct fs_extent_idx {
+    uint32_t logical;			/* first logical block under child */
+    uint32_t child;				/* block holding the child node */
+};								/* total 8 bytes */
+
+enum {
+    FS_EXT_MAGIC = 0xf30a,
+    FS_EXT_ROOT_EXTENTS = (FS_INLINE_MAX - sizeof(struct fs_extent_header)) / sizeof(struct fs_extent),
+    FS_EXT_ROOT_IDX = (FS_INLINE_MAX - sizeof(struct fs_extent_header)) / sizeof(struct fs_extent_idx),
+    FS_EXT_BLK_EXTENTS = (FS_BLOCK_SIZE - sizeof(struct fs_extent_header)) / sizeof(struct fs_extent),
+    FS_EXT_BLK_IDX = (FS_BLOCK_SIZE - sizeof(struct fs_extent_header)) / sizeof(struct fs_extent_idx)
+};
+
+/**
+ * High bit of fs_extent.len: the extent was preallocated and not
+ * yet written, so its blocks read as zeros.
+ */
+#define FS_EXT_UNWRITTEN 0x80000000u
+#define FS_EXT_LEN(ex)   ((ex)->len & ~FS_EXT_UNWRITTEN)
 
 /**
  * Constants for blocks
- *   DIRENTS_PER_BLK   - number of directory entries per block
+ *   DIRENTS_PER_BLK   - most directory entries a block can hold
  *   INODES_PER_BLOCK  - number of inodes per block
  *   PTRS_PER_BLOCK    - number of inode pointers per block
  *   BITS_PER_BLOCK    - number of bits per block
  */
 enum {
-    DIRENTS_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_dirent),
+    DIRENTS_PER_BLK = FS_BLOCK_SIZE / FS_DIRENT_LEN(1),
 	INODES_PER_BLK = FS_BLOCK_SIZE / sizeof(struct fs_inode),
     PTRS_PER_BLK = FS_BLOCK_SIZE / sizeof(uint32_t),
 	BITS_PER_BLK = FS_BLOCK_SIZE * 8
@@ -14,6 +14,7 @@
 #include <sys/stat.h>
 
 #include "fsx600.h"
+#include "crc32c.h"
 
 char *disk;
 
@@ -31,16 +32,28 @@ int parseint(char *s)
 
 #define DIV_ROUND_UP(n, m) ((n) + (m) - 1) / (m)
 
-/* usage: mkfs-x6 [-size #] file.img
+/* usage: mkfs-x6 [-size #] [-csum | -csum-data] file.img
  * If file doesn't exist, create with size '#' (K and M suffixes allowed)
+ * -csum adds a checksum map covering metadata blocks, -csum-data
+ * one covering data blocks too.
  */
 int main(int argc, char **argv)
 {
-    int i, fd = -1, size = 0;
-    if (!strcmp(argv[1], "-size") && argc >= 3) {
-        size = parseint(argv[2]);
-        argv += 2;
-        argc -= 2;
+    int i, fd = -1, size = 0, csum_flags = 0;
+    while (argc >= 2 && argv[1][0] == '-') {
+        if (!strcmp(argv[1], "-size") && argc >= 3) {
+            size = parseint(argv[2]);
+            argv++;
+            argc--;
+        }
+        else if (!strcmp(argv[1], "-csum"))
+            csum_flags = FS_CSUM_META;
+        else if (!strcmp(argv[1], "-csum-data"))
+            csum_flags = FS_CSUM_META | FS_CSUM_DATA;
+        else
+            break;
+        argv++;
+        argc--;
     }
 
     if (argc == 2) {
@@ -52,7 +65,7 @@ int main(int argc, char **argv)
         }
     }
     if (fd < 0) {
-        printf("usage: mkfs-x6 [-size #] file.img\n");
+        printf("usage: mkfs-x6 [-size #] [-csum | -csum-data] file.img\n");
         exit(1);
     }
 
@@ -84,23 +97,36 @@ int main(int argc, char **argv)
     int rootdir_base = inode_base + n_ino_blks;
     struct fs_dirent *de = (void*)(disk + rootdir_base*FS_BLOCK_SIZE);
 
+    /* checksum map, if any, follows the root directory */
+    int csum_base = csum_flags ? rootdir_base + 1 : 0;
+    int n_csum_blks = csum_flags ? DIV_ROUND_UP(n_blks, CSUMS_PER_BLK) : 0;
+    uint32_t *csums = (void*)(disk + csum_base*FS_BLOCK_SIZE);
+
     /* superblock */
     *sb = (struct fs_super){.magic = FS_MAGIC, .inode_map_sz = n_ino_map_blks,
                             .inode_region_sz = n_ino_blks,
                             .block_map_sz = n_map_blks,
-                            .num_blocks = n_blks, .root_inode = 1};
+                            .num_blocks = n_blks, .root_inode = 1,
+                            .state = FS_STATE_CLEAN,
+                            .free_blocks = n_blks - (rootdir_base + 1) - n_csum_blks,
+                            .free_inodes = n_ino_blks * INODES_PER_BLK - 2,
+                            .csum_map = csum_base, .csum_map_sz = n_csum_blks,
+                            .csum_flags = csum_flags};
 
     /* bitmaps */
     FD_SET(0, inode_map);
     FD_SET(1, inode_map);
-    for (i = 0; i <= rootdir_base; i++)
+    for (i = 0; i <= rootdir_base + n_csum_blks; i++)
         FD_SET(i, block_map);
 
     int t  = time(NULL);
     inodes[1] = (struct fs_inode){.uid = 1001, .gid = 125, .mode = 0040777, 
                                   .ctime = t, .mtime = t, .size = 1024,
                                   .direct = {rootdir_base, 0, 0, 0, 0, 0},
-                                  .indir_1 = 0, .indir_2 = 0};
+                                  .indir_1 = 0, .indir_2 = 0, .nlink = 1};
+
+    /* empty root directory: one unused entry spanning the block */
+    de->rec_len = FS_BLOCK_SIZE;
 
     /* remember (from /usr/include/i386-linux-gnu/bits/stat.h)
      *    S_IFDIR = 0040000 - directory
@@ -109,9 +135,17 @@ int main(int argc, char **argv)
     /* block 0 - superblock  [layout for 1MB file]
      *       1 - inode map
      *       2 - block map
-     *       3,4,5,6 - inodes
-     *       7 - root directory (inode 1)
+     *       3-34 - inodes
+     *       35 - root directory (inode 1)
+     *       36-39 - checksum map, with -csum
      */
+
+    /* checksums of everything but the superblock and the map */
+    if (csum_flags) {
+        crc32c_init();
+        for (i = 1; i <= rootdir_base; i++)
+            csums[i] = crc32c_block(i, disk + i*FS_BLOCK_SIZE);
+    }
                       
 
     assert(size == n_blks* FS_BLOCK_SIZE);
@@ -17,6 +17,31 @@ fd_set *inode_map;
 fd_set *block_map;
 void *next_ptr;
 
+/* append an entry at *off in a directory block; inum 0 leaves an
+ * unused entry with a stale name
+ */
+void put_dirent(void *blk, int *off, int inum, int type, char *name)
+{
+    struct fs_dirent *de = blk + *off;
+    int len = strlen(name);
+    de->inode = inum;
+    de->rec_len = FS_DIRENT_LEN(len);
+    de->name_len = len;
+    de->type = type;
+    memcpy(de->name, name, len);
+    *off += de->rec_len;
+}
+
+/* give the last entry of a directory block the rest of the block
+ */
+void end_dir(void *blk, int off)
+{
+    int last = 0;
+    while (last + ((struct fs_dirent*)(blk + last))->rec_len < off)
+        last += ((struct fs_dirent*)(blk + last))->rec_len;
+    ((struct fs_dirent*)(blk + last))->rec_len = FS_BLOCK_SIZE - last;
+}
+
 int main(int argc, char **argv)
 {
 	if (argc != 2) {
@@ -53,12 +78,12 @@ int main(int argc, char **argv)
     /* block 0 - superblock
      *       1 - inode map
      *       2 - block map
-     *       3,4,5,6 - inodes
-     *       7 - root directory (inode 1)
-     *      [8 - file]
+     *       3..10 - inodes
+     *       11 - root directory (inode 1)
+     *      [12 - file]
      */
                       
-    struct fs_inode *inodes = ptr; ptr += 4*FS_BLOCK_SIZE;
+    struct fs_inode *inodes = ptr; ptr += n_ino_blks*FS_BLOCK_SIZE;
 
     /* root directory
      */
@@ -66,24 +91,22 @@ int main(int argc, char **argv)
     int root_inum = inum++;
     FD_SET(root_inum, inode_map); // root inode allocated
     int root_blk = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    struct fs_dirent *root_de = ptr; ptr += FS_BLOCK_SIZE;
+    void *root_de = ptr; ptr += FS_BLOCK_SIZE;
+    int root_off = 0;
 
     int t = 0x50000000;
     inodes[root_inum] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0040777, 
                                           .ctime = t, .mtime = t,
                                           .size = 1024,
                                           .direct = {root_blk, 0, 0, 0, 0, 0},
-                                          .indir_1 = 0, .indir_2 = 0};
+                                          .indir_1 = 0, .indir_2 = 0, .nlink = 1};
 
 
     /*  "/file.A", 1000 bytes, permission 777
      */
     int f1_inode = inum++;
-    root_de[0] = (struct fs_dirent){.valid = 0, .isDir = 0,
-                                    .inode = 1717, .name = "file.A"};
-
-    root_de[1] = (struct fs_dirent){.valid = 1, .isDir = 0,
-                                    .inode = f1_inode, .name = "file.A"};
+    put_dirent(root_de, &root_off, 0, FS_DT_REG, "file.A");
+    put_dirent(root_de, &root_off, f1_inode, FS_DT_REG, "file.A");
     int f1_blk = (ptr - (void*)disk) / FS_BLOCK_SIZE;
     void *f1_ptr = ptr; ptr += FS_BLOCK_SIZE;
     
@@ -92,23 +115,22 @@ int main(int argc, char **argv)
                                          .ctime = t+200, .mtime = t+200,
                                          .size = 1000,
                                          .direct = {f1_blk, 0, 0, 0, 0, 0},
-                                         .indir_1 = 0, .indir_2 = 0};
+                                         .indir_1 = 0, .indir_2 = 0, .nlink = 1};
     /* "/dir1/", directory, permission 755
      * note invalid directory entry for testing...
      */
     int d1_inode = inum++;
-    root_de[3] = (struct fs_dirent){.valid = 0, .isDir = 1,
-                                        .inode = f1_inode, .name = "dir1"};
-    root_de[5] = (struct fs_dirent){.valid = 1, .isDir = 1,
-                                        .inode = d1_inode, .name = "dir1"};
+    put_dirent(root_de, &root_off, 0, FS_DT_DIR, "dir1");
+    put_dirent(root_de, &root_off, d1_inode, FS_DT_DIR, "dir1");
     int d1_blk = (ptr - (void*)disk) / FS_BLOCK_SIZE;
-    struct fs_dirent *d1_de = ptr; ptr += FS_BLOCK_SIZE;
+    void *d1_de = ptr; ptr += FS_BLOCK_SIZE;
+    int d1_off = 0;
     
     inodes[d1_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0040755, 
                                          .ctime = t+400, .mtime = t+400,
                                          .size = 0,
                                          .direct = {d1_blk, 0, 0, 0, 0, 0},
-                                         .indir_1 = 0, .indir_2 = 0};
+                                         .indir_1 = 0, .indir_2 = 0, .nlink = 1};
 
     /* "/dir1/file.2", file, 2012 bytes
      */
@@ -117,26 +139,24 @@ int main(int argc, char **argv)
     void *f2_ptr = ptr; ptr += FS_BLOCK_SIZE;
     int f2_blk2 = (ptr - (void*)disk) / FS_BLOCK_SIZE; ptr += FS_BLOCK_SIZE;
 
-    d1_de[3] = (struct fs_dirent){.valid = 1, .isDir = 0,
-                                  .inode = f2_inode, .name = "file.2"};
+    put_dirent(d1_de, &d1_off, f2_inode, FS_DT_REG, "file.2");
 
     memset(f2_ptr, '2', 2 * FS_BLOCK_SIZE);
     inodes[f2_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                          .ctime = t+200, .mtime = t+200,
                                          .size = 2012,
                                          .direct = {f2_blk2, f2_blk1, 0, 0, 0, 0},
-                                         .indir_1 = 0, .indir_2 = 0};
+                                         .indir_1 = 0, .indir_2 = 0, .nlink = 1};
 
     /* "/dir1/file.0", zero-length file
      */
     int f3_inode = inum++;
-    d1_de[4] = (struct fs_dirent){.valid = 1, .isDir = 0,
-                                        .inode = f3_inode, .name = "file.0"};
+    put_dirent(d1_de, &d1_off, f3_inode, FS_DT_REG, "file.0");
     inodes[f3_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                          .ctime = t+200, .mtime = t+200,
                                          .size = 0,
                                          .direct = {0, 0, 0, 0, 0, 0},
-                                         .indir_1 = 0, .indir_2 = 0};
+                                         .indir_1 = 0, .indir_2 = 0, .nlink = 1};
 
     /* "/file.7", 7KB file
      */
@@ -146,13 +166,12 @@ int main(int argc, char **argv)
     int f4_blk0 = (ptr - (void*)disk) / FS_BLOCK_SIZE;
     void *f4_data = ptr; ptr += 7*FS_BLOCK_SIZE;
 
-    root_de[6] = (struct fs_dirent){.valid = 1, .isDir = 0,
-                                    .inode = f4_inode, .name = "file.7"};
+    put_dirent(root_de, &root_off, f4_inode, FS_DT_REG, "file.7");
     inodes[f4_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                          .ctime = t+300, .mtime = t+300,
                                          .size = 6*1024 + 500,
                                          .direct = {0, 0, 0, 0, 0, 0},
-                                         .indir_1 = f4_indirN, .indir_2 = 0};
+                                         .indir_1 = f4_indirN, .indir_2 = 0, .nlink = 1};
     // fill in the direct block numbers
     for (i = 0; i < 6; i++) {
         inodes[f4_inode].direct[i] = f4_blk0++;
@@ -176,13 +195,12 @@ int main(int argc, char **argv)
     int f5_blk0 = (ptr - (void*)disk) / FS_BLOCK_SIZE;
     void *f5_data = ptr; ptr += 270*FS_BLOCK_SIZE;
 
-    d1_de[6] = (struct fs_dirent){.valid = 1, .isDir = 0,
-                                  .inode = f5_inode, .name = "file.270"};
+    put_dirent(d1_de, &d1_off, f5_inode, FS_DT_REG, "file.270");
     inodes[f5_inode] = (struct fs_inode){.uid = 1000, .gid = 1000, .mode = 0100777, 
                                              .ctime = t+300, .mtime = t+300,
                                              .size = 269*1024 + 721,
                                              .direct = {0, 0, 0, 0, 0, 0},
-                                             .indir_1 = 0, .indir_2 = 0};
+                                             .indir_1 = 0, .indir_2 = 0, .nlink = 1};
     // fill in the direct block numbers
     for (i = 0; i < 6; i++) {
         inodes[f5_inode].direct[i] = f5_blk0++;
@@ -203,6 +221,9 @@ int main(int argc, char **argv)
     
     memset(f5_data, 'K', 269*1024+721);
 
+    end_dir(root_de, root_off);
+    end_dir(d1_de, d1_off);
+
     // mark inodes allocated in inode map
     for (i = 0; i < inum; i++) {
         FD_SET(i, inode_map);
@@ -13,14 +13,453 @@
 #include <time.h>
 
 #include "fsx600.h"
+#include "crc32c.h"
+
+/** number of references to each block found by the walk */
+static uint16_t *refs;
+
+/** fragments of each block reached by packed tails, and the number
+ * of packed tails */
+static uint8_t *frag_used;
+static int n_tails;
+
+/** number of inodes using each block as their xattr block */
+static uint16_t *xattr_refs;
+
+/**
+ * Record a reference to a block and mark it reached.
+ *
+ * @param blk the block number
+ * @param blkmap map of blocks reached so far
+ */
+static void use_blk(int blk, fd_set *blkmap)
+{
+    FD_SET(blk, blkmap);
+    refs[blk]++;
+}
+
+/**
+ * Count the entries of an xattr area, checking that they fit.
+ *
+ * @param area the entry list
+ * @param size the size of the area
+ * @return the number of entries, or -1 if one runs past the end
+ */
+static int count_xattrs(uint8_t *area, int size)
+{
+    int off = 0, n = 0;
+    while (off + (int)sizeof(struct fs_xattr) <= size) {
+        struct fs_xattr *xe = (void*)(area + off);
+        if (xe->name_len == 0)
+            break;
+        if (off + FS_XATTR_LEN(xe->name_len, xe->value_len) > size)
+            return -1;
+        off += FS_XATTR_LEN(xe->name_len, xe->value_len);
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Report on the extended attributes of an inode, and mark its xattr
+ * block reached. The block is counted in xattr_refs, not refs, as
+ * its sharing is counted in the block itself.
+ *
+ * @param disk the image in memory
+ * @param sb the superblock
+ * @param in the inode
+ * @param blkmap map of blocks reached so far
+ * @param block_map the block map of the image
+ */
+static void check_xattrs(void *disk, struct fs_super *sb, struct fs_inode *in,
+                         fd_set *blkmap, fd_set *block_map)
+{
+    int n_inl = count_xattrs(in->xattr, FS_XATTR_INLINE), n_blk = 0;
+    uint32_t b = in->xattr_blk;
+
+    if (n_inl < 0) {
+        printf("***ERROR*** bad xattr in inode\n");
+        n_inl = 0;
+    }
+    if (b != 0) {
+        struct fs_xattr_header *h = disk + b * FS_BLOCK_SIZE;
+        if (b >= sb->num_blocks || h->magic != FS_XATTR_MAGIC) {
+            printf("***ERROR*** bad xattr block %u\n", b);
+            return;
+        }
+        if (!FD_ISSET(b, block_map))
+            printf("***ERROR*** xattr block %u marked free\n", b);
+        FD_SET(b, blkmap);
+        xattr_refs[b]++;
+        n_blk = count_xattrs((uint8_t*)(h + 1), FS_XATTR_BLOCK_SPACE);
+        if (n_blk < 0) {
+            printf("***ERROR*** bad xattr in block %u\n", b);
+            n_blk = 0;
+        }
+    }
+    if (n_inl + n_blk > 0)
+        printf("xattrs: %d in inode, %d in block %u\n", n_inl, n_blk, b);
+}
+
+/**
+ * Block number held in a pointer slot, or the fragment block of a
+ * packed tail.
+ *
+ * @param p the pointer slot
+ * @return the block number
+ */
+static uint32_t slot_blk(uint32_t p)
+{
+    return FS_IS_FRAG(p) ? FS_FRAG_BLK(p) : p;
+}
 
 /**
- * Read and print memory summary of cs/5600/7600 file system
+ * Report one data block of a pointer-mapped file. The marker of a
+ * compressed cluster is printed as "c" and reaches no block. A
+ * packed tail is printed as "f<block>.<first>+<count>" and reaches
+ * its fragment block without counting a reference to it, since the
+ * block is shared with other tails.
+ *
+ * @param blk the pointer slot
+ * @param blkmap map of blocks reached so far
+ * @param block_map the block map of the image
+ * @param counts counts[0] is incremented for each data block and
+ *   counts[1] for each compressed cluster
+ */
+static void print_data_blk(uint32_t blk, fd_set *blkmap, fd_set *block_map, int *counts)
+{
+    if (blk == FS_BLK_COMPRESSED) {
+        printf("c ");
+        counts[1]++;
+        return;
+    }
+    if (FS_IS_FRAG(blk)) {
+        uint32_t fb = FS_FRAG_BLK(blk);
+        uint8_t mask = ((1 << FS_FRAG_COUNT(blk)) - 1) << FS_FRAG_FIRST(blk);
+        printf("f%u.%u+%u ", fb, FS_FRAG_FIRST(blk), FS_FRAG_COUNT(blk));
+        n_tails++;
+        FD_SET(fb, blkmap);
+        if (!FD_ISSET(fb, block_map))
+            printf("\n***ERROR*** fragment block %u marked free\n", fb);
+        if (frag_used[fb] & mask)
+            printf("\n***ERROR*** fragments of block %u used twice\n", fb);
+        frag_used[fb] |= mask;
+        return;
+    }
+    printf("%d ", blk);
+    counts[0]++;
+    use_blk(blk, blkmap);
+    if (!FD_ISSET(blk, block_map))
+        printf("\n***ERROR*** block %d marked free\n", blk);
+}
+
+/**
+ * Report on the blocks below an extent tree node, checking node
+ * headers and key order along the way.
+ *
+ * @param disk the image in memory
+ * @param hdr the node header
+ * @param blkmap map of blocks reached so far
+ * @param block_map the block map of the image
+ * @param nodes incremented for each tree block read
+ */
+static void check_extents(void *disk, struct fs_extent_header *hdr, fd_set *blkmap,
+                          fd_set *block_map, int *nodes)
+{
+    int i;
+    uint32_t b, prev_end = 0;
+    if (hdr->magic != FS_EXT_MAGIC || hdr->entries > hdr->max) {
+        printf("\n***ERROR*** bad extent node (magic %04x, %d/%d entries)\n",
+               hdr->magic, hdr->entries, hdr->max);
+        return;
+    }
+    if (hdr->depth == 0) {
+        struct fs_extent *ex = (void*)(hdr + 1);
+        for (i = 0; i < hdr->entries; i++) {
+            uint32_t len = FS_EXT_LEN(&ex[i]);
+            printf("%u+%u@%u%s ", ex[i].logical, len, ex[i].physical,
+                   (ex[i].len & FS_EXT_UNWRITTEN) ? "u" : "");
+            if (ex[i].logical < prev_end)
+                printf("\n***ERROR*** extent at %u overlaps previous\n", ex[i].logical);
+            prev_end = ex[i].logical + len;
+            for (b = ex[i].physical; b < ex[i].physical + len; b++) {
+                use_blk(b, blkmap);
+                if (!FD_ISSET(b, block_map))
+                    printf("\n***ERROR*** block %d marked free\n", b);
+            }
+        }
+        return;
+    }
+    struct fs_extent_idx *idx = (void*)(hdr + 1);
+    for (i = 0; i < hdr->entries; i++) {
+        if (i > 0 && idx[i].logical <= idx[i-1].logical)
+            printf("\n***ERROR*** extent index keys out of order\n");
+        use_blk(idx[i].child, blkmap);
+        if (!FD_ISSET(idx[i].child, block_map))
+            printf("\n***ERROR*** block %d marked free\n", idx[i].child);
+        struct fs_extent_header *child = disk + idx[i].child * FS_BLOCK_SIZE;
+        (*nodes)++;
+        if (child->depth != hdr->depth - 1)
+            printf("\n***ERROR*** extent node %d at wrong depth\n", idx[i].child);
+        else
+            check_extents(disk, child, blkmap, block_map, nodes);
+    }
+}
+
+/** blocks per read when scrubbing */
+#define SCRUB_BATCH 256
+
+/**
+ * Read blocks of the image.
+ *
+ * @param fd the image file
+ * @param first the first block number
+ * @param n number of blocks
+ * @param buf n blocks
+ * @return 0, or -1 on a short read
+ */
+static int read_blks(int fd, uint32_t first, int n, void *buf)
+{
+    ssize_t len = (ssize_t)n * FS_BLOCK_SIZE;
+    return pread(fd, buf, len, (off_t)first * FS_BLOCK_SIZE) == len ? 0 : -1;
+}
+
+/**
+ * Check whether an extent tree node maps a block, or is or holds a
+ * tree block equal to it.
+ *
+ * @param fd the image file
+ * @param hdr the node header
+ * @param blk the block number
+ * @return 1 if found, else 0
+ */
+static int ext_owns(int fd, struct fs_extent_header *hdr, uint32_t blk)
+{
+    int i;
+    if (hdr->magic != FS_EXT_MAGIC)
+        return 0;
+    if (hdr->depth == 0) {
+        struct fs_extent *ex = (void*)(hdr + 1);
+        for (i = 0; i < hdr->entries; i++) {
+            if (blk >= ex[i].physical && blk < ex[i].physical + FS_EXT_LEN(&ex[i]))
+                return 1;
+        }
+        return 0;
+    }
+    struct fs_extent_idx *idx = (void*)(hdr + 1);
+    char node[FS_BLOCK_SIZE];
+    for (i = 0; i < hdr->entries; i++) {
+        if (idx[i].child == blk)
+            return 1;
+        if (read_blks(fd, idx[i].child, 1, node) == 0 && ext_owns(fd, (void*)node, blk))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Check whether an inode maps a block as a data, directory,
+ * pointer or extent block.
+ *
+ * @param fd the image file
+ * @param in the inode
+ * @param blk the block number
+ * @return 1 if found, else 0
+ */
+static int inode_owns(int fd, struct fs_inode *in, uint32_t blk)
+{
+    uint32_t ptrs[PTRS_PER_BLK], ptrs2[PTRS_PER_BLK];
+    int i, j;
+    if (in->xattr_blk == blk)
+        return 1;
+    if (in->flags & FS_FL_INLINE)
+        return 0;
+    if (in->flags & FS_FL_EXTENTS)
+        return ext_owns(fd, (void*)in->direct, blk);
+    for (i = 0; i < N_DIRECT; i++) {
+        if (slot_blk(in->direct[i]) == blk)
+            return 1;
+    }
+    if (in->indir_1 != 0) {
+        if (in->indir_1 == blk)
+            return 1;
+        read_blks(fd, in->indir_1, 1, ptrs);
+        for (i = 0; i < PTRS_PER_BLK; i++) {
+            if (slot_blk(ptrs[i]) == blk)
+                return 1;
+        }
+    }
+    if (in->indir_2 != 0) {
+        if (in->indir_2 == blk)
+            return 1;
+        read_blks(fd, in->indir_2, 1, ptrs2);
+        for (j = 0; j < PTRS_PER_BLK; j++) {
+            if (ptrs2[j] == 0)
+                continue;
+            if (ptrs2[j] == blk)
+                return 1;
+            read_blks(fd, ptrs2[j], 1, ptrs);
+            for (i = 0; i < PTRS_PER_BLK; i++) {
+                if (slot_blk(ptrs[i]) == blk)
+                    return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Print a block that failed its checksum and what owns it: fixed
+ * metadata, the first allocated inode mapping it, or nothing live.
+ *
+ * @param fd the image file
+ * @param sb the superblock
+ * @param inode_map the inode map
+ * @param blk the block number
+ */
+static void print_bad_owner(int fd, struct fs_super *sb, fd_set *inode_map, uint32_t blk)
+{
+    uint32_t inode_base = 1 + sb->inode_map_sz + sb->block_map_sz;
+    struct fs_inode inodes[INODES_PER_BLK];
+    int i, b;
+
+    printf("***ERROR*** block %u fails its checksum", blk);
+    if (blk < inode_base) {
+        printf(" (%s)\n", blk < 1 + sb->inode_map_sz ? "inode map" : "block map");
+        return;
+    }
+    if (blk < inode_base + sb->inode_region_sz) {
+        i = (blk - inode_base) * INODES_PER_BLK;
+        printf(" (inode table, inodes %d-%d)\n", i, i + INODES_PER_BLK - 1);
+        return;
+    }
+    if (sb->refcount_map != 0 && blk >= sb->refcount_map &&
+        blk < sb->refcount_map + sb->refcount_map_sz) {
+        printf(" (refcount map)\n");
+        return;
+    }
+    if (sb->dedup_map != 0 && blk >= sb->dedup_map && blk < sb->dedup_map + sb->dedup_map_sz) {
+        printf(" (dedup map)\n");
+        return;
+    }
+    if (sb->frag_map != 0 && blk >= sb->frag_map && blk < sb->frag_map + sb->frag_map_sz) {
+        printf(" (fragment map)\n");
+        return;
+    }
+    if (blk == sb->snap_table) {
+        printf(" (snapshot table)\n");
+        return;
+    }
+    for (b = 0; b < sb->inode_region_sz; b++) {
+        if (read_blks(fd, inode_base + b, 1, inodes) < 0)
+            break;
+        for (i = 0; i < INODES_PER_BLK; i++) {
+            int inum = b * INODES_PER_BLK + i;
+            if (FD_ISSET(inum, inode_map) && inode_owns(fd, &inodes[i], blk)) {
+                printf(" (inode %d)\n", inum);
+                return;
+            }
+        }
+    }
+    printf(" (%s)\n", sb->snap_table != 0 ? "snapshot" : "no owner");
+}
+
+/**
+ * Scrub an image offline: read the blocks in use that have a
+ * checksum, SCRUB_BATCH blocks at a time, at most rate MB/s, and
+ * report each bad one with its owner.
+ *
+ * @param fd the image file
+ * @param rate MB/s, 0 for no limit
+ * @return the number of bad blocks
+ */
+static int scrub_image(int fd, int rate)
+{
+    struct fs_super sb;
+    struct timespec t0, t1, pause;
+    int n, i, checked = 0, bad = 0;
+    uint32_t first, blk;
+
+    if (read_blks(fd, 0, 1, &sb) < 0) {
+        perror("read"), exit(1);
+    }
+    if (sb.csum_map == 0) {
+        printf("no checksum map, nothing to scrub\n");
+        return 0;
+    }
+    fd_set *inode_map = malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
+    fd_set *block_map = malloc(sb.block_map_sz * FS_BLOCK_SIZE);
+    uint32_t *csum_map = malloc(sb.csum_map_sz * FS_BLOCK_SIZE);
+    uint8_t *buf = malloc(SCRUB_BATCH * FS_BLOCK_SIZE);
+    if (read_blks(fd, 1, sb.inode_map_sz, inode_map) < 0 ||
+        read_blks(fd, 1 + sb.inode_map_sz, sb.block_map_sz, block_map) < 0 ||
+        read_blks(fd, sb.csum_map, sb.csum_map_sz, csum_map) < 0) {
+        perror("read"), exit(1);
+    }
+    crc32c_init();
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (first = 1; first < sb.num_blocks; first += n) {
+        // one read from the first block wanted to the last in the batch
+        n = sb.num_blocks - first < SCRUB_BATCH ? sb.num_blocks - first : SCRUB_BATCH;
+        while (n > 0 && (!FD_ISSET(first + n - 1, block_map) || csum_map[first + n - 1] == 0))
+            n--;
+        if (n == 0) {
+            n = SCRUB_BATCH;
+            continue;
+        }
+        if (read_blks(fd, first, n, buf) < 0) {
+            printf("***ERROR*** cannot read blocks %u-%u\n", first, first + n - 1);
+            continue;
+        }
+        for (i = 0; i < n; i++) {
+            blk = first + i;
+            if (!FD_ISSET(blk, block_map) || csum_map[blk] == 0 ||
+                (blk >= sb.csum_map && blk < sb.csum_map + sb.csum_map_sz))
+                continue;
+            checked++;
+            if (crc32c_block(blk, buf + i * FS_BLOCK_SIZE) != csum_map[blk]) {
+                print_bad_owner(fd, &sb, inode_map, blk);
+                bad++;
+            }
+        }
+        if (rate > 0) {
+            long ns = (long)((double)n * FS_BLOCK_SIZE * 1e9 / ((double)rate * 1024 * 1024));
+            pause.tv_sec = ns / 1000000000;
+            pause.tv_nsec = ns % 1000000000;
+            nanosleep(&pause, NULL);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("scrub: %d blocks checked in %.2f s (%.1f MB/s), %d bad%s\n", checked, secs,
+           secs > 0 ? checked * (double)FS_BLOCK_SIZE / (secs * 1024 * 1024) : 0.0, bad,
+           sb.state == FS_STATE_CLEAN ? "" : " (not clean, map may be stale)");
+    free(inode_map);
+    free(block_map);
+    free(csum_map);
+    free(buf);
+    return bad;
+}
+
+/**
+ * Read and print memory summary of cs/5600/7600 file system, or
+ * with -scrub only verify the block checksums
+ *
+ *  usage: read-img [-scrub [MB/s]] disk.img
  *
  * @param argv[0] name of image file system
  */
 int main(int argc, char **argv)
 {
+    if (argc >= 3 && strcmp(argv[1], "-scrub") == 0) {
+        int fd = open(argv[argc - 1], O_RDONLY);
+        if (fd < 0) {
+            perror("can't open"), exit(1);
+        }
+        return scrub_image(fd, argc > 3 ? atoi(argv[2]) : 0) > 0;
+    }
+
 	// open image file
     int i, j, fd = open(argv[1], O_RDONLY);
     if (fd < 0) {
@@ -43,6 +482,9 @@ int main(int argc, char **argv)
     }
     fd_set *blkmap = calloc(size/BITS_PER_BLK, 1);
     fd_set *imap = calloc(size/BITS_PER_BLK, 1);
+    refs = calloc(size/FS_BLOCK_SIZE, sizeof(uint16_t));
+    xattr_refs = calloc(size/FS_BLOCK_SIZE, sizeof(uint16_t));
+    frag_used = calloc(size/FS_BLOCK_SIZE, 1);
 
     // report on superblock
     struct fs_super *sb = (void*)disk;
@@ -51,9 +493,23 @@ int main(int argc, char **argv)
            "            bmap:   %d blocks\n"
            "            inodes: %d blocks\n" 
            "            blocks: %d\n"
-           "            root inode: %d\n\n",
+           "            root inode: %d\n"
+           "            state:  %s\n"
+           "            free:   %d blocks, %d inodes\n"
+           "            refcount map: %d blocks at %d\n"
+           "            snapshot table: %d\n"
+           "            checksum map: %d blocks at %d%s\n"
+           "            scrub cursor: %d\n"
+           "            dedup map: %d blocks at %d\n"
+           "            fragment map: %d blocks at %d\n\n",
 		   sb->magic, sb->inode_map_sz, sb->block_map_sz,
-		   sb->inode_region_sz, sb->num_blocks, sb->root_inode);
+		   sb->inode_region_sz, sb->num_blocks, sb->root_inode,
+		   sb->state == FS_STATE_CLEAN ? "clean" : "not clean",
+		   sb->free_blocks, sb->free_inodes, sb->refcount_map_sz, sb->refcount_map,
+		   sb->snap_table, sb->csum_map_sz, sb->csum_map,
+		   (sb->csum_flags & FS_CSUM_DATA) ? ", metadata and data" :
+		   sb->csum_flags ? ", metadata" : "", sb->scrub_cursor,
+		   sb->dedup_map_sz, sb->dedup_map, sb->frag_map_sz, sb->frag_map);
 
     // report on inode map
     printf("allocated inodes: ");
@@ -66,6 +522,12 @@ int main(int argc, char **argv)
         }
     }
     printf("\n\n");
+    int free_inodes = 0;
+    for (i = 0; i < sb->inode_region_sz * INODES_PER_BLK; i++) {
+        if (!FD_ISSET(i, inode_map)) {
+            free_inodes++;
+        }
+    }
 
     // report on block map
     printf("allocated blocks: ");
@@ -77,6 +539,19 @@ int main(int argc, char **argv)
         }
     }
     printf("\n\n");
+    int free_blocks = 0;
+    for (i = 0; i < sb->num_blocks; i++) {
+        if (!FD_ISSET(i, block_map)) {
+            free_blocks++;
+        }
+    }
+
+    // free counters are only maintained across a clean unmount
+    if (sb->state == FS_STATE_CLEAN &&
+        (sb->free_blocks != free_blocks || sb->free_inodes != free_inodes)) {
+        printf("***ERROR*** free counters %d/%d, bitmaps have %d/%d\n\n",
+               sb->free_blocks, sb->free_inodes, free_blocks, free_inodes);
+    }
 
     // point to inodes
     struct fs_inode *inodes = (void*)block_map + sb->block_map_sz * FS_BLOCK_SIZE;
@@ -84,12 +559,16 @@ int main(int argc, char **argv)
     int max_inodes = sb->inode_region_sz * INODES_PER_BLK;
     struct entry { int dir; int inum;} inode_list[max_inodes + 100];
     int head = 0, tail = 0;
+    // directory entries naming each inode, checked against nlink
+    int *nrefs = calloc(max_inodes, sizeof(int));
 
     inode_list[head++] = (struct entry){.dir=1, .inum=1};
     FD_SET(1, imap);
+    nrefs[1] = 1;
     while (head != tail) {
         struct entry e = inode_list[tail++];
         struct fs_inode *in = inodes + e.inum;
+        check_xattrs(disk, sb, in, blkmap, block_map);
         if (!e.dir) {
         	// report on inode info
             printf("file: inode %d\n"
@@ -97,29 +576,49 @@ int main(int argc, char **argv)
                    "      mode %08o\n"
                    "      size  %d\n",
                    e.inum, in->uid, in->gid, in->mode, in->size);
+            if (S_ISLNK(in->mode)) {
+                // the target is in the inode or in the block at direct[0]
+                int inl = in->flags & FS_FL_INLINE;
+                if (in->size <= 0 || in->size > FS_SYMLINK_MAX ||
+                    (!inl && (in->direct[0] == 0 || in->direct[0] >= sb->num_blocks))) {
+                    printf("***ERROR*** bad symlink (size %d, block %d)\n", in->size, in->direct[0]);
+                }
+                else {
+                    printf("symlink: -> %.*s\n", in->size,
+                           inl ? (char*)in->direct : (char*)disk + in->direct[0] * FS_BLOCK_SIZE);
+                }
+            }
+            if (in->flags & FS_FL_INLINE) {
+                // data lives in the inode, no blocks to check
+                printf("inline: %d bytes\n\n", in->size);
+                if (in->size < 0 || in->size > FS_INLINE_MAX) {
+                    printf("***ERROR*** inline size %d too large\n\n", in->size);
+                }
+                continue;
+            }
+            if (in->flags & FS_FL_EXTENTS) {
+                // logical+len@physical for each extent, u if unwritten
+                int nodes = 0;
+                printf("extents: ");
+                check_extents(disk, (void*)in->direct, blkmap, block_map, &nodes);
+                printf("\n(%d tree blocks)\n\n", nodes);
+                continue;
+            }
+            int counts[2] = {0, 0};
             printf("blocks: ");
 
             // report on direct blocks
             for (i = 0; i < N_DIRECT; i++) {
-                if (in->direct[i] != 0) {
-                    printf("%d ", in->direct[i]);
-                    FD_SET(in->direct[i], blkmap);
-                    if (!FD_ISSET(in->direct[i], block_map))
-                        printf("\n***ERROR*** block %d marked free\n", in->direct[i]);
-                }
+                if (in->direct[i] != 0)
+                    print_data_blk(in->direct[i], blkmap, block_map, counts);
             }
 
             // report on single indirect blocks
             if (in->indir_1 != 0) {
                 int *buf = disk + in->indir_1 * FS_BLOCK_SIZE;
                 for (i = 0; i < PTRS_PER_BLK; i++) {
-                    if (buf[i] != 0) {
-                        printf("%d ", buf[i]);
-                        FD_SET(buf[i], blkmap);
-                        if (!FD_ISSET(buf[i], block_map)) {
-                            printf("\n***ERROR*** block %d marked free\n", buf[i]);
-                        }
-                    }
+                    if (buf[i] != 0)
+                        print_data_blk(buf[i], blkmap, block_map, counts);
                 }
             }
 
@@ -132,18 +631,17 @@ int main(int argc, char **argv)
                     	// scan double-indirect block
                         int *buf = disk + buf2[i] * FS_BLOCK_SIZE;
                         for (j = 0; j < PTRS_PER_BLK; j++) {
-                            if (buf[j] != 0) {
-                                printf("%d ", buf[j]);
-                                FD_SET(buf[j], blkmap);
-                                if (!FD_ISSET(buf[j], block_map)) {
-                                    printf("\n***ERROR*** block %d marked free\n", buf[j]);
-                                }
-                            }
+                            if (buf[j] != 0)
+                                print_data_blk(buf[j], blkmap, block_map, counts);
                         }
                     }
                 }
             }
             printf("\n\n");
+            if (in->flags & FS_FL_COMPRESS) {
+                printf("compressed: %d clusters, %d blocks hold %d\n\n", counts[1], counts[0],
+                       (in->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE);
+            }
         }
         else {
         	// report on directory
@@ -151,42 +649,96 @@ int main(int argc, char **argv)
                 printf("***ERROR*** inode %d not a directory\n", e.inum);
                 continue;
             }
-            printf("directory: inode %d (block %d)\n", e.inum, in->direct[0]);
-            struct fs_dirent *de = disk + in->direct[0] * FS_BLOCK_SIZE;
+            printf("directory: inode %d (block %d)%s\n", e.inum, in->direct[0],
+                   (in->flags & FS_FL_COMPRESS) ? " compressed" : "");
+            void *dblk = disk + in->direct[0] * FS_BLOCK_SIZE;
             if (!FD_ISSET(in->direct[0], block_map)) {
                 printf("\n***ERROR*** block %d marked free\n", in->direct[0]);
             }
-            FD_SET(in->direct[0], blkmap);
+            use_blk(in->direct[0], blkmap);
             
-            // scan directory block
-            for (i = 0; i < DIRENTS_PER_BLK; i++) {
-                if (de[i].valid) {
-                	// report on valid directory entry
-                    printf("  %s %d %s\n", de[i].isDir ? "D" : "F", de[i].inode,
-                           de[i].name);
-                    int j = de[i].inode;
-                    if (j < 0 || j >= sb->inode_region_sz * 16) {
-                        printf("***ERROR*** invalid inode %d\n", j);
+            // scan directory block; a zeroed block is empty
+            int off, n_ents = 0, n_free = 0;
+            for (off = 0; off < FS_BLOCK_SIZE; off += ((struct fs_dirent*)(dblk + off))->rec_len) {
+                struct fs_dirent *de = dblk + off;
+                if (off == 0 && de->rec_len == 0 && de->inode == 0) {
+                    n_free = FS_BLOCK_SIZE;
+                    break;
+                }
+                if (de->rec_len < FS_DIRENT_LEN(0) || de->rec_len % 4 != 0 ||
+                    off + de->rec_len > FS_BLOCK_SIZE ||
+                    (de->inode != 0 && de->rec_len < FS_DIRENT_LEN(de->name_len))) {
+                    printf("***ERROR*** bad directory entry at offset %d (rec_len %d name_len %d)\n",
+                           off, de->rec_len, de->name_len);
+                    break;
+                }
+                if (de->inode == 0) {
+                    n_free += de->rec_len;
+                    continue;
+                }
+                n_ents++;
+                n_free += de->rec_len - FS_DIRENT_LEN(de->name_len);
+                // report on valid directory entry
+                printf("  %s %d %.*s\n", de->type == FS_DT_DIR ? "D" : de->type == FS_DT_LNK ? "L" : "F", de->inode,
+                       de->name_len, de->name);
+                int j = de->inode;
+                if (j < 0 || j >= sb->inode_region_sz * INODES_PER_BLK) {
+                    printf("***ERROR*** invalid inode %d\n", j);
+                    continue;
+                }
+                nrefs[j]++;
+                if (FD_ISSET(j, imap)) {
+                    // a file may have more than one name, a directory not
+                    if (de->type != FS_DT_DIR && !S_ISDIR(inodes[j].mode))
                         continue;
-                    }
-                    if (FD_ISSET(j, imap)) {
-                        printf("***ERROR*** loop found (inode %d)\n", e.inum);
-                        goto fail;
-                    }
-                    FD_SET(j, imap);
-                    if (!FD_ISSET(j, inode_map)) {
-                        printf("***ERROR*** inode %d is marked free\n", j);
-                    }
-                    inode_list[head++] = (struct entry) {.dir = de[i].isDir, j};
+                    printf("***ERROR*** loop found (inode %d)\n", e.inum);
+                    goto fail;
+                }
+                FD_SET(j, imap);
+                if (!FD_ISSET(j, inode_map)) {
+                    printf("***ERROR*** inode %d is marked free\n", j);
                 }
+                inode_list[head++] = (struct entry) {.dir = de->type == FS_DT_DIR, j};
             }
+            printf("  %d entries, %d bytes free\n", n_ents, n_free);
             printf("\n");
         }
     }
 
+    // report on link counts; 0 in images from before link counts
+    int n_multi = 0;
+    for (i = 1; i < max_inodes; i++) {
+        if (!FD_ISSET(i, imap))
+            continue;
+        int nlink = inodes[i].nlink > 0 ? inodes[i].nlink : 1;
+        if (nrefs[i] != nlink) {
+            printf("***ERROR*** inode %d named by %d entries, link count %d\n", i, nrefs[i], nlink);
+        }
+        if (nrefs[i] > 1) {
+            n_multi++;
+        }
+    }
+    printf("link counts: %d files with more than one name\n", n_multi);
+    free(nrefs);
+
+    // report on xattr blocks and the inodes sharing them
+    int n_xblks = 0, n_xrefs = 0;
+    for (i = 0; i < sb->num_blocks; i++) {
+        struct fs_xattr_header *h = disk + i * FS_BLOCK_SIZE;
+        if (xattr_refs[i] == 0)
+            continue;
+        if (h->refcount != xattr_refs[i]) {
+            printf("***ERROR*** xattr block %d used by %d inodes, refcount %u\n",
+                   i, xattr_refs[i], h->refcount);
+        }
+        n_xblks++;
+        n_xrefs += xattr_refs[i];
+    }
+    printf("xattr blocks: %d, used by %d inodes\n", n_xblks, n_xrefs);
+
     // report on unreachable inodes
     printf("unreachable inodes: ");
-    for (i = 1; i < sb->inode_region_sz * 16; i++) {
+    for (i = 1; i < sb->inode_region_sz * INODES_PER_BLK; i++) {
         if (!FD_ISSET(i, imap) && FD_ISSET(i, inode_map)) {
             printf("%d ", i);
         }
@@ -203,6 +755,125 @@ int main(int argc, char **argv)
     }
     printf("\n");
 
+    // snapshots keep their exception blocks and copies allocated
+    if (sb->snap_table != 0) {
+        struct fs_snapshot *snaps = disk + sb->snap_table * FS_BLOCK_SIZE;
+        printf("snapshots: table at %d\n", sb->snap_table);
+        for (i = 0; i < FS_SNAP_MAX; i++) {
+            int n_exc = 0, n_blk = 0, j;
+            uint32_t b;
+            if (snaps[i].name[0] == '\0')
+                continue;
+            for (b = snaps[i].exc_blk; b != 0 && n_blk < sb->num_blocks; n_blk++) {
+                struct fs_snap_exc *exc = disk + b * FS_BLOCK_SIZE;
+                if (b >= sb->num_blocks || exc->count > FS_SNAP_EXC_PER_BLK) {
+                    printf("***ERROR*** bad exception block %u\n", b);
+                    break;
+                }
+                if (!FD_ISSET(b, block_map))
+                    printf("***ERROR*** block %u marked free\n", b);
+                for (j = 0; j < exc->count; j++) {
+                    if (exc->e[j].copy >= sb->num_blocks || !FD_ISSET(exc->e[j].copy, block_map))
+                        printf("***ERROR*** copy of block %u in bad or free block %u\n",
+                               exc->e[j].orig, exc->e[j].copy);
+                }
+                n_exc += exc->count;
+                b = exc->next;
+            }
+            time_t t = snaps[i].ctime;
+            printf("  %s: %d blocks copied out, %d exception blocks, taken %s",
+                   snaps[i].name, n_exc, n_blk, ctime(&t));
+        }
+    }
+
+    // a block reached n times needs n-1 extra references in the refcount map
+    uint16_t *refcount_map = sb->refcount_map ? disk + sb->refcount_map * FS_BLOCK_SIZE : NULL;
+    int shared = 0;
+    for (i = 0; refcount_map != NULL && i < sb->refcount_map_sz; i++) {
+        use_blk(sb->refcount_map + i, blkmap);
+    }
+    for (i = 0; i < sb->num_blocks; i++) {
+        int extra = refs[i] > 1 ? refs[i] - 1 : 0;
+        int counted = refcount_map ? refcount_map[i] : 0;
+        if (extra > 0)
+            shared++;
+        if (counted != extra && FD_ISSET(i, block_map))
+            printf("***ERROR*** block %d has %d references, refcount map says %d\n",
+                   i, extra + 1, counted + 1);
+    }
+    printf("shared blocks: %d\n", shared);
+
+    // each hash in the dedup map must be that of an allocated block;
+    // the map is only up to date after a clean unmount
+    if (sb->dedup_map != 0) {
+        uint32_t *dedup_map = disk + sb->dedup_map * FS_BLOCK_SIZE;
+        int indexed = 0, data_refs = 0, data_blks = 0;
+        crc32c_init();
+        for (i = 1; i < sb->num_blocks; i++) {
+            if (dedup_map[i] == 0)
+                continue;
+            uint32_t h = crc32c(0, disk + i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+            indexed++;
+            if (!FD_ISSET(i, block_map))
+                printf("***ERROR*** free block %d in dedup map\n", i);
+            else if ((h != 0 ? h : 1) != dedup_map[i] && sb->state == FS_STATE_CLEAN)
+                printf("***ERROR*** block %d does not match its dedup hash\n", i);
+        }
+        for (i = 0; i < sb->num_blocks; i++) {
+            if (refs[i] > 0 && FD_ISSET(i, block_map)) {
+                data_blks++;
+                data_refs += refs[i];
+            }
+        }
+        for (i = 0; i < sb->dedup_map_sz; i++) {
+            use_blk(sb->dedup_map + i, blkmap);
+        }
+        printf("dedup map: %d blocks indexed, %d references to %d blocks (ratio %.2f)\n",
+               indexed, data_refs, data_blks, data_blks ? (double)data_refs / data_blks : 0.0);
+    }
+
+    // each fragment block holds the tails that reached it; the map
+    // is only up to date after a clean unmount
+    if (sb->frag_map != 0) {
+        uint8_t *frag_map = disk + sb->frag_map * FS_BLOCK_SIZE;
+        int frag_blks = 0, frags = 0;
+        for (i = 0; i < sb->frag_map_sz; i++) {
+            use_blk(sb->frag_map + i, blkmap);
+        }
+        for (i = 0; i < sb->num_blocks; i++) {
+            if (frag_used[i] != 0) {
+                frag_blks++;
+                frags += __builtin_popcount(frag_used[i]);
+                if (refs[i] > 0)
+                    printf("***ERROR*** fragment block %d is also a whole block of a file\n", i);
+            }
+            if (frag_map[i] != frag_used[i] && sb->state == FS_STATE_CLEAN)
+                printf("***ERROR*** block %d has fragment mask %02x, fragment map says %02x\n",
+                       i, frag_used[i], frag_map[i]);
+        }
+        printf("tails: %d packed in %d fragment blocks (%d of %d fragments used), saving %d blocks\n",
+               n_tails, frag_blks, frags, frag_blks * FS_FRAGS_PER_BLK, n_tails - frag_blks);
+    }
+
+    // every block with a checksum must match it; the map is only
+    // up to date after a clean unmount
+    if (sb->csum_map != 0) {
+        uint32_t *csum_map = disk + sb->csum_map * FS_BLOCK_SIZE;
+        int checked = 0, bad = 0;
+        crc32c_init();
+        for (i = 1; i < sb->num_blocks; i++) {
+            if (csum_map[i] == 0 || (i >= sb->csum_map && i < sb->csum_map + sb->csum_map_sz))
+                continue;
+            checked++;
+            if (crc32c_block(i, disk + i * FS_BLOCK_SIZE) != csum_map[i]) {
+                printf("***ERROR*** block %d fails its checksum\n", i);
+                bad++;
+            }
+        }
+        printf("checksums: %d blocks checked, %d bad%s\n", checked, bad,
+               sb->state == FS_STATE_CLEAN ? "" : " (not clean, map may be stale)");
+    }
+
 fail:
     return 0;
 }
@@ -0,0 +1,41 @@
+/*
+ * file:        batch.h
+ * description: compound file creation. fs_create_batch creates many
+ *              small files, writing their contents and setting their
+ *              times, under one hold of the file system lock and with
+ *              one metadata flush, instead of a mknod, open, writes
+ *              and release for each.
+ */
+
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+/**
+ * A file for fs_create_batch.
+ */
+struct fs_batch_file {
+    const char *path;       /* absolute path of the new file */
+    mode_t      mode;       /* permissions and file type, as for mknod */
+    const char *data;       /* contents */
+    size_t      len;        /* bytes of contents */
+    time_t      mtime;      /* modification time, 0 for the current time */
+    int         status;     /* set to 0, or -error number if not created */
+};
+
+/**
+ * Create files with their contents. Files in the same directory
+ * should be next to each other: the directory is looked up and
+ * its block read and written once for each run of them. A file
+ * that cannot be created or written is left out, with the error
+ * in its status; the others are still created.
+ *
+ * @param files the files
+ * @param n number of files
+ * @return number of files created
+ */
+extern int fs_create_batch(struct fs_batch_file *files, int n);
+
+#endif /* BATCH_H_ */
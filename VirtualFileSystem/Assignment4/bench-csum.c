@@ -0,0 +1,140 @@
+/*
+ * file:        bench-csum.c
+ * description: checksum benchmark for the file system. Reports
+ *              CRC-32C throughput over file system blocks with the
+ *              SSE4.2 instruction and with the portable table, and,
+ *              given an image, times reading files through fs_ops so
+ *              that images made with and without mkfs -csum-data can
+ *              be compared.
+ *
+ *  usage: ./bench-csum [disk.img path ...]
+ */
+
+#define FUSE_USE_VERSION 27
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <fuse.h>
+
+#include "fsx600.h"
+#include "blkdev.h"
+#include "image.h"
+#include "crc32c.h"
+
+/** All homework functions accessed through operations structure. */
+extern struct fuse_operations fs_ops;
+
+/**  disk block device */
+struct blkdev *disk;
+int sync_metadata;
+int extents_default;
+int compress_default;
+int reflink_copies;
+int scrub_rate;
+int dedup_blocks;
+int pack_tails;
+
+#define BENCH_BLOCKS 4096           /* 4 MiB working set, stays in cache */
+#define BENCH_ROUNDS 64
+
+/**
+ * Current time in milliseconds.
+ */
+static double now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/**
+ * Time crc32c_block over a buffer of blocks and print the rate.
+ *
+ * @param name label for the output line
+ * @param buf BENCH_BLOCKS blocks of data
+ */
+static void bench_crc(const char *name, const uint8_t *buf)
+{
+    volatile uint32_t sum = 0;
+    double t0 = now_ms();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (int i = 0; i < BENCH_BLOCKS; i++) {
+            sum ^= crc32c_block(i, buf + i * FS_BLOCK_SIZE);
+        }
+    }
+    double t1 = now_ms();
+    double bytes = (double)BENCH_ROUNDS * BENCH_BLOCKS * FS_BLOCK_SIZE;
+    printf("crc32c %-9s %7.2f GB/s, %6.1f ns/block\n", name,
+           bytes / ((t1 - t0) * 1e6),
+           (t1 - t0) * 1e6 / ((double)BENCH_ROUNDS * BENCH_BLOCKS));
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *buf = malloc(BENCH_BLOCKS * FS_BLOCK_SIZE);
+    srandom(1);
+    for (int i = 0; i < BENCH_BLOCKS * FS_BLOCK_SIZE; i++) {
+        buf[i] = random();
+    }
+
+    crc32c_init();
+    int hw = crc32c_hw;
+    if (hw) {
+        bench_crc("(sse4.2)", buf);
+    } else {
+        printf("crc32c (sse4.2)  not available\n");
+    }
+    crc32c_hw = 0;
+    bench_crc("(table)", buf);
+    crc32c_hw = hw;
+    free(buf);
+
+    if (argc < 2) {
+        return 0;
+    }
+    if ((disk = image_create(argv[1])) == NULL) {
+        exit(1);
+    }
+    struct fs_super sb;
+    disk->ops->read(disk, 0, 1, &sb);
+    printf("image: %s, checksums: %s\n", argv[1],
+           sb.csum_map == 0 ? "none" :
+           (sb.csum_flags & FS_CSUM_DATA) ? "metadata and data" : "metadata");
+    fs_ops.init(NULL);
+
+    /* verified reads go through read_block/read_blocks */
+    for (int i = 2; i < argc; i++) {
+        struct stat st;
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        if (fs_ops.getattr(argv[i], &st) < 0 || fs_ops.open(argv[i], &fi) < 0) {
+            printf("%s: cannot open\n", argv[i]);
+            continue;
+        }
+        size_t len = 1024 * 1024;
+        char *data = malloc(len);
+        double t0 = now_ms();
+        off_t off = 0;
+        int n;
+        while ((n = fs_ops.read(argv[i], data, len, off, &fi)) > 0) {
+            off += n;
+        }
+        double t1 = now_ms() + 1e-6;
+        if (n < 0) {
+            printf("%s: read error %d at offset %lld\n", argv[i], n, (long long)off);
+        }
+        printf("read %-20s %10lld bytes %8.3f ms, %7.2f GB/s\n", argv[i],
+               (long long)off, t1 - t0, off / ((t1 - t0) * 1e6));
+        if (fs_ops.release != NULL) {
+            fs_ops.release(argv[i], &fi);
+        }
+        free(data);
+    }
+    fs_ops.destroy(NULL);
+    disk->ops->close(disk);
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * file:        bench-dedup.c
+ * description: deduplication benchmark for the file system. Writes
+ *              several copies of the same random artifact through
+ *              fs_ops, one fs_ops.write per megabyte, and reports
+ *              the write latency and the blocks used, so that runs
+ *              with and without -dedup on fresh images can be
+ *              compared.
+ *
+ *  usage: ./bench-dedup [-dedup] disk.img
+ */
+
+#define FUSE_USE_VERSION 27
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/statvfs.h>
+#include <fuse.h>
+
+#include "fsx600.h"
+#include "blkdev.h"
+#include "image.h"
+
+/** All homework functions accessed through operations structure. */
+extern struct fuse_operations fs_ops;
+
+/**  disk block device */
+struct blkdev *disk;
+int sync_metadata;
+int extents_default;
+int compress_default;
+int reflink_copies;
+int scrub_rate;
+int dedup_blocks;
+int pack_tails;
+
+#define ARTIFACT_MB 4
+#define COPIES      8
+#define CHUNK       (1024 * 1024)
+
+/**
+ * Current time in milliseconds.
+ */
+static double now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/**
+ * Compare two latencies for qsort.
+ */
+static int cmp_ms(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Blocks in use, from statfs.
+ */
+static long used_blocks(void)
+{
+    struct statvfs st;
+    fs_ops.statfs("/", &st);
+    return st.f_blocks - st.f_bfree;
+}
+
+int main(int argc, char **argv)
+{
+    int n = COPIES * ARTIFACT_MB, k = 0;
+    double *lat = malloc(n * sizeof(double)), total = 0;
+    char *data = malloc(ARTIFACT_MB * CHUNK);
+
+    if (argc > 1 && strcmp(argv[1], "-dedup") == 0) {
+        dedup_blocks = 1;
+        argc--;
+        argv++;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "usage: bench-dedup [-dedup] disk.img\n");
+        exit(1);
+    }
+    if ((disk = image_create(argv[1])) == NULL) {
+        exit(1);
+    }
+    srandom(1);
+    for (int i = 0; i < ARTIFACT_MB * CHUNK; i++) {
+        data[i] = random();
+    }
+    sync_metadata = 1;              /* each write reaches the device */
+    fs_ops.init(NULL);
+    long used0 = used_blocks();
+
+    for (int c = 0; c < COPIES; c++) {
+        char path[64];
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof(fi));
+        sprintf(path, "/artifact.%d", c);
+        if (fs_ops.mknod(path, 0100644, 0) < 0 || fs_ops.open(path, &fi) < 0) {
+            printf("%s: cannot create\n", path);
+            exit(1);
+        }
+        for (int m = 0; m < ARTIFACT_MB; m++) {
+            double t0 = now_ms();
+            int rv = fs_ops.write(path, data + m * CHUNK, CHUNK, (off_t)m * CHUNK, &fi);
+            lat[k] = now_ms() - t0;
+            total += lat[k++];
+            if (rv != CHUNK) {
+                printf("%s: write error %d\n", path, rv);
+                exit(1);
+            }
+        }
+        if (fs_ops.release != NULL) {
+            fs_ops.release(path, &fi);
+        }
+    }
+    long used = used_blocks() - used0;
+    long logical = (long)COPIES * ARTIFACT_MB * CHUNK / FS_BLOCK_SIZE;
+
+    qsort(lat, n, sizeof(double), cmp_ms);
+    printf("%s: %d copies of %d MiB, %s\n", argv[1], COPIES, ARTIFACT_MB,
+           dedup_blocks ? "dedup" : "no dedup");
+    printf("write 1 MiB: mean %.3f ms, p99 %.3f ms, %.1f MB/s\n", total / n,
+           lat[(n * 99 + 99) / 100 - 1], n / (total / 1000));
+    printf("blocks: %ld logical, %ld used, ratio %.2f\n", logical, used,
+           used > 0 ? (double)logical / used : 0.0);
+
+    fs_ops.destroy(NULL);
+    disk->ops->close(disk);
+    free(lat);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * file:        bench-dir.c
+ * description: directory search micro-benchmark. Looks names up in
+ *              full and empty directory blocks built in memory, with
+ *              dir_search and with an entry-by-entry memcmp walk,
+ *              and reports the time per search. It needs only
+ *              dirsearch.h, not the rest of the file system.
+ *
+ *  usage: ./bench-dir [iterations]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "fsx600.h"
+#include "dirsearch.h"
+
+#define ITERATIONS 1000000
+
+/** keeps the searches from being optimized away */
+static volatile int sink;
+
+/**
+ * Current time in milliseconds.
+ */
+static double now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/**
+ * Search a directory block entry by entry, checking each entry and
+ * comparing the names of entries of the right length with memcmp,
+ * as find_in_dir did before dir_search.
+ *
+ * @param blk the directory block
+ * @param name the name
+ * @return the entry offset, or -1
+ */
+static int walk_search(const uint8_t *blk, const char *name)
+{
+    int len = strlen(name), off = 0;
+    while (off <= FS_BLOCK_SIZE - (int)sizeof(struct fs_dirent)) {
+        const struct fs_dirent *de = (const struct fs_dirent*)(blk + off);
+        if (de -> rec_len < sizeof(struct fs_dirent) || de -> rec_len % 4 != 0 ||
+            off + de -> rec_len > FS_BLOCK_SIZE ||
+            (de -> inode != 0 && FS_DIRENT_LEN(de -> name_len) > de -> rec_len))
+            break;
+        if (de -> inode != 0 && de -> name_len == len && memcmp(de -> name, name, len) == 0)
+            return off;
+        off += de -> rec_len;
+    }
+    return -1;
+}
+
+/**
+ * Fill a directory block with as many entries named by a format as
+ * fit.
+ *
+ * @param blk the directory block
+ * @param fmt the name format, with one %d
+ * @param last set to the name of the last entry
+ * @return the number of entries
+ */
+static int fill_dir(uint8_t *blk, const char *fmt, char *last)
+{
+    char name[FS_NAME_MAX + 1];
+    struct fs_dirent *de = NULL;
+    int off = 0, n = 0;
+
+    memset(blk, 0, FS_BLOCK_SIZE);
+    for (;;) {
+        int len = sprintf(name, fmt, n);
+        if (off + FS_DIRENT_LEN(len) > FS_BLOCK_SIZE)
+            break;
+        de = (struct fs_dirent*)(blk + off);
+        de -> inode = n + 2;
+        de -> rec_len = FS_DIRENT_LEN(len);
+        de -> name_len = len;
+        de -> type = FS_DT_REG;
+        memcpy(de -> name, name, len);
+        off += de -> rec_len;
+        strcpy(last, name);
+        n++;
+    }
+    de -> rec_len += FS_BLOCK_SIZE - off;
+    return n;
+}
+
+/**
+ * Time both searches for one name and print a line.
+ *
+ * @param what description of the case
+ * @param blk the directory block
+ * @param name the name to search for
+ * @param iters number of searches
+ */
+static void run(const char *what, const uint8_t *blk, const char *name, int iters)
+{
+    struct dir_key key;
+    double t0, t_walk, t_key;
+    int i, r1, r2;
+
+    r1 = walk_search(blk, name);
+    dir_key_init(&key, name);
+    r2 = dir_search(blk, &key, NULL, NULL);
+    if (r1 != r2) {
+        printf("%s: results differ (%d, %d)\n", what, r1, r2);
+        exit(1);
+    }
+    t0 = now_ms();
+    for (i = 0; i < iters; i++) {
+        sink += walk_search(blk, name);
+    }
+    t_walk = now_ms() - t0;
+    t0 = now_ms();
+    for (i = 0; i < iters; i++) {
+        dir_key_init(&key, name);
+        sink += dir_search(blk, &key, NULL, NULL);
+    }
+    t_key = now_ms() - t0;
+    printf("%-34s walk %7.1f ns  dir_search %7.1f ns  (%.2fx)\n", what,
+           t_walk * 1e6 / iters, t_key * 1e6 / iters, t_walk / t_key);
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t blk[FS_BLOCK_SIZE];
+    char last[FS_NAME_MAX + 1], what[64];
+    int iters = argc > 1 ? atoi(argv[1]) : ITERATIONS, n;
+
+    if (iters <= 0) {
+        fprintf(stderr, "usage: bench-dir [iterations]\n");
+        exit(1);
+    }
+#ifdef DIRSEARCH_SSE2
+    printf("dir_search: SSE2, %d iterations\n", iters);
+#else
+    printf("dir_search: portable, %d iterations\n", iters);
+#endif
+
+    n = fill_dir(blk, "f%08d", last);
+    sprintf(what, "full, %d short names, last", n);
+    run(what, blk, last, iters);
+    sprintf(what, "full, %d short names, missing", n);
+    run(what, blk, "f99999999", iters);
+
+    n = fill_dir(blk, "access-log-2026-10-19-%05d.txt", last);
+    sprintf(what, "full, %d long names, last", n);
+    run(what, blk, last, iters);
+    sprintf(what, "full, %d long names, missing", n);
+    run(what, blk, "access-log-2026-10-19-99999.txt", iters);
+
+    memset(blk, 0, FS_BLOCK_SIZE);
+    ((struct fs_dirent*)blk) -> rec_len = FS_BLOCK_SIZE;
+    run("empty, missing", blk, "f99999999", iters);
+    return 0;
+}
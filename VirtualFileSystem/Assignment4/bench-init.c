@@ -0,0 +1,110 @@
+/*
+ * file:        bench-init.c
+ * description: startup-time benchmark for the file system. Times
+ *              fs_ops.init on an image and reports peak RSS, and
+ *              compares it with reading the whole inode region the
+ *              way mount used to.
+ *
+ *  usage: ./bench-init disk.img [path ...]
+ */
+
+#define FUSE_USE_VERSION 27
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fuse.h>
+
+#include "fsx600.h"
+#include "blkdev.h"
+#include "image.h"
+
+/** All homework functions accessed through operations structure. */
+extern struct fuse_operations fs_ops;
+
+/**  disk block device */
+struct blkdev *disk;
+int sync_metadata;
+int extents_default;
+int compress_default;
+int reflink_copies;
+int scrub_rate;
+int dedup_blocks;
+int pack_tails;
+
+/**
+ * Current time in milliseconds.
+ */
+static double now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+/**
+ * Peak resident set size in KiB.
+ */
+static long peak_rss_kb(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1024;
+#else
+    return ru.ru_maxrss;
+#endif
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s disk.img [path ...]\n", argv[0]);
+        exit(1);
+    }
+    if ((disk = image_create(argv[1])) == NULL) {
+        exit(1);
+    }
+
+    struct fs_super sb;
+    disk->ops->read(disk, 0, 1, &sb);
+    printf("image: %s, %d blocks, %d inode blocks\n", argv[1],
+           sb.num_blocks, sb.inode_region_sz);
+
+    long rss0 = peak_rss_kb();
+    double t0 = now_ms();
+    fs_ops.init(NULL);
+    double t1 = now_ms();
+    printf("init:            %8.3f ms, peak rss +%ld KiB\n", t1 - t0,
+           peak_rss_kb() - rss0);
+
+    /* first lookups fault in only the inode blocks they touch */
+    struct stat st;
+    t0 = now_ms();
+    fs_ops.getattr("/", &st);
+    for (int i = 2; i < argc; i++) {
+        fs_ops.getattr(argv[i], &st);
+    }
+    t1 = now_ms();
+    printf("first getattr:   %8.3f ms (%d paths)\n", t1 - t0, argc - 1);
+    fs_ops.destroy(NULL);
+
+    /* cost of the old mount, which read the whole inode region */
+    int inode_base = 1 + sb.inode_map_sz + sb.block_map_sz;
+    void *inodes = malloc(sb.inode_region_sz * FS_BLOCK_SIZE);
+    rss0 = peak_rss_kb();
+    t0 = now_ms();
+    disk->ops->read(disk, inode_base, sb.inode_region_sz, inodes);
+    t1 = now_ms();
+    printf("eager inode read:%8.3f ms, peak rss +%ld KiB\n", t1 - t0,
+           peak_rss_kb() - rss0);
+    free(inodes);
+
+    disk->ops->close(disk);
+    return 0;
+}
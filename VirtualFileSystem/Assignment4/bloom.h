@@ -0,0 +1,145 @@
+/*
+ * bloom.h
+ *
+ * Directory name filters. A Bloom filter of the names in a
+ * directory is built from its block the first time a name is
+ * looked up in it, and names added to the directory are added to
+ * the filter, so that a lookup of a name the filter has never seen
+ * returns -ENOENT without reading the directory block. Names
+ * removed cannot be taken out of a filter; they only make false
+ * positives likelier, and after BLOOM_STALE_MAX removals the filter
+ * is dropped and built again on the next lookup.
+ *
+ * Filters are kept for the live file system only; lookups in
+ * snapshots always read the directory block.
+ */
+
+/** hash functions per name */
+#define BLOOM_K 6
+/** names removed from a directory before its filter is rebuilt */
+#define BLOOM_STALE_MAX 16
+
+/**
+ * Hash a name into the two values that give the BLOOM_K bit
+ * positions of the name (FNV-1a, 64 bits, split in two).
+ *
+ * @param name the name
+ * @param len the name length
+ * @param h2 set to the second value, odd
+ * @return the first value
+ */
+static uint32_t bloom_hash(const char *name, int len, uint32_t *h2)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)name[i]) * 0x100000001b3ull;
+    }
+    *h2 = (uint32_t)(h >> 32) | 1;
+    return (uint32_t)h;
+}
+
+/**
+ * Add a name to a filter.
+ *
+ * @param b the filter
+ * @param name the name
+ * @param len the name length
+ */
+static void bloom_add(struct dir_bloom *b, const char *name, int len)
+{
+    uint32_t h2, h1 = bloom_hash(name, len, &h2);
+    for (int i = 0; i < BLOOM_K; i++, h1 += h2) {
+        b -> bits[(h1 % BLOOM_BITS) / 64] |= 1ull << (h1 % 64);
+    }
+}
+
+/**
+ * Check whether a filter may hold a name.
+ *
+ * @param b the filter
+ * @param name the name
+ * @return FALSE if the name is certainly not in the directory
+ */
+static int bloom_maybe(struct dir_bloom *b, const char *name)
+{
+    uint32_t h2, h1 = bloom_hash(name, strlen(name), &h2);
+    for (int i = 0; i < BLOOM_K; i++, h1 += h2) {
+        if ((b -> bits[(h1 % BLOOM_BITS) / 64] & (1ull << (h1 % 64))) == 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Find the filter of a directory.
+ *
+ * @param inum the directory inode number
+ * @return the filter, or NULL if there is none
+ */
+static struct dir_bloom *bloom_find(int inum)
+{
+    struct dir_bloom *b = &bloom_table[inum % BLOOM_SLOTS];
+    return b -> inum == inum ? b : NULL;
+}
+
+/**
+ * Build the filter of a directory from its block, replacing the
+ * filter of any other directory in its slot.
+ *
+ * @param inum the directory inode number
+ * @param blk the directory block
+ */
+static void bloom_build(int inum, uint8_t *blk)
+{
+    struct dir_bloom *b = &bloom_table[inum % BLOOM_SLOTS];
+    DirEntry *de;
+    int off;
+
+    memset(b, 0, sizeof(*b));
+    for (off = 0; (de = dir_entry(blk, off)) != NULL; off += de -> rec_len) {
+        if (de -> inode != 0)
+            bloom_add(b, de -> name, de -> name_len);
+    }
+    b -> inum = inum;
+    bloom_builds++;
+}
+
+/**
+ * Note a name added to a directory.
+ *
+ * @param inum the directory inode number
+ * @param name the name
+ */
+static void bloom_note_add(int inum, const char *name)
+{
+    struct dir_bloom *b = bloom_find(inum);
+    if (b != NULL) {
+        bloom_add(b, name, strlen(name));
+    }
+}
+
+/**
+ * Note a name removed from a directory.
+ *
+ * @param inum the directory inode number
+ */
+static void bloom_note_remove(int inum)
+{
+    struct dir_bloom *b = bloom_find(inum);
+    if (b != NULL && ++b -> stale > BLOOM_STALE_MAX) {
+        b -> inum = 0;
+    }
+}
+
+/**
+ * Drop the filter of a directory that is removed.
+ *
+ * @param inum the directory inode number
+ */
+static void bloom_drop(int inum)
+{
+    struct dir_bloom *b = bloom_find(inum);
+    if (b != NULL) {
+        b -> inum = 0;
+    }
+}
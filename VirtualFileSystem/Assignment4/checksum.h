@@ -0,0 +1,214 @@
+/*
+ * checksum.h
+ *
+ * Per-block CRC32C checksums. The checksum map is held in memory
+ * while mounted; write_block sets the checksum of each metadata
+ * block it writes, write_data_blocks sets those of data blocks if
+ * the image checksums data too and clears them otherwise, and
+ * read_block verifies every block that has a checksum. Freed
+ * blocks lose theirs. Map blocks are written back with the other
+ * dirty metadata.
+ *
+ * Like the bitmaps, the map is only trusted after a clean unmount;
+ * otherwise it is recomputed from the blocks on disk at mount.
+ */
+
+/**
+ * Check whether a block is kept out of the checksum map.
+ *
+ * @param blk the block number
+ * @return TRUE for the superblock and the map's own blocks
+ */
+static int csum_excluded(uint32_t blk)
+{
+    return blk == 0 || blk >= n_blocks ||
+        (blk >= sb.csum_map && blk < sb.csum_map + sb.csum_map_sz);
+}
+
+/**
+ * Mark the checksum map block holding the checksum of a block as
+ * dirty.
+ *
+ * @param blk the block number
+ */
+static void mark_csum(uint32_t blk)
+{
+    int b = blk / CSUMS_PER_BLK;
+    if (!csum_dirty[b]) {
+        csum_dirty[b] = TRUE;
+        n_dirty++;
+    }
+}
+
+/**
+ * Read the checksum map of an image that has one.
+ */
+static void csum_load(void)
+{
+    if (sb.csum_map == 0) {
+        return;
+    }
+    crc32c_init();
+    csum_map = malloc(sb.csum_map_sz * FS_BLOCK_SIZE);
+    csum_dirty = calloc(sb.csum_map_sz, 1);
+    if (disk->ops->read(disk, sb.csum_map, sb.csum_map_sz, csum_map) < 0) {
+        exit(1);
+    }
+}
+
+/**
+ * Record the checksums of blocks just written.
+ *
+ * @param first the first block number
+ * @param n number of blocks
+ * @param buf their contents
+ * @param data TRUE for file data, which only has checksums with
+ *   FS_CSUM_DATA
+ */
+static void csum_set(uint32_t first, int n, const uint8_t *buf, int data)
+{
+    int keep = !data || (sb.csum_flags & FS_CSUM_DATA);
+    for (int i = 0; csum_map != NULL && i < n; i++) {
+        uint32_t blk = first + i;
+        uint32_t c = keep ? crc32c_block(blk, buf + i * FS_BLOCK_SIZE) : 0;
+        if (!csum_excluded(blk) && csum_map[blk] != c) {
+            csum_map[blk] = c;
+            mark_csum(blk);
+        }
+    }
+}
+
+/**
+ * Forget the checksums of a run of blocks being freed.
+ *
+ * @param first the first block number
+ * @param count number of blocks
+ */
+static void csum_clear(uint32_t first, uint32_t count)
+{
+    for (uint32_t blk = first; csum_map != NULL && blk < first + count; blk++) {
+        if (csum_map[blk] != 0) {
+            csum_map[blk] = 0;
+            mark_csum(blk);
+        }
+    }
+}
+
+/**
+ * Verify a block against its checksum, if it has one.
+ *
+ * @param blk the block number
+ * @param buf the block contents read from the device
+ * @return 0 if the block is good or has no checksum, or -EIO
+ */
+static int csum_verify(uint32_t blk, const uint8_t *buf)
+{
+    if (csum_map == NULL || csum_excluded(blk) || csum_map[blk] == 0 ||
+        crc32c_block(blk, buf) == csum_map[blk]) {
+        return 0;
+    }
+    fprintf(stderr, "checksum error in block %u\n", blk);
+    return -EIO;
+}
+
+/**
+ * Remember a block that failed its checksum during the current
+ * operation, so that the operation fails with -EIO and does not
+ * write the block back. Rebuild threads may call this at once.
+ *
+ * @param blk the block number
+ */
+static void io_bad_add(uint32_t blk)
+{
+    int i = __atomic_fetch_add(&n_io_bad, 1, __ATOMIC_RELAXED);
+    if (i < IO_BAD_MAX) {
+        io_bad[i] = blk;
+    }
+}
+
+/**
+ * Check whether a block failed its checksum during the current
+ * operation. Once more than IO_BAD_MAX have failed, every block
+ * is treated as failed.
+ *
+ * @param blk the block number
+ * @return TRUE if the block must not be written
+ */
+static int io_bad_blk(uint32_t blk)
+{
+    if (n_io_bad > IO_BAD_MAX) {
+        return TRUE;
+    }
+    for (int i = 0; i < n_io_bad; i++) {
+        if (io_bad[i] == blk)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * Result of an operation that read file blocks.
+ *
+ * @param ret the result so far
+ * @return -EIO if a block failed its checksum during the
+ *   operation, else ret
+ */
+static int io_status(int ret)
+{
+    return n_io_bad > 0 ? -EIO : ret;
+}
+
+/**
+ * Write back the dirty blocks of the checksum map. Called last by
+ * flush_metadata, since writing other blocks changes the map.
+ */
+static void csum_flush(void)
+{
+    for (int i = 0; csum_map != NULL && i < sb.csum_map_sz; i++) {
+        if (csum_dirty[i]) {
+            write_block(sb.csum_map + i, (uint8_t*)(csum_map + i * CSUMS_PER_BLK));
+            csum_dirty[i] = FALSE;
+        }
+    }
+}
+
+/**
+ * Recompute checksums after an unclean unmount left the map behind
+ * the blocks written before the crash: those of free blocks are
+ * cleared, and blocks in use get one if they had one before, or
+ * all of them if the image checksums data. Blocks are read
+ * COPY_CHUNK at a time.
+ *
+ * @param report if TRUE, print how many checksums were fixed
+ */
+static void csum_rebuild(int report)
+{
+    uint8_t *buf = malloc(COPY_CHUNK * FS_BLOCK_SIZE);
+    uint32_t blk, first, c;
+    int i, n, fixed = 0;
+
+    for (first = 0; csum_map != NULL && first < n_blocks; first += n) {
+        n = n_blocks - first < COPY_CHUNK ? n_blocks - first : COPY_CHUNK;
+        if (disk->ops->read(disk, first, n, buf) < 0) {
+            fprintf(stderr, "checksum rebuild: cannot read block %u\n", first);
+            exit(1);
+        }
+        for (i = 0; i < n; i++) {
+            blk = first + i;
+            if (csum_excluded(blk))
+                continue;
+            c = 0;
+            if (FD_ISSET(blk, block_map) && (csum_map[blk] != 0 || (sb.csum_flags & FS_CSUM_DATA)))
+                c = crc32c_block(blk, buf + i * FS_BLOCK_SIZE);
+            if (csum_map[blk] != c) {
+                csum_map[blk] = c;
+                mark_csum(blk);
+                fixed++;
+            }
+        }
+    }
+    free(buf);
+    if (report && fixed > 0) {
+        fprintf(stderr, "unclean unmount: %d block checksums fixed\n", fixed);
+    }
+}
@@ -0,0 +1,345 @@
+/*
+ * compress.h
+ *
+ * Transparent compression for files with FS_FL_COMPRESS. Such a
+ * file is pointer-mapped and handled in clusters of FS_CLUSTER_BLKS
+ * logical blocks (see fsx600.h). Writes to it are always buffered
+ * as with delayed allocation; at write-back each dirty cluster is
+ * assembled, compressed with the codec in lz4.h, and written to new
+ * blocks with one device request if that saves at least a block,
+ * or raw if not, after which its old blocks are freed. Reads fetch
+ * the compressed blocks of a cluster and expand them in memory.
+ *
+ * Clusters are kept small so that short reads expand little they
+ * do not need. The codec runs well above device speed, so moving
+ * fewer blocks raises the effective read and write bandwidth by
+ * about the compression ratio.
+ */
+
+#define CLUSTER_BYTES (FS_CLUSTER_BLKS * FS_BLOCK_SIZE)
+
+/**
+ * Number of blocks of a cluster inside the file.
+ *
+ * @param in the file inode
+ * @param c the cluster number
+ * @return blocks of the cluster before the end of file, at most
+ *   FS_CLUSTER_BLKS; 0 or less if the cluster is past it
+ */
+static int cluster_nblks(struct fs_inode *in, int c)
+{
+    int n = get_file_block_num(in -> size) - c * FS_CLUSTER_BLKS;
+    return n < FS_CLUSTER_BLKS ? n : FS_CLUSTER_BLKS;
+}
+
+/**
+ * Check whether any block of a cluster is mapped.
+ *
+ * @param in the file inode
+ * @param c the cluster number
+ * @return TRUE if the cluster holds data
+ */
+static int cluster_mapped(struct fs_inode *in, int c)
+{
+    uint32_t slots[FS_CLUSTER_BLKS];
+    get_ptr_slots(in, c * FS_CLUSTER_BLKS, FS_CLUSTER_BLKS, slots);
+    for (int i = 0; i < FS_CLUSTER_BLKS; i++) {
+        if (slots[i] != 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * Read the blocks named by pointer slots, each run of consecutive
+ * blocks with one device request. Holes read as zeros.
+ *
+ * @param slots the block numbers
+ * @param n number of slots
+ * @param buf n blocks
+ * @return 0 if successful, or -EIO if a block fails its checksum
+ */
+static int cluster_read_slots(const uint32_t *slots, int n, uint8_t *buf)
+{
+    int i = 0, run, rv = 0;
+    while (i < n) {
+        if (slots[i] == 0 || slots[i] == FS_BLK_COMPRESSED) {
+            memset(buf + i * FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE);
+            i++;
+            continue;
+        }
+        for (run = 1; i + run < n && slots[i + run] == slots[i] + run; run++)
+            ;
+        if (read_blocks(slots[i], run, buf + i * FS_BLOCK_SIZE) < 0)
+            rv = -EIO;
+        i += run;
+    }
+    return rv;
+}
+
+/**
+ * Get the data of a cluster, expanding it if it is compressed.
+ * Compressed data that does not expand cleanly fails the current
+ * operation like a block that fails its checksum.
+ *
+ * @param in the file inode
+ * @param c the cluster number
+ * @param buf CLUSTER_BYTES, filled with the data; zeros past it
+ * @return 0 if successful, or -EIO
+ */
+static int cluster_load(struct fs_inode *in, int c, uint8_t *buf)
+{
+    uint32_t slots[FS_CLUSTER_BLKS];
+    uint8_t cbuf[CLUSTER_BYTES];
+    struct fs_cluster_hdr *hdr = (struct fs_cluster_hdr*)cbuf;
+    int k, n = -1;
+
+    get_ptr_slots(in, c * FS_CLUSTER_BLKS, FS_CLUSTER_BLKS, slots);
+    if (slots[0] != FS_BLK_COMPRESSED) {
+        return cluster_read_slots(slots, FS_CLUSTER_BLKS, buf);
+    }
+    for (k = 0; k + 1 < FS_CLUSTER_BLKS && slots[k + 1] != 0; k++)
+        ;
+    if (cluster_read_slots(slots + 1, k, cbuf) < 0) {
+        memset(buf, 0, CLUSTER_BYTES);
+        return -EIO;
+    }
+    if (k > 0 && hdr -> clen <= k * FS_BLOCK_SIZE - sizeof(*hdr) && hdr -> ulen <= CLUSTER_BYTES) {
+        n = lz4_decompress(cbuf + sizeof(*hdr), hdr -> clen, buf, CLUSTER_BYTES);
+    }
+    if (n < 0 || n != hdr -> ulen) {
+        fprintf(stderr, "compressed cluster %d at block %u is damaged\n", c, slots[k > 0]);
+        io_bad_add(slots[k > 0]);
+        memset(buf, 0, CLUSTER_BYTES);
+        return -EIO;
+    }
+    memset(buf + n, 0, CLUSTER_BYTES - n);
+    return 0;
+}
+
+/**
+ * Store the data of a cluster in new blocks, compressed if that
+ * saves at least one block, and free its old blocks. The new blocks
+ * are written before the old ones are let go, and the compressed
+ * marker is mapped last.
+ *
+ * @param in the file inode
+ * @param c the cluster number
+ * @param buf the data
+ * @param nblk number of blocks of data, 1 to FS_CLUSTER_BLKS
+ * @return 0 if successful, or -ENOSPC; the cluster is unchanged if
+ *   no blocks were found for its data
+ */
+static int cluster_store(struct fs_inode *in, int c, const uint8_t *buf, int nblk)
+{
+    uint32_t old[FS_CLUSTER_BLKS + 1], start[FS_CLUSTER_BLKS], goal = 0;
+    int len[FS_CLUSTER_BLKS], first = c * FS_CLUSTER_BLKS;
+    uint8_t cbuf[CLUSTER_BYTES];
+    struct fs_cluster_hdr *hdr = (struct fs_cluster_hdr*)cbuf;
+    const uint8_t *data = buf;
+    struct free_run run = {0, 0};
+    int i, r, nrun = 0, k = nblk, clen = 0, done, rv = 0;
+
+    if (nblk > 1) {
+        clen = lz4_compress(buf, nblk * FS_BLOCK_SIZE, cbuf + sizeof(*hdr),
+                            (nblk - 1) * FS_BLOCK_SIZE - sizeof(*hdr));
+    }
+    if (clen > 0) {
+        hdr -> clen = clen;
+        hdr -> ulen = nblk * FS_BLOCK_SIZE;
+        k = (clen + sizeof(*hdr) + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+        memset(cbuf + sizeof(*hdr) + clen, 0, k * FS_BLOCK_SIZE - sizeof(*hdr) - clen);
+        data = cbuf;
+    }
+
+    // keep the cluster next to the one before it, or where it was
+    get_ptr_slots(in, first > 0 ? first - 1 : 0, FS_CLUSTER_BLKS + (first > 0), old);
+    for (i = 0; i < FS_CLUSTER_BLKS + (first > 0) && goal == 0; i++) {
+        if (old[i] != FS_BLK_COMPRESSED)
+            goal = old[i];
+    }
+    if (first > 0)
+        memmove(old, old + 1, FS_CLUSTER_BLKS * sizeof(uint32_t));
+
+    for (done = 0; done < k; done += len[nrun++]) {
+        start[nrun] = get_free_run(goal ? goal + 1 : 0, k - done, &len[nrun]);
+        if (start[nrun] == 0) {
+            for (r = 0; r < nrun; r++)
+                return_blk_range(start[r], len[r]);
+            return -ENOSPC;
+        }
+        write_data_blocks(start[nrun], len[nrun], data + (size_t)done * FS_BLOCK_SIZE);
+        goal = start[nrun] + len[nrun] - 1;
+    }
+
+    clear_ptr_slots(in, first, FS_CLUSTER_BLKS);
+    for (i = 0; i < FS_CLUSTER_BLKS; i++)
+        free_run_add(&run, old[i], 1);
+    free_run_flush(&run);
+
+    done = clen > 0 ? 1 : 0;
+    for (r = 0; r < nrun; r++) {
+        if (rv == 0)
+            rv = map_blks(in, first + done, first + done + len[r] - 1, start[r]);
+        if (rv < 0)
+            return_blk_range(start[r], len[r]);
+        done += len[r];
+    }
+    if (rv == 0 && clen > 0) {
+        rv = map_blks(in, first, first, FS_BLK_COMPRESSED);
+    }
+    mark_inode(in);
+    return rv;
+}
+
+/**
+ * Read data from a compressed file, a cluster at a time. Buffered
+ * blocks are not included.
+ *
+ * @param in the file inode
+ * @param buf the read buffer
+ * @param len the number of bytes to read, not past end of file
+ * @param offset to start reading at
+ * @return 0 if successful, or -EIO
+ */
+static int cluster_read(struct fs_inode *in, char *buf, int len, off_t offset)
+{
+    uint8_t cbuf[CLUSTER_BYTES];
+    int c, from, chunk, done = 0, rv = 0;
+
+    while (done < len) {
+        c = (offset + done) / CLUSTER_BYTES;
+        from = (offset + done) % CLUSTER_BYTES;
+        chunk = CLUSTER_BYTES - from;
+        if (chunk > len - done)
+            chunk = len - done;
+        // whole clusters expand straight into buf
+        if (chunk == CLUSTER_BYTES) {
+            if (cluster_load(in, c, (uint8_t*)buf + done) < 0)
+                rv = -EIO;
+        }
+        else {
+            if (cluster_load(in, c, cbuf) < 0)
+                rv = -EIO;
+            memcpy(buf + done, cbuf + from, chunk);
+        }
+        done += chunk;
+    }
+    return rv;
+}
+
+/**
+ * Write data to a compressed file. The data is buffered, whatever
+ * the mount mode, and compressed when the file is written back;
+ * with -sync that is before returning.
+ *
+ * @param inum the file inode number
+ * @param in the file inode, not inline
+ * @param buf the buffer to write
+ * @param len the number of bytes to write
+ * @param offset the offset to starting writing at
+ * @return number of bytes written if successful, or -error number
+ */
+static int cluster_write(int inum, struct fs_inode *in, const char *buf, size_t len, off_t offset)
+{
+    uint8_t block_buf[FS_BLOCK_SIZE];
+    struct da_file *f;
+    int first = offset / FS_BLOCK_SIZE, last = (offset + len - 1) / FS_BLOCK_SIZE;
+    int nblks = get_file_block_num(in -> size);
+    int n, from, chunk, done = 0, needed = last - first + 1, rv;
+
+    if (last >= MAX_PTR_BLOCKS) {
+        return -EFBIG;
+    }
+    // a cluster is written to new blocks before its old ones are freed
+    if (sb.free_blocks - da_total < needed + FS_CLUSTER_BLKS + 2 + needed / PTRS_PER_BLK) {
+        return -ENOSPC;
+    }
+    for (n = first; n <= last; n++) {
+        from = n == first ? offset % FS_BLOCK_SIZE : 0;
+        chunk = FS_BLOCK_SIZE - from;
+        if (chunk > len - done)
+            chunk = len - done;
+        // a partial block keeps the bytes around the written range
+        f = da_find(inum, NULL);
+        if (chunk < FS_BLOCK_SIZE && n < nblks && (f == NULL || da_search(f, n) < 0)) {
+            if ((rv = cluster_read(in, (char*)block_buf, FS_BLOCK_SIZE, (off_t)n * FS_BLOCK_SIZE)) < 0)
+                return rv;
+            memcpy(da_block(inum, n), block_buf, FS_BLOCK_SIZE);
+        }
+        memcpy(da_block(inum, n) + from, buf + done, chunk);
+        done += chunk;
+    }
+    if (offset + len > in -> size)
+        in -> size = offset + len;
+    mark_inode(in);
+    if ((!delalloc || da_total > DA_MAX_BLOCKS) && (rv = da_writeback(inum)) < 0)
+        return rv;
+    return len;
+}
+
+/**
+ * Write back the buffered blocks of a compressed file, cluster by
+ * cluster. A cluster is only read first if some of its blocks are
+ * not buffered.
+ *
+ * @param in the file inode
+ * @param f the file's buffer
+ * @return 0 if successful, or -error number if a cluster was lost
+ */
+static int cluster_writeback(struct fs_inode *in, struct da_file *f)
+{
+    uint8_t buf[CLUSTER_BYTES];
+    int i = 0, j, c, nblk, err, rv = 0;
+
+    while (i < f -> n) {
+        c = f -> lblk[i] / FS_CLUSTER_BLKS;
+        for (j = i; j < f -> n && f -> lblk[j] / FS_CLUSTER_BLKS == c; j++)
+            ;
+        nblk = cluster_nblks(in, c);
+        err = 0;
+        if (j - i < nblk)
+            err = cluster_load(in, c, buf);
+        else
+            memset(buf, 0, CLUSTER_BYTES);
+        if (err == 0 && nblk > 0) {
+            for (; i < j; i++) {
+                memcpy(buf + (f -> lblk[i] % FS_CLUSTER_BLKS) * FS_BLOCK_SIZE,
+                       f -> data + (size_t)i * FS_BLOCK_SIZE, FS_BLOCK_SIZE);
+            }
+            err = cluster_store(in, c, buf, nblk);
+        }
+        if (err < 0) {
+            fprintf(stderr, "write-back of inode %d: cluster %d lost (%s)\n",
+                    f -> inum, c, strerror(-err));
+            rv = err;
+        }
+        i = j;
+    }
+    return rv;
+}
+
+/**
+ * Free the clusters of a compressed file past a new, shorter
+ * length. A mapped cluster cut in the middle is stored again
+ * without its tail.
+ *
+ * @param in the file inode, not inline
+ * @param len the new length
+ * @return 0 if successful, or -error number
+ */
+static int cluster_truncate(struct fs_inode *in, off_t len)
+{
+    uint8_t buf[CLUSTER_BYTES];
+    int keep = get_file_block_num(len), c = len / CLUSTER_BYTES, rv;
+
+    if (len % CLUSTER_BYTES && cluster_mapped(in, c)) {
+        if ((rv = cluster_load(in, c, buf)) < 0)
+            return rv;
+        memset(buf + len % CLUSTER_BYTES, 0, CLUSTER_BYTES - len % CLUSTER_BYTES);
+        if ((rv = cluster_store(in, c, buf, keep - c * FS_CLUSTER_BLKS)) < 0)
+            return rv;
+    }
+    truncate_ptr_blks(in, keep);
+    return 0;
+}
@@ -0,0 +1,391 @@
+/*
+ * dedup.h
+ *
+ * Block-level deduplication. Mounted with -dedup, every full data
+ * block written back from the delayed-allocation buffer is hashed
+ * with CRC-32C (the SSE4.2 crc32 instruction where the processor
+ * has it) and looked up in an in-memory index of hash -> block. If
+ * an allocated block with the same contents exists, the file maps
+ * it with one more reference in the refcount map instead of being
+ * given a block of its own. Blocks are compared byte for byte
+ * before they are shared, so a hash collision only costs a missed
+ * chance to share.
+ *
+ * The index is persisted as the dedup map (see fsx600.h) and built
+ * from it at mount. A block leaves the index when it is freed or
+ * written in place. After an unclean unmount the map is cleared
+ * instead of trusted; a dedupe pass (fs_dedupe) fills it again
+ * from the files.
+ */
+
+/**
+ * Content hash of a data block as kept in the dedup map.
+ *
+ * @param buf the block contents
+ * @return the hash, never 0
+ */
+static uint32_t dedup_hash(const uint8_t *buf)
+{
+    uint32_t h = crc32c(0, buf, FS_BLOCK_SIZE);
+    return h != 0 ? h : 1;
+}
+
+/**
+ * Mark the dedup map block holding the hash of a block as dirty.
+ *
+ * @param blk the block number
+ */
+static void mark_dedup(uint32_t blk)
+{
+    int b = blk / HASHES_PER_BLK;
+    if (!dedup_dirty[b]) {
+        dedup_dirty[b] = TRUE;
+        n_dirty++;
+    }
+}
+
+/**
+ * Find the index slot of a hash.
+ *
+ * @param hash the content hash
+ * @return the slot, or -1 if the hash is not indexed
+ */
+static int dedup_index_find(uint32_t hash)
+{
+    uint32_t i;
+    for (i = hash & dedup_mask; dedup_index[i].blk != 0; i = (i + 1) & dedup_mask) {
+        if (dedup_index[i].hash == hash)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Add a hash that is not indexed yet.
+ *
+ * @param hash the content hash
+ * @param blk the block holding the contents
+ */
+static void dedup_index_add(uint32_t hash, uint32_t blk)
+{
+    uint32_t i;
+    for (i = hash & dedup_mask; dedup_index[i].blk != 0; i = (i + 1) & dedup_mask)
+        ;
+    dedup_index[i].hash = hash;
+    dedup_index[i].blk = blk;
+}
+
+/**
+ * Empty an index slot, moving later entries of its probe sequence
+ * back so that lookups need no tombstones.
+ *
+ * @param i the slot
+ */
+static void dedup_index_del(uint32_t i)
+{
+    uint32_t j = i, home;
+    for (;;) {
+        dedup_index[i].blk = 0;
+        do {
+            j = (j + 1) & dedup_mask;
+            if (dedup_index[j].blk == 0)
+                return;
+            home = dedup_index[j].hash & dedup_mask;
+        } while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+        dedup_index[i] = dedup_index[j];
+        i = j;
+    }
+}
+
+/**
+ * Allocate the index for the dedup map and fill it. The index has
+ * at least twice as many slots as the device has blocks.
+ */
+static void dedup_index_build(void)
+{
+    uint32_t size = 1, blk;
+    while (size < 2 * (uint32_t)n_blocks)
+        size *= 2;
+    dedup_index = calloc(size, sizeof(*dedup_index));
+    dedup_mask = size - 1;
+    for (blk = 1; blk < n_blocks; blk++) {
+        if (dedup_map[blk] != 0)
+            dedup_index_add(dedup_map[blk], blk);
+    }
+}
+
+/**
+ * Read the dedup map of an image that has one and build its index.
+ *
+ * @param trusted FALSE after an unclean unmount, when the map is
+ *   cleared instead of read
+ */
+static void dedup_load(int trusted)
+{
+    if (sb.dedup_map == 0) {
+        return;
+    }
+    crc32c_init();
+    dedup_map = calloc(sb.dedup_map_sz, FS_BLOCK_SIZE);
+    dedup_dirty = calloc(sb.dedup_map_sz, 1);
+    if (!trusted || read_blocks(sb.dedup_map, sb.dedup_map_sz, (uint8_t*)dedup_map) < 0) {
+        memset(dedup_map, 0, sb.dedup_map_sz * FS_BLOCK_SIZE);
+        for (int i = 0; i < sb.dedup_map_sz; i++)
+            mark_dedup(i * HASHES_PER_BLK);
+    }
+    dedup_index_build();
+}
+
+/**
+ * Create an empty dedup map in a run of free blocks, along with
+ * the refcount map that shared blocks need. The superblock is
+ * written at once so that a rebuild after a crash finds the map.
+ *
+ * @return 0 if successful, or -ENOSPC
+ */
+static int dedup_create(void)
+{
+    int sz = (sb.num_blocks + HASHES_PER_BLK - 1) / HASHES_PER_BLK, got;
+    uint32_t start;
+
+    if (refcount_create() < 0) {
+        return -ENOSPC;
+    }
+    if (dedup_map != NULL) {
+        return 0;
+    }
+    start = get_free_run(0, sz, &got);
+    if (got < sz) {
+        if (start != 0)
+            return_blk_range(start, got);
+        return -ENOSPC;
+    }
+    crc32c_init();
+    dedup_map = calloc(sz, FS_BLOCK_SIZE);
+    dedup_dirty = calloc(sz, 1);
+    write_blocks(start, sz, (uint8_t*)dedup_map);
+    sb.dedup_map = start;
+    sb.dedup_map_sz = sz;
+    write_block(0, (uint8_t*)&sb);
+    dedup_index_build();
+    return 0;
+}
+
+/**
+ * Index a block that was just written, unless its contents are
+ * indexed already.
+ *
+ * @param blk the block number
+ * @param hash its content hash, 0 to skip it
+ */
+static void dedup_add(uint32_t blk, uint32_t hash)
+{
+    if (dedup_map == NULL || hash == 0 || dedup_index_find(hash) >= 0) {
+        return;
+    }
+    dedup_index_add(hash, blk);
+    dedup_map[blk] = hash;
+    mark_dedup(blk);
+}
+
+/**
+ * Take a run of blocks out of the index, as they are freed or
+ * about to be written with other contents.
+ *
+ * @param first the first block number
+ * @param count number of blocks
+ */
+static void dedup_clear(uint32_t first, uint32_t count)
+{
+    for (uint32_t blk = first; dedup_map != NULL && blk < first + count; blk++) {
+        if (dedup_map[blk] != 0) {
+            int i = dedup_index_find(dedup_map[blk]);
+            if (i >= 0 && dedup_index[i].blk == blk)
+                dedup_index_del(i);
+            dedup_map[blk] = 0;
+            mark_dedup(blk);
+        }
+    }
+}
+
+/**
+ * Find an allocated block with the given contents.
+ *
+ * @param hash the content hash
+ * @param buf the contents
+ * @return the block number, or 0 if there is none
+ */
+static uint32_t dedup_find(uint32_t hash, const uint8_t *buf)
+{
+    uint8_t old[FS_BLOCK_SIZE];
+    int i = dedup_index_find(hash);
+    uint32_t blk;
+
+    if (i < 0) {
+        return 0;
+    }
+    blk = dedup_index[i].blk;
+    if (!FD_ISSET(blk, block_map) || read_block(blk, old) < 0 ||
+        memcmp(old, buf, FS_BLOCK_SIZE) != 0) {
+        return 0;
+    }
+    return blk;
+}
+
+/**
+ * Map the buffered blocks of a file whose contents are already on
+ * disk to those blocks, and drop them from the buffer. A block
+ * equal to an earlier one in the same buffer is dropped too, and
+ * listed in dups to be mapped by dedup_writeback_dups once that
+ * one has a block. Only blocks entirely inside the file are
+ * shared. Called by da_writeback.
+ *
+ * @param in the file inode
+ * @param f the file's buffer
+ * @param dups set to pairs of logical blocks (the duplicate, then
+ *   the block it equals), to be freed by the caller
+ * @param n_dups set to the number of pairs
+ * @return the content hashes of the blocks left in the buffer, 0
+ *   for blocks not to be indexed, to be freed by the caller; NULL
+ *   when not deduplicating
+ */
+static uint32_t *dedup_writeback(struct fs_inode *in, struct da_file *f,
+                                 uint32_t **dups, int *n_dups)
+{
+    uint32_t *hashes, hash, blk, mask = 1;
+    int *local, i, j, kept = 0;
+
+    *dups = NULL;
+    *n_dups = 0;
+    if (!dedup_blocks || dedup_map == NULL || (in -> flags & FS_FL_COMPRESS)) {
+        return NULL;
+    }
+    // kept blocks of this buffer by hash, with linear probing
+    while (mask < 2 * (uint32_t)f -> n)
+        mask *= 2;
+    local = malloc(mask * sizeof(int));
+    memset(local, -1, mask * sizeof(int));
+    mask--;
+    hashes = malloc(f -> n * sizeof(uint32_t));
+    *dups = malloc(f -> n * 2 * sizeof(uint32_t));
+
+    for (i = 0; i < f -> n; i++) {
+        uint8_t *data = f -> data + (size_t)i * BLOCK_SIZE;
+        uint32_t lblk = f -> lblk[i];
+        hash = 0;
+        if ((off_t)(lblk + 1) * BLOCK_SIZE <= in -> size) {
+            hash = dedup_hash(data);
+            blk = dedup_find(hash, data);
+            if (blk != 0 && share_blk_range(blk, 1) == 0) {
+                if (map_blks(in, lblk, lblk, blk) == 0)
+                    continue;
+                release_blk_range(blk, 1);
+            }
+            for (j = hash & mask; local[j] >= 0; j = (j + 1) & mask) {
+                int k = local[j];
+                if (hashes[k] == hash &&
+                    memcmp(f -> data + (size_t)k * BLOCK_SIZE, data, BLOCK_SIZE) == 0)
+                    break;
+            }
+            if (local[j] >= 0) {
+                (*dups)[2 * *n_dups] = lblk;
+                (*dups)[2 * *n_dups + 1] = f -> lblk[local[j]];
+                (*n_dups)++;
+                continue;
+            }
+            local[j] = kept;
+        }
+        if (kept != i) {
+            f -> lblk[kept] = lblk;
+            memcpy(f -> data + (size_t)kept * BLOCK_SIZE, data, BLOCK_SIZE);
+        }
+        hashes[kept++] = hash;
+    }
+    da_total -= f -> n - kept;
+    f -> n = kept;
+    free(local);
+    return hashes;
+}
+
+/**
+ * Map the duplicate blocks found by dedup_writeback to the blocks
+ * now holding their contents.
+ *
+ * @param in the file inode
+ * @param dups pairs of logical blocks, the duplicate then the
+ *   block it equals
+ * @param n_dups number of pairs
+ * @return 0 if successful, or -ENOSPC if some blocks were lost
+ */
+static int dedup_writeback_dups(struct fs_inode *in, uint32_t *dups, int n_dups)
+{
+    int i, rv = 0;
+    for (i = 0; i < n_dups; i++) {
+        uint32_t blk = get_blk(in, dups[2 * i + 1], FALSE);
+        if (blk == 0 || share_blk_range(blk, 1) < 0) {
+            rv = -ENOSPC;
+            continue;
+        }
+        if (map_blks(in, dups[2 * i], dups[2 * i], blk) < 0) {
+            release_blk_range(blk, 1);
+            rv = -ENOSPC;
+        }
+    }
+    return rv;
+}
+
+/**
+ * Share the full data blocks of a file with identical blocks found
+ * earlier in a dedupe pass, indexing the rest.
+ *
+ * @param in the file inode, pointer- or extent-mapped
+ * @param scanned incremented for each data block read
+ * @param freed incremented for each block given up
+ */
+static void dedup_inode(struct fs_inode *in, int *scanned, int *freed)
+{
+    uint8_t buf[FS_BLOCK_SIZE];
+    uint32_t hash, blk, shared;
+    int n, nblks = in -> size / FS_BLOCK_SIZE;
+
+    for (n = 0; n < nblks; n++) {
+        if ((blk = get_blk(in, n, FALSE)) == 0 || read_block(blk, buf) < 0)
+            continue;
+        (*scanned)++;
+        hash = dedup_hash(buf);
+        if (dedup_map[blk] == hash)
+            continue;
+        if ((shared = dedup_find(hash, buf)) == 0) {
+            dedup_add(blk, hash);
+            continue;
+        }
+        if (share_blk_range(shared, 1) < 0)
+            continue;
+        if (in -> flags & FS_FL_EXTENTS) {
+            if (ext_remap(in, n, n, shared) < 0) {
+                release_blk_range(shared, 1);
+                continue;
+            }
+        }
+        else {
+            set_ptr_blk(in, n, shared);
+        }
+        release_blk_range(blk, 1);
+        (*freed)++;
+    }
+    mark_inode(in);
+}
+
+/**
+ * Write back the dirty blocks of the dedup map. Called before
+ * csum_flush, since writing them changes the checksum map.
+ */
+static void dedup_flush(void)
+{
+    for (int i = 0; dedup_map != NULL && i < sb.dedup_map_sz; i++) {
+        if (dedup_dirty[i]) {
+            write_block(sb.dedup_map + i, (uint8_t*)(dedup_map + i * HASHES_PER_BLK));
+            dedup_dirty[i] = FALSE;
+        }
+    }
+}
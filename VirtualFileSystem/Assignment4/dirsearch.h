@@ -0,0 +1,150 @@
+/*
+ * dirsearch.h
+ *
+ * Name search in a raw directory block (see fsx600.h), in a single
+ * pass over its entries that also finds room for a new entry, with
+ * no copy of the entries. An entry in use whose name length matches
+ * has the last DIR_KEY_SIZE bytes of its name (all of a shorter
+ * name) compared with those of the name sought all at once: with
+ * one SSE2 compare on x86, elsewhere with two masked 64-bit
+ * compares. Names in a directory often share a prefix and differ
+ * near the end, so only names that do match there are compared
+ * further. Both give the same results.
+ *
+ * Entries are variable length, so the walk from entry to entry
+ * stays serial; the wide compare replaces the per-entry strcmp.
+ */
+
+#ifndef DIRSEARCH_H_
+#define DIRSEARCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "fsx600.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define DIRSEARCH_SSE2 1
+#endif
+
+/** name bytes compared at once */
+#define DIR_KEY_SIZE 16
+
+/**
+ * A name prepared for dir_search.
+ */
+struct dir_key {
+    const char *name;
+    int len;                        /* name length */
+    int need;                       /* bytes of an entry for it */
+    int tail;                       /* offset in the name of the bytes compared */
+    uint8_t pat[DIR_KEY_SIZE];      /* the bytes compared, zero padded */
+    uint8_t msk[DIR_KEY_SIZE];      /* 0xff for the bytes compared */
+    uint32_t mask;                  /* the same, one bit per byte */
+};
+
+/**
+ * Prepare a name for dir_search.
+ *
+ * @param key the key to fill in
+ * @param name the name, at most FS_NAME_MAX bytes
+ */
+static void dir_key_init(struct dir_key *key, const char *name)
+{
+    int len = strlen(name), n = len < DIR_KEY_SIZE ? len : DIR_KEY_SIZE;
+
+    memset(key, 0, sizeof(*key));
+    key -> name = name;
+    key -> len = len;
+    key -> need = FS_DIRENT_LEN(len);
+    key -> tail = len - n;
+    memcpy(key -> pat, name + key -> tail, n);
+    memset(key -> msk, 0xff, n);
+    key -> mask = (1u << n) - 1;
+}
+
+/**
+ * Check whether an entry in use holds the name of a key.
+ *
+ * @param blk the directory block
+ * @param off the entry offset
+ * @param key the key
+ * @return 1 if it does, 0 if not
+ */
+static inline int dir_key_match(const uint8_t *blk, int off, const struct dir_key *key)
+{
+    const struct fs_dirent *de = (const struct fs_dirent*)(blk + off);
+    const uint8_t *e = (const uint8_t*)de -> name + key -> tail;
+
+    if (de -> name_len != key -> len) {
+        return 0;
+    }
+    if (e + DIR_KEY_SIZE > blk + FS_BLOCK_SIZE) {
+        // a short name too near the end of the block to load
+        return memcmp(de -> name, key -> name, key -> len) == 0;
+    }
+#ifdef DIRSEARCH_SSE2
+    __m128i v = _mm_loadu_si128((const __m128i*)e);
+    __m128i p = _mm_loadu_si128((const __m128i*)key -> pat);
+    if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, p)) & key -> mask) != key -> mask)
+        return 0;
+#else
+    uint64_t v[2], p[2], m[2];
+    memcpy(v, e, DIR_KEY_SIZE);
+    memcpy(p, key -> pat, DIR_KEY_SIZE);
+    memcpy(m, key -> msk, DIR_KEY_SIZE);
+    if (((v[0] ^ p[0]) & m[0]) != 0 || ((v[1] ^ p[1]) & m[1]) != 0)
+        return 0;
+#endif
+    return key -> tail == 0 || memcmp(de -> name, key -> name, key -> tail) == 0;
+}
+
+/**
+ * Search a directory block for a name and, while at it, for the
+ * first entry with room for an entry of that name at its end. The
+ * walk stops at the end of the block or at a damaged entry.
+ *
+ * @param blk the directory block
+ * @param key the name
+ * @param slot set to the offset of the first entry with room, or
+ *   -1 if none has; may be NULL. Only set fully if the name is not
+ *   found.
+ * @param unused set to the unused bytes of all entries, with the
+ *   same caveat; may be NULL
+ * @return the offset of the entry with the name, or -1
+ */
+static int dir_search(const uint8_t *blk, const struct dir_key *key, int *slot, int *unused)
+{
+    int off = 0, match = -1, room = -1, total = 0, used;
+    const struct fs_dirent *de;
+
+    while (off <= FS_BLOCK_SIZE - (int)sizeof(struct fs_dirent)) {
+        de = (const struct fs_dirent*)(blk + off);
+        if (de -> rec_len < sizeof(struct fs_dirent) || de -> rec_len % 4 != 0 ||
+            off + de -> rec_len > FS_BLOCK_SIZE ||
+            (de -> inode != 0 && FS_DIRENT_LEN(de -> name_len) > de -> rec_len)) {
+            break;
+        }
+        used = 0;
+        if (de -> inode != 0) {
+            if (dir_key_match(blk, off, key)) {
+                match = off;
+                break;
+            }
+            used = FS_DIRENT_LEN(de -> name_len);
+        }
+        if (room < 0 && de -> rec_len - used >= key -> need)
+            room = off;
+        total += de -> rec_len - used;
+        off += de -> rec_len;
+    }
+    if (slot != NULL)
+        *slot = room;
+    if (unused != NULL)
+        *unused = total;
+    return match;
+}
+
+#endif /* DIRSEARCH_H_ */
@@ -0,0 +1,708 @@
+/*
+ * extent.h
+ *
+ * Extent tree mapping for files with FS_FL_EXTENTS. The root node
+ * is stored in the inode in place of direct[], indir_1 and indir_2
+ * and holds FS_EXT_ROOT_EXTENTS extents; when it fills up, its
+ * entries move into a block and the tree grows by one level.
+ */
+
+#define EXT_MAX_DEPTH 4
+
+/** one level of a path from the root of an extent tree to a leaf */
+struct ext_path {
+    uint32_t blk;                   /* block holding node, 0 for the root */
+    int pos;                        /* entry followed or found, -1 if none */
+    struct fs_extent_header *hdr;   /* node header */
+    uint8_t buf[FS_BLOCK_SIZE];     /* node contents if held in a block */
+};
+
+/**
+ * Get the root node of an inode's extent tree.
+ *
+ * @param in the inode
+ * @return the root node header
+ */
+static struct fs_extent_header *ext_root(struct fs_inode *in)
+{
+    return (struct fs_extent_header*)in -> direct;
+}
+
+/**
+ * Get the extents of a leaf node.
+ *
+ * @param hdr the node header
+ * @return the first extent
+ */
+static struct fs_extent *ext_extents(struct fs_extent_header *hdr)
+{
+    return (struct fs_extent*)(hdr + 1);
+}
+
+/**
+ * Get the child pointers of an index node.
+ *
+ * @param hdr the node header
+ * @return the first index entry
+ */
+static struct fs_extent_idx *ext_idx(struct fs_extent_header *hdr)
+{
+    return (struct fs_extent_idx*)(hdr + 1);
+}
+
+/**
+ * Size of an entry in a node.
+ *
+ * @param hdr the node header
+ */
+static int ext_entry_size(struct fs_extent_header *hdr)
+{
+    return hdr -> depth == 0 ? sizeof(struct fs_extent) : sizeof(struct fs_extent_idx);
+}
+
+/**
+ * Logical block of the i-th entry of a node. Both kinds of entry
+ * start with the logical block number.
+ *
+ * @param hdr the node header
+ * @param i the entry index
+ */
+static uint32_t ext_key(struct fs_extent_header *hdr, int i)
+{
+    return *(uint32_t*)((uint8_t*)(hdr + 1) + i * ext_entry_size(hdr));
+}
+
+/**
+ * Set up an empty extent tree in an inode.
+ *
+ * @param in the inode
+ */
+static void ext_init(struct fs_inode *in)
+{
+    struct fs_extent_header *hdr = ext_root(in);
+    memset(in -> direct, 0, FS_INLINE_MAX);
+    hdr -> magic = FS_EXT_MAGIC;
+    hdr -> max = FS_EXT_ROOT_EXTENTS;
+    hdr -> depth = 0;
+    hdr -> entries = 0;
+    mark_inode(in);
+}
+
+/**
+ * Find the last entry of a node whose key is <= n.
+ *
+ * @param hdr the node header
+ * @param n the logical block
+ * @return entry index or -1 if all keys are larger
+ */
+static int ext_search(struct fs_extent_header *hdr, uint32_t n)
+{
+    int lo = 0, hi = hdr -> entries - 1, pos = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (ext_key(hdr, mid) <= n) {
+            pos = mid;
+            lo = mid + 1;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+    return pos;
+}
+
+/**
+ * Read an extent tree node from disk into a path level.
+ *
+ * @param p the path level
+ * @param blk the node block
+ * @return 0 if successful, or -EIO if the block is not a node or
+ *   fails its checksum
+ */
+static int ext_read_node(struct ext_path *p, uint32_t blk)
+{
+    p -> blk = blk;
+    p -> hdr = (struct fs_extent_header*)p -> buf;
+    if (read_block(blk, p -> buf) < 0) {
+        return -EIO;
+    }
+    if (p -> hdr -> magic != FS_EXT_MAGIC) {
+        fprintf(stderr, "bad extent node in block %u\n", blk);
+        return -EIO;
+    }
+    return 0;
+}
+
+/**
+ * Write back a node of the path.
+ *
+ * @param in the inode
+ * @param p the path level
+ */
+static void ext_write_node(struct fs_inode *in, struct ext_path *p)
+{
+    if (p -> blk == 0)
+        mark_inode(in);
+    else
+        write_block(p -> blk, p -> buf);
+}
+
+/**
+ * Look up the path from the root to the leaf that covers
+ * logical block n.
+ *
+ * @param in the inode
+ * @param n the logical block
+ * @param path array of EXT_MAX_DEPTH+1 levels
+ * @return depth of the leaf in the path, or -EIO
+ */
+static int ext_find(struct fs_inode *in, uint32_t n, struct ext_path *path)
+{
+    int l = 0;
+    path[0].blk = 0;
+    path[0].hdr = ext_root(in);
+    while (TRUE) {
+        struct fs_extent_header *hdr = path[l].hdr;
+        path[l].pos = ext_search(hdr, n);
+        if (hdr -> depth == 0)
+            return l;
+        if (path[l].pos < 0)
+            path[l].pos = 0;
+        if (hdr -> entries == 0 || l == EXT_MAX_DEPTH)
+            return -EIO;
+        if (ext_read_node(&path[l + 1], ext_idx(hdr)[path[l].pos].child) < 0)
+            return -EIO;
+        l++;
+    }
+}
+
+/**
+ * Map a logical block of an extent-mapped file.
+ *
+ * @param in the inode
+ * @param n the logical block
+ * @param run if not NULL, set to the number of blocks from n that
+ *   map contiguously, or for a hole the number of blocks up to the
+ *   next extent (INT_MAX if there is none); at least 1
+ * @param unwritten if not NULL, set to TRUE if the block is
+ *   preallocated but not yet written
+ * @return physical block, or 0 for a hole
+ */
+static uint32_t ext_map(struct fs_inode *in, uint32_t n, int *run, int *unwritten)
+{
+    struct ext_path path[EXT_MAX_DEPTH + 1];
+    uint32_t next = UINT32_MAX;
+    int d = ext_find(in, n, path), l;
+    if (run)
+        *run = 1;
+    if (unwritten)
+        *unwritten = FALSE;
+    if (d < 0)
+        return 0;
+    // the hole ends at the first key to the right along the path
+    for (l = 0; l <= d; l++) {
+        if (path[l].pos + 1 < path[l].hdr -> entries && ext_key(path[l].hdr, path[l].pos + 1) < next)
+            next = ext_key(path[l].hdr, path[l].pos + 1);
+    }
+    struct fs_extent *ex = path[d].pos >= 0 ? ext_extents(path[d].hdr) + path[d].pos : NULL;
+    if (ex == NULL || n >= ex -> logical + FS_EXT_LEN(ex)) {
+        if (run)
+            *run = next - n > INT_MAX ? INT_MAX : (int)(next - n);
+        return 0;
+    }
+    if (run)
+        *run = ex -> logical + FS_EXT_LEN(ex) - n;
+    if (unwritten)
+        *unwritten = (ex -> len & FS_EXT_UNWRITTEN) != 0;
+    return ex -> physical + (n - ex -> logical);
+}
+
+/**
+ * After a new first entry was put in the node at path level l,
+ * update the keys of its ancestors.
+ *
+ * @param in the inode
+ * @param path the path
+ * @param l the level of the changed node
+ */
+static void ext_fix_keys(struct fs_inode *in, struct ext_path *path, int l)
+{
+    uint32_t key = ext_key(path[l].hdr, 0);
+    for (; l > 0; l--) {
+        struct fs_extent_idx *idx = ext_idx(path[l - 1].hdr) + path[l - 1].pos;
+        if (idx -> logical <= key)
+            break;
+        idx -> logical = key;
+        ext_write_node(in, &path[l - 1]);
+        if (path[l - 1].pos != 0)
+            break;
+    }
+}
+
+/**
+ * Insert an entry into the node at path level l, splitting
+ * nodes up the path as needed.
+ *
+ * @param in the inode
+ * @param path the path to the node
+ * @param l the level of the node
+ * @param at position of the new entry
+ * @param entry the new extent or index entry
+ * @return 0 if successful, or -ENOSPC
+ */
+static int ext_insert_entry(struct fs_inode *in, struct ext_path *path,
+        int l, int at, void *entry)
+{
+    struct fs_extent_header *hdr = path[l].hdr;
+    int esz = ext_entry_size(hdr);
+    uint8_t *ents = (uint8_t*)(hdr + 1);
+
+    if (hdr -> entries < hdr -> max) {
+        memmove(ents + (at + 1) * esz, ents + at * esz, (hdr -> entries - at) * esz);
+        memcpy(ents + at * esz, entry, esz);
+        hdr -> entries++;
+        ext_write_node(in, &path[l]);
+        if (at == 0)
+            ext_fix_keys(in, path, l);
+        return 0;
+    }
+
+    // callers grow the tree first, so a full root is never split
+    uint32_t nb = l > 0 ? get_free_blk() : 0;
+    if (nb == 0)
+        return l > 0 ? -ENOSPC : -EIO;
+
+    // split: appending starts an empty node so sequential files
+    // pack their nodes full; otherwise move the upper half
+    uint8_t buf[FS_BLOCK_SIZE];
+    struct fs_extent_header *right = (struct fs_extent_header*)buf;
+    int mid = (at == hdr -> entries) ? hdr -> entries : hdr -> entries / 2;
+    memset(buf, 0, FS_BLOCK_SIZE);
+    *right = *hdr;
+    right -> entries = hdr -> entries - mid;
+    memcpy(right + 1, ents + mid * esz, right -> entries * esz);
+    hdr -> entries = mid;
+
+    int first = (at == 0);
+    if (at >= mid) {
+        uint8_t *rents = (uint8_t*)(right + 1);
+        at -= mid;
+        memmove(rents + (at + 1) * esz, rents + at * esz, (right -> entries - at) * esz);
+        memcpy(rents + at * esz, entry, esz);
+        right -> entries++;
+        first = FALSE;
+    }
+    else {
+        memmove(ents + (at + 1) * esz, ents + at * esz, (hdr -> entries - at) * esz);
+        memcpy(ents + at * esz, entry, esz);
+        hdr -> entries++;
+    }
+    write_block(nb, buf);
+    ext_write_node(in, &path[l]);
+    if (first)
+        ext_fix_keys(in, path, l);
+
+    struct fs_extent_idx idx = {.logical = ext_key(right, 0), .child = nb};
+    return ext_insert_entry(in, path, l - 1, path[l - 1].pos + 1, &idx);
+}
+
+/**
+ * Move the entries of the root into a new block one level down,
+ * leaving the root with a single index entry.
+ *
+ * @param in the inode
+ * @return 0 if successful, or -ENOSPC
+ */
+static int ext_grow(struct fs_inode *in)
+{
+    struct fs_extent_header *hdr = ext_root(in);
+    uint8_t buf[FS_BLOCK_SIZE];
+    struct fs_extent_header *child = (struct fs_extent_header*)buf;
+    uint32_t nb;
+
+    if (hdr -> depth >= EXT_MAX_DEPTH || (nb = get_free_blk()) == 0)
+        return -ENOSPC;
+    memset(buf, 0, FS_BLOCK_SIZE);
+    *child = *hdr;
+    child -> max = hdr -> depth == 0 ? FS_EXT_BLK_EXTENTS : FS_EXT_BLK_IDX;
+    memcpy(child + 1, hdr + 1, hdr -> entries * ext_entry_size(hdr));
+    write_block(nb, buf);
+
+    struct fs_extent_idx *idx = ext_idx(hdr);
+    idx[0].logical = hdr -> entries ? ext_key(child, 0) : 0;
+    idx[0].child = nb;
+    hdr -> depth++;
+    hdr -> max = FS_EXT_ROOT_IDX;
+    hdr -> entries = 1;
+    mark_inode(in);
+    return 0;
+}
+
+/**
+ * Map len blocks starting at a logical block to consecutive
+ * physical blocks, merging with the preceding extent when it
+ * ends just before both and is in the same written state.
+ *
+ * @param in the inode
+ * @param logical the first logical block
+ * @param physical the first physical block
+ * @param len number of blocks, or'ed with FS_EXT_UNWRITTEN for
+ *   preallocated blocks
+ * @return 0 if successful, or -error number
+ */
+static int ext_insert(struct fs_inode *in, uint32_t logical, uint32_t physical, uint32_t len)
+{
+    struct ext_path path[EXT_MAX_DEPTH + 1];
+    struct fs_extent new_ex = {.logical = logical, .physical = physical, .len = len};
+    int d, l, rv;
+
+    while (TRUE) {
+        d = ext_find(in, logical, path);
+        if (d < 0)
+            return d;
+        struct fs_extent_header *hdr = path[d].hdr;
+        int pos = path[d].pos;
+        if (pos >= 0) {
+            struct fs_extent *ex = ext_extents(hdr) + pos;
+            if (ex -> logical + FS_EXT_LEN(ex) == logical && ex -> physical + FS_EXT_LEN(ex) == physical &&
+                (ex -> len & FS_EXT_UNWRITTEN) == (len & FS_EXT_UNWRITTEN)) {
+                ex -> len += len & ~FS_EXT_UNWRITTEN;
+                ext_write_node(in, &path[d]);
+                return 0;
+            }
+        }
+        // a split that would reach a full root needs another level
+        for (l = d; l >= 0 && path[l].hdr -> entries == path[l].hdr -> max; l--)
+            ;
+        if (l >= 0)
+            break;
+        if ((rv = ext_grow(in)) < 0)
+            return rv;
+    }
+    if (sb.free_blocks < (uint32_t)d)
+        return -ENOSPC;
+    return ext_insert_entry(in, path, d, path[d].pos + 1, &new_ex);
+}
+
+/**
+ * Call visit() for every block below an extent tree node, including
+ * the blocks holding child nodes.
+ *
+ * @param hdr the node header
+ * @param visit function called with each block number
+ * @param arg argument passed to visit
+ */
+static void ext_walk_node(struct fs_extent_header *hdr,
+        void (*visit)(uint32_t blk, void *arg), void *arg)
+{
+    int i;
+    uint32_t b;
+    if (hdr -> depth == 0) {
+        struct fs_extent *ex = ext_extents(hdr);
+        for (i = 0; i < hdr -> entries; i++) {
+            for (b = 0; b < FS_EXT_LEN(&ex[i]); b++)
+                visit(ex[i].physical + b, arg);
+        }
+        return;
+    }
+    for (i = 0; i < hdr -> entries; i++) {
+        struct ext_path child;
+        uint32_t blk = ext_idx(hdr)[i].child;
+        visit(blk, arg);
+        if (ext_read_node(&child, blk) == 0)
+            ext_walk_node(child.hdr, visit, arg);
+    }
+}
+
+/**
+ * Free every block of an extent tree node's subtree that maps
+ * logical blocks from keep on, dropping emptied entries and child
+ * nodes. The node itself is not written.
+ *
+ * @param hdr the node header
+ * @param keep number of leading logical blocks to keep
+ * @param run the pending run of freed blocks
+ * @return TRUE if the node changed
+ */
+static int ext_trunc_node(struct fs_extent_header *hdr, uint32_t keep, struct free_run *run)
+{
+    int i, changed = FALSE;
+    if (hdr -> depth == 0) {
+        struct fs_extent *ex = ext_extents(hdr);
+        for (i = hdr -> entries - 1; i >= 0; i--) {
+            if (ex[i].logical >= keep) {
+                free_run_add(run, ex[i].physical, FS_EXT_LEN(&ex[i]));
+                hdr -> entries--;
+                changed = TRUE;
+            }
+            else {
+                if (ex[i].logical + FS_EXT_LEN(&ex[i]) > keep) {
+                    uint32_t cut = ex[i].logical + FS_EXT_LEN(&ex[i]) - keep;
+                    free_run_add(run, ex[i].physical + (keep - ex[i].logical), cut);
+                    ex[i].len -= cut;
+                    changed = TRUE;
+                }
+                break;
+            }
+        }
+        return changed;
+    }
+    for (i = hdr -> entries - 1; i >= 0; i--) {
+        struct ext_path child;
+        struct fs_extent_idx *idx = ext_idx(hdr) + i;
+        if (ext_read_node(&child, idx -> child) < 0)
+            break;
+        int child_changed = ext_trunc_node(child.hdr, idx -> logical >= keep ? 0 : keep, run);
+        if (child.hdr -> entries == 0) {
+            free_run_add(run, idx -> child, 1);
+            hdr -> entries--;
+            changed = TRUE;
+        }
+        else if (child_changed) {
+            write_block(child.blk, child.buf);
+        }
+        // children to the left map only blocks below keep
+        if (idx -> logical < keep)
+            break;
+    }
+    return changed;
+}
+
+/**
+ * Free the blocks of an extent-mapped file from block keep on.
+ * Each tree node is read at most once and whole extents are
+ * freed as ranges.
+ *
+ * @param in the file inode
+ * @param keep number of leading blocks to keep
+ */
+static void ext_truncate(struct fs_inode *in, uint32_t keep)
+{
+    struct free_run run = {0, 0};
+    ext_trunc_node(ext_root(in), keep, &run);
+    free_run_flush(&run);
+    if (ext_root(in) -> entries == 0)
+        ext_init(in);
+    else
+        mark_inode(in);
+}
+
+/**
+ * Allocate every block of an extent-mapped file from first to last
+ * that is not yet mapped. Each hole is filled from blocks right
+ * after the preceding mapped block where possible, so it usually
+ * merges into the preceding extent.
+ *
+ * @param in the file inode
+ * @param first the first 0-based block index
+ * @param last the last 0-based block index
+ * @return 0 if successful, or -ENOSPC
+ */
+static int ext_alloc(struct fs_inode *in, int first, int last)
+{
+    uint32_t goal = first > 0 ? ext_map(in, first - 1, NULL, NULL) : 0;
+    uint32_t run_start, run_phys, run_len, b;
+    int i = first, run, rv = 0;
+
+    if (goal != 0)
+        goal++;
+    while (i <= last && rv == 0) {
+        uint32_t phys = ext_map(in, i, &run, NULL);
+        if (run > last - i + 1)
+            run = last - i + 1;
+        if (phys != 0) {
+            goal = phys + run;
+            i += run;
+            continue;
+        }
+        // fill the hole [i, i+run) with as few extents as possible
+        run_start = i;
+        run_phys = run_len = 0;
+        for (; run > 0; run--, i++) {
+            uint32_t blk = get_free_blk_near(goal);
+            if (run_len > 0 && blk != 0 && blk == run_phys + run_len) {
+                run_len++;
+            }
+            else {
+                if (run_len > 0 && (rv = ext_insert(in, run_start, run_phys, run_len)) < 0) {
+                    for (b = 0; b < run_len; b++)
+                        return_blk(run_phys + b);
+                    run_len = 0;
+                    if (blk != 0)
+                        return_blk(blk);
+                    break;
+                }
+                if (blk == 0) {
+                    rv = -ENOSPC;
+                    run_len = 0;
+                    break;
+                }
+                run_start = i;
+                run_phys = blk;
+                run_len = 1;
+            }
+            goal = blk + 1;
+        }
+        if (run_len > 0 && (rv = ext_insert(in, run_start, run_phys, run_len)) < 0) {
+            for (b = 0; b < run_len; b++)
+                return_blk(run_phys + b);
+        }
+    }
+    return rv;
+}
+
+/**
+ * Preallocate every unmapped block of an extent-mapped file from
+ * first to last as unwritten extents. Each hole is taken from the
+ * longest free runs available, ideally one.
+ *
+ * @param in the file inode
+ * @param first the first 0-based block index
+ * @param last the last 0-based block index
+ * @param split set to the number of extra extents needed because
+ *   a hole found no single run of free blocks large enough
+ * @return 0 if successful, or -ENOSPC
+ */
+static int ext_prealloc(struct fs_inode *in, int first, int last, int *split)
+{
+    uint32_t goal = first > 0 ? ext_map(in, first - 1, NULL, NULL) : 0;
+    int i = first, run, got, rv;
+
+    *split = 0;
+    if (goal != 0)
+        goal++;
+    while (i <= last) {
+        uint32_t phys = ext_map(in, i, &run, NULL);
+        if (run > last - i + 1)
+            run = last - i + 1;
+        if (phys != 0) {
+            goal = phys + run;
+            i += run;
+            continue;
+        }
+        while (run > 0) {
+            uint32_t start = get_free_run(goal, run, &got);
+            if (start == 0)
+                return -ENOSPC;
+            if ((rv = ext_insert(in, i, start, got | FS_EXT_UNWRITTEN)) < 0) {
+                return_blk_range(start, got);
+                return rv;
+            }
+            if (got < run)
+                (*split)++;
+            i += got;
+            run -= got;
+            goal = start + got;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Mark the blocks of an extent-mapped file from first to last as
+ * written, splitting unwritten extents that only partly overlap.
+ *
+ * @param in the file inode
+ * @param first the first 0-based block index
+ * @param last the last 0-based block index
+ * @return 0 if successful, or -error number
+ */
+static int ext_mark_written(struct fs_inode *in, uint32_t first, uint32_t last)
+{
+    struct ext_path path[EXT_MAX_DEPTH + 1];
+    uint32_t i = first;
+    int d, rv;
+
+    while (i <= last) {
+        if ((d = ext_find(in, i, path)) < 0)
+            return d;
+        struct fs_extent *ex = path[d].pos >= 0 ? ext_extents(path[d].hdr) + path[d].pos : NULL;
+        if (ex == NULL || i >= ex -> logical + FS_EXT_LEN(ex)) {
+            int run;
+            ext_map(in, i, &run, NULL);
+            i += run;
+            continue;
+        }
+        uint32_t start = ex -> logical, len = FS_EXT_LEN(ex), phys = ex -> physical;
+        uint32_t end = start + len, stop = last + 1 < end ? last + 1 : end;
+        if (!(ex -> len & FS_EXT_UNWRITTEN)) {
+            i = end;
+            continue;
+        }
+        // [start, i) stays unwritten, [i, stop) is written, [stop, end) stays unwritten
+        struct fs_extent *prev = path[d].pos > 0 ? ex - 1 : NULL;
+        if (i == start && prev != NULL && !(prev -> len & FS_EXT_UNWRITTEN) &&
+            prev -> logical + prev -> len == start && prev -> physical + prev -> len == phys) {
+            // grow the written extent before it instead of adding one
+            prev -> len += stop - start;
+            if (stop < end) {
+                ex -> logical = stop;
+                ex -> physical = phys + (stop - start);
+                ex -> len = (end - stop) | FS_EXT_UNWRITTEN;
+            }
+            else {
+                struct fs_extent_header *hdr = path[d].hdr;
+                memmove(ex, ex + 1, (hdr -> entries - path[d].pos - 1) * sizeof(*ex));
+                hdr -> entries--;
+            }
+            ext_write_node(in, &path[d]);
+            i = stop;
+            continue;
+        }
+        if (i > start)
+            ex -> len = (i - start) | FS_EXT_UNWRITTEN;
+        else
+            ex -> len = stop - start;
+        ext_write_node(in, &path[d]);
+        if (i > start && (rv = ext_insert(in, i, phys + (i - start), stop - i)) < 0)
+            return rv;
+        if (stop < end && (rv = ext_insert(in, stop, phys + (stop - start), (end - stop) | FS_EXT_UNWRITTEN)) < 0)
+            return rv;
+        i = stop;
+    }
+    return 0;
+}
+
+/**
+ * Point the blocks of a file from first to last at a new run of
+ * physical blocks starting at phys, splitting the extents that
+ * hold them. The range must be mapped.
+ *
+ * @param in the file inode
+ * @param first the first logical block
+ * @param last the last logical block
+ * @param phys the block that first now maps to
+ * @return 0 if successful, or -error number
+ */
+static int ext_remap(struct fs_inode *in, uint32_t first, uint32_t last, uint32_t phys)
+{
+    struct ext_path path[EXT_MAX_DEPTH + 1];
+    uint32_t i = first;
+    int d, rv;
+
+    while (i <= last) {
+        if ((d = ext_find(in, i, path)) < 0)
+            return d;
+        struct fs_extent *ex = path[d].pos >= 0 ? ext_extents(path[d].hdr) + path[d].pos : NULL;
+        if (ex == NULL || i >= ex -> logical + FS_EXT_LEN(ex))
+            return -EIO;
+        uint32_t start = ex -> logical, old = ex -> physical;
+        uint32_t flag = ex -> len & FS_EXT_UNWRITTEN, end = start + FS_EXT_LEN(ex);
+        uint32_t stop = last + 1 < end ? last + 1 : end, to = phys + (i - first);
+        // [start, i) and [stop, end) keep their blocks, [i, stop) moves
+        if (i == start) {
+            ex -> physical = to;
+            ex -> len = (stop - start) | flag;
+        }
+        else {
+            ex -> len = (i - start) | flag;
+        }
+        ext_write_node(in, &path[d]);
+        if (i > start && (rv = ext_insert(in, i, to, (stop - i) | flag)) < 0)
+            return rv;
+        if (stop < end && (rv = ext_insert(in, stop, old + (stop - start), (end - stop) | flag)) < 0)
+            return rv;
+        i = stop;
+    }
+    return 0;
+}
@@ -1,7 +1,9 @@
 #define FALSE 0
 #define TRUE  1
 #define MAX_PATH_TOKEN_NUM  100
-#define MAX_PATH_TOKEN_SIZE 40
+#define MAX_PATH_TOKEN_SIZE (FS_NAME_MAX + 2) /* name, '/' and NUL */
+#define MAX_PATH_DEPTH      256 /* directories walked by translate */
+#define SYMLINK_FOLLOW_MAX  16  /* links followed by translate */
 
 #define IMAP_DIRTY 1
 #define BMAP_DIRTY 2
@@ -13,75 +15,280 @@
 #define NAME_NOT_FOUND -1
 #define DIR_FULL -1
 
-static int count_free_blk(void);
+#define FLUSH_INTERVAL_SEC 5    /* max age of dirty metadata in lazy mode */
+#define FLUSH_DIRTY_MAX    64   /* dirty metadata blocks that force a flush */
+#define ICACHE_SLOTS       256  /* inode cache size in inode blocks */
+#define REBUILD_THREADS_MAX 8   /* threads rebuilding the block map */
+#define REBUILD_BATCH      32   /* inode blocks read per device request */
+#define DA_MAX_BLOCKS      4096 /* buffered blocks that force a write-back */
+#define COPY_CHUNK         256  /* blocks per device request when copying */
+#define SNAP_ICACHE_SLOTS  8    /* inode blocks cached for snapshot views */
+#define SCRUB_SAVE_BATCHES 64   /* scrubber batches between cursor saves */
+#define SCRUB_IDLE_SEC     60   /* scrubber pause between passes */
+#define MAX_PTR_BLOCKS (N_DIRECT + PTRS_PER_BLK + PTRS_PER_BLK * PTRS_PER_BLK)
+
+static int count_zero_bits(fd_set *map, int nbits);
+static void walk_inode_blocks(struct fs_inode *in,
+        void (*visit)(uint32_t blk, void *arg), void *arg);
+static void rebuild_maps(int report);
 static int get_blk(struct fs_inode *in, int n, int alloc);
+static int alloc_blks(struct fs_inode *in, int first, int last);
+static int map_blks(struct fs_inode *in, int first, int last, uint32_t phys);
+static int ext_insert(struct fs_inode *in, uint32_t logical, uint32_t physical, uint32_t len);
 static int get_file_block_num(int32_t size);
-static int is_empty_dir(struct fs_dirent *de);
-static int find_free_dir(struct fs_dirent *de);
-static int find_in_dir(struct fs_dirent *de, char *name);
+static uint8_t *inline_data(struct fs_inode *in);
+static int uninline_inode(struct fs_inode *in);
+static int is_empty_dir(uint8_t *blk);
+static int find_in_dir(uint8_t *blk, const char *name);
+static int dir_add(uint8_t *blk, const char *name, int inum, int type);
+static void dir_remove(uint8_t *blk, int off);
+static void dir_compact(uint8_t *blk);
+static int dir_find_slot(uint8_t *blk, const char *name, int *slot);
+static void dir_insert(uint8_t *blk, int slot, const char *name, int inum, int type);
+static struct dir_bloom *bloom_find(int inum);
+static int bloom_maybe(struct dir_bloom *b, const char *name);
+static void bloom_build(int inum, uint8_t *blk);
 static void return_inode(int inum);
 static int get_free_inode(void);
 static void return_blk(int blkno);
 static int get_free_blk(void);
-static void return_indir_ptrs_blocks(Inode* inodePtr);
+static int get_free_blk_near(uint32_t goal);
+static int get_blk_run(struct fs_inode *in, int n, int max, int *run);
+static int count_holes(struct fs_inode *in, int first, int last);
+static void ext_init(struct fs_inode *in);
+static uint32_t ext_map(struct fs_inode *in, uint32_t n, int *run, int *unwritten);
+static int ext_prealloc(struct fs_inode *in, int first, int last, int *split);
+static int ext_mark_written(struct fs_inode *in, uint32_t first, uint32_t last);
+static int get_free_run(uint32_t goal, int want, int *got);
+static int ext_alloc(struct fs_inode *in, int first, int last);
+static struct fs_extent_header *ext_root(struct fs_inode *in);
+static void ext_walk_node(struct fs_extent_header *hdr,
+        void (*visit)(uint32_t blk, void *arg), void *arg);
+static void ext_truncate(struct fs_inode *in, uint32_t keep);
+static void truncate_ptr_blks(struct fs_inode *in, int keep);
+static void return_blk_range(uint32_t first, uint32_t count);
+static void release_blk_range(uint32_t first, uint32_t count);
+static int refcount_create(void);
+static int share_blk_range(uint32_t first, uint32_t count);
+static int unshare_blks(struct fs_inode *in, int first, int last);
+static int blk_shared(uint32_t blk);
+static void get_ptr_slots(struct fs_inode *in, int first, int n, uint32_t *slots);
+static void clear_ptr_slots(struct fs_inode *in, int first, int n);
+static int ext_remap(struct fs_inode *in, uint32_t first, uint32_t last, uint32_t phys);
 static void get_parent_dir(const char* path, char* parentPath);
 static void flush_metadata(void);
+static uint8_t *da_block(int inum, uint32_t lblk);
+static void da_read(int inum, off_t offset, int len, char *buf);
+static void da_truncate(int inum, off_t len);
+static int da_writeback(int inum);
+static void da_writeback_all(void);
+static void defer_flush_metadata(void);
+static void *flush_timer(void *arg);
+static void fs_lock(void);
+static void fs_unlock(void);
+static void icache_init(int nslots);
+static struct fs_inode *get_inode(int inum);
+static void icache_flush(void);
 static void mark_inode(struct fs_inode *in);
+static void mark_map(fd_set *map, int map_base, int bit);
 static int translate_1(const char *path, char *leaf);
 static int translate(const char *path, uint8_t* isRealDir);
+static int translate_path(const char *path, uint8_t* isRealDir, int *chain, int *chain_len);
+static int read_link(int inum, char *target);
 static int parse(const char *path, char **names, int nnames);
 static int lookup(int inum, char *name, uint8_t* isRealDir);
-static int parser_dir_block(int dirBlkIndex, DirEntry* dirEntries);
-static void write_block(uint32_t blk_index, const uint8_t* data_buf);
-static void read_block(uint32_t blk_index, uint8_t* data_buf);
 static void write_block(uint32_t blk_index, const uint8_t* data_buf);
-static void read_block(uint32_t blk_index, uint8_t* data_buf);
+static int read_block(uint32_t blk_index, uint8_t* data_buf);
 static void strip_dir(const char* path, char *nodirFilename);
+static int read_blocks(uint32_t blk_index, int n, uint8_t* data_buf);
+static void write_blocks(uint32_t blk_index, int n, const uint8_t* data_buf);
+static void write_data_blocks(uint32_t blk_index, int n, const uint8_t* data_buf);
+static const char *snap_enter(const char *path);
+static uint32_t snap_remap(struct snap *s, uint32_t blk);
+static int snap_holds(uint32_t blk);
+static void snap_preserve(uint32_t first, int n);
+static void snap_preserve_dirty(void);
+static struct fs_inode *snap_get_inode(int inum);
+static void snap_mark_blocks(fd_set *new_map);
+static void stat_inode(int inum, struct stat *sb);
+static int csum_verify(uint32_t blk, const uint8_t *buf);
+static void csum_set(uint32_t first, int n, const uint8_t *buf, int data);
+static void csum_clear(uint32_t first, uint32_t count);
+static void csum_flush(void);
+static void io_bad_add(uint32_t blk);
+static int io_bad_blk(uint32_t blk);
+static int io_status(int ret);
+static int cluster_read(struct fs_inode *in, char *buf, int len, off_t offset);
+static int cluster_write(int inum, struct fs_inode *in, const char *buf, size_t len, off_t offset);
+static int cluster_writeback(struct fs_inode *in, struct da_file *f);
+static int cluster_truncate(struct fs_inode *in, off_t len);
+static int cluster_mapped(struct fs_inode *in, int c);
+static void dedup_clear(uint32_t first, uint32_t count);
+static void dedup_add(uint32_t blk, uint32_t hash);
+static uint32_t *dedup_writeback(struct fs_inode *in, struct da_file *f,
+                                 uint32_t **dups, int *n_dups);
+static int dedup_writeback_dups(struct fs_inode *in, uint32_t *dups, int n_dups);
+static void dedup_flush(void);
+static void mark_frag(uint32_t blk);
+static int frag_read(uint32_t addr, uint8_t *buf);
+static void frag_free(uint32_t addr);
+static void tail_pack(struct fs_inode *in, struct da_file *f);
+static int tail_unpack(struct fs_inode *in, int inum);
+static void frag_flush(void);
 
 /**
- * Reading blocks from block device.
+ * Reading blocks from block device. In a snapshot view, a block
+ * that has been copied out is read from its copy. A block that
+ * fails its checksum reads as zeros, so that no pointer or entry
+ * in it is followed, and fails the current operation.
  * @param blk_index
  * @param data_buf
+ * @return 0 if successful, or -EIO on a checksum mismatch
  *
  */
-static void read_block(uint32_t blk_index, uint8_t* data_buf) {
+static int read_block(uint32_t blk_index, uint8_t* data_buf) {
+    if (cur_snap != NULL) {
+        blk_index = snap_remap(cur_snap, blk_index);
+    }
     if (disk->ops->read(disk, blk_index, 1, (void*)data_buf) < 0) {
         printf("block reading error %u\n", blk_index);
         exit(1);
     }
+    if (csum_verify(blk_index, data_buf) < 0) {
+        io_bad_add(blk_index);
+        memset(data_buf, 0, FS_BLOCK_SIZE);
+        return -EIO;
+    }
+    return 0;
 }
 
 /**
- * Writing blocks to block device.
+ * Writing blocks to block device. The old contents are first
+ * copied out if a snapshot uses the block. A block that failed its
+ * checksum in the current operation is left as it is.
  * @param blk_index
  * @param data_buf
  *
  */
 static void write_block(uint32_t blk_index, const uint8_t* data_buf) {
+    if (n_io_bad > 0 && io_bad_blk(blk_index)) {
+        return;
+    }
+    if (n_snaps > 0) {
+        snap_preserve(blk_index, 1);
+    }
     if (disk->ops->write(disk, blk_index, 1, (void*)data_buf) < 0) {
         printf("block writing error %u\n", blk_index);
         exit(1);
     }
+    csum_set(blk_index, 1, data_buf, FALSE);
+}
+
+/**
+ * Reading consecutive blocks from block device in one request.
+ * In a snapshot view with copied-out blocks they are read one by one.
+ * @param blk_index first block
+ * @param n number of blocks
+ * @param data_buf
+ * @return 0 if successful, or -EIO if a block fails its checksum
+ *
+ */
+static int read_blocks(uint32_t blk_index, int n, uint8_t* data_buf) {
+    int i, rv = 0;
+    if (cur_snap != NULL && cur_snap -> n_exc > 0) {
+        for (i = 0; i < n; i++) {
+            if (read_block(blk_index + i, data_buf + i * FS_BLOCK_SIZE) < 0)
+                rv = -EIO;
+        }
+        return rv;
+    }
+    if (disk->ops->read(disk, blk_index, n, (void*)data_buf) < 0) {
+        printf("block reading error %u+%d\n", blk_index, n);
+        exit(1);
+    }
+    for (i = 0; csum_map != NULL && i < n; i++) {
+        if (csum_verify(blk_index + i, data_buf + i * FS_BLOCK_SIZE) < 0) {
+            io_bad_add(blk_index + i);
+            memset(data_buf + i * FS_BLOCK_SIZE, 0, FS_BLOCK_SIZE);
+            rv = -EIO;
+        }
+    }
+    return rv;
 }
 
+/**
+ * Write consecutive blocks to the device in one request, copying
+ * out blocks that snapshots use first.
+ * @param blk_index first block
+ * @param n number of blocks
+ * @param data_buf
+ * @return FALSE if a block failed its checksum in the current
+ *   operation and nothing was written
+ *
+ */
+static int write_blocks_dev(uint32_t blk_index, int n, const uint8_t* data_buf) {
+    for (int i = 0; n_io_bad > 0 && i < n; i++) {
+        if (io_bad_blk(blk_index + i))
+            return FALSE;
+    }
+    if (n_snaps > 0) {
+        snap_preserve(blk_index, n);
+    }
+    if (disk->ops->write(disk, blk_index, n, (void*)data_buf) < 0) {
+        printf("block writing error %u+%d\n", blk_index, n);
+        exit(1);
+    }
+    return TRUE;
+}
 
 /**
- * Parse a data block storing a directory entry into an array
- * @param dir_blk_index
- * @param dir_entries
+ * Writing consecutive metadata blocks to block device in one request.
+ * @param blk_index first block
+ * @param n number of blocks
+ * @param data_buf
  *
  */
-static int parser_dir_block(int dir_blk_index, DirEntry* dir_entries) {
-    uint8_t blk_buf[FS_BLOCK_SIZE];
-    int wr_idx, i;
-    DirEntry* tmp_entry;
-    read_block(dir_blk_index, blk_buf);
-    for (i = 0, wr_idx=0; i < DIRENTS_PER_BLK; i++) {
-    	tmp_entry = (DirEntry*)(blk_buf + i * sizeof(DirEntry));
-        if (tmp_entry -> valid)
-        	dir_entries[wr_idx++] = *tmp_entry;
+static void write_blocks(uint32_t blk_index, int n, const uint8_t* data_buf) {
+    if (write_blocks_dev(blk_index, n, data_buf)) {
+        csum_set(blk_index, n, data_buf, FALSE);
     }
-    return wr_idx;
+}
+
+/**
+ * Writing consecutive file data blocks to block device in one
+ * request. They only keep checksums if the image checksums data,
+ * and leave the dedup index since their contents change.
+ * @param blk_index first block
+ * @param n number of blocks
+ * @param data_buf
+ *
+ */
+static void write_data_blocks(uint32_t blk_index, int n, const uint8_t* data_buf) {
+    dedup_clear(blk_index, n);
+    if (write_blocks_dev(blk_index, n, data_buf)) {
+        csum_set(blk_index, n, data_buf, TRUE);
+    }
+}
+
+
+/**
+ * Return the directory entry at an offset in a directory block, or
+ * NULL at the end of the block or at an entry whose length would
+ * run past it, so that a damaged block is never read out of bounds.
+ *
+ * @param blk the directory block
+ * @param off the entry offset
+ * @return the entry, or NULL
+ */
+static DirEntry *dir_entry(uint8_t *blk, int off)
+{
+    DirEntry *de = (DirEntry*)(blk + off);
+    if (off > FS_BLOCK_SIZE - (int)sizeof(DirEntry) || de -> rec_len < sizeof(DirEntry) ||
+        de -> rec_len % 4 != 0 || off + de -> rec_len > FS_BLOCK_SIZE ||
+        (de -> inode != 0 && FS_DIRENT_LEN(de -> name_len) > de -> rec_len)) {
+        return NULL;
+    }
+    return de;
 }
 
 /* Suggested functions to implement -- you are free to ignore these
@@ -89,44 +296,61 @@ static int parser_dir_block(int dir_blk_index, DirEntry* dir_entries) {
  */
 
 /**
- * Look up a single directory entry in a directory.
+ * Look up a single directory entry in a directory. In the live file
+ * system, a name the directory's filter has never seen is not
+ * looked for in the directory block (see bloom.h).
  *
  * Errors
  *   -EIO     - error reading block
  *   -ENOENT  - a component of the path is not present.
  *   -ENOTDIR - intermediate component of path not a directory
  *
+ * A name with a trailing '/' may name a symbolic link, for the
+ * caller to follow; *is_real_dir is then FALSE.
  */
 static int lookup(int inum, char *name, uint8_t* is_real_dir)
 {
-    int dir_block_index = inodes[inum].direct[0];
+    int dir_block_index = get_inode(inum) -> direct[0];
     uint32_t name_length = strlen(name);
+    if (n_io_bad > 0)
+        return -EIO;
     uint8_t isdir = name[name_length - 1] == '/';
     char pure_name[MAX_PATH_TOKEN_SIZE];
-    int entries_read_num = 0;
-    DirEntry dir_entry_buf[DIRENTS_PER_BLK];
-    int inode_found;
+    uint8_t blk_buf[FS_BLOCK_SIZE];
+    DirEntry *de;
+    struct dir_bloom *b = NULL;
+    int off;
     memset(pure_name, '\0', MAX_PATH_TOKEN_SIZE);
     if (isdir) 
         strncpy(pure_name, name, name_length-1);
     else 
         strncpy(pure_name, name, name_length);
-    entries_read_num = parser_dir_block(dir_block_index, dir_entry_buf);
-
-    //read almost DIRENTS_PER_BLK's entry
-    assert(entries_read_num <= DIRENTS_PER_BLK);
-    for (int j = 0; j < entries_read_num; j++) {
-        if (strcmp(dir_entry_buf[j].name, pure_name) == 0) {
-            //file name is directory but its not a directory
-            if (isdir && !dir_entry_buf[j].isDir) {
-                return -ENOTDIR;
-            }
-            inode_found = dir_entry_buf[j].inode;
-            *is_real_dir = dir_entry_buf[j].isDir ? TRUE: FALSE;
-            return inode_found;
+    if (cur_snap == NULL) {
+        bloom_lookups++;
+        if ((b = bloom_find(inum)) != NULL && !bloom_maybe(b, pure_name)) {
+            bloom_filtered++;
+            return -ENOENT;
         }
     }
-    return -ENOENT;
+    if (read_block(dir_block_index, blk_buf) < 0)
+        return -EIO;
+
+    //search the entries in place
+    off = find_in_dir(blk_buf, pure_name);
+    if (cur_snap == NULL && b == NULL)
+        bloom_build(inum, blk_buf);
+    if (off == NAME_NOT_FOUND) {
+        if (b != NULL)
+            bloom_false_pos++;
+        return -ENOENT;
+    }
+    de = (DirEntry*)(blk_buf + off);
+    //file name is directory but its not a directory
+    if (isdir && de -> type != FS_DT_DIR && de -> type != FS_DT_LNK) {
+        return -ENOTDIR;
+    }
+    *is_real_dir = de -> type == FS_DT_DIR ? TRUE: FALSE;
+    return de -> inode;
 }
 
 /**
@@ -141,11 +365,11 @@ static int lookup(int inum, char *name, uint8_t* is_real_dir)
  * @param path the directory path
  * @param names the argument token array or NULL
  * @param nnames the maximum number of names, 0 = unlimited
- * @return the number of path name tokens
+ * @return the number of path name tokens, or -ENAMETOOLONG if a
+ *   name is longer than FS_NAME_MAX or there are more than nnames
  */
 static int parse(const char *path, char **names, int nnames)
 { 
-    assert(nnames == 0);
     char tmp_file_name[MAX_PATH_TOKEN_SIZE];
     int idx;
     //first filename
@@ -156,6 +380,9 @@ static int parse(const char *path, char **names, int nnames)
 
     while (path[idx] != '\0') {
         if ((path[idx] == '/') || (path[idx + 1] == '\0' && path[idx] != '/')) { 
+            if (path + idx - file_name_start_ptr + (path[idx] != '/') > FS_NAME_MAX ||
+                (nnames > 0 && file_name_wr_idx == nnames))
+                return -ENAMETOOLONG;
             //copy directory path
             memset(tmp_file_name, '\0', MAX_PATH_TOKEN_SIZE);
             strncpy(tmp_file_name, file_name_start_ptr, path + idx + 1 - file_name_start_ptr);
@@ -169,42 +396,148 @@ static int parse(const char *path, char **names, int nnames)
 }
 
 
+/**
+ * Read the target of a symbolic link.
+ *
+ * @param inum the link inode number
+ * @param target FS_SYMLINK_MAX + 1 bytes, set to the target and a NUL
+ * @return the target length, or -EIO
+ */
+static int read_link(int inum, char *target)
+{
+    struct fs_inode *in = get_inode(inum);
+    uint8_t blk_buf[FS_BLOCK_SIZE];
+    int len = in -> size;
+
+    if (in -> flags & FS_FL_INLINE) {
+        memcpy(target, inline_data(in), len);
+    }
+    else {
+        if (read_block(in -> direct[0], blk_buf) < 0)
+            return -EIO;
+        memcpy(target, blk_buf, len);
+    }
+    target[len] = '\0';
+    return len;
+}
+
 /* Return inode number for specified file or
  * directory.
+ *
+ * "." and ".." are resolved against the directories walked, and
+ * symbolic links are followed in every component but a last one
+ * with no trailing '/', which is looked up itself, as by lstat(2).
+ * A link's target replaces the components walked if it is absolute
+ * (from the root of the snapshot in a snapshot view), and otherwise
+ * the link's name.
  * 
  * Errors
  *   -ENOENT  - a component of the path is not present.
  *   -ENOTDIR - an intermediate component of path not a directory
+ *   -ENAMETOOLONG - a component is longer than FS_NAME_MAX, or the
+ *              path with a link target in it is too long
+ *   -ELOOP   - more than SYMLINK_FOLLOW_MAX links were followed
+ *   -EIO     - a directory or inode block failed its checksum
  *
  * @param path the file path
  * @return inode of path node or error
  */
 static int translate(const char *path, uint8_t* is_real_dir)
+{
+	return translate_path(path, is_real_dir, NULL, NULL);
+}
+
+/**
+ * Look up a path as translate does, and give the directories it
+ * ends up in, from the root down to the last directory walked (the
+ * path's own inode if it is a directory), after "..", "." and
+ * symbolic links are resolved. A directory has one name, so these
+ * are all the ancestors of that directory.
+ *
+ * @param path the file path
+ * @param is_real_dir set as by translate
+ * @param chain if not NULL, MAX_PATH_DEPTH entries for the inode
+ *   numbers of the directories
+ * @param chain_len set to the number of directories in chain
+ * @return inode of path node or error
+ */
+static int translate_path(const char *path, uint8_t* is_real_dir, int *chain, int *chain_len)
 {
 	char *names[MAX_PATH_TOKEN_NUM];
 	char name_storage[MAX_PATH_TOKEN_NUM][MAX_PATH_TOKEN_SIZE];
-	int token_nums = 0;
+	char target[FS_SYMLINK_MAX + 1], rest[PATH_MAX];
+	int dirs[MAX_PATH_DEPTH];
+	int token_nums = 0, depth = 0, links = 0, len, followed;
 	int tmp_inode_index;
-	Inode tmp_inode;
 	for (int i = 0; i < MAX_PATH_TOKEN_NUM; i++) {
 		names[i] = name_storage[i];
 	}
-	//split the path into multiple tokens
-	token_nums = parse(path, names, 0);
+	//paths under /.snapshots/<name> are looked up in that snapshot
+	if ((path = snap_enter(path)) == NULL)
+		return -ENOENT;
 	//root inode
-	tmp_inode_index = sbPtr -> root_inode;
-	tmp_inode = inodes[tmp_inode_index];
+	tmp_inode_index = dirs[0] = sbPtr -> root_inode;
 	*is_real_dir=TRUE;
-	//from root path
-	for (int i = 1; i < token_nums; i++) {
-		tmp_inode_index = lookup(tmp_inode_index, names[i], is_real_dir);
-		//return error code
-		if (tmp_inode_index < 0)
-			return tmp_inode_index;
-		else
-			tmp_inode = inodes[tmp_inode_index];
+	do {
+		//split the path into multiple tokens
+		token_nums = parse(path, names, MAX_PATH_TOKEN_NUM);
+		if (token_nums < 0)
+			return token_nums;
+		followed = FALSE;
+		for (int i = 0; i < token_nums; i++) {
+			len = strlen(names[i]);
+			if (strcmp(names[i], "/") == 0 || strcmp(names[i], ".") == 0 ||
+			    strcmp(names[i], "./") == 0)
+				continue;
+			if (strcmp(names[i], "..") == 0 || strcmp(names[i], "../") == 0) {
+				if (depth > 0)
+					depth--;
+				tmp_inode_index = dirs[depth];
+				*is_real_dir = TRUE;
+				continue;
+			}
+			tmp_inode_index = lookup(dirs[depth], names[i], is_real_dir);
+			//return error code
+			if (tmp_inode_index < 0)
+				return tmp_inode_index;
+			if (*is_real_dir) {
+				if (depth == MAX_PATH_DEPTH - 1)
+					return -ENAMETOOLONG;
+				dirs[++depth] = tmp_inode_index;
+				continue;
+			}
+			if (names[i][len - 1] != '/')
+				continue;
+			//a link: walk its target, then the rest of the path
+			if (++links > SYMLINK_FOLLOW_MAX)
+				return -ELOOP;
+			if (read_link(tmp_inode_index, target) < 0)
+				return io_status(-EIO);
+			len = strlen(target) + 1;
+			for (int j = i; j < token_nums; j++) {
+				len += strlen(names[j]);
+			}
+			if (len >= PATH_MAX)
+				return -ENAMETOOLONG;
+			strcpy(rest, target);
+			strcat(rest, "/");
+			for (int j = i + 1; j < token_nums; j++) {
+				strcat(rest, names[j]);
+			}
+			if (target[0] == '/')
+				depth = 0;
+			tmp_inode_index = dirs[depth];
+			*is_real_dir = TRUE;
+			path = rest;
+			followed = TRUE;
+			break;
+		}
+	} while (followed);
+	if (chain != NULL) {
+		memcpy(chain, dirs, (depth + 1) * sizeof(int));
+		*chain_len = depth + 1;
 	}
-	return tmp_inode_index;
+	return io_status(tmp_inode_index);
 }
 
 /**
@@ -226,16 +559,151 @@ static int translate_1(const char *path, char *leaf)
     return -EOPNOTSUPP;
 }
 
+/**
+ * Record a metadata block as dirty.
+ *
+ * @param blk_index the disk block number
+ * @param data the in-memory copy of the block
+ */
+static void mark_dirty(int blk_index, void *data)
+{
+    if (dirty[blk_index] == NULL) {
+        n_dirty++;
+    }
+    dirty[blk_index] = data;
+}
+
+/**
+ * Set up an empty inode cache.
+ *
+ * @param nslots number of inode blocks the cache may hold
+ */
+static void icache_init(int nslots)
+{
+    assert(nslots >= 8);
+    icache_nslots = nslots;
+    icache = calloc(nslots, sizeof(struct icache_slot));
+    icache_hash = malloc(nslots * sizeof(int));
+    for (int i = 0; i < nslots; i++) {
+        icache[i].blk = -1;
+        icache[i].next = -1;
+        icache_hash[i] = -1;
+    }
+    icache_clock = 0;
+}
+
+/**
+ * Write a dirty inode cache slot back to disk.
+ *
+ * @param slot the cache slot
+ */
+static void icache_writeback(struct icache_slot *slot)
+{
+    if (slot -> dirty) {
+        if (!slot -> bad)
+            write_block(inode_base + slot -> blk, (uint8_t*)slot -> inodes);
+        slot -> dirty = FALSE;
+        n_dirty--;
+    }
+}
+
+/**
+ * Write back all dirty inode blocks.
+ */
+static void icache_flush(void)
+{
+    for (int i = 0; i < icache_nslots; i++) {
+        icache_writeback(icache + i);
+    }
+}
+
+/**
+ * Return a pointer to an inode, reading its block into the
+ * cache if necessary. The block used longest ago is replaced,
+ * written back first if dirty, so the pointer stays valid until at
+ * least icache_nslots-1 other inode blocks have been used, however
+ * many of the cached blocks are dirty. The inodes of a block that
+ * fails its checksum read as zeros and are never written back.
+ *
+ * @param inum the inode number
+ * @return pointer to the cached inode
+ */
+static struct fs_inode *get_inode(int inum)
+{
+    int blk = inum / INODES_PER_BLK;
+    int h = blk % icache_nslots;
+    int i, victim = -1;
+    struct icache_slot *slot;
+
+    if (cur_snap != NULL) {
+        return snap_get_inode(inum);
+    }
+    assert(inum >= 0 && inum < n_inodes);
+    for (i = icache_hash[h]; i >= 0; i = icache[i].next) {
+        if (icache[i].blk == blk) {
+            icache[i].used = ++icache_clock;
+            // a block that failed its checksum is read again each time
+            if (icache[i].bad)
+                icache[i].bad = read_block(inode_base + blk, (uint8_t*)icache[i].inodes) < 0;
+            return icache[i].inodes + inum % INODES_PER_BLK;
+        }
+    }
+
+    // miss - take an empty slot, else the least recently used one,
+    // written back if dirty; preferring clean slots could replace one
+    // a caller still holds a pointer into
+    for (i = 0; i < icache_nslots; i++) {
+        if (icache[i].blk < 0) {
+            victim = i;
+            break;
+        }
+        if (victim < 0 || icache[i].used < icache[victim].used) {
+            victim = i;
+        }
+    }
+    slot = icache + victim;
+    if (slot -> blk >= 0) {
+        icache_writeback(slot);
+        int *pp = icache_hash + slot -> blk % icache_nslots;
+        while (*pp != victim) {
+            pp = &icache[*pp].next;
+        }
+        *pp = slot -> next;
+    }
+
+    slot -> bad = read_block(inode_base + blk, (uint8_t*)slot -> inodes) < 0;
+    slot -> blk = blk;
+    slot -> used = ++icache_clock;
+    slot -> next = icache_hash[h];
+    icache_hash[h] = victim;
+    return slot -> inodes + inum % INODES_PER_BLK;
+}
+
 /**
  * Mark a inode as dirty.
  *
- * @param in pointer to an inode
+ * @param in pointer to a cached inode
  */
 static void mark_inode(struct fs_inode *in)
 {
-    int inum = in - inodes;
-    int blk = inum / INODES_PER_BLK;
-    dirty[inode_base + blk] = (void*)inodes + blk * FS_BLOCK_SIZE;
+    struct icache_slot *slot = icache + ((char*)in - (char*)icache) / sizeof(struct icache_slot);
+    if (!slot -> dirty) {
+        slot -> dirty = TRUE;
+        n_dirty++;
+    }
+}
+
+/**
+ * Mark the bitmap block holding a bit as dirty.
+ *
+ * @param map the in-memory bitmap
+ * @param map_base number of the first block of the bitmap
+ * @param bit the bit that changed
+ */
+static void mark_map(fd_set *map, int map_base, int bit)
+{
+    int blk = bit / BITS_PER_BLK;
+    mark_dirty(map_base + blk, (void*)map + blk * FS_BLOCK_SIZE);
 }
 
 /**
@@ -244,14 +712,82 @@ static void mark_inode(struct fs_inode *in)
 static void flush_metadata(void)
 {
     int i;
-    dirty[1] = inode_map;
-    dirty[2] = block_map;
+    da_writeback_all();
+    if (n_dirty == 0) {
+        return;
+    }
+    if (n_snaps > 0) {
+        snap_preserve_dirty();
+    }
     for (i = 0; i < dirty_len; i++) {
         if (dirty[i]) {
-            disk->ops->write(disk, i, 1, dirty[i]);
-            dirty[i] = NULL; 
+            write_block(i, dirty[i]);
+            dirty[i] = NULL;
+        }
+    }
+    for (i = 0; refcount_map != NULL && i < sb.refcount_map_sz; i++) {
+        if (refcount_dirty[i]) {
+            write_block(sb.refcount_map + i, (uint8_t*)(refcount_map + i * REFS_PER_BLK));
+            refcount_dirty[i] = FALSE;
         }
     }
+    icache_flush();
+    frag_flush();
+    dedup_flush();
+    csum_flush();
+    n_dirty = 0;
+}
+
+/**
+ * Called after an operation changes metadata. Writes the dirty
+ * blocks back at once when mounted with -sync or when too many
+ * are pending; otherwise the flush timer picks them up.
+ */
+static void defer_flush_metadata(void)
+{
+    if (sync_metadata || n_dirty >= FLUSH_DIRTY_MAX) {
+        flush_metadata();
+    }
+}
+
+/**
+ * Background thread that writes back dirty metadata at most
+ * FLUSH_INTERVAL_SEC seconds after it was changed.
+ *
+ * @param arg unused
+ * @return unused - returns NULL
+ */
+static void *flush_timer(void *arg)
+{
+    struct timespec deadline;
+    fs_lock();
+    while (!flush_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += FLUSH_INTERVAL_SEC;
+        pthread_cond_timedwait(&flush_cond, &fs_mutex, &deadline);
+        flush_metadata();
+    }
+    fs_unlock();
+    return NULL;
+}
+
+/**
+ * Serialize file system operations against each other
+ * and against the flush timer.
+ */
+static void fs_lock(void)
+{
+    pthread_mutex_lock(&fs_mutex);
+}
+
+/**
+ * Release the file system lock.
+ */
+static void fs_unlock(void)
+{
+    cur_snap = NULL;
+    n_io_bad = 0;
+    pthread_mutex_unlock(&fs_mutex);
 }
 
 /**
@@ -274,10 +810,12 @@ static void get_parent_dir(const char* path, char* parent_path) {
 } 
 
 /**
- * Strip the directory.
+ * Strip the directory. Names too long for a directory entry are
+ * cut to FS_NAME_MAX + 1 characters, so that callers see they are
+ * too long.
  *
  * @param path
- * @param nodir_filename
+ * @param nodir_filename MAX_PATH_TOKEN_SIZE bytes, zeroed
  */
 static void strip_dir(const char* path, char *nodir_filename) {
     int length = strlen(path);
@@ -294,33 +832,142 @@ static void strip_dir(const char* path, char *nodir_filename) {
     }
     i++;
     int k = 0;
-    while (path[i] != '/' && path[i] != '\0') {
+    while (path[i] != '/' && path[i] != '\0' && k < MAX_PATH_TOKEN_SIZE - 1) {
     	nodir_filename[k++] = path[i++];
     }
 } 
 
+/** a run of consecutive blocks waiting to be freed */
+struct free_run {
+    uint32_t start;         /* first block of run */
+    uint32_t len;           /* number of blocks, 0 if empty */
+};
+
 /**
- * Return the indir pointers blocks.
- * @param inode_ptr
+ * Free the pending run of blocks.
  *
+ * @param run the pending run
  */
-static void return_indir_ptrs_blocks(Inode* inode_ptr) {
-    uint32_t indir2;
-    indir2 = inode_ptr -> indir_2;
-    uint32_t indir2s[PTRS_PER_BLK];
-    if (inode_ptr -> indir_1 != 0)
-        return_blk(inode_ptr -> indir_1);
-    if (indir2 != 0) {
-        read_block(indir2, (uint8_t*)indir2s);
-        for (int i = 0; i < PTRS_PER_BLK; i++) {
-            if (indir2s[i]!=0) {
-                return_blk(indir2s[i]);
-            }
-        } 
-        return_blk(inode_ptr -> indir_2);
+static void free_run_flush(struct free_run *run)
+{
+    if (run -> len > 0) {
+        release_blk_range(run -> start, run -> len);
+    }
+    run -> len = 0;
+}
+
+/**
+ * Add blocks to a run of blocks being freed. When they do not
+ * extend the run, the run is freed first and a new one started.
+ *
+ * @param run the pending run
+ * @param blk the first block number, 0 and FS_BLK_COMPRESSED are
+ *   ignored and a fragment address frees its fragments at once
+ * @param len number of blocks
+ */
+static void free_run_add(struct free_run *run, uint32_t blk, uint32_t len)
+{
+    if (blk == 0 || blk == FS_BLK_COMPRESSED || len == 0) {
+        return;
+    }
+    if (FS_IS_FRAG(blk)) {
+        frag_free(blk);
+        return;
+    }
+    if (run -> len > 0 && blk == run -> start + run -> len) {
+        run -> len += len;
+        return;
+    }
+    free_run_flush(run);
+    run -> start = blk;
+    run -> len = len;
+}
+
+/**
+ * Free every entry of a pointer block from index first on,
+ * clearing the entries.
+ *
+ * @param ptrs the pointer block
+ * @param first the first entry to free
+ * @param run the pending run of freed blocks
+ * @return TRUE if any entry was cleared
+ */
+static int free_ptrs(uint32_t *ptrs, int first, struct free_run *run)
+{
+    int changed = FALSE;
+    for (int i = first; i < PTRS_PER_BLK; i++) {
+        if (ptrs[i] != 0) {
+            free_run_add(run, ptrs[i], 1);
+            ptrs[i] = 0;
+            changed = TRUE;
+        }
     }
+    return changed;
 }
 
+/**
+ * Free the blocks of a pointer-mapped file from block keep on,
+ * along with pointer blocks left empty. Each pointer block is read
+ * at most once and freed blocks are returned to the block map in
+ * contiguous ranges.
+ *
+ * @param in the file inode
+ * @param keep number of leading blocks to keep
+ */
+static void truncate_ptr_blks(struct fs_inode *in, int keep)
+{
+    uint32_t ptrs[PTRS_PER_BLK], ptrs_ptrs[PTRS_PER_BLK];
+    struct free_run run = {0, 0};
+    int i, lo, base2 = N_DIRECT + PTRS_PER_BLK;
+
+    if (in -> size > 0 && keep <= (in -> size - 1) / FS_BLOCK_SIZE) {
+        in -> flags &= ~FS_FL_TAIL;
+    }
+    for (i = keep; i < N_DIRECT; i++) {
+        free_run_add(&run, in -> direct[i], 1);
+        in -> direct[i] = 0;
+    }
+    if (in -> indir_1 != 0 && keep < base2) {
+        lo = keep > N_DIRECT ? keep - N_DIRECT : 0;
+        read_block(in -> indir_1, (uint8_t*)ptrs);
+        if (free_ptrs(ptrs, lo, &run) && lo > 0) {
+            write_block(in -> indir_1, (uint8_t*)ptrs);
+        }
+        if (lo == 0) {
+            free_run_add(&run, in -> indir_1, 1);
+            in -> indir_1 = 0;
+        }
+    }
+    if (in -> indir_2 != 0) {
+        int changed = FALSE;
+        read_block(in -> indir_2, (uint8_t*)ptrs_ptrs);
+        for (i = 0; i < PTRS_PER_BLK; i++) {
+            lo = base2 + i * PTRS_PER_BLK;
+            if (ptrs_ptrs[i] == 0 || keep >= lo + PTRS_PER_BLK)
+                continue;
+            read_block(ptrs_ptrs[i], (uint8_t*)ptrs);
+            if (keep > lo) {
+                if (free_ptrs(ptrs, keep - lo, &run))
+                    write_block(ptrs_ptrs[i], (uint8_t*)ptrs);
+            }
+            else {
+                free_ptrs(ptrs, 0, &run);
+                free_run_add(&run, ptrs_ptrs[i], 1);
+                ptrs_ptrs[i] = 0;
+                changed = TRUE;
+            }
+        }
+        if (keep <= base2) {
+            free_run_add(&run, in -> indir_2, 1);
+            in -> indir_2 = 0;
+        }
+        else if (changed) {
+            write_block(in -> indir_2, (uint8_t*)ptrs_ptrs);
+        }
+    }
+    free_run_flush(&run);
+    mark_inode(in);
+}
 
 /**
  * Returns a free block number or 0 if none available.
@@ -334,6 +981,8 @@ static int get_free_blk(void)
     for (int i = start_idx; i < sb.num_blocks; i++) {
         if (!FD_ISSET(i, block_map)) {
             FD_SET(i, block_map);
+            mark_map(block_map, block_map_base, i);
+            sb.free_blocks--;
             return i;
         }
     }
@@ -341,219 +990,1454 @@ static int get_free_blk(void)
 }
 
 /**
- * Count the free block.
+ * Returns a free block at or after goal, wrapping around to the
+ * start of the data region, or 0 if none available. Whole words
+ * of the map that are full are skipped.
  *
+ * @param goal preferred block number, 0 for no preference
+ * @return free block number or 0 if none available
  */
-static int count_free_blk(void) {
-    int cnt = 0;
+static int get_free_blk_near(uint32_t goal)
+{
+    uint64_t *words = (uint64_t*)block_map;
     int start_idx = sb.inode_map_sz + sb.inode_region_sz + sb.block_map_sz + 1;
-    for (int i = start_idx; i < sb.num_blocks; i++) {
-        if (!FD_ISSET(i, block_map)) {
-            cnt++;
+    int i = goal >= start_idx && goal < sb.num_blocks ? goal : start_idx;
+    int end = sb.num_blocks, first = i, pass;
+
+    for (pass = 0; pass < 2; pass++) {
+        while (i < end) {
+            if (i % 64 == 0 && i + 64 <= end && words[i / 64] == ~(uint64_t)0) {
+                i += 64;
+                continue;
+            }
+            if (!FD_ISSET(i, block_map)) {
+                FD_SET(i, block_map);
+                mark_map(block_map, block_map_base, i);
+                sb.free_blocks--;
+                return i;
+            }
+            i++;
         }
+        end = first;
+        i = start_idx;
     }
-    return cnt;
+    return 0;
 }
 
 /**
- * Return a block to the free list
+ * Allocate a run of consecutive free blocks, looking first at or
+ * after goal and then from the start of the data region. Whole
+ * words of the map that are full or empty are stepped over at once.
+ * If no run of want blocks exists, the longest run found is taken.
  *
- * @param  blkno the block number
+ * @param goal preferred first block, 0 for no preference
+ * @param want number of blocks wanted
+ * @param got set to the number of blocks allocated
+ * @return first block of the run, or 0 if no block is free
  */
-static void return_blk(int blkno)
+static int get_free_run(uint32_t goal, int want, int *got)
 {
-    FD_CLR(blkno, block_map);
+    uint64_t *words = (uint64_t*)block_map;
+    int start_idx = sb.inode_map_sz + sb.inode_region_sz + sb.block_map_sz + 1;
+    int first = goal >= start_idx && goal < sb.num_blocks ? goal : start_idx;
+    int best = 0, best_len = 0, pass, i, end;
+
+    for (pass = 0; pass < 2 && best_len < want; pass++) {
+        int run_start = 0, run_len = 0;
+        i = pass == 0 ? first : start_idx;
+        end = pass == 0 ? sb.num_blocks : first;
+        while (i < end && run_len < want) {
+            if (i % 64 == 0 && i + 64 <= end && words[i / 64] == ~(uint64_t)0) {
+                run_len = 0;
+                i += 64;
+            }
+            else if (i % 64 == 0 && i + 64 <= end && words[i / 64] == 0) {
+                if (run_len == 0)
+                    run_start = i;
+                run_len += 64;
+                i += 64;
+            }
+            else if (FD_ISSET(i, block_map)) {
+                run_len = 0;
+                i++;
+            }
+            else {
+                if (run_len == 0)
+                    run_start = i;
+                run_len++;
+                i++;
+            }
+            if (run_len > best_len) {
+                best = run_start;
+                best_len = run_len;
+            }
+        }
+    }
+    if (best_len == 0) {
+        *got = 0;
+        return 0;
+    }
+    *got = best_len < want ? best_len : want;
+    for (i = best; i < best + *got; i++) {
+        FD_SET(i, block_map);
+    }
+    for (i = best - best % BITS_PER_BLK; i < best + *got; i += BITS_PER_BLK) {
+        mark_map(block_map, block_map_base, i);
+    }
+    sb.free_blocks -= *got;
+    return best;
 }
 
 /**
- * Returns a free inode number
+ * Count the clear bits of a bitmap.
  *
- * @return a free inode number or 0 if none available
+ * @param map the bitmap
+ * @param nbits number of bits in use
+ * @return number of clear bits below nbits
  */
-static int get_free_inode(void)
+static int count_zero_bits(fd_set *map, int nbits)
 {
-    for (int i = sb.root_inode; i < sb.inode_region_sz * INODES_PER_BLK; i++) {
-        if (!FD_ISSET(i, inode_map)) {
-            FD_SET(i, inode_map);
-            return i;
+    uint64_t *words = (uint64_t*)map;
+    int cnt = 0, i;
+    for (i = 0; i + 64 <= nbits; i += 64) {
+        cnt += 64 - __builtin_popcountll(words[i / 64]);
+    }
+    for (; i < nbits; i++) {
+        if (!FD_ISSET(i, map)) {
+            cnt++;
         }
     }
-    return 0;
+    return cnt;
 }
 
 /**
- * Return a inode to the free list.
+ * Return a block to the free list. A block that a snapshot uses
+ * stays allocated.
  *
- * @param  inum the inode number
+ * @param  blkno the block number
  */
-static void return_inode(int inum)
+static void return_blk(int blkno)
 {
-    FD_CLR(inum, inode_map);
+    if (FD_ISSET(blkno, block_map) && !(n_snaps > 0 && snap_holds(blkno))) {
+        FD_CLR(blkno, block_map);
+        mark_map(block_map, block_map_base, blkno);
+        sb.free_blocks++;
+        csum_clear(blkno, 1);
+        dedup_clear(blkno, 1);
+    }
 }
 
 /**
- * Find inode for existing directory entry.
+ * Return a range of blocks to the free list. Whole 64-bit words of
+ * the block map are cleared at once; like the FD_ macros on
+ * little-endian hosts, bit n is bit n%64 of word n/64. Blocks that
+ * a snapshot uses stay allocated.
  *
- * @param fs_dirent ptr to first dirent in directory
- * @param name the name of the directory entry
- * @return the entry inode, or 0 if not found.
+ * @param first the first block number
+ * @param count number of blocks
  */
-static int find_in_dir(struct fs_dirent *de, char *name)
+static void return_blk_range(uint32_t first, uint32_t count)
 {
-    int i;
-    DirEntry* tmp_entry_ptr;
-    for (i = 0; i < DIRENTS_PER_BLK; i++) {
-    	tmp_entry_ptr = de + i;
-        if (tmp_entry_ptr -> valid && strcmp(tmp_entry_ptr -> name, name) == 0)
-            return i;
+    uint64_t *words = (uint64_t*)block_map;
+    uint32_t blk = first, end = first + count;
+
+    while (blk < end) {
+        if (n_snaps == 0 && blk % 64 == 0 && blk + 64 <= end) {
+            sb.free_blocks += __builtin_popcountll(words[blk / 64]);
+            words[blk / 64] = 0;
+            csum_clear(blk, 64);
+            dedup_clear(blk, 64);
+            blk += 64;
+        }
+        else {
+            if (FD_ISSET(blk, block_map) && !(n_snaps > 0 && snap_holds(blk))) {
+                FD_CLR(blk, block_map);
+                sb.free_blocks++;
+                csum_clear(blk, 1);
+                dedup_clear(blk, 1);
+            }
+            blk++;
+        }
+    }
+    // one mark per block map block covered
+    for (blk = first - first % BITS_PER_BLK; blk < end; blk += BITS_PER_BLK) {
+        mark_map(block_map, block_map_base, blk);
     }
-    return NAME_NOT_FOUND;
 }
 
 /**
- * Find free directory entry.
+ * Mark the refcount map block holding the count of a block as dirty.
  *
- * @return index of directory free entry or -ENOSPC
- *   if no space for new entry in directory
+ * @param blk the block number
  */
-static int find_free_dir(struct fs_dirent *de)
+static void mark_refcount(uint32_t blk)
 {
-    int i;
-    DirEntry* tmp_entry_ptr;
-    for (i = 0; i < DIRENTS_PER_BLK; i++) {
-    	tmp_entry_ptr = de + i;
-        if (!(tmp_entry_ptr -> valid))
-            return i;
+    int b = blk / REFS_PER_BLK;
+    if (!refcount_dirty[b]) {
+        refcount_dirty[b] = TRUE;
+        n_dirty++;
     }
-    return DIR_FULL;
 }
 
 /**
- * Determines whether directory is empty.
+ * Create an empty refcount map in a run of free blocks, the first
+ * time a block is shared. The superblock is written at once so
+ * that a rebuild after a crash finds the map.
  *
- * @param de ptr to first entry in directory
- * @return 1 if empty 0 if has entries
+ * @return 0 if successful, or -ENOSPC
  */
-static int is_empty_dir(struct fs_dirent *de)
+static int refcount_create(void)
 {
-    int i;
-    DirEntry* tmp_entry_ptr;
-    for (i = 0; i < DIRENTS_PER_BLK; i++) {
-    	tmp_entry_ptr = de + i;
-        if (tmp_entry_ptr -> valid)
-            return FALSE;
+    int sz = (sb.num_blocks + REFS_PER_BLK - 1) / REFS_PER_BLK, got;
+    uint32_t start;
+
+    if (refcount_map != NULL) {
+        return 0;
     }
-    return TRUE;
+    start = get_free_run(0, sz, &got);
+    if (got < sz) {
+        if (start != 0)
+            return_blk_range(start, got);
+        return -ENOSPC;
+    }
+    refcount_map = calloc(sz, FS_BLOCK_SIZE);
+    refcount_dirty = calloc(sz, 1);
+    write_blocks(start, sz, (uint8_t*)refcount_map);
+    sb.refcount_map = start;
+    sb.refcount_map_sz = sz;
+    write_block(0, (uint8_t*)&sb);
+    return 0;
 }
 
 /**
- * Get the file block numbers.
+ * Add a reference to each block of a run that one more file now
+ * maps. Nothing is changed if a block already has the most
+ * references a count can hold.
  *
- * @param size
+ * @param first the first block number
+ * @param count number of blocks
+ * @return 0 if successful, or -EMLINK
  */
-static int get_file_block_num(int32_t size) {
+static int share_blk_range(uint32_t first, uint32_t count)
+{
+    uint32_t b, end = first + count;
+    for (b = first; b < end; b++) {
+        if (refcount_map[b] >= FS_REFCOUNT_MAX)
+            return -EMLINK;
+    }
+    for (b = first; b < end; b++) {
+        refcount_map[b]++;
+    }
+    for (b = first - first % REFS_PER_BLK; b < end; b += REFS_PER_BLK) {
+        mark_refcount(b);
+    }
+    return 0;
+}
+
+/**
+ * Drop one reference to each block of a run. Blocks that other
+ * files still share lose a count; the rest return to the free list.
+ *
+ * @param first the first block number
+ * @param count number of blocks
+ */
+static void release_blk_range(uint32_t first, uint32_t count)
+{
+    uint32_t b, end = first + count, free_start = first;
+
+    if (refcount_map == NULL) {
+        return_blk_range(first, count);
+        return;
+    }
+    for (b = first; b < end; b++) {
+        if (refcount_map[b] > 0) {
+            if (b > free_start)
+                return_blk_range(free_start, b - free_start);
+            refcount_map[b]--;
+            mark_refcount(b);
+            free_start = b + 1;
+        }
+    }
+    if (end > free_start) {
+        return_blk_range(free_start, end - free_start);
+    }
+}
+
+/**
+ * Returns a free inode number
+ *
+ * @return a free inode number or 0 if none available
+ */
+static int get_free_inode(void)
+{
+    for (int i = sb.root_inode; i < sb.inode_region_sz * INODES_PER_BLK; i++) {
+        if (!FD_ISSET(i, inode_map)) {
+            FD_SET(i, inode_map);
+            mark_map(inode_map, inode_map_base, i);
+            sb.free_inodes--;
+            return i;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Return a inode to the free list.
+ *
+ * @param  inum the inode number
+ */
+static void return_inode(int inum)
+{
+    if (FD_ISSET(inum, inode_map)) {
+        FD_CLR(inum, inode_map);
+        mark_map(inode_map, inode_map_base, inum);
+        sb.free_inodes++;
+    }
+}
+
+/**
+ * Find an existing directory entry (see dir_search).
+ *
+ * @param blk the directory block
+ * @param name the name of the directory entry
+ * @return the entry offset in the block, or NAME_NOT_FOUND
+ */
+static int find_in_dir(uint8_t *blk, const char *name)
+{
+    struct dir_key key;
+    dir_key_init(&key, name);
+    return dir_search(blk, &key, NULL, NULL);      // -1 is NAME_NOT_FOUND
+}
+
+/**
+ * Move the entries of a directory block to its start, so that its
+ * unused space is in one piece at the end of the last entry.
+ *
+ * @param blk the directory block
+ */
+static void dir_compact(uint8_t *blk)
+{
+    uint8_t tmp[FS_BLOCK_SIZE];
+    DirEntry *de, *last = NULL;
+    int off, wr = 0;
+
+    memset(tmp, 0, FS_BLOCK_SIZE);
+    for (off = 0; (de = dir_entry(blk, off)) != NULL; off += de -> rec_len) {
+        if (de -> inode == 0)
+            continue;
+        last = (DirEntry*)(tmp + wr);
+        memcpy(last, de, FS_DIRENT_LEN(de -> name_len));
+        last -> rec_len = FS_DIRENT_LEN(de -> name_len);
+        wr += last -> rec_len;
+    }
+    if (last == NULL)
+        ((DirEntry*)tmp) -> rec_len = FS_BLOCK_SIZE;
+    else
+        last -> rec_len += FS_BLOCK_SIZE - wr;
+    memcpy(blk, tmp, FS_BLOCK_SIZE);
+}
+
+/**
+ * Look up a name in a directory block and find room for an entry
+ * of that name, in one pass (see dir_search). If the unused space
+ * is only enough when taken together, the block is compacted,
+ * which may move other entries. A zeroed block is made an empty
+ * directory.
+ *
+ * @param blk the directory block
+ * @param name the name, at most FS_NAME_MAX bytes
+ * @param slot set to the entry offset for dir_insert, or DIR_FULL
+ *   if the block has no room
+ * @return the offset of the entry with the name, or NAME_NOT_FOUND
+ */
+static int dir_find_slot(uint8_t *blk, const char *name, int *slot)
+{
+    struct dir_key key;
+    int off, unused;
+
+    if (((DirEntry*)blk) -> rec_len == 0) {
+        memset(blk, 0, FS_BLOCK_SIZE);
+        ((DirEntry*)blk) -> rec_len = FS_BLOCK_SIZE;
+    }
+    dir_key_init(&key, name);
+    if ((off = dir_search(blk, &key, slot, &unused)) >= 0) {
+        return off;
+    }
+    if (*slot < 0 && unused >= key.need) {
+        dir_compact(blk);
+        dir_search(blk, &key, slot, &unused);
+    }
+    if (*slot < 0) {
+        *slot = DIR_FULL;
+    }
+    return NAME_NOT_FOUND;
+}
+
+/**
+ * Add an entry to a directory block at a slot from dir_find_slot,
+ * splitting it off the unused space at the end of the entry there.
+ *
+ * @param blk the directory block
+ * @param slot the entry offset
+ * @param name the entry name
+ * @param inum the entry inode
+ * @param type FS_DT_REG or FS_DT_DIR
+ */
+static void dir_insert(uint8_t *blk, int slot, const char *name, int inum, int type)
+{
+    DirEntry *de = (DirEntry*)(blk + slot);
+    int len = strlen(name), used = de -> inode != 0 ? FS_DIRENT_LEN(de -> name_len) : 0;
+
+    if (used > 0) {
+        DirEntry *next = (DirEntry*)(blk + slot + used);
+        next -> rec_len = de -> rec_len - used;
+        de -> rec_len = used;
+        de = next;
+    }
+    de -> inode = inum;
+    de -> name_len = len;
+    de -> type = type;
+    memcpy(de -> name, name, len);
+}
+
+/**
+ * Add an entry to a directory block, which must not already hold
+ * the name.
+ *
+ * @param blk the directory block
+ * @param name the entry name, at most FS_NAME_MAX bytes
+ * @param inum the entry inode
+ * @param type FS_DT_REG or FS_DT_DIR
+ * @return 0 if successful, or DIR_FULL if the block has no room
+ */
+static int dir_add(uint8_t *blk, const char *name, int inum, int type)
+{
+    int slot;
+
+    dir_find_slot(blk, name, &slot);
+    if (slot == DIR_FULL) {
+        return DIR_FULL;
+    }
+    dir_insert(blk, slot, name, inum, type);
+    return 0;
+}
+
+/**
+ * Remove the entry at an offset from a directory block. Its space
+ * goes to the entry before it, or the first entry is marked unused.
+ *
+ * @param blk the directory block
+ * @param off the entry offset, from find_in_dir
+ */
+static void dir_remove(uint8_t *blk, int off)
+{
+    DirEntry *de = (DirEntry*)(blk + off), *prev = NULL;
+    int o;
+    for (o = 0; (prev = dir_entry(blk, o)) != NULL && o + prev -> rec_len < off; o += prev -> rec_len)
+        ;
+    if (off > 0 && prev != NULL && o + prev -> rec_len == off)
+        prev -> rec_len += de -> rec_len;
+    else
+        de -> inode = 0;
+}
+
+/**
+ * Determines whether directory is empty.
+ *
+ * @param blk the directory block
+ * @return 1 if empty 0 if has entries
+ */
+static int is_empty_dir(uint8_t *blk)
+{
+    int off;
+    DirEntry *de;
+    for (off = 0; (de = dir_entry(blk, off)) != NULL; off += de -> rec_len) {
+        if (de -> inode != 0)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Get the file block numbers.
+ *
+ * @param size
+ */
+static int get_file_block_num(int32_t size) {
     int8_t no_complete = size % BLOCK_SIZE != 0;
     int current_block_num = (size / BLOCK_SIZE) + no_complete;
     return current_block_num;
 }
 
 /**
- * Returns the n-th block of the file, or allocates
- * it if it does not exist and alloc == 1.
+ * Get the inline data area of an inode.
+ *
+ * @param in the inode
+ * @return pointer to the FS_INLINE_MAX bytes starting at direct[0]
+ */
+static uint8_t *inline_data(struct fs_inode *in)
+{
+    return (uint8_t*)in -> direct;
+}
+
+/**
+ * Move the data of an inline file into its first data block,
+ * turning it into a block-backed file.
+ *
+ * @param in the file inode
+ * @return 0 if successful, or -ENOSPC
+ */
+static int uninline_inode(struct fs_inode *in)
+{
+    uint8_t block_buf[FS_BLOCK_SIZE];
+    int32_t size = in -> size;
+
+    if (size > 0 && sb.free_blocks == 0) {
+        return -ENOSPC;
+    }
+    memset(block_buf, 0, FS_BLOCK_SIZE);
+    memcpy(block_buf, inline_data(in), size);
+    memset(inline_data(in), 0, FS_INLINE_MAX);
+    in -> flags &= ~FS_FL_INLINE;
+    in -> size = 0;
+    if (in -> flags & FS_FL_EXTENTS) {
+        ext_init(in);
+    }
+    if (size > 0) {
+        write_data_blocks(get_blk(in, 0, TRUE), 1, block_buf);
+        in -> size = size;
+    }
+    mark_inode(in);
+    return 0;
+}
+
+/**
+ * Returns the n-th block of the file, or allocates it if it is
+ * a hole and alloc == 1. Preallocated blocks that were never
+ * written are reported as holes.
  *
  * @param in the file inode
  * @param n the 0-based block index in file
- * @param alloc 1=allocate block if does not exist 0 = fail
+ * @param alloc 1=allocate block if does not exist 0 = return 0
  *   if does not exist
- * @return block number of the n-th block or 0 if available
+ * @return block number of the n-th block, or 0 for a hole or
+ *   if it could not be allocated
  */
 static int get_blk(struct fs_inode *in, int n, int alloc)
 {
-    int current_block_num = get_file_block_num(in -> size);
-    //assert(n >= 0 && n <= currentBlockNum);
-    if (!alloc || (alloc && n < current_block_num)) {
-        if (n < N_DIRECT) {
-            return (in -> direct)[n];
-        }
-        else if (n >= N_DIRECT && n < N_DIRECT + PTRS_PER_BLK) {
-            uint32_t ptrs[PTRS_PER_BLK];
-            read_block(in -> indir_1, (uint8_t*)ptrs);
-            return ptrs[n - N_DIRECT];
-        }
-        else {
-            uint32_t ptrs_ptrs[PTRS_PER_BLK];
-            uint32_t ptrs[PTRS_PER_BLK];
-            int n_offset2 = n - N_DIRECT - PTRS_PER_BLK;
-            int ptrs_ptrs_offset = n_offset2 / PTRS_PER_BLK;
-            int ptrs_offset = n_offset2 % PTRS_PER_BLK;
-            read_block(in -> indir_2, (uint8_t*)ptrs_ptrs);
-            read_block(ptrs_ptrs[ptrs_ptrs_offset], (uint8_t*)ptrs);
-            return ptrs[ptrs_offset];
-        }
+    if (alloc && alloc_blks(in, n, n) < 0) {
+        return 0;
     }
-    //allocate new blocks
-    else {
-        int new_allocate_num = n - current_block_num + 1;
+    if (in -> flags & FS_FL_EXTENTS) {
+        int unwritten;
+        uint32_t blk = ext_map(in, n, NULL, &unwritten);
+        return unwritten ? 0 : blk;
+    }
+    if (n < N_DIRECT) {
+        return (in -> direct)[n];
+    }
+    else if (n < N_DIRECT + PTRS_PER_BLK) {
+        uint32_t ptrs[PTRS_PER_BLK];
+        if (in -> indir_1 == 0)
+            return 0;
+        read_block(in -> indir_1, (uint8_t*)ptrs);
+        return ptrs[n - N_DIRECT];
+    }
+    else if (n < MAX_PTR_BLOCKS) {
         uint32_t ptrs_ptrs[PTRS_PER_BLK];
         uint32_t ptrs[PTRS_PER_BLK];
-        int ptrs_ptrs_blk_idx;
-        int ptrs_blk_idx;
-        int ptrs_offset = 0;
-        int ptrs_ptrs_offset = 0;
-        int n_offset2 = 0;
-
-        for (int i = 0; i < new_allocate_num; i++) {
-            int cur_nth_block = current_block_num + i;
-            int new_block_index = get_free_blk();
-            if (cur_nth_block < N_DIRECT) {
-                (in -> direct)[cur_nth_block] = new_block_index;
-                mark_inode(in);
-                //flush meta
-            }
-            else if (cur_nth_block >= N_DIRECT && cur_nth_block < N_DIRECT + PTRS_PER_BLK) {
-                if (cur_nth_block == N_DIRECT) {
-                    ptrs_blk_idx = get_free_blk();
-                    in -> indir_1 = ptrs_blk_idx;
+        int n_offset2 = n - N_DIRECT - PTRS_PER_BLK;
+        int ptrs_ptrs_offset = n_offset2 / PTRS_PER_BLK;
+        int ptrs_offset = n_offset2 % PTRS_PER_BLK;
+        if (in -> indir_2 == 0)
+            return 0;
+        read_block(in -> indir_2, (uint8_t*)ptrs_ptrs);
+        if (ptrs_ptrs[ptrs_ptrs_offset] == 0)
+            return 0;
+        read_block(ptrs_ptrs[ptrs_ptrs_offset], (uint8_t*)ptrs);
+        return ptrs[ptrs_offset];
+    }
+    return 0;
+}
+
+/**
+ * Allocate every block of a file from first to last that is not
+ * yet mapped. Blocks before first that are not mapped stay holes.
+ * New data blocks are not cleared; pointer blocks are.
+ *
+ * @param in the file inode
+ * @param first the first 0-based block index
+ * @param last the last 0-based block index
+ * @return 0 if successful, -EFBIG if last is beyond the largest
+ *   file, or -ENOSPC
+ */
+static int alloc_blks(struct fs_inode *in, int first, int last)
+{
+    return map_blks(in, first, last, 0);
+}
+
+/**
+ * Map the unmapped blocks of a file from first to last, either to
+ * newly allocated blocks or to an already allocated run.
+ *
+ * @param in the file inode
+ * @param first the first 0-based block index
+ * @param last the last 0-based block index
+ * @param phys if not 0, block first maps to phys, first+1 to
+ *   phys+1 and so on; the range must be a hole
+ * @return 0 if successful, -EFBIG if last is beyond the largest
+ *   file, or -ENOSPC
+ */
+static int map_blks(struct fs_inode *in, int first, int last, uint32_t phys)
+{
+    if (in -> flags & FS_FL_EXTENTS) {
+        return phys ? ext_insert(in, first, phys, last - first + 1) : ext_alloc(in, first, last);
+    }
+    if (last >= MAX_PTR_BLOCKS) {
+        return -EFBIG;
+    }
+
+    uint32_t ptrs_ptrs[PTRS_PER_BLK];
+    uint32_t ptrs[PTRS_PER_BLK];
+    int ptrs_blk_idx = 0;
+    int ptrs_ptrs_offset = -1;
+    int n_offset2;
+    /* pointer blocks are loaded once and written back when left or done */
+    int ptrs_dirty = FALSE, ptrs_ptrs_dirty = FALSE;
+    int ptrs_loaded = FALSE, ptrs_ptrs_loaded = FALSE;
+    /* keep new blocks next to the previous one */
+    int prev_block_index = first > 0 ? get_blk(in, first - 1, FALSE) : 0;
+    int rv = 0;
+
+    for (int cur_nth_block = first; cur_nth_block <= last; cur_nth_block++) {
+        uint32_t *slot;
+        if (cur_nth_block < N_DIRECT) {
+            slot = &(in -> direct)[cur_nth_block];
+        }
+        else if (cur_nth_block < N_DIRECT + PTRS_PER_BLK) {
+            if (!ptrs_loaded) {
+                if (in -> indir_1 == 0) {
+                    if ((in -> indir_1 = get_free_blk()) == 0) {
+                        rv = -ENOSPC;
+                        break;
+                    }
                     mark_inode(in);
-                    flush_metadata();
+                    memset(ptrs, 0, FS_BLOCK_SIZE);
+                    ptrs_dirty = TRUE;
                 }
                 else {
-                    ptrs_blk_idx = in -> indir_1;
-                    read_block(ptrs_blk_idx, (uint8_t*)ptrs);
+                    read_block(in -> indir_1, (uint8_t*)ptrs);
                 }
-                ptrs[cur_nth_block - N_DIRECT] = new_block_index;
-                if (cur_nth_block == N_DIRECT + PTRS_PER_BLK - 1 || cur_nth_block == n) {
-                    write_block(ptrs_blk_idx, (uint8_t*)ptrs);
+                ptrs_blk_idx = in -> indir_1;
+                ptrs_loaded = TRUE;
+            }
+            slot = &ptrs[cur_nth_block - N_DIRECT];
+        }
+        else {
+            n_offset2 = cur_nth_block - N_DIRECT - PTRS_PER_BLK;
+            if (!ptrs_ptrs_loaded) {
+                if (in -> indir_2 == 0) {
+                    if ((in -> indir_2 = get_free_blk()) == 0) {
+                        rv = -ENOSPC;
+                        break;
+                    }
+                    mark_inode(in);
+                    memset(ptrs_ptrs, 0, FS_BLOCK_SIZE);
+                    ptrs_ptrs_dirty = TRUE;
+                }
+                else {
+                    read_block(in -> indir_2, (uint8_t*)ptrs_ptrs);
                 }
+                ptrs_ptrs_loaded = TRUE;
             }
-            else {     
-                n_offset2 = cur_nth_block - N_DIRECT - PTRS_PER_BLK;
+            if (ptrs_ptrs_offset != n_offset2 / PTRS_PER_BLK) {
+                // moving on to the next pointer block
+                if (ptrs_loaded && ptrs_dirty)
+                    write_block(ptrs_blk_idx, (uint8_t*)ptrs);
+                ptrs_dirty = FALSE;
                 ptrs_ptrs_offset = n_offset2 / PTRS_PER_BLK;
-                ptrs_offset = n_offset2 % PTRS_PER_BLK;
-                if (cur_nth_block == N_DIRECT + PTRS_PER_BLK) {
-                    ptrs_ptrs_blk_idx = get_free_blk();
-                    in -> indir_2 = ptrs_ptrs_blk_idx;
-                    mark_inode(in);
+                if (ptrs_ptrs[ptrs_ptrs_offset] == 0) {
+                    if ((ptrs_ptrs[ptrs_ptrs_offset] = get_free_blk()) == 0) {
+                        ptrs_loaded = FALSE;
+                        rv = -ENOSPC;
+                        break;
+                    }
+                    ptrs_ptrs_dirty = TRUE;
+                    memset(ptrs, 0, FS_BLOCK_SIZE);
+                    ptrs_dirty = TRUE;
                 }
-
-                if (ptrs_offset == 0) {
-                    ptrs_blk_idx = get_free_blk();
-                    ptrs_ptrs[ptrs_ptrs_offset] = ptrs_blk_idx;
+                else {
+                    read_block(ptrs_ptrs[ptrs_ptrs_offset], (uint8_t*)ptrs);
                 }
+                ptrs_blk_idx = ptrs_ptrs[ptrs_ptrs_offset];
+                ptrs_loaded = TRUE;
+            }
+            slot = &ptrs[n_offset2 % PTRS_PER_BLK];
+        }
+
+        if (*slot == 0) {
+            int new_block_index = phys ? phys + (cur_nth_block - first) :
+                get_free_blk_near(prev_block_index + 1);
+            if (new_block_index == 0) {
+                rv = -ENOSPC;
+                break;
+            }
+            *slot = new_block_index;
+            if (cur_nth_block < N_DIRECT)
+                mark_inode(in);
+            else
+                ptrs_dirty = TRUE;
+        }
+        prev_block_index = *slot;
 
-                ptrs[ptrs_offset] = new_block_index;
+        // leaving the single indirect block
+        if (cur_nth_block == N_DIRECT + PTRS_PER_BLK - 1 && ptrs_loaded) {
+            if (ptrs_dirty)
+                write_block(ptrs_blk_idx, (uint8_t*)ptrs);
+            ptrs_loaded = ptrs_dirty = FALSE;
+        }
+    }
+    if (ptrs_loaded && ptrs_dirty)
+        write_block(ptrs_blk_idx, (uint8_t*)ptrs);
+    if (ptrs_ptrs_loaded && ptrs_ptrs_dirty)
+        write_block(in -> indir_2, (uint8_t*)ptrs_ptrs);
+    return rv;
+}
 
-                if (ptrs_offset == PTRS_PER_BLK - 1 || cur_nth_block == n) {
-                    write_block(ptrs_ptrs[ptrs_ptrs_offset], (uint8_t*)ptrs);
-                }
+/**
+ * Returns the n-th block of the file and how many of the following
+ * blocks, up to max in all, are physically contiguous with it.
+ * Runs are only known for extent-mapped files; others give 1.
+ * Like holes, preallocated blocks that were never written give 0.
+ *
+ * @param in the file inode
+ * @param n the 0-based block index in file
+ * @param max the largest run wanted
+ * @param run set to the run length, at least 1
+ * @return block number of the n-th block or 0 if not mapped
+ */
+static int get_blk_run(struct fs_inode *in, int n, int max, int *run)
+{
+    int blk;
+    if (in -> flags & FS_FL_EXTENTS) {
+        int unwritten;
+        blk = ext_map(in, n, run, &unwritten);
+        if (unwritten)
+            blk = 0;
+        if (*run > max)
+            *run = max;
+        return blk;
+    }
+    *run = 1;
+    return get_blk(in, n, FALSE);
+}
 
-                assert (cur_nth_block <= n);
-                if (cur_nth_block == n) {
-                    write_block(in -> indir_2, (uint8_t*)ptrs_ptrs);
-                }
+/**
+ * Count the unmapped blocks of a file from first to last.
+ *
+ * @param in the file inode
+ * @param first the first 0-based block index
+ * @param last the last 0-based block index
+ * @return number of holes in the range
+ */
+static int count_holes(struct fs_inode *in, int first, int last)
+{
+    int n = first, run, holes = 0;
+    while (n <= last) {
+        int blk = get_blk_run(in, n, last - n + 1, &run);
+        if (run > last - n + 1)
+            run = last - n + 1;
+        if (blk == 0)
+            holes += run;
+        n += run;
+    }
+    return holes;
+}
+
+/**
+ * Point the n-th block of a pointer-mapped file at another block.
+ * The block must already be mapped.
+ *
+ * @param in the file inode
+ * @param n the 0-based block index in file
+ * @param blk the new block number
+ */
+static void set_ptr_blk(struct fs_inode *in, int n, uint32_t blk)
+{
+    uint32_t ptrs[PTRS_PER_BLK];
+    uint32_t ptrs_blk;
+
+    if (n < N_DIRECT) {
+        in -> direct[n] = blk;
+        mark_inode(in);
+        return;
+    }
+    n -= N_DIRECT;
+    ptrs_blk = in -> indir_1;
+    if (n >= PTRS_PER_BLK) {
+        n -= PTRS_PER_BLK;
+        read_block(in -> indir_2, (uint8_t*)ptrs);
+        ptrs_blk = ptrs[n / PTRS_PER_BLK];
+        n %= PTRS_PER_BLK;
+    }
+    read_block(ptrs_blk, (uint8_t*)ptrs);
+    ptrs[n] = blk;
+    write_block(ptrs_blk, (uint8_t*)ptrs);
+}
+
+/**
+ * Find the pointer block holding the slot of the n-th block of a
+ * pointer-mapped file, past the direct blocks.
+ *
+ * @param in the file inode
+ * @param n the 0-based block index in file, at least N_DIRECT
+ * @param ptrs_ptrs the double indirect block, read on first use
+ * @param loaded TRUE once ptrs_ptrs has been read
+ * @param idx set to the index of the slot in the pointer block
+ * @return the pointer block number, or 0 if there is none or n is
+ *   past MAX_PTR_BLOCKS
+ */
+static uint32_t ptr_blk_of(struct fs_inode *in, int n, uint32_t *ptrs_ptrs, int *loaded,
+                           int *idx)
+{
+    n -= N_DIRECT;
+    if (n < PTRS_PER_BLK) {
+        *idx = n;
+        return in -> indir_1;
+    }
+    n -= PTRS_PER_BLK;
+    *idx = n % PTRS_PER_BLK;
+    if (in -> indir_2 == 0 || n / PTRS_PER_BLK >= PTRS_PER_BLK)
+        return 0;
+    if (!*loaded) {
+        read_block(in -> indir_2, (uint8_t*)ptrs_ptrs);
+        *loaded = TRUE;
+    }
+    return ptrs_ptrs[n / PTRS_PER_BLK];
+}
+
+/**
+ * Get the raw pointer slots of a range of blocks of a pointer-mapped
+ * file, reading each pointer block once.
+ *
+ * @param in the file inode
+ * @param first the first 0-based block index
+ * @param n number of blocks, all below MAX_PTR_BLOCKS
+ * @param slots set to the n slot values, 0 for holes
+ */
+static void get_ptr_slots(struct fs_inode *in, int first, int n, uint32_t *slots)
+{
+    uint32_t ptrs[PTRS_PER_BLK], ptrs_ptrs[PTRS_PER_BLK];
+    uint32_t cur = 0, pb;
+    int i, idx, loaded = FALSE;
+
+    for (i = 0; i < n; i++) {
+        if (first + i < N_DIRECT) {
+            slots[i] = in -> direct[first + i];
+            continue;
+        }
+        pb = ptr_blk_of(in, first + i, ptrs_ptrs, &loaded, &idx);
+        if (pb != 0 && pb != cur)
+            read_block(pb, (uint8_t*)ptrs);
+        cur = pb;
+        slots[i] = pb ? ptrs[idx] : 0;
+    }
+}
+
+/**
+ * Clear the pointer slots of a range of blocks of a pointer-mapped
+ * file. The blocks they point to, and pointer blocks left empty,
+ * are not freed.
+ *
+ * @param in the file inode
+ * @param first the first 0-based block index
+ * @param n number of blocks, all below MAX_PTR_BLOCKS
+ */
+static void clear_ptr_slots(struct fs_inode *in, int first, int n)
+{
+    uint32_t ptrs[PTRS_PER_BLK], ptrs_ptrs[PTRS_PER_BLK];
+    uint32_t cur = 0, pb;
+    int i, idx, loaded = FALSE, changed = FALSE;
+
+    for (i = 0; i < n; i++) {
+        if (first + i < N_DIRECT) {
+            in -> direct[first + i] = 0;
+            continue;
+        }
+        pb = ptr_blk_of(in, first + i, ptrs_ptrs, &loaded, &idx);
+        if (pb != cur) {
+            if (changed)
+                write_block(cur, (uint8_t*)ptrs);
+            if (pb != 0)
+                read_block(pb, (uint8_t*)ptrs);
+            cur = pb;
+            changed = FALSE;
+        }
+        if (pb != 0 && ptrs[idx] != 0) {
+            ptrs[idx] = 0;
+            changed = TRUE;
+        }
+    }
+    if (changed)
+        write_block(cur, (uint8_t*)ptrs);
+    mark_inode(in);
+}
+
+/**
+ * Tell whether a block is shared with another file or with a
+ * snapshot, so that a file must not write it in place.
+ *
+ * @param blk the block number
+ * @return TRUE if the block is shared
+ */
+static int blk_shared(uint32_t blk)
+{
+    return (refcount_map != NULL && refcount_map[blk] > 0) ||
+        (n_snaps > 0 && snap_holds(blk));
+}
+
+/**
+ * Give a file its own copy of every block from first to last that
+ * it shares with other files or snapshots, so that the blocks can
+ * be written in place. Each shared run is copied to a new run of
+ * blocks with large device requests; blocks it owns alone are left
+ * where they are.
+ *
+ * @param in the file inode
+ * @param first the first 0-based block index
+ * @param last the last 0-based block index
+ * @return 0 if successful, -ENOSPC, or -EIO
+ */
+static int unshare_blks(struct fs_inode *in, int first, int last)
+{
+    uint8_t *buf = NULL;
+    int n = first, run, len, got, i, rv = 0;
+
+    if (refcount_map == NULL && n_snaps == 0) {
+        return 0;
+    }
+    while (n <= last && rv == 0) {
+        uint32_t blk = get_blk_run(in, n, last - n + 1, &run);
+        if (blk == 0) {
+            n += run;
+            continue;
+        }
+        // skip the blocks this file owns alone, then take the shared ones
+        for (i = 0; i < run && !blk_shared(blk + i); i++)
+            ;
+        n += i;
+        blk += i;
+        for (len = 0; i + len < run && blk_shared(blk + len); len++)
+            ;
+        if (len == 0) {
+            continue;
+        }
+        uint32_t goal = n > 0 ? get_blk(in, n - 1, FALSE) : 0;
+        uint32_t start = get_free_run(goal ? goal + 1 : 0, len, &got);
+        if (start == 0) {
+            rv = -ENOSPC;
+            break;
+        }
+        if (buf == NULL) {
+            buf = malloc(COPY_CHUNK * FS_BLOCK_SIZE);
+        }
+        for (i = 0; i < got && rv == 0; i += COPY_CHUNK) {
+            int cnt = got - i < COPY_CHUNK ? got - i : COPY_CHUNK;
+            rv = read_blocks(blk + i, cnt, buf);
+            write_data_blocks(start + i, cnt, buf);
+        }
+        // a block that fails its checksum keeps its place
+        if (rv < 0) {
+            return_blk_range(start, got);
+            break;
+        }
+        if (in -> flags & FS_FL_EXTENTS) {
+            if ((rv = ext_remap(in, n, n + got - 1, start)) < 0)
+                break;
+        }
+        else {
+            for (i = 0; i < got; i++)
+                set_ptr_blk(in, n + i, start + i);
+        }
+        release_blk_range(blk, got);
+        n += got;
+    }
+    free(buf);
+    return rv;
+}
+
+/**
+ * Find the delayed-allocation buffer of a file.
+ *
+ * @param inum the file inode number
+ * @param prev if not NULL, set to the link pointing at the buffer
+ * @return the buffer, or NULL if the file has none
+ */
+static struct da_file *da_find(int inum, struct da_file ***prev)
+{
+    struct da_file **link;
+    for (link = &da_files; *link != NULL; link = &(*link) -> next) {
+        if ((*link) -> inum == inum) {
+            if (prev)
+                *prev = link;
+            return *link;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find a block in a delayed-allocation buffer.
+ *
+ * @param f the buffer
+ * @param lblk the logical block
+ * @return index of the block, or -(insert position)-1 if absent
+ */
+static int da_search(struct da_file *f, uint32_t lblk)
+{
+    int lo = 0, hi = f -> n - 1;
+    // appends are the common case
+    if (f -> n > 0 && f -> lblk[hi] < lblk) {
+        return -f -> n - 1;
+    }
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (f -> lblk[mid] == lblk)
+            return mid;
+        if (f -> lblk[mid] < lblk)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -lo - 1;
+}
+
+/**
+ * Get the buffered data of an unallocated block of a file, adding
+ * a zero-filled block to the file's buffer if it is not there. The
+ * caller has checked there is space to allocate it later.
+ *
+ * @param inum the file inode number
+ * @param lblk the logical block
+ * @return the block data
+ */
+static uint8_t *da_block(int inum, uint32_t lblk)
+{
+    struct da_file *f = da_find(inum, NULL);
+    int i;
+
+    if (f == NULL) {
+        f = calloc(1, sizeof(*f));
+        f -> inum = inum;
+        f -> next = da_files;
+        da_files = f;
+    }
+    if ((i = da_search(f, lblk)) >= 0) {
+        return f -> data + (size_t)i * BLOCK_SIZE;
+    }
+    i = -i - 1;
+    if (f -> n == f -> cap) {
+        f -> cap = f -> cap ? f -> cap * 2 : 16;
+        f -> lblk = realloc(f -> lblk, f -> cap * sizeof(uint32_t));
+        f -> data = realloc(f -> data, (size_t)f -> cap * BLOCK_SIZE);
+    }
+    memmove(f -> lblk + i + 1, f -> lblk + i, (f -> n - i) * sizeof(uint32_t));
+    memmove(f -> data + (size_t)(i + 1) * BLOCK_SIZE, f -> data + (size_t)i * BLOCK_SIZE,
+            (size_t)(f -> n - i) * BLOCK_SIZE);
+    f -> lblk[i] = lblk;
+    memset(f -> data + (size_t)i * BLOCK_SIZE, 0, BLOCK_SIZE);
+    f -> n++;
+    da_total++;
+    return f -> data + (size_t)i * BLOCK_SIZE;
+}
+
+/**
+ * Copy the buffered blocks of a file that overlap a read into the
+ * read buffer, over the zeros read for their holes.
+ *
+ * @param inum the file inode number
+ * @param offset offset of the read
+ * @param len length of the read
+ * @param buf the read buffer
+ */
+static void da_read(int inum, off_t offset, int len, char *buf)
+{
+    struct da_file *f = da_find(inum, NULL);
+    if (f == NULL) {
+        return;
+    }
+    int i = da_search(f, offset / BLOCK_SIZE);
+    if (i < 0)
+        i = -i - 1;
+    for (; i < f -> n && (off_t)f -> lblk[i] * BLOCK_SIZE < offset + len; i++) {
+        off_t blk_start = (off_t)f -> lblk[i] * BLOCK_SIZE;
+        off_t from = blk_start > offset ? blk_start : offset;
+        off_t to = blk_start + BLOCK_SIZE < offset + len ? blk_start + BLOCK_SIZE : offset + len;
+        memcpy(buf + (from - offset), f -> data + (size_t)i * BLOCK_SIZE + (from - blk_start), to - from);
+    }
+}
+
+/**
+ * Free a delayed-allocation buffer.
+ *
+ * @param link the link pointing at the buffer
+ */
+static void da_free(struct da_file **link)
+{
+    struct da_file *f = *link;
+    *link = f -> next;
+    da_total -= f -> n;
+    free(f -> lblk);
+    free(f -> data);
+    free(f);
+}
+
+/**
+ * Drop the buffered blocks of a file past a new length, and clear
+ * the bytes past it in the new last block.
+ *
+ * @param inum the file inode number
+ * @param len the new length
+ */
+static void da_truncate(int inum, off_t len)
+{
+    struct da_file **link, *f = da_find(inum, &link);
+    int keep = get_file_block_num(len), i;
+    if (f == NULL) {
+        return;
+    }
+    i = da_search(f, keep);
+    if (i < 0)
+        i = -i - 1;
+    da_total -= f -> n - i;
+    f -> n = i;
+    if (len % BLOCK_SIZE && i > 0 && f -> lblk[i - 1] == keep - 1) {
+        memset(f -> data + (size_t)(i - 1) * BLOCK_SIZE + len % BLOCK_SIZE, 0,
+               BLOCK_SIZE - len % BLOCK_SIZE);
+    }
+    if (f -> n == 0) {
+        da_free(link);
+    }
+}
+
+/**
+ * Write back the buffered blocks of a file. Now that all of its
+ * dirty range is known, each run of consecutive logical blocks is
+ * given one run of free blocks where possible and written with a
+ * single device request. With -dedup, blocks whose contents are
+ * already on disk are shared instead, and the rest are indexed.
+ * With -tails, a partial last block is packed into fragments.
+ *
+ * @param inum the file inode number
+ * @return 0 if successful, or -ENOSPC if some blocks were lost
+ */
+static int da_writeback(int inum)
+{
+    struct da_file **link, *f = da_find(inum, &link);
+    struct fs_inode *in;
+    uint32_t *hashes, *dups;
+    int i = 0, rv = 0, n_dups;
+
+    if (f == NULL) {
+        return 0;
+    }
+    in = get_inode(inum);
+    // compressed files rewrite whole clusters
+    if (in -> flags & FS_FL_COMPRESS) {
+        rv = cluster_writeback(in, f);
+        i = f -> n;
+    }
+    tail_pack(in, f);
+    hashes = dedup_writeback(in, f, &dups, &n_dups);
+    while (i < f -> n) {
+        int len = 1, got;
+        while (i + len < f -> n && f -> lblk[i + len] == f -> lblk[i] + len)
+            len++;
+        uint32_t goal = f -> lblk[i] > 0 ? get_blk(in, f -> lblk[i] - 1, FALSE) : 0;
+        while (len > 0) {
+            uint32_t start = get_free_run(goal ? goal + 1 : 0, len, &got);
+            if (start == 0 || map_blks(in, f -> lblk[i], f -> lblk[i] + got - 1, start) < 0) {
+                fprintf(stderr, "write-back of inode %d: no space for %d blocks\n", inum, len);
+                if (start != 0)
+                    return_blk_range(start, got);
+                rv = -ENOSPC;
+                i += len;
+                break;
             }
+            write_data_blocks(start, got, f -> data + (size_t)i * BLOCK_SIZE);
+            for (int k = 0; hashes != NULL && k < got; k++)
+                dedup_add(start + k, hashes[i + k]);
+            goal = start + got - 1;
+            i += got;
+            len -= got;
         }
-        flush_metadata();
     }
-    return 0;
+    if (n_dups > 0 && dedup_writeback_dups(in, dups, n_dups) < 0) {
+        fprintf(stderr, "write-back of inode %d: no space to share blocks\n", inum);
+        rv = -ENOSPC;
+    }
+    mark_inode(in);
+    da_free(link);
+    free(hashes);
+    free(dups);
+    return rv;
+}
+
+/**
+ * Write back the buffered blocks of every file.
+ */
+static void da_writeback_all(void)
+{
+    while (da_files != NULL) {
+        da_writeback(da_files -> inum);
+    }
+}
+
+/**
+ * Call visit() for every data and pointer block of an inode,
+ * including blocks allocated past the end of the file by
+ * fallocate with FALLOC_FL_KEEP_SIZE, so every pointer slot of a
+ * file is looked at whatever its size. Unallocated (0) pointers
+ * and compressed cluster markers are skipped; a packed tail is
+ * visited with its fragment address.
+ *
+ * @param in the inode
+ * @param visit function called with each block number
+ * @param arg argument passed to visit
+ */
+static void walk_inode_blocks(struct fs_inode *in,
+        void (*visit)(uint32_t blk, void *arg), void *arg)
+{
+    uint32_t ptrs[PTRS_PER_BLK], ptrs_ptrs[PTRS_PER_BLK];
+    int nblks = S_ISDIR(in -> mode) ? 1 : MAX_PTR_BLOCKS;
+    int i, j;
+
+    if (in -> flags & FS_FL_INLINE) {
+        return;
+    }
+    if (in -> flags & FS_FL_EXTENTS) {
+        ext_walk_node(ext_root(in), visit, arg);
+        return;
+    }
+
+    for (i = 0; i < N_DIRECT && i < nblks; i++) {
+        if (in -> direct[i] != 0 && in -> direct[i] != FS_BLK_COMPRESSED)
+            visit(in -> direct[i], arg);
+    }
+    nblks -= N_DIRECT;
+    if (nblks > 0 && in -> indir_1 != 0) {
+        visit(in -> indir_1, arg);
+        read_block(in -> indir_1, (uint8_t*)ptrs);
+        for (i = 0; i < PTRS_PER_BLK && i < nblks; i++) {
+            if (ptrs[i] != 0 && ptrs[i] != FS_BLK_COMPRESSED)
+                visit(ptrs[i], arg);
+        }
+    }
+    nblks -= PTRS_PER_BLK;
+    if (nblks > 0 && in -> indir_2 != 0) {
+        visit(in -> indir_2, arg);
+        read_block(in -> indir_2, (uint8_t*)ptrs_ptrs);
+        for (j = 0; j < PTRS_PER_BLK && nblks > 0; j++, nblks -= PTRS_PER_BLK) {
+            if (ptrs_ptrs[j] == 0)
+                continue;
+            visit(ptrs_ptrs[j], arg);
+            read_block(ptrs_ptrs[j], (uint8_t*)ptrs);
+            for (i = 0; i < PTRS_PER_BLK && i < nblks; i++) {
+                if (ptrs[i] != 0 && ptrs[i] != FS_BLK_COMPRESSED)
+                    visit(ptrs[i], arg);
+            }
+        }
+    }
+}
+
+/** range of inode blocks scanned by one block map rebuild thread */
+struct rebuild_range {
+    int first_blk;          /* first inode block of range */
+    int last_blk;           /* one past last inode block */
+    fd_set *new_map;        /* block map being rebuilt, shared */
+    uint16_t *refs;         /* references per block, NULL if no sharing */
+    uint8_t *frags;         /* fragments in use per block, NULL if no tails */
+};
+
+/**
+ * Mark a block in use in the block map being rebuilt, and count
+ * the reference if blocks may be shared; for a packed tail, mark
+ * its fragment block and fragments instead. Bits are set with an
+ * atomic byte OR since threads share the map; like the FD_ macros
+ * on little-endian hosts, bit n is bit n%8 of byte n/8.
+ *
+ * @param blk the block number or fragment address
+ * @param arg the rebuild_range
+ */
+static void rebuild_mark_blk(uint32_t blk, void *arg)
+{
+    struct rebuild_range *r = arg;
+    uint8_t *map = (uint8_t*)r -> new_map;
+    uint32_t addr = blk;
+    if (FS_IS_FRAG(addr)) {
+        blk = FS_FRAG_BLK(addr);
+    }
+    if (blk >= n_blocks || (FS_IS_FRAG(addr) && r -> frags == NULL)) {
+        fprintf(stderr, "rebuild: bad block pointer %u\n", addr);
+        return;
+    }
+    __atomic_fetch_or(map + blk / 8, (uint8_t)(1 << (blk % 8)), __ATOMIC_RELAXED);
+    if (FS_IS_FRAG(addr)) {
+        uint8_t mask = ((1 << FS_FRAG_COUNT(addr)) - 1) << FS_FRAG_FIRST(addr);
+        __atomic_fetch_or(r -> frags + blk, mask, __ATOMIC_RELAXED);
+    }
+    else if (r -> refs != NULL) {
+        __atomic_fetch_add(r -> refs + blk, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Thread scanning a range of the inode region. Inode blocks
+ * without allocated inodes are not read.
+ *
+ * @param arg the rebuild_range
+ * @return unused - returns NULL
+ */
+static void *rebuild_thread(void *arg)
+{
+    struct rebuild_range *r = arg, xr = *r;
+    struct fs_inode *batch = malloc(REBUILD_BATCH * FS_BLOCK_SIZE);
+    int blk, i, n;
+
+    // xattr blocks count the inodes sharing them themselves
+    xr.refs = NULL;
+
+    for (blk = r -> first_blk; blk < r -> last_blk; blk += n) {
+        n = r -> last_blk - blk < REBUILD_BATCH ? r -> last_blk - blk : REBUILD_BATCH;
+        // trim batch to the last inode block with allocated inodes
+        while (n > 0) {
+            int first = (blk + n - 1) * INODES_PER_BLK;
+            for (i = 0; i < INODES_PER_BLK && !FD_ISSET(first + i, inode_map); i++)
+                ;
+            if (i < INODES_PER_BLK)
+                break;
+            n--;
+        }
+        if (n == 0) {
+            n = 1;
+            continue;
+        }
+        if (disk->ops->read(disk, inode_base + blk, n, batch) < 0) {
+            fprintf(stderr, "rebuild: cannot read inode block %d\n", blk);
+            exit(1);
+        }
+        for (i = 0; i < n * INODES_PER_BLK; i++) {
+            if (FD_ISSET(blk * INODES_PER_BLK + i, inode_map)) {
+                walk_inode_blocks(batch + i, rebuild_mark_blk, r);
+                if (batch[i].xattr_blk != 0)
+                    rebuild_mark_blk(batch[i].xattr_blk, &xr);
+            }
+        }
+    }
+    free(batch);
+    return NULL;
+}
+
+/**
+ * Rebuild the block map and free counters after an unclean
+ * unmount. The inode map is trusted; the block map is rebuilt from
+ * the block pointers of all allocated inodes, scanning ranges of
+ * the inode region in parallel, and from the blocks of each
+ * snapshot. The refcount and fragment maps, if there are any, are
+ * recounted the same way. Only map blocks that changed are marked
+ * dirty.
+ *
+ * @param report if TRUE, print how many bits and counts were fixed
+ */
+static void rebuild_maps(int report)
+{
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t threads[REBUILD_THREADS_MAX];
+    struct rebuild_range ranges[REBUILD_THREADS_MAX];
+    fd_set *new_map = calloc(sb.block_map_sz, FS_BLOCK_SIZE);
+    uint16_t *refs = refcount_map ? calloc(n_blocks, sizeof(uint16_t)) : NULL;
+    uint8_t *frags = frag_map ? calloc(n_blocks, 1) : NULL;
+    int i, b, fixed = 0, refs_fixed = 0, frags_fixed = 0;
+
+    if (nthreads > REBUILD_THREADS_MAX)
+        nthreads = REBUILD_THREADS_MAX;
+    if (nthreads > sb.inode_region_sz)
+        nthreads = sb.inode_region_sz;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    // superblock, bitmaps and inode region are always in use
+    for (i = 0; i < inode_base + sb.inode_region_sz; i++) {
+        FD_SET(i, new_map);
+    }
+    for (i = 0; refs != NULL && i < sb.refcount_map_sz; i++) {
+        FD_SET(sb.refcount_map + i, new_map);
+    }
+    for (i = 0; i < sb.csum_map_sz; i++) {
+        FD_SET(sb.csum_map + i, new_map);
+    }
+    for (i = 0; i < sb.dedup_map_sz; i++) {
+        FD_SET(sb.dedup_map + i, new_map);
+    }
+    for (i = 0; frags != NULL && i < sb.frag_map_sz; i++) {
+        FD_SET(sb.frag_map + i, new_map);
+    }
+    for (i = 0; i < nthreads; i++) {
+        ranges[i].first_blk = (long)sb.inode_region_sz * i / nthreads;
+        ranges[i].last_blk = (long)sb.inode_region_sz * (i + 1) / nthreads;
+        ranges[i].new_map = new_map;
+        ranges[i].refs = refs;
+        ranges[i].frags = frags;
+        pthread_create(&threads[i], NULL, rebuild_thread, &ranges[i]);
+    }
+    for (i = 0; i < nthreads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    snap_mark_blocks(new_map);
+
+    // install changed bitmap blocks
+    for (b = 0; b < sb.block_map_sz; b++) {
+        uint8_t *old_blk = (uint8_t*)block_map + b * FS_BLOCK_SIZE;
+        uint8_t *new_blk = (uint8_t*)new_map + b * FS_BLOCK_SIZE;
+        if (memcmp(old_blk, new_blk, FS_BLOCK_SIZE) != 0) {
+            for (i = 0; i < FS_BLOCK_SIZE; i++) {
+                fixed += __builtin_popcount(old_blk[i] ^ new_blk[i]);
+            }
+            memcpy(old_blk, new_blk, FS_BLOCK_SIZE);
+            mark_dirty(block_map_base + b, old_blk);
+        }
+    }
+    free(new_map);
+
+    // a block mapped n times has n-1 extra references
+    for (i = 0; refs != NULL && i < n_blocks; i++) {
+        uint16_t extra = refs[i] > 1 ? refs[i] - 1 : 0;
+        if (refcount_map[i] != extra) {
+            refcount_map[i] = extra;
+            mark_refcount(i);
+            refs_fixed++;
+        }
+    }
+    free(refs);
+
+    for (i = 0; frags != NULL && i < n_blocks; i++) {
+        if (frag_map[i] != frags[i]) {
+            frag_map[i] = frags[i];
+            mark_frag(i);
+            frags_fixed++;
+        }
+    }
+    free(frags);
+
+    sb.free_blocks = count_zero_bits(block_map, n_blocks);
+    sb.free_inodes = count_zero_bits(inode_map, n_inodes);
+    if (report && fixed > 0) {
+        fprintf(stderr, "unclean unmount: %d block map bits fixed\n", fixed);
+    }
+    if (report && refs_fixed > 0) {
+        fprintf(stderr, "unclean unmount: %d block refcounts fixed\n", refs_fixed);
+    }
+    if (report && frags_fixed > 0) {
+        fprintf(stderr, "unclean unmount: %d fragment masks fixed\n", frags_fixed);
+    }
 }
@@ -16,12 +16,32 @@
 #include <stdio.h>
 #include <errno.h>
 #include <sys/select.h>
+#include <sys/xattr.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "fsx600.h"
+#include "batch.h"
+
+/* SEEK_DATA and SEEK_HOLE are not exposed by every libc by default */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
 #include "blkdev.h"
 
 //extern int homework_part;       /* set by '-part n' command-line option */
+extern int sync_metadata;       /* set by '-sync' command-line option */
+extern int extents_default;     /* set by '-extents' command-line option */
+extern int compress_default;    /* set by '-compress' command-line option */
+extern int reflink_copies;      /* set by '-reflink' command-line option */
+extern int scrub_rate;          /* set by '-scrub' command-line option, MB/s */
+extern int dedup_blocks;        /* set by '-dedup' command-line option */
+extern int pack_tails;          /* set by '-tails' command-line option */
 
 typedef struct fs_inode Inode;
 typedef struct fs_dirent DirEntry;
@@ -48,8 +68,25 @@ extern struct blkdev *disk;
 static fd_set *inode_map;
 static int     inode_map_base;
 
-/** pointer to inode blocks */
-static struct fs_inode *inodes;
+/**
+ * Inode cache - inode blocks are read on demand into a fixed
+ * number of slots; clean blocks are evicted least recently used
+ * first and dirty ones are written back before their slot is reused.
+ */
+struct icache_slot {
+    int      blk;           /* inode block in the inode region, -1 if unused */
+    int      dirty;         /* block must be written back */
+    int      bad;           /* block failed its checksum, never written back */
+    int      next;          /* next slot in hash chain, -1 at end */
+    unsigned long used;     /* LRU stamp */
+    struct fs_inode inodes[INODES_PER_BLK];
+};
+static struct icache_slot *icache;
+/** number of cache slots and hash chain heads */
+static int   icache_nslots;
+static int  *icache_hash;
+/** LRU clock */
+static unsigned long icache_clock;
 /** number of inodes from superblock */
 static int   n_inodes;
 /** number of first inode block */
@@ -60,6 +97,100 @@ fd_set *block_map;
 /** number of first data block */
 static int     block_map_base;
 
+/** extra references to each block shared copy-on-write, NULL until
+ * the first reflink copy; dirty flag per map block */
+static uint16_t *refcount_map;
+static uint8_t  *refcount_dirty;
+
+/** checksum of each block, NULL if the image has no checksum map;
+ * dirty flag per map block */
+static uint32_t *csum_map;
+static uint8_t  *csum_dirty;
+
+/** content hash of each shareable data block, NULL if the image has
+ * no dedup map; dirty flag per map block; and the index of blocks
+ * by hash, with linear probing */
+static uint32_t *dedup_map;
+static uint8_t  *dedup_dirty;
+struct dedup_slot {
+    uint32_t hash;
+    uint32_t blk;           /* 0 if the slot is empty */
+};
+static struct dedup_slot *dedup_index;
+static uint32_t dedup_mask;     /* number of slots - 1, a power of 2 */
+
+/** fragments in use in each block, NULL until the first packed
+ * tail; dirty flag per map block; and the fragment block used last */
+static uint8_t  *frag_map;
+static uint8_t  *frag_dirty;
+static uint32_t frag_cursor;
+
+/** Bloom filters of the names in recently looked-up directories,
+ * direct-mapped by inode number (see bloom.h), and lookup counts */
+#define BLOOM_SLOTS 64
+#define BLOOM_BITS  1024
+struct dir_bloom {
+    int      inum;          /* directory inode number, 0 if unused */
+    int      stale;         /* names removed since it was built */
+    uint64_t bits[BLOOM_BITS / 64];
+};
+static struct dir_bloom bloom_table[BLOOM_SLOTS];
+static long bloom_lookups;      /* lookups in the live file system */
+static long bloom_filtered;     /* absent names found by a filter */
+static long bloom_false_pos;    /* absent names a filter let through */
+static long bloom_builds;
+
+/** xattr blocks used lately, with their contents (see xattr.h) */
+#define XATTR_CACHE_SLOTS 16
+struct xattr_cache_ent {
+    uint32_t blk;           /* block number, 0 if unused */
+    uint32_t used;          /* xattr_clock at last use */
+    uint8_t  data[FS_BLOCK_SIZE];
+};
+static struct xattr_cache_ent xattr_cache[XATTR_CACHE_SLOTS];
+static uint32_t xattr_clock;
+
+/** blocks that failed their checksum in the current operation */
+#define IO_BAD_MAX 16
+static uint32_t io_bad[IO_BAD_MAX];
+static int      n_io_bad;
+
+/**
+ * Snapshots - for each snapshot in the table, the blocks it uses
+ * in place (at first the block map when it was taken) and its
+ * exceptions, the blocks it uses whose contents were copied out
+ * before the live file system overwrote them.
+ */
+struct snap {
+    uint32_t  gen;          /* mount-unique id kept in open file handles */
+    int       slot;         /* entry in the snapshot table */
+    fd_set   *bmap;         /* blocks used in place */
+    fd_set   *copied;       /* blocks with an exception */
+    uint32_t *orig;         /* exception blocks as seen by the snapshot */
+    uint32_t *copy;         /* blocks holding their contents */
+    int       n_exc;        /* number of exceptions */
+    int       cap;          /* capacity of orig and copy */
+    int      *hash;         /* index into orig by block, -1 if empty */
+    int       hcap;         /* hash size, a power of 2 */
+    uint32_t  tail_blk;     /* last exception block, 0 if none */
+    struct fs_snap_exc tail;    /* its contents */
+};
+static struct fs_snapshot snap_table[FS_SNAP_MAX];
+static struct snap *snaps[FS_SNAP_MAX];
+static int          n_snaps;
+static uint32_t     snap_gen;
+/** snapshot the current operation looks at, NULL for the live file system */
+static struct snap *cur_snap;
+
+/** inode blocks read from snapshot views */
+struct snap_icache_slot {
+    struct snap *s;         /* snapshot, NULL if unused */
+    int      blk;           /* inode block in the inode region */
+    struct fs_inode inodes[INODES_PER_BLK];
+};
+static struct snap_icache_slot *snap_icache;
+static int   snap_icache_next;
+
 /** number of available blocks from superblock */
 static int   n_blocks;
 
@@ -72,8 +203,66 @@ static void **dirty;
 /** length of dirty array -- optional */
 static int    dirty_len;
 
+/** number of non-NULL entries in dirty array */
+static int    n_dirty;
+
+/** lock serializing fuse operations and the flush timer */
+static pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Delayed allocation - data written to unallocated blocks of a
+ * file is buffered in memory, and blocks are only chosen for it
+ * when it is written back, at flush time or when too much is
+ * buffered. Off when mounted with -sync.
+ */
+struct da_file {
+    int       inum;         /* file inode number */
+    int       n;            /* number of buffered blocks */
+    int       cap;          /* capacity of lblk and data */
+    uint32_t *lblk;         /* logical block numbers, ascending */
+    uint8_t  *data;         /* block data, in lblk order */
+    struct da_file *next;
+};
+static struct da_file *da_files;
+static int             da_total;    /* buffered blocks, all reserved */
+static int             delalloc;
+
+/** flush timer thread, wakeup condition and stop request */
+static pthread_t       flush_thread;
+static pthread_cond_t  flush_cond = PTHREAD_COND_INITIALIZER;
+static int             flush_stop;
+
+/**
+ * Background scrubber - its thread and wakeup condition, and the
+ * bad blocks it has found with their owning inode (-1 for
+ * metadata or snapshot blocks). Stops on flush_stop.
+ */
+#define SCRUB_BAD_MAX 64
+struct scrub_bad {
+    uint32_t blk;
+    int      inum;
+};
+static pthread_t        scrub_tid;
+static pthread_cond_t   scrub_cond = PTHREAD_COND_INITIALIZER;
+static int              scrub_running;
+static struct scrub_bad scrub_bad[SCRUB_BAD_MAX];
+static int              n_scrub_bad;
+static int              scrub_passes;
+
 
+#include "dirsearch.h"
 #include "helper.h"
+#include "extent.h"
+#include "snapshot.h"
+#include "crc32c.h"
+#include "checksum.h"
+#include "scrub.h"
+#include "lz4.h"
+#include "compress.h"
+#include "dedup.h"
+#include "tail.h"
+#include "bloom.h"
+#include "xattr.h"
 
 
 /* Fuse functions
@@ -96,6 +285,15 @@ void* fs_init(struct fuse_conn_info *conn)
     if (disk->ops->read(disk, 0, 1, &sb) < 0) {
         exit(1);
     }
+    int rebuild = sb.state != FS_STATE_CLEAN;
+
+    // number of blocks on device
+    n_blocks = sb.num_blocks;
+
+    // block checksums, if trusted, verify everything read from here on
+    if (!rebuild) {
+        csum_load();
+    }
 
     root_inode = sb.root_inode;
 
@@ -104,34 +302,114 @@ void* fs_init(struct fuse_conn_info *conn)
     // read inode map
     inode_map_base = 1;
     inode_map = malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, inode_map_base, sb.inode_map_sz, inode_map) < 0) {
+    if (read_blocks(inode_map_base, sb.inode_map_sz, (uint8_t*)inode_map) < 0) {
+        fprintf(stderr, "inode map is damaged, cannot mount\n");
         exit(1);
     }
 
     // read block map
     block_map_base = inode_map_base + sb.inode_map_sz;
     block_map = malloc(sb.block_map_sz * FS_BLOCK_SIZE);
-    if (disk->ops->read(disk, block_map_base, sb.block_map_sz, block_map) < 0) {
-        exit(1);
+    if (read_blocks(block_map_base, sb.block_map_sz, (uint8_t*)block_map) < 0) {
+        fprintf(stderr, "block map is damaged, rebuilding\n");
+        rebuild = TRUE;
     }
 
-    /* The inode data is written to the next set of blocks */
+    /* The inode data is written to the next set of blocks, and is
+     * faulted into the inode cache as it is used */
     inode_base = block_map_base + sb.block_map_sz;
     n_inodes = sb.inode_region_sz * INODES_PER_BLK;
-    inodes = malloc(sb.inode_region_sz * FS_BLOCK_SIZE); //read innodes to memory
-    if (disk->ops->read(disk, inode_base, sb.inode_region_sz, inodes) < 0) {
-        exit(1);
+    icache_init(ICACHE_SLOTS);
+
+    // dirty bitmap blocks; dirty inode blocks are tracked by the cache
+    dirty_len = inode_base;
+    dirty = calloc(dirty_len*sizeof(void*), 1);
+    n_dirty = 0;
+
+    // refcount map, if any file shares blocks
+    if (sb.refcount_map != 0) {
+        refcount_map = malloc(sb.refcount_map_sz * FS_BLOCK_SIZE);
+        refcount_dirty = calloc(sb.refcount_map_sz, 1);
+        if (read_blocks(sb.refcount_map, sb.refcount_map_sz, (uint8_t*)refcount_map) < 0) {
+            fprintf(stderr, "refcount map is damaged, rebuilding\n");
+            rebuild = TRUE;
+        }
     }
 
-    // number of blocks on device
-    n_blocks = sb.num_blocks;
+    // fragment map, if any tail is packed
+    if (sb.frag_map != 0) {
+        frag_map = malloc(sb.frag_map_sz * FS_BLOCK_SIZE);
+        frag_dirty = calloc(sb.frag_map_sz, 1);
+        if (read_blocks(sb.frag_map, sb.frag_map_sz, frag_map) < 0) {
+            fprintf(stderr, "fragment map is damaged, rebuilding\n");
+            rebuild = TRUE;
+        }
+    }
 
-    // dirty metadata blocks
-    dirty_len = inode_base + sb.inode_region_sz;
-    dirty = calloc(dirty_len*sizeof(void*), 1);
+    // snapshots and their copied-out blocks
+    snap_load();
+
+    // bitmaps and counters are only trusted after a clean unmount
+    // and if they pass their checksums
+    n_io_bad = 0;
+    if (rebuild) {
+        rebuild_maps(TRUE);
+        flush_metadata();
+    }
+    if (csum_map == NULL && sb.csum_map != 0) {
+        csum_load();
+        csum_rebuild(TRUE);
+        flush_metadata();
+    }
+
+    // dedup index, kept up to date whenever the image has a map
+    dedup_load(!rebuild);
+    if (dedup_blocks && dedup_create() < 0) {
+        fprintf(stderr, "no room for the dedup map, not deduplicating\n");
+        dedup_blocks = FALSE;
+    }
+    sb.state = FS_STATE_DIRTY;
+    write_block(0, (uint8_t*)&sb);
+    disk->ops->flush(disk, 0, 1);
+
+    // lazy metadata and data write-back unless mounted with -sync
+    flush_stop = FALSE;
+    delalloc = !sync_metadata;
+    if (!sync_metadata) {
+        pthread_create(&flush_thread, NULL, flush_timer, NULL);
+    }
+    scrub_start();
     return NULL;
 }
 
+/**
+ * destroy - this is called once by the FUSE framework at unmount.
+ *
+ * Stops the flush timer and scrubber, writes back all dirty
+ * metadata, flushes the device and then marks the superblock clean.
+ *
+ * @param private_data unused
+ */
+void fs_destroy(void *private_data)
+{
+    fs_lock();
+    flush_stop = TRUE;
+    pthread_cond_signal(&flush_cond);
+    fs_unlock();
+    if (!sync_metadata) {
+        pthread_join(flush_thread, NULL);
+    }
+    scrub_stop();
+
+    fs_lock();
+    flush_metadata();
+    disk->ops->flush(disk, 0, n_blocks);
+    sb.state = FS_STATE_CLEAN;
+    write_block(0, (uint8_t*)&sb);
+    disk->ops->flush(disk, 0, 1);
+    fs_unlock();
+}
+
 /* Note on path translation errors:
  * In addition to the method-specific errors listed below, almost
  * every method can return one of the following errors if it fails to
@@ -140,6 +418,7 @@ void* fs_init(struct fuse_conn_info *conn)
  * ENOENT - a component of the path is not present.
  * ENOTDIR - an intermediate component of the path (e.g. 'b' in
  *           /a/b/c) is not a directory $todo
+ * EIO - a directory or inode block on the path failed its checksum
  */
 
 /* note on splitting the 'path' variable:
@@ -154,13 +433,38 @@ void* fs_init(struct fuse_conn_info *conn)
  *    free(_path);
  */
 
+/**
+ * Fill in a stat struct from an inode.
+ *
+ * @param inum the inode number
+ * @param sb pointer to stat struct
+ */
+static void stat_inode(int inum, struct stat *sb)
+{
+    Inode tmp_inode = *get_inode(inum);
+    memset(sb, 0, sizeof(*sb));
+    sb -> st_ino = inum;
+    sb -> st_mode = tmp_inode.mode;
+    /* number of hard links to the file */
+    sb -> st_nlink = tmp_inode.nlink > 0 ? tmp_inode.nlink : 1;
+    sb -> st_uid = tmp_inode.uid;
+    sb -> st_gid = tmp_inode.gid;
+    sb -> st_size = tmp_inode.size;
+    (sb -> st_mtimespec).tv_sec = tmp_inode.mtime;
+    (sb -> st_ctimespec).tv_sec = tmp_inode.ctime;
+    // snapshot views are read-only
+    if (cur_snap != NULL) {
+        sb -> st_mode &= ~0222;
+    }
+}
+
 /**
  * getattr - get file or directory attributes. For a description of
  * the fields in 'struct stat', see 'man lstat'.
  *
  * Note - fields not provided in CS5600fs are:
- *    st_nlink - always set to 1
  *    st_atime, st_ctime - set to same value as st_mtime
+ * st_nlink is 1 for a directory, which has no '.' or '..' entries.
  *
  * Errors
  *   -ENOENT  - a component of the path is not present.
@@ -173,21 +477,21 @@ void* fs_init(struct fuse_conn_info *conn)
 static int fs_getattr(const char *path, struct stat *sb)
 {   
     uint8_t is_real_dir;
+    fs_lock();
+    if (snap_path(path, NULL) == SNAP_PATH_DIR) {
+        snap_stat_dir(sb);
+        fs_unlock();
+        return 0;
+    }
     int dir_inode_index = translate(path, &is_real_dir);
     if (dir_inode_index < 0) {
+        fs_unlock();
         return dir_inode_index;
     }
-    Inode tmp_inode = inodes[dir_inode_index];
-    sb -> st_ino = dir_inode_index;
-    sb -> st_mode = tmp_inode.mode;
-    /* number of hard links to the file */
-    sb -> st_nlink = 1;
-    sb -> st_uid = tmp_inode.uid;
-    sb -> st_gid = tmp_inode.gid;
-    sb -> st_size = tmp_inode.size;
-    (sb -> st_mtimespec).tv_sec = tmp_inode.mtime;
-    (sb -> st_ctimespec).tv_sec = tmp_inode.ctime;
-    return 0;
+    stat_inode(dir_inode_index, sb);
+    int rv = io_status(0);
+    fs_unlock();
+    return rv;
 }
 
 /**
@@ -213,38 +517,47 @@ static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
 		       off_t offset, struct fuse_file_info *fi)
 {
     uint8_t is_real_dir;
-    struct stat st;
-    DirEntry dir_entry_buf[DIRENTS_PER_BLK];
-    int dir_inode_index, dir_block_index, entries_read_num;
-    char path_buf[MAX_PATH_TOKEN_SIZE*MAX_PATH_TOKEN_NUM];
-
+    uint8_t blk_buf[FS_BLOCK_SIZE];
+    char name[FS_NAME_MAX + 1];
+    DirEntry *de;
+    int dir_inode_index, dir_block_index, off;
+
+    fs_lock();
+    if (snap_path(path, NULL) == SNAP_PATH_DIR) {
+        snap_readdir(ptr, filler);
+        fs_unlock();
+        return 0;
+    }
     dir_inode_index = translate(path, &is_real_dir);
     //return error code
     if (dir_inode_index < 0) {
+        fs_unlock();
         return dir_inode_index;
     }
     //return error code
     if (!is_real_dir) {
+        fs_unlock();
         return -ENOTDIR;
     }
     //only have one data block
-    dir_block_index = inodes[dir_inode_index].direct[0];
-    entries_read_num = parser_dir_block(dir_block_index, dir_entry_buf);
+    dir_block_index = get_inode(dir_inode_index) -> direct[0];
+    if (read_block(dir_block_index, blk_buf) < 0) {
+        fs_unlock();
+        return -EIO;
+    }
 
-    for (int i = 0; i < entries_read_num; i++) {
+    for (off = 0; (de = dir_entry(blk_buf, off)) != NULL; off += de -> rec_len) {
         struct stat sa;
-        struct stat* sb = &sa;
-        strcpy(path_buf, path);
-        int path_len = strlen(path_buf);
-
-        if (path_buf[path_len - 1] != '/')
-            strcat(path_buf, "/");
-
-        strcat(path_buf, dir_entry_buf[i].name);
-        fs_getattr(path_buf, &sa);
-        (*filler)(ptr, dir_entry_buf[i].name, &sa, 0);
+        if (de -> inode == 0)
+            continue;
+        memcpy(name, de -> name, de -> name_len);
+        name[de -> name_len] = '\0';
+        stat_inode(de -> inode, &sa);
+        (*filler)(ptr, name, &sa, 0);
     }
-    return 0;
+    int rv = io_status(0);
+    fs_unlock();
+    return rv;
 }
 
 /**
@@ -264,7 +577,13 @@ static int fs_readdir(const char *path, void *ptr, fuse_fill_dir_t filler,
 static int fs_opendir(const char *path, struct fuse_file_info *fi)
 {   
     uint8_t is_real_dir;
+    if (snap_path(path, NULL) == SNAP_PATH_DIR) {
+        fi->fh = 0;
+        return 0;
+    }
+    fs_lock();
     int file_handler = translate(path, &is_real_dir);
+    fs_unlock();
     // return error code
     if (file_handler < 0)
         return file_handler;
@@ -286,19 +605,67 @@ static int fs_releasedir(const char *path, struct fuse_file_info *fi)
     return 0;
 }
 
+/**
+ * Allocate and set up the inode of a new file, as for mknod.
+ * Regular files start out inline; they use extents if mode has
+ * FS_MODE_EXTENTS or -extents was given, and are compressed if
+ * mode has FS_MODE_COMPRESS, -compress was given or the parent
+ * directory is marked for compression.
+ *
+ * @param mode the mode, with any FS_MODE_ flags
+ * @param dir_flags the flags of the parent directory
+ * @return the inode number, or 0 if no inode is free
+ */
+static int init_file_inode(mode_t mode, uint32_t dir_flags)
+{
+    int inum = get_free_inode();
+    Inode *in;
+
+    if (inum == 0) {
+        return 0;
+    }
+    in = get_inode(inum);
+    in -> size = 0;
+    memset(in -> direct, 0, sizeof(uint32_t) * N_DIRECT);
+    in -> indir_1 = 0;
+    in -> indir_2 = 0;
+    in -> ctime = time(NULL);
+    in -> mtime = time(NULL);
+    in -> nlink = 1;
+    in -> xattr_blk = 0;
+    memset(in -> xattr, 0, FS_XATTR_INLINE);
+    // small files live in the inode until they outgrow it
+    in -> flags = S_ISREG(mode) ? FS_FL_INLINE : 0;
+    if (S_ISREG(mode) && (extents_default || (mode & FS_MODE_EXTENTS))) {
+        in -> flags |= FS_FL_EXTENTS;
+    }
+    // compression is asked for by the mode or inherited from the directory
+    if (S_ISREG(mode) &&
+        (compress_default || (mode & FS_MODE_COMPRESS) || (dir_flags & FS_FL_COMPRESS))) {
+        in -> flags = FS_FL_INLINE | FS_FL_COMPRESS;
+    }
+    in -> mode = mode & ~(FS_MODE_EXTENTS | FS_MODE_COMPRESS);
+    mark_inode(in);
+    return inum;
+}
+
 /**
  * mknod - create a new file with permissions (mode & 01777)
  * minor device numbers extracted from mode. Behavior undefined
  * when mode bits other than the low 9 bits are used.
  *
  * The access permissions of path are constrained by the
- * umask(2) of the parent process.
+ * umask(2) of the parent process. A regular file is compressed if
+ * mode has FS_MODE_COMPRESS, -compress was given or the parent
+ * directory is marked for compression.
  *
  * Errors
  *   -ENOTDIR  - component of path not a directory
  *   -EEXIST   - file already exists
+ *   -ENAMETOOLONG - name longer than FS_NAME_MAX
  *   -ENOSPC   - free inode not available
- *   -ENOSPC   - results in >32 entries in directory
+ *   -ENOSPC   - no room for the entry in the directory block
+ *   -EROFS    - path is in a snapshot
  *
  * @param path the file path
  * @param mode the mode, indicating block or character-special file
@@ -309,67 +676,78 @@ static int fs_mknod(const char *path, mode_t mode, dev_t dev)
 {
     char parent_path[MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE];
     char file_name_to_create[MAX_PATH_TOKEN_SIZE];
-    DirEntry entries_parent[DIRENTS_PER_BLK];
+    uint8_t entries_parent[FS_BLOCK_SIZE];
     uint8_t is_real_dir, is_parent_dir;
-    Inode *parent_dir_inode_ptr, *file_inode_ptr;
+    Inode *parent_dir_inode_ptr;
     int file_to_create_inode_idx, dir_parent_idx;
-    int file_to_create_entry_idx;
     int file_to_create_blk_idx;
     uint8_t block_buf[BLOCK_SIZE];
 
     memset(parent_path, '\0', MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE);
     memset(file_name_to_create, '\0', MAX_PATH_TOKEN_SIZE);
-    
+
+    if (snap_path(path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    fs_lock();
     int test_inode_idx = translate(path, &is_real_dir);
     if (test_inode_idx > 0) {
+        fs_unlock();
         return -EEXIST;
     } 
-    if (test_inode_idx == -ENOTDIR) {
-        return -ENOTDIR;
+    if (test_inode_idx == -ENOTDIR || test_inode_idx == -ENAMETOOLONG) {
+        fs_unlock();
+        return test_inode_idx;
     }
-    //file inode
-    file_to_create_inode_idx = get_free_inode();
-    if (file_to_create_inode_idx == 0)
-        return -ENOSPC;
-    inodes[file_to_create_inode_idx].size = 0;
-    inodes[file_to_create_inode_idx].mode = mode;
-    memset(inodes[file_to_create_inode_idx].direct, 0, N_DIRECT);
-    inodes[file_to_create_inode_idx].indir_1 = 0;
-    inodes[file_to_create_inode_idx].indir_2 = 0;
-    inodes[file_to_create_inode_idx].ctime = time(NULL);
-    inodes[file_to_create_inode_idx].mtime = time(NULL);
-    mark_inode(inodes + file_to_create_inode_idx);
-
     get_parent_dir(path, parent_path);
     strip_dir(path, file_name_to_create);
-    
+
     dir_parent_idx = translate(parent_path, &is_parent_dir);
-    parent_dir_inode_ptr = inodes + dir_parent_idx;
-    read_block((parent_dir_inode_ptr -> direct)[0], (uint8_t*)entries_parent);
+    if (dir_parent_idx < 0) {
+        fs_unlock();
+        return dir_parent_idx;
+    }
+    //file inode
+    file_to_create_inode_idx = init_file_inode(mode, get_inode(dir_parent_idx) -> flags);
+    if (file_to_create_inode_idx == 0) {
+        fs_unlock();
+        return -ENOSPC;
+    }
+    parent_dir_inode_ptr = get_inode(dir_parent_idx);
+    if (read_block((parent_dir_inode_ptr -> direct)[0], entries_parent) < 0) {
+        return_inode(file_to_create_inode_idx);
+        fs_unlock();
+        return -EIO;
+    }
     //file entry
-    file_to_create_entry_idx = find_free_dir(entries_parent);
-    if (file_to_create_entry_idx == DIR_FULL) {
+    if (dir_add(entries_parent, file_name_to_create, file_to_create_inode_idx, FS_DT_REG) == DIR_FULL) {
+        return_inode(file_to_create_inode_idx);
+        fs_unlock();
         return -ENOSPC;
     }
-    entries_parent[file_to_create_entry_idx].valid = TRUE;
-    strcpy(entries_parent[file_to_create_entry_idx].name, file_name_to_create);
-    entries_parent[file_to_create_entry_idx].inode = file_to_create_inode_idx;
-    entries_parent[file_to_create_entry_idx].isDir = FALSE;
+    bloom_note_add(dir_parent_idx, file_name_to_create);
     //write back entries
-    write_block((parent_dir_inode_ptr -> direct)[0], (uint8_t*)entries_parent);
-    flush_metadata();
+    write_block((parent_dir_inode_ptr -> direct)[0], entries_parent);
+    defer_flush_metadata();
+    fs_unlock();
     return 0;
 }
 
 /**
  *  mkdir - create a directory with the given mode. Behavior
  *  undefined when mode bits other than the low 9 bits are used.
+ *  Making a directory /.snapshots/<name> takes a snapshot of the
+ *  file system named <name> (see snap_create). The new directory
+ *  is marked for compression if mode has FS_MODE_COMPRESS or its
+ *  parent is marked.
  *
  * Errors
  *   -ENOTDIR  - component of path not a directory
  *   -EEXIST   - directory already exists
+ *   -ENAMETOOLONG - name longer than FS_NAME_MAX
  *   -ENOSPC   - free inode not available
- *   -ENOSPC   - results in >32 entries in directory
+ *   -ENOSPC   - no room for the entry in the directory block
+ *   -EROFS    - path is in a snapshot
  *
  * @param path path to file
  * @param mode the mode for the new directory
@@ -379,63 +757,163 @@ static int fs_mkdir(const char *path, mode_t mode)
 {   
     char parent_path[MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE];
     char file_name_to_create[MAX_PATH_TOKEN_SIZE];
-    DirEntry entries_to_create[DIRENTS_PER_BLK], entries_parent[DIRENTS_PER_BLK];
+    uint8_t entries_parent[FS_BLOCK_SIZE];
     uint8_t is_real_dir, is_parent_dir;
     Inode* parent_dir_inode_ptr, *dir_inode_ptr;
-    int dir_to_create_inode_idx, dir_parent_idx;
-    int dir_to_create_entry_idx;
+    int dir_to_create_inode_idx, dir_parent_idx, slot;
     int dir_to_create_blk_idx;
     uint8_t block_buf[BLOCK_SIZE];
+    int rv;
 
     memset(parent_path, '\0', MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE);
     memset(file_name_to_create, '\0', MAX_PATH_TOKEN_SIZE);
 
+    switch (snap_path(path, file_name_to_create)) {
+    case SNAP_PATH_DIR:
+        return -EEXIST;
+    case SNAP_PATH_ROOT:
+        fs_lock();
+        rv = snap_create(file_name_to_create);
+        fs_unlock();
+        return rv;
+    case SNAP_PATH_IN:
+        return -EROFS;
+    }
     get_parent_dir(path, parent_path);
     strip_dir(path, file_name_to_create);
+    if (strlen(file_name_to_create) > FS_NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+    fs_lock();
     dir_parent_idx = translate(parent_path, &is_parent_dir);
-    parent_dir_inode_ptr = inodes + dir_parent_idx;
-    read_block((parent_dir_inode_ptr -> direct)[0], (uint8_t*)entries_parent);
-    if (find_in_dir(entries_parent, file_name_to_create) != NAME_NOT_FOUND) {
+    if (dir_parent_idx < 0) {
+        fs_unlock();
+        return dir_parent_idx;
+    }
+    parent_dir_inode_ptr = get_inode(dir_parent_idx);
+    int compress = (mode & FS_MODE_COMPRESS) || (parent_dir_inode_ptr -> flags & FS_FL_COMPRESS);
+    if (read_block((parent_dir_inode_ptr -> direct)[0], entries_parent) < 0) {
+        fs_unlock();
+        return -EIO;
+    }
+    if (dir_find_slot(entries_parent, file_name_to_create, &slot) != NAME_NOT_FOUND) {
+        fs_unlock();
         return -EEXIST;
     }
-
-    dir_to_create_entry_idx = find_free_dir(entries_parent);
+    if (slot == DIR_FULL) {
+        fs_unlock();
+        return -ENOSPC;
+    }
     dir_to_create_inode_idx = get_free_inode();
-    dir_to_create_blk_idx = get_free_blk();
     //cannot allocate empty inode and entry
-    if (dir_to_create_entry_idx == DIR_FULL || dir_to_create_inode_idx == 0) {
+    if (dir_to_create_inode_idx == 0) {
+        fs_unlock();
         return -ENOSPC;
     }
+    dir_to_create_blk_idx = get_free_blk();
+    if (dir_to_create_blk_idx == 0) {
+        return_inode(dir_to_create_inode_idx);
+        fs_unlock();
+        return -ENOSPC;
+    }
+    dir_insert(entries_parent, slot, file_name_to_create, dir_to_create_inode_idx, FS_DT_DIR);
+    bloom_note_add(dir_parent_idx, file_name_to_create);
 
-    dir_inode_ptr = inodes + dir_to_create_inode_idx;
+    dir_inode_ptr = get_inode(dir_to_create_inode_idx);
+    memset(dir_inode_ptr, 0, sizeof(Inode));
     (dir_inode_ptr -> direct)[0] = dir_to_create_blk_idx;
-    dir_inode_ptr -> mode = mode | S_IFDIR;
+    dir_inode_ptr -> mode = (mode & ~FS_MODE_COMPRESS) | S_IFDIR;
+    dir_inode_ptr -> flags = compress ? FS_FL_COMPRESS : 0;
     dir_inode_ptr -> ctime = time(NULL);
     dir_inode_ptr -> mtime = time(NULL);
+    dir_inode_ptr -> nlink = 1;
 
     mark_inode(dir_inode_ptr);
     memset(block_buf, 0, BLOCK_SIZE);
+    ((DirEntry*)block_buf) -> rec_len = FS_BLOCK_SIZE;
     write_block(dir_to_create_blk_idx, block_buf);
 
-    entries_parent[dir_to_create_entry_idx].valid = TRUE;
-    strcpy(entries_parent[dir_to_create_entry_idx].name, file_name_to_create);
-    entries_parent[dir_to_create_entry_idx].inode = dir_to_create_inode_idx;
-    entries_parent[dir_to_create_entry_idx].isDir = TRUE;
+    write_block((parent_dir_inode_ptr -> direct)[0], entries_parent);
+    defer_flush_metadata();
+    fs_unlock();
+    return 0;
+}
 
-    write_block((parent_dir_inode_ptr -> direct)[0], (uint8_t*)entries_parent);
-    flush_metadata();
-    
+/**
+ * Set the size of a file. Blocks past the new end are released;
+ * growing the file leaves a hole. The bytes after the new end in
+ * its last block are cleared so that a later extension reads zeros.
+ *
+ * @param inode_ptr the file inode
+ * @param len the new length
+ * @return 0 if successful, or -error number
+ */
+static int truncate_inode(Inode *inode_ptr, off_t len)
+{
+    int keep = get_file_block_num(len);
+    uint8_t block_buf[BLOCK_SIZE];
+
+    if (len > INT32_MAX || (!(inode_ptr -> flags & FS_FL_EXTENTS) && keep > MAX_PTR_BLOCKS)) {
+        return -EFBIG;
+    }
+    if (inode_ptr -> flags & FS_FL_INLINE) {
+        if (len <= FS_INLINE_MAX) {
+            if (len < inode_ptr -> size)
+                memset(inline_data(inode_ptr) + len, 0, FS_INLINE_MAX - len);
+            inode_ptr -> size = len;
+            mark_inode(inode_ptr);
+            return 0;
+        }
+        if (uninline_inode(inode_ptr) < 0) {
+            return -ENOSPC;
+        }
+    }
+
+    // a tail that stays in the file is no longer packed
+    if ((inode_ptr -> flags & FS_FL_TAIL) && len != inode_ptr -> size &&
+        len > (off_t)((inode_ptr -> size - 1) / BLOCK_SIZE) * BLOCK_SIZE &&
+        tail_unpack(inode_ptr, -1) == -ENOSPC) {
+        return -ENOSPC;
+    }
+    if ((inode_ptr -> flags & FS_FL_COMPRESS) && len < inode_ptr -> size) {
+        int rv = cluster_truncate(inode_ptr, len);
+        if (rv < 0)
+            return rv;
+    }
+    else if (len < inode_ptr -> size || len == 0) {
+        // truncating to 0 also frees blocks fallocate kept past the end
+        // the kept part of the last block is cleared below, in place
+        if (len % BLOCK_SIZE && unshare_blks(inode_ptr, keep - 1, keep - 1) < 0) {
+            return -ENOSPC;
+        }
+        if (inode_ptr -> flags & FS_FL_EXTENTS)
+            ext_truncate(inode_ptr, keep);
+        else
+            truncate_ptr_blks(inode_ptr, keep);
+        int blk = (len % BLOCK_SIZE) ? get_blk(inode_ptr, keep - 1, FALSE) : 0;
+        if (blk != 0) {
+            read_block(blk, block_buf);
+            memset(block_buf + len % BLOCK_SIZE, 0, BLOCK_SIZE - len % BLOCK_SIZE);
+            write_data_blocks(blk, 1, block_buf);
+        }
+    }
+    inode_ptr -> size = len;
+    mark_inode(inode_ptr);
     return 0;
 }
 
 /**
- * truncate - truncate file to exactly 'len' bytes.
+ * truncate - truncate or extend file to exactly 'len' bytes.
  *
  * Errors:
  *   ENOENT  - file does not exist
  *   ENOTDIR - component of path not a directory
- *   EINVAL  - length invalid (only supports 0)
+ *   EINVAL  - length is negative
  *   EISDIR	 - path is a directory (only files)
+ *   ELOOP   - path is a symbolic link, which is not followed
+ *   EFBIG   - length is past the largest file size
+ *   EROFS   - path is in a snapshot
+ *   EIO     - a block of the file failed its checksum
  *
  * @param path the file path
  * @param len the length
@@ -443,47 +921,84 @@ static int fs_mkdir(const char *path, mode_t mode)
  */
 static int fs_truncate(const char *path, off_t len)
 {
-    if (len != 0) {
+    if (len < 0) {
     	return -EINVAL;		
     }
+    if (snap_path(path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
     uint8_t is_real_dir;
+    fs_lock();
     int inode_idx = translate(path, &is_real_dir);
-    Inode* inode_ptr;
-    int blk_idx;
-    int total_blocks;
-    uint32_t indir2ptrs[PTRS_PER_BLK];
 
     if (inode_idx < 0) {
+        fs_unlock();
         return inode_idx;
     }
     if (is_real_dir) {
+        fs_unlock();
         return -EISDIR; 
     }
-    inode_ptr = inodes + inode_idx;
-    //release stored data blocks
-    total_blocks = get_file_block_num(inode_ptr -> size);
-    for (int i = 0; i < total_blocks; i++) {
-    	blk_idx = get_blk(inode_ptr, i, FALSE);
-        return_blk(blk_idx);
+    if (S_ISLNK(get_inode(inode_idx) -> mode)) {
+        fs_unlock();
+        return -ELOOP;
     }
-    return_indir_ptrs_blocks(inode_ptr);
-    
-    inode_ptr -> size = 0;
-    memset(inode_ptr -> direct, 0, sizeof(uint32_t) * N_DIRECT);
-    inode_ptr -> indir_1 = 0;
-    inode_ptr -> indir_2 = 0;
-    mark_inode(inode_ptr);
-    flush_metadata();
-    return 0;
+    int rv = io_status(truncate_inode(get_inode(inode_idx), len));
+    if (rv == 0)
+        da_truncate(inode_idx, len);
+    defer_flush_metadata();
+    fs_unlock();
+    return rv;
 }
 
 /**
- * unlink - delete a file.
+ * Release an inode whose directory entry is gone: a file's stored
+ * and buffered data blocks, or a directory's block, its xattr block
+ * reference, and the inode.
+ *
+ * @param inum the inode number
+ */
+static void release_inode(int inum)
+{
+    Inode *in = get_inode(inum);
+    if (S_ISDIR(in -> mode)) {
+        return_blk(in -> direct[0]);
+        bloom_drop(inum);
+    }
+    else {
+        da_truncate(inum, 0);
+        truncate_inode(in, 0);
+    }
+    xattr_release(get_inode(inum));
+    return_inode(inum);
+}
+
+/**
+ * Drop one directory entry's reference to an inode, releasing it
+ * with the last one.
+ *
+ * @param inum the inode number
+ */
+static void drop_link(int inum)
+{
+    Inode *in = get_inode(inum);
+    if (in -> nlink > 1) {
+        in -> nlink--;
+        mark_inode(in);
+    }
+    else {
+        release_inode(inum);
+    }
+}
+
+/**
+ * unlink - delete a file name. The file goes with its last name.
  *
  * Errors
  *   -ENOENT   - file does not exist
  *   -ENOTDIR  - component of path not a directory
  *   -EISDIR   - cannot unlink a directory
+ *   -EROFS    - path is in a snapshot
  *
  * @param path path to file
  * @return 0 if successful, or -error number
@@ -493,50 +1008,59 @@ static int fs_unlink(const char *path)
     uint8_t is_real_dir, is_parent_dir;
     int dir_parent_idx, inode_idx, entries_blk_idx, entry_to_rm_idx;
 
-    Inode* parent_inode_ptr = inodes + inode_idx;
+    Inode* parent_inode_ptr;
     char parent_path[MAX_PATH_TOKEN_NUM * MAX_PATH_TOKEN_SIZE];
     char file_name_to_rm[MAX_PATH_TOKEN_SIZE];
-    DirEntry entries_parent[DIRENTS_PER_BLK];
+    uint8_t entries_parent[FS_BLOCK_SIZE];
 
     memset(parent_path, '\0', MAX_PATH_TOKEN_NUM * MAX_PATH_TOKEN_SIZE);
+    memset(file_name_to_rm, '\0', MAX_PATH_TOKEN_SIZE);
 
+    if (snap_path(path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    fs_lock();
     inode_idx = translate(path, &is_real_dir);
     if (inode_idx < 0) {
+        fs_unlock();
         return inode_idx;
     }
     if (is_real_dir) {
+        fs_unlock();
         return -EISDIR; 
     }
-    //release stored data blocks
-    fs_truncate(path, 0);
-    //release inode
-    return_inode(inode_idx);
-    flush_metadata();
+    //release data blocks and inode with the last link
+    drop_link(inode_idx);
 
     get_parent_dir(path, parent_path);
     strip_dir(path, file_name_to_rm);
     
     //delete name in parent directory
     dir_parent_idx = translate(parent_path, &is_parent_dir);
-    parent_inode_ptr = inodes + dir_parent_idx;
+    parent_inode_ptr = get_inode(dir_parent_idx);
     entries_blk_idx = (parent_inode_ptr -> direct)[0];
 
-    read_block(entries_blk_idx, (uint8_t*)entries_parent);
+    read_block(entries_blk_idx, entries_parent);
     entry_to_rm_idx = find_in_dir(entries_parent, file_name_to_rm);
-    entries_parent[entry_to_rm_idx].valid = FALSE;
+    dir_remove(entries_parent, entry_to_rm_idx);
+    bloom_note_remove(dir_parent_idx);
     //write back
-    write_block(entries_blk_idx, (uint8_t*)entries_parent);
+    write_block(entries_blk_idx, entries_parent);
+    defer_flush_metadata();
+    fs_unlock();
     return 0;
 }
 
 /**
- * rmdir - remove a directory.
+ * rmdir - remove a directory. Removing /.snapshots/<name> deletes
+ * the snapshot (see snap_delete).
  *
  * Errors
  *   -ENOENT   - file does not exist
  *   -ENOTDIR  - component of path not a directory
  *   -ENOTDIR  - path not a directory
  *   -ENOTEMPTY - directory not empty
+ *   -EROFS    - path is in a snapshot
  *
  * @param path the path of the directory
  * @return 0 if successful, or -error number
@@ -552,58 +1076,83 @@ static int fs_rmdir(const char *path)
     uint32_t entries_blk;
     int entry_to_rm_idx;
     Inode* inode_ptr_rm, *inode_ptr_parent;
-    DirEntry entries_to_rm[DIRENTS_PER_BLK], entries_parent[DIRENTS_PER_BLK];
-
+    uint8_t entries_to_rm[FS_BLOCK_SIZE], entries_parent[FS_BLOCK_SIZE];
+    char snap_name[FS_FILENAME_SIZE + 1];
+    int rv;
+
+    switch (snap_path(path, snap_name)) {
+    case SNAP_PATH_DIR:
+    case SNAP_PATH_IN:
+        return -EROFS;
+    case SNAP_PATH_ROOT:
+        fs_lock();
+        rv = snap_delete(snap_name);
+        fs_unlock();
+        return rv;
+    }
+    fs_lock();
     dir_to_rm_inode_idx = translate(path, &is_real_dir);
     if (dir_to_rm_inode_idx < 0) {
+        fs_unlock();
         return dir_to_rm_inode_idx;
     } 
     if (!is_real_dir) {
+        fs_unlock();
         return -ENOTDIR;
     }
 
-    inode_ptr_rm = inodes + dir_to_rm_inode_idx;
+    inode_ptr_rm = get_inode(dir_to_rm_inode_idx);
     entries_blk = (inode_ptr_rm -> direct)[0];
-    read_block(entries_blk, (uint8_t*)entries_to_rm);
+    if (read_block(entries_blk, entries_to_rm) < 0) {
+        fs_unlock();
+        return -EIO;
+    }
     //cannot delete non-empty directory
     if (!is_empty_dir(entries_to_rm)) {
+        fs_unlock();
         return -ENOTEMPTY;
     }
-    return_blk(entries_blk);
-
-    //delete inode
-    return_inode(dir_to_rm_inode_idx);
-    flush_metadata();
+    //delete directory block and inode
+    release_inode(dir_to_rm_inode_idx);
     
     get_parent_dir(path, parent_path);
     strip_dir(path, file_name_to_rm);
 
     //delete in parent directory's entries
     dir_parent_idx = translate(parent_path, &is_parent_dir);
-    inode_ptr_parent = inodes + dir_parent_idx;
+    inode_ptr_parent = get_inode(dir_parent_idx);
     entries_blk = (inode_ptr_parent -> direct)[0];
-    read_block(entries_blk, (uint8_t*)entries_parent);
+    read_block(entries_blk, entries_parent);
 
     entry_to_rm_idx = find_in_dir(entries_parent, file_name_to_rm);
-    entries_parent[entry_to_rm_idx].valid = FALSE;
+    dir_remove(entries_parent, entry_to_rm_idx);
+    bloom_note_remove(dir_parent_idx);
     //write back
-    write_block(entries_blk, (uint8_t*)entries_parent);
+    write_block(entries_blk, entries_parent);
+    defer_flush_metadata();
+    fs_unlock();
     return 0;
 }
 
 /**
- * rename - rename a file or directory.
- *
- * Note that this is a simplified version of the UNIX rename
- * functionality - see 'man 2 rename' for full semantics. In
- * particular, the full version can move across directories, replace a
- * destination file, and replace an empty directory with a full one.
+ * rename - rename a file or directory, see 'man 2 rename'. The
+ * source may move to another directory, and replaces a destination
+ * file, or an empty destination directory, of the same kind. The
+ * new name is written before the old one is removed, so a crash in
+ * between leaves both names rather than neither; a rename within a
+ * directory is a single block write.
  *
  * Errors:
- *   -ENOENT   - source file or directory does not exist
+ *   -ENOENT   - source, or destination directory, does not exist
  *   -ENOTDIR  - component of source or target path not a directory
- *   -EEXIST   - destination already exists
- *   -EINVAL   - source and destination not in the same directory
+ *   -ENOTDIR  - source is a directory and destination is not
+ *   -EISDIR   - destination is a directory and source is not
+ *   -ENOTEMPTY - destination is a non-empty directory
+ *   -EINVAL   - destination is inside the source directory
+ *   -EBUSY    - source or destination is the root directory
+ *   -ENAMETOOLONG - destination name longer than FS_NAME_MAX
+ *   -ENOSPC   - no room for the name in the destination directory
+ *   -EROFS    - source or destination is in a snapshot
  *
  * @param src_path the source path
  * @param dst_path the destination path.
@@ -611,109 +1160,903 @@ static int fs_rmdir(const char *path)
  */
 static int fs_rename(const char *src_path, const char *dst_path)
 {
-    uint8_t is_parent_dir;
-    int dir_parent_idx;
-    Inode* inode_ptr_rm;
-    DirEntry entries_parent[DIRENTS_PER_BLK];
+    uint8_t is_src_dir, is_dst_dir, is_parent_dir;
+    int src_inum, dst_inum, src_parent_idx, dst_parent_idx;
+    uint8_t src_entries[FS_BLOCK_SIZE], dst_entries[FS_BLOCK_SIZE], dst_dir_entries[FS_BLOCK_SIZE];
+    uint8_t *dst_blk;
     char parent_path_src[MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE];
     char parent_path_dst[MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE];
     char file_name_src[MAX_PATH_TOKEN_SIZE];
     char file_name_dst[MAX_PATH_TOKEN_SIZE];
-
-    int entry_to_rename_idx, entries_blk_idx;
+    int chain[MAX_PATH_DEPTH], chain_len, i, off, type;
+    DirEntry *de;
 
     memset(parent_path_src, '\0', MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE);
     memset(parent_path_dst, '\0', MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE);
     memset(file_name_src, '\0', MAX_PATH_TOKEN_SIZE);
     memset(file_name_dst, '\0', MAX_PATH_TOKEN_SIZE);
 
+    if (snap_path(src_path, NULL) != SNAP_PATH_NONE || snap_path(dst_path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    if (strcmp(src_path, "/") == 0 || strcmp(dst_path, "/") == 0) {
+        return -EBUSY;
+    }
     get_parent_dir(src_path, parent_path_src);
     get_parent_dir(dst_path, parent_path_dst);
-
-    if (strcmp(parent_path_src, parent_path_dst) != 0) {
-        return -EINVAL;
-    }
-
     strip_dir(src_path, file_name_src);
     strip_dir(dst_path, file_name_dst);
+    if (strlen(file_name_dst) > FS_NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
 
-    dir_parent_idx = translate(parent_path_src, &is_parent_dir);
-
-    if (dir_parent_idx < 0) {
-        return dir_parent_idx;
-    } 
+    fs_lock();
+    src_inum = translate(src_path, &is_src_dir);
+    if (src_inum < 0) {
+        fs_unlock();
+        return src_inum;
+    }
+    src_parent_idx = translate(parent_path_src, &is_parent_dir);
+    dst_parent_idx = translate_path(parent_path_dst, &is_parent_dir, chain, &chain_len);
+    if (dst_parent_idx < 0) {
+        fs_unlock();
+        return dst_parent_idx;
+    }
     if (!is_parent_dir) {
+        fs_unlock();
         return -ENOTDIR;
     }
-    inode_ptr_rm = inodes + dir_parent_idx;
-    //delete in parent directory's entries
-    entries_blk_idx = (inode_ptr_rm -> direct)[0];
-    read_block(entries_blk_idx, (uint8_t*)entries_parent);
-    if(find_in_dir(entries_parent, file_name_dst) >= 0) {
-        return EEXIST;
+    dst_inum = translate(dst_path, &is_dst_dir);
+    if (dst_inum < 0 && dst_inum != -ENOENT) {
+        fs_unlock();
+        return dst_inum;
+    }
+    //both names for the same file: nothing to do
+    if (dst_inum == src_inum) {
+        fs_unlock();
+        return 0;
+    }
+    //a directory cannot move into itself, by any path: look for it
+    //among the destination directory's ancestors
+    for (i = 0; is_src_dir && i < chain_len; i++) {
+        if (chain[i] == src_inum) {
+            fs_unlock();
+            return -EINVAL;
+        }
+    }
+    if (dst_inum > 0) {
+        if (is_src_dir && !is_dst_dir) {
+            fs_unlock();
+            return -ENOTDIR;
+        }
+        if (!is_src_dir && is_dst_dir) {
+            fs_unlock();
+            return -EISDIR;
+        }
+        if (is_dst_dir) {
+            if (read_block(get_inode(dst_inum) -> direct[0], dst_dir_entries) < 0) {
+                fs_unlock();
+                return -EIO;
+            }
+            if (!is_empty_dir(dst_dir_entries)) {
+                fs_unlock();
+                return -ENOTEMPTY;
+            }
+        }
     }
-    entry_to_rename_idx = find_in_dir(entries_parent, file_name_src);
-    strcpy(entries_parent[entry_to_rename_idx].name, file_name_dst);
-    //write back
-    write_block(entries_blk_idx, (uint8_t*)entries_parent);
-    return 0;
-}
 
-/**
- * chmod - change file permissions
- *
- * Errors:
- *   -ENOENT   - file does not exist
- *   -ENOTDIR  - component of path not a directory
- *
- * @param path the file or directory path
- * @param mode the mode_t mode value -- see man 'chmod'
- *   for description
- * @return 0 if successful, or -error number
- */
-static int fs_chmod(const char *path, mode_t mode)
-{
-    int inode_idx;
-    uint8_t is_real_dir;
-    Inode* inode_ptr;
-    inode_idx = translate(path, &is_real_dir);
-    if (inode_idx < 0) {
-        return inode_idx;
+    if (read_block(get_inode(src_parent_idx) -> direct[0], src_entries) < 0) {
+        fs_unlock();
+        return -EIO;
     }
-    inode_ptr = inodes + inode_idx;
-    inode_ptr -> mode = mode;
-    mark_inode(inodes + inode_idx);
-    flush_metadata();
+    dst_blk = src_entries;
+    if (dst_parent_idx != src_parent_idx) {
+        dst_blk = dst_entries;
+        if (read_block(get_inode(dst_parent_idx) -> direct[0], dst_entries) < 0) {
+            fs_unlock();
+            return -EIO;
+        }
+    }
+    type = ((DirEntry*)(src_entries + find_in_dir(src_entries, file_name_src))) -> type;
+
+    //point the destination name at the source, replacing its inode
+    if (dst_inum > 0) {
+        de = (DirEntry*)(dst_blk + find_in_dir(dst_blk, file_name_dst));
+        de -> inode = src_inum;
+        de -> type = type;
+    }
+    else if (dir_add(dst_blk, file_name_dst, src_inum, type) == DIR_FULL) {
+        fs_unlock();
+        return -ENOSPC;
+    }
+    else {
+        bloom_note_add(dst_parent_idx, file_name_dst);
+    }
+    if (dst_blk != src_entries) {
+        write_block(get_inode(dst_parent_idx) -> direct[0], dst_blk);
+    }
+    //then remove the source name; offsets may have moved in dir_add
+    off = find_in_dir(src_entries, file_name_src);
+    dir_remove(src_entries, off);
+    bloom_note_remove(src_parent_idx);
+    write_block(get_inode(src_parent_idx) -> direct[0], src_entries);
+
+    if (dst_inum > 0) {
+        drop_link(dst_inum);
+    }
+    defer_flush_metadata();
+    fs_unlock();
     return 0;
 }
 
 /**
- * utime - change access and modification times.
+ * link - make a new name for a file, in any directory. Both names
+ * refer to the same inode, which counts them in nlink.
  *
  * Errors:
- *   -ENOENT   - file does not exist
- *   -ENOTDIR  - component of path not a directory
+ *   -ENOENT   - source, or destination directory, does not exist
+ *   -ENOTDIR  - component of source or target path not a directory
+ *   -EPERM    - source is a directory
+ *   -EEXIST   - destination already exists
+ *   -ENAMETOOLONG - destination name longer than FS_NAME_MAX
+ *   -ENOSPC   - no room for the name in the destination directory
+ *   -EROFS    - source or destination is in a snapshot
  *
- * @param path the file or directory path.
- * @param ut utimbuf - see man 'utime' for description.
+ * @param src_path the existing file
+ * @param dst_path the new name
  * @return 0 if successful, or -error number
  */
-int fs_utime(const char *path, struct utimbuf *ut)
+static int fs_link(const char *src_path, const char *dst_path)
 {
-    int inode_idx;
-    uint8_t is_real_dir;
-    Inode* inode_ptr;
-    inode_idx = translate(path, &is_real_dir);
-    if (inode_idx < 0) {
-        return inode_idx;
+    uint8_t is_src_dir, is_dst_dir, is_parent_dir;
+    int src_inum, dst_inum, dst_parent_idx;
+    uint8_t entries_parent[FS_BLOCK_SIZE];
+    char parent_path_dst[MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE];
+    char file_name_dst[MAX_PATH_TOKEN_SIZE];
+    Inode *in;
+
+    memset(parent_path_dst, '\0', MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE);
+    memset(file_name_dst, '\0', MAX_PATH_TOKEN_SIZE);
+
+    if (snap_path(src_path, NULL) != SNAP_PATH_NONE || snap_path(dst_path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    get_parent_dir(dst_path, parent_path_dst);
+    strip_dir(dst_path, file_name_dst);
+    if (strlen(file_name_dst) > FS_NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+
+    fs_lock();
+    src_inum = translate(src_path, &is_src_dir);
+    if (src_inum < 0) {
+        fs_unlock();
+        return src_inum;
+    }
+    if (is_src_dir) {
+        fs_unlock();
+        return -EPERM;
+    }
+    dst_inum = translate(dst_path, &is_dst_dir);
+    if (dst_inum > 0) {
+        fs_unlock();
+        return -EEXIST;
+    }
+    if (dst_inum != -ENOENT) {
+        fs_unlock();
+        return dst_inum;
+    }
+    dst_parent_idx = translate(parent_path_dst, &is_parent_dir);
+    if (dst_parent_idx < 0) {
+        fs_unlock();
+        return dst_parent_idx;
+    }
+    if (!is_parent_dir) {
+        fs_unlock();
+        return -ENOTDIR;
+    }
+    if (read_block(get_inode(dst_parent_idx) -> direct[0], entries_parent) < 0) {
+        fs_unlock();
+        return -EIO;
+    }
+    in = get_inode(src_inum);
+    if (dir_add(entries_parent, file_name_dst, src_inum,
+                S_ISLNK(in -> mode) ? FS_DT_LNK : FS_DT_REG) == DIR_FULL) {
+        fs_unlock();
+        return -ENOSPC;
+    }
+    bloom_note_add(dst_parent_idx, file_name_dst);
+    in -> nlink = (in -> nlink > 0 ? in -> nlink : 1) + 1;
+    mark_inode(in);
+    write_block(get_inode(dst_parent_idx) -> direct[0], entries_parent);
+    defer_flush_metadata();
+    fs_unlock();
+    return 0;
+}
+
+/**
+ * symlink - make a symbolic link. A target of up to FS_INLINE_MAX
+ * bytes is kept in the inode, so that reading the link needs no
+ * block; a longer one gets a block of its own.
+ *
+ * Errors:
+ *   -ENOENT   - target is empty, or the directory does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -EEXIST   - path already exists
+ *   -ENAMETOOLONG - name longer than FS_NAME_MAX, or target longer
+ *               than FS_SYMLINK_MAX
+ *   -ENOSPC   - no free inode or block, or no room for the entry
+ *   -EROFS    - path is in a snapshot
+ *
+ * @param target the link contents
+ * @param path the link name
+ * @return 0 if successful, or -error number
+ */
+static int fs_symlink(const char *target, const char *path)
+{
+    uint8_t is_real_dir, is_parent_dir;
+    int inum, dir_parent_idx, blk = 0, len = strlen(target);
+    uint8_t entries_parent[FS_BLOCK_SIZE], block_buf[FS_BLOCK_SIZE];
+    char parent_path[MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE];
+    char link_name[MAX_PATH_TOKEN_SIZE];
+    Inode *in;
+
+    memset(parent_path, '\0', MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE);
+    memset(link_name, '\0', MAX_PATH_TOKEN_SIZE);
+
+    if (snap_path(path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    if (len == 0) {
+        return -ENOENT;
+    }
+    if (len > FS_SYMLINK_MAX) {
+        return -ENAMETOOLONG;
+    }
+    get_parent_dir(path, parent_path);
+    strip_dir(path, link_name);
+
+    fs_lock();
+    inum = translate(path, &is_real_dir);
+    if (inum > 0) {
+        fs_unlock();
+        return -EEXIST;
+    }
+    if (inum != -ENOENT) {
+        fs_unlock();
+        return inum;
+    }
+    dir_parent_idx = translate(parent_path, &is_parent_dir);
+    if (dir_parent_idx < 0) {
+        fs_unlock();
+        return dir_parent_idx;
+    }
+    if (!is_parent_dir) {
+        fs_unlock();
+        return -ENOTDIR;
+    }
+    if (read_block(get_inode(dir_parent_idx) -> direct[0], entries_parent) < 0) {
+        fs_unlock();
+        return -EIO;
+    }
+    if ((inum = get_free_inode()) == 0) {
+        fs_unlock();
+        return -ENOSPC;
+    }
+    if (len > FS_INLINE_MAX && (blk = get_free_blk()) == 0) {
+        return_inode(inum);
+        fs_unlock();
+        return -ENOSPC;
+    }
+    if (dir_add(entries_parent, link_name, inum, FS_DT_LNK) == DIR_FULL) {
+        if (blk != 0)
+            return_blk(blk);
+        return_inode(inum);
+        fs_unlock();
+        return -ENOSPC;
+    }
+    in = get_inode(inum);
+    memset(in, 0, sizeof(*in));
+    in -> mode = S_IFLNK | 0777;
+    in -> size = len;
+    in -> ctime = in -> mtime = time(NULL);
+    in -> nlink = 1;
+    if (blk == 0) {
+        in -> flags = FS_FL_INLINE;
+        memcpy(inline_data(in), target, len);
+    }
+    else {
+        // the target is written once, like a directory block
+        memset(block_buf, 0, FS_BLOCK_SIZE);
+        memcpy(block_buf, target, len);
+        write_block(blk, block_buf);
+        in -> direct[0] = blk;
+    }
+    mark_inode(in);
+    bloom_note_add(dir_parent_idx, link_name);
+    write_block(get_inode(dir_parent_idx) -> direct[0], entries_parent);
+    defer_flush_metadata();
+    fs_unlock();
+    return 0;
+}
+
+/**
+ * readlink - read the target of a symbolic link, cut to fit len - 1
+ * bytes and ended with a NUL.
+ *
+ * Errors:
+ *   -ENOENT   - link does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -EINVAL   - path is not a symbolic link
+ *   -EIO      - the link's block failed its checksum
+ *
+ * @param path the link name
+ * @param buf buffer for the target
+ * @param len size of buf
+ * @return 0 if successful, or -error number
+ */
+static int fs_readlink(const char *path, char *buf, size_t len)
+{
+    uint8_t is_real_dir;
+    char target[FS_SYMLINK_MAX + 1];
+    int inum, rv;
+
+    if (len == 0) {
+        return -EINVAL;
+    }
+    fs_lock();
+    inum = translate(path, &is_real_dir);
+    if (inum < 0) {
+        fs_unlock();
+        return inum;
+    }
+    if (!S_ISLNK(get_inode(inum) -> mode)) {
+        fs_unlock();
+        return -EINVAL;
+    }
+    rv = io_status(read_link(inum, target) < 0 ? -EIO : 0);
+    fs_unlock();
+    if (rv < 0) {
+        return rv;
+    }
+    strncpy(buf, target, len - 1);
+    buf[len - 1] = '\0';
+    return 0;
+}
+
+/**
+ * Switch an inode to extent mapping or compression: an empty
+ * regular file to either, or a directory to compressing the files
+ * later created in it. Flags the inode already has are left alone.
+ *
+ * Errors:
+ *   -EINVAL   - file not empty, not a regular file (or for
+ *               compression a directory), or both mappings asked for
+ *
+ * @param inode_ptr the inode
+ * @param flags FS_FL_EXTENTS and FS_FL_COMPRESS to set
+ * @return 0 if successful, or -error number
+ */
+static int set_mapping_flags(Inode *inode_ptr, uint32_t flags)
+{
+    // extents need an empty regular file that is not compressed
+    if ((flags & FS_FL_EXTENTS) && !(inode_ptr -> flags & FS_FL_EXTENTS)) {
+        if (!S_ISREG(inode_ptr -> mode) || inode_ptr -> size > 0 ||
+            (inode_ptr -> flags & FS_FL_COMPRESS) || (flags & FS_FL_COMPRESS)) {
+            return -EINVAL;
+        }
+        inode_ptr -> flags |= FS_FL_EXTENTS;
+        if (!(inode_ptr -> flags & FS_FL_INLINE))
+            ext_init(inode_ptr);
+    }
+    // compression marks a directory, or an empty regular file
+    if ((flags & FS_FL_COMPRESS) && !(inode_ptr -> flags & FS_FL_COMPRESS)) {
+        if (S_ISDIR(inode_ptr -> mode)) {
+            inode_ptr -> flags |= FS_FL_COMPRESS;
+        }
+        else if (!S_ISREG(inode_ptr -> mode) || inode_ptr -> size > 0 ||
+                 (inode_ptr -> flags & FS_FL_EXTENTS)) {
+            return -EINVAL;
+        }
+        else {
+            if (!(inode_ptr -> flags & FS_FL_INLINE))
+                truncate_ptr_blks(inode_ptr, 0);
+            inode_ptr -> flags = FS_FL_INLINE | FS_FL_COMPRESS;
+        }
+    }
+    mark_inode(inode_ptr);
+    return 0;
+}
+
+/**
+ * setxattr - set an extended attribute of a file or directory (of a
+ * symbolic link itself, not its target). The attribute is kept in
+ * the inode if it fits in what is left there, and in the inode's
+ * xattr block if not. XATTR_NAME_EXTENTS and XATTR_NAME_COMPRESS
+ * are not stored but set the flag they name, as set_mapping_flags
+ * does; their value is ignored.
+ *
+ * Errors:
+ *   -ENOENT   - file does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -EEXIST   - XATTR_CREATE, and the attribute exists
+ *   -ENOATTR  - XATTR_REPLACE, and the attribute does not exist
+ *   -ERANGE   - name empty or longer than FS_NAME_MAX
+ *   -E2BIG    - value too large for an xattr block
+ *   -ENOSPC   - no room left in the xattr block, or no free block
+ *   -EROFS    - path is in a snapshot
+ *   -EIO      - the xattr block failed its checksum
+ *   -EINVAL   - the flag of XATTR_NAME_EXTENTS or XATTR_NAME_COMPRESS
+ *               cannot be set
+ *
+ * @param path the file path
+ * @param name the attribute name
+ * @param value the value
+ * @param size the value length
+ * @param flags XATTR_CREATE, XATTR_REPLACE or 0
+ * @return 0 if successful, or -error number
+ */
+#ifdef __APPLE__
+static int fs_setxattr(const char *path, const char *name, const char *value, size_t size,
+                       int flags, uint32_t position)
+#else
+static int fs_setxattr(const char *path, const char *name, const char *value, size_t size,
+                       int flags)
+#endif
+{
+    uint8_t is_real_dir;
+    uint8_t inl[FS_XATTR_INLINE], entries[FS_XATTR_BLOCK_SPACE];
+    int inum, off_inl, off_blk, end, rv, len = strlen(name);
+    uint32_t flag;
+    Inode *in;
+
+    if (snap_path(path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    if (len == 0 || len > FS_NAME_MAX) {
+        return -ERANGE;
+    }
+    if (FS_XATTR_LEN(len, size) > FS_XATTR_BLOCK_SPACE) {
+        return -E2BIG;
+    }
+    fs_lock();
+    inum = translate(path, &is_real_dir);
+    if (inum < 0) {
+        fs_unlock();
+        return inum;
+    }
+    if ((flag = xattr_flag(name)) != 0) {
+        in = get_inode(inum);
+        if ((flags & XATTR_CREATE) && (in -> flags & flag))
+            rv = -EEXIST;
+        else if ((flags & XATTR_REPLACE) && !(in -> flags & flag))
+            rv = -ENOATTR;
+        else
+            rv = set_mapping_flags(in, flag);
+        defer_flush_metadata();
+        fs_unlock();
+        return rv;
+    }
+    if ((rv = xattr_load(get_inode(inum), inl, entries)) < 0) {
+        rv = io_status(rv);
+        fs_unlock();
+        return rv;
+    }
+    off_inl = xattr_find(inl, FS_XATTR_INLINE, name, &end);
+    off_blk = xattr_find(entries, FS_XATTR_BLOCK_SPACE, name, &end);
+    if ((flags & XATTR_CREATE) && (off_inl >= 0 || off_blk >= 0)) {
+        fs_unlock();
+        return -EEXIST;
+    }
+    if ((flags & XATTR_REPLACE) && off_inl < 0 && off_blk < 0) {
+        fs_unlock();
+        return -ENOATTR;
+    }
+    if (off_inl >= 0)
+        xattr_remove(inl, FS_XATTR_INLINE, off_inl);
+    if (off_blk >= 0)
+        xattr_remove(entries, FS_XATTR_BLOCK_SPACE, off_blk);
+    if (xattr_append(inl, FS_XATTR_INLINE, name, value, size) < 0 &&
+        xattr_append(entries, FS_XATTR_BLOCK_SPACE, name, value, size) < 0) {
+        rv = -ENOSPC;
+    }
+    else {
+        rv = io_status(xattr_store(inum, inl, entries));
+    }
+    defer_flush_metadata();
+    fs_unlock();
+    return rv;
+}
+
+/**
+ * getxattr - get an extended attribute. One kept in the inode is
+ * read from the inode cache; one kept in an xattr block from the
+ * xattr block cache, if the block is there. XATTR_NAME_EXTENTS and
+ * XATTR_NAME_COMPRESS read as "1" if the inode has their flag.
+ *
+ * Errors:
+ *   -ENOENT   - file does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -ENOATTR  - the file has no such attribute
+ *   -ERANGE   - value longer than size
+ *   -EIO      - the xattr block failed its checksum
+ *
+ * @param path the file path
+ * @param name the attribute name
+ * @param value buffer for the value
+ * @param size size of the buffer, or 0 to get the value length only
+ * @return the value length if successful, or -error number
+ */
+#ifdef __APPLE__
+static int fs_getxattr(const char *path, const char *name, char *value, size_t size,
+                       uint32_t position)
+#else
+static int fs_getxattr(const char *path, const char *name, char *value, size_t size)
+#endif
+{
+    uint8_t is_real_dir, buf[FS_BLOCK_SIZE];
+    uint8_t *area;
+    struct fs_xattr *xe;
+    int inum, off, end, rv;
+    Inode *in;
+
+    fs_lock();
+    inum = translate(path, &is_real_dir);
+    if (inum < 0) {
+        fs_unlock();
+        return inum;
+    }
+    in = get_inode(inum);
+    if (xattr_flag(name) != 0) {
+        rv = (in -> flags & xattr_flag(name)) ? 1 : -ENOATTR;
+        if (rv > 0 && size > 0)
+            value[0] = '1';
+        fs_unlock();
+        return rv;
+    }
+    area = in -> xattr;
+    off = xattr_find(area, FS_XATTR_INLINE, name, &end);
+    if (off < 0 && in -> xattr_blk != 0) {
+        if (xattr_blk_read(in -> xattr_blk, buf) < 0) {
+            rv = io_status(-EIO);
+            fs_unlock();
+            return rv;
+        }
+        area = buf + sizeof(struct fs_xattr_header);
+        off = xattr_find(area, FS_XATTR_BLOCK_SPACE, name, &end);
+    }
+    if (off < 0) {
+        fs_unlock();
+        return -ENOATTR;
     }
-    inode_ptr = inodes + inode_idx;
+    xe = (struct fs_xattr*)(area + off);
+    rv = xe -> value_len;
+    if (size > 0 && size < xe -> value_len)
+        rv = -ERANGE;
+    else if (size > 0)
+        memcpy(value, xe -> name + xe -> name_len, xe -> value_len);
+    fs_unlock();
+    return rv;
+}
+
+/**
+ * Copy the names of the attributes in an xattr area to a list.
+ *
+ * @param area the entry list
+ * @param size the size of the area
+ * @param list buffer for the names, each with a NUL, or NULL
+ * @param len number of bytes in list so far
+ * @return number of bytes in list after the names
+ */
+static int xattr_names(uint8_t *area, int size, char *list, int len)
+{
+    int off = 0;
+    struct fs_xattr *xe;
+
+    while (off + (int)sizeof(struct fs_xattr) <= size) {
+        xe = (struct fs_xattr*)(area + off);
+        if (xe -> name_len == 0 || off + FS_XATTR_LEN(xe -> name_len, xe -> value_len) > size)
+            break;
+        if (list != NULL) {
+            memcpy(list + len, xe -> name, xe -> name_len);
+            list[len + xe -> name_len] = '\0';
+        }
+        len += xe -> name_len + 1;
+        off += FS_XATTR_LEN(xe -> name_len, xe -> value_len);
+    }
+    return len;
+}
+
+/**
+ * listxattr - list the extended attribute names of a file, each
+ * ended by a NUL.
+ *
+ * Errors:
+ *   -ENOENT   - file does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -ERANGE   - the list is longer than size
+ *   -EIO      - the xattr block failed its checksum
+ *
+ * @param path the file path
+ * @param list buffer for the names
+ * @param size size of the buffer, or 0 to get the list length only
+ * @return the list length if successful, or -error number
+ */
+static int fs_listxattr(const char *path, char *list, size_t size)
+{
+    uint8_t is_real_dir;
+    uint8_t inl[FS_XATTR_INLINE], entries[FS_XATTR_BLOCK_SPACE];
+    int inum, len, rv;
+
+    fs_lock();
+    inum = translate(path, &is_real_dir);
+    if (inum < 0) {
+        fs_unlock();
+        return inum;
+    }
+    if ((rv = xattr_load(get_inode(inum), inl, entries)) < 0) {
+        rv = io_status(rv);
+        fs_unlock();
+        return rv;
+    }
+    fs_unlock();
+    len = xattr_names(inl, FS_XATTR_INLINE, NULL, 0);
+    len = xattr_names(entries, FS_XATTR_BLOCK_SPACE, NULL, len);
+    if (size == 0) {
+        return len;
+    }
+    if (size < len) {
+        return -ERANGE;
+    }
+    len = xattr_names(inl, FS_XATTR_INLINE, list, 0);
+    return xattr_names(entries, FS_XATTR_BLOCK_SPACE, list, len);
+}
+
+/**
+ * removexattr - remove an extended attribute. A file left with no
+ * attributes in its xattr block gives the block up. Removing
+ * XATTR_NAME_COMPRESS from a directory stops it compressing new
+ * files; a file cannot be switched back from extents or compression.
+ *
+ * Errors:
+ *   -ENOENT   - file does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -ENOATTR  - the file has no such attribute
+ *   -EINVAL   - the flag of XATTR_NAME_EXTENTS or XATTR_NAME_COMPRESS
+ *               cannot be cleared
+ *   -EROFS    - path is in a snapshot
+ *   -ENOSPC   - no free block for a copy of a shared xattr block
+ *   -EIO      - the xattr block failed its checksum
+ *
+ * @param path the file path
+ * @param name the attribute name
+ * @return 0 if successful, or -error number
+ */
+static int fs_removexattr(const char *path, const char *name)
+{
+    uint8_t is_real_dir;
+    uint8_t inl[FS_XATTR_INLINE], entries[FS_XATTR_BLOCK_SPACE];
+    int inum, off, end, rv;
+    uint32_t flag;
+
+    if (snap_path(path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    fs_lock();
+    inum = translate(path, &is_real_dir);
+    if (inum < 0) {
+        fs_unlock();
+        return inum;
+    }
+    if ((flag = xattr_flag(name)) != 0) {
+        Inode *in = get_inode(inum);
+        rv = (in -> flags & flag) ? -EINVAL : -ENOATTR;
+        if ((in -> flags & flag) && flag == FS_FL_COMPRESS && S_ISDIR(in -> mode)) {
+            in -> flags &= ~FS_FL_COMPRESS;
+            mark_inode(in);
+            defer_flush_metadata();
+            rv = 0;
+        }
+        fs_unlock();
+        return rv;
+    }
+    if ((rv = xattr_load(get_inode(inum), inl, entries)) < 0) {
+        rv = io_status(rv);
+        fs_unlock();
+        return rv;
+    }
+    if ((off = xattr_find(inl, FS_XATTR_INLINE, name, &end)) >= 0) {
+        xattr_remove(inl, FS_XATTR_INLINE, off);
+    }
+    else if ((off = xattr_find(entries, FS_XATTR_BLOCK_SPACE, name, &end)) >= 0) {
+        xattr_remove(entries, FS_XATTR_BLOCK_SPACE, off);
+    }
+    else {
+        fs_unlock();
+        return -ENOATTR;
+    }
+    rv = io_status(xattr_store(inum, inl, entries));
+    defer_flush_metadata();
+    fs_unlock();
+    return rv;
+}
+
+/**
+ * chmod - change file permissions
+ *
+ * From the command line tool, FS_MODE_EXTENTS or FS_MODE_COMPRESS
+ * in mode does what setting the matching flag attribute does (see
+ * set_mapping_flags). The kernel keeps only the low 12 bits of a
+ * chmod(2) mode, so on a mounted file system the attributes are
+ * the only way.
+ *
+ * Errors:
+ *   -ENOENT   - file does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -EINVAL   - mapping change asked for a file that is not empty,
+ *               or both mappings asked for
+ *   -EROFS    - path is in a snapshot
+ *
+ * @param path the file or directory path
+ * @param mode the mode_t mode value -- see man 'chmod'
+ *   for description
+ * @return 0 if successful, or -error number
+ */
+static int fs_chmod(const char *path, mode_t mode)
+{
+    int inode_idx, rv;
+    uint8_t is_real_dir;
+    Inode* inode_ptr;
+    if (snap_path(path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    fs_lock();
+    inode_idx = translate(path, &is_real_dir);
+    if (inode_idx < 0) {
+        fs_unlock();
+        return inode_idx;
+    }
+    inode_ptr = get_inode(inode_idx);
+    rv = set_mapping_flags(inode_ptr, ((mode & FS_MODE_EXTENTS) ? FS_FL_EXTENTS : 0) |
+                                      ((mode & FS_MODE_COMPRESS) ? FS_FL_COMPRESS : 0));
+    if (rv < 0) {
+        fs_unlock();
+        return rv;
+    }
+    inode_ptr -> mode = (inode_ptr -> mode & S_IFMT) | (mode & 07777);
+    mark_inode(inode_ptr);
+    defer_flush_metadata();
+    fs_unlock();
+    return 0;
+}
+
+/**
+ * utime - change access and modification times.
+ *
+ * Errors:
+ *   -ENOENT   - file does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -EROFS    - path is in a snapshot
+ *
+ * @param path the file or directory path.
+ * @param ut utimbuf - see man 'utime' for description.
+ * @return 0 if successful, or -error number
+ */
+int fs_utime(const char *path, struct utimbuf *ut)
+{
+    int inode_idx;
+    uint8_t is_real_dir;
+    Inode* inode_ptr;
+    if (snap_path(path, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    fs_lock();
+    inode_idx = translate(path, &is_real_dir);
+    if (inode_idx < 0) {
+        fs_unlock();
+        return inode_idx;
+    }
+    inode_ptr = get_inode(inode_idx);
     inode_ptr -> mtime = ut -> modtime;
-    mark_inode(inodes + inode_idx);
-    flush_metadata();
+    mark_inode(inode_ptr);
+    defer_flush_metadata();
+    fs_unlock();
     return 0;
 }
 
+/**
+ * Read data from a file. Runs of contiguous blocks are read with
+ * one device request and holes read as zeros.
+ *
+ * @param inum the file inode number
+ * @param buf the read buffer
+ * @param len the number of bytes to read
+ * @param offset to start reading at
+ * @return number of bytes read, 0 at or past end of file
+ */
+static int read_inode(int inum, char *buf, size_t len, off_t offset)
+{
+    Inode* inode_ptr;
+    int32_t file_size;
+    int32_t size_to_return;
+    uint8_t block_buf[BLOCK_SIZE];
+
+    inode_ptr = get_inode(inum);
+    file_size = inode_ptr -> size;
+    if (offset >= file_size) {
+        return 0;
+    }
+
+    if (offset + len > file_size)
+    	size_to_return = file_size - offset;
+    else
+    	size_to_return = len;
+
+    // inline data needs no device read
+    if (inode_ptr -> flags & FS_FL_INLINE) {
+        memcpy(buf, inline_data(inode_ptr) + offset, size_to_return);
+        return size_to_return;
+    }
+
+    int rest_length = size_to_return;
+    int block_index_nth;
+    int block_offset;
+    int chunk;
+    int real_blk_idx;
+    int run;
+    int buf_idx = 0;
+    block_index_nth = offset / BLOCK_SIZE;
+    block_offset = offset % BLOCK_SIZE;
+
+    // compressed clusters are expanded whole
+    if (inode_ptr -> flags & FS_FL_COMPRESS) {
+        cluster_read(inode_ptr, buf, size_to_return, offset);
+        rest_length = 0;
+    }
+    while (rest_length > 0) {
+    	real_blk_idx = get_blk_run(inode_ptr, block_index_nth,
+                (rest_length + BLOCK_SIZE - 1) / BLOCK_SIZE, &run);
+        //holes read as zeros without touching the device
+        if (real_blk_idx == 0) {
+            chunk = run * BLOCK_SIZE - block_offset;
+            if (chunk > rest_length)
+                chunk = rest_length;
+            memset(buf + buf_idx, 0, chunk);
+            buf_idx += chunk;
+            rest_length -= chunk;
+            block_index_nth += run;
+            block_offset = 0;
+            continue;
+        }
+        //whole blocks of a contiguous run go straight into buf
+        if (block_offset == 0 && rest_length >= BLOCK_SIZE) {
+            if (run > rest_length / BLOCK_SIZE)
+                run = rest_length / BLOCK_SIZE;
+            read_blocks(real_blk_idx, run, (uint8_t*)buf + buf_idx);
+            buf_idx += run * BLOCK_SIZE;
+            rest_length -= run * BLOCK_SIZE;
+            block_index_nth += run;
+            continue;
+        }
+        if (FS_IS_FRAG(real_blk_idx))
+            frag_read(real_blk_idx, block_buf);
+        else
+            read_block(real_blk_idx, block_buf);
+        chunk = BLOCK_SIZE - block_offset;
+        if (chunk > rest_length)
+            chunk = rest_length;
+        memcpy(buf + buf_idx, block_buf + block_offset, chunk);
+        buf_idx += chunk;
+        rest_length -= chunk;
+        block_index_nth++;
+        block_offset = 0;
+    }
+    if (cur_snap == NULL) {
+        da_read(inum, offset, size_to_return, buf);
+    }
+    return size_to_return;
+}
+
 /**
  * read - read data from an open file.
  *
@@ -727,6 +2070,7 @@ int fs_utime(const char *path, struct utimbuf *ut)
  *   -ENOTDIR - component of path not a directory
  *   -EISDIR  - file is a directory
  *   -EIO     - error reading block
+ *   -ESTALE  - file was opened in a snapshot since deleted
  *
  * @param path the path to the file
  * @param buf the read buffer
@@ -738,40 +2082,153 @@ int fs_utime(const char *path, struct utimbuf *ut)
 static int fs_read(const char *path, char *buf, size_t len, off_t offset,
 		    struct fuse_file_info *fi)
 {
-    Inode* inode_ptr = inodes + fi -> fh;
-    int32_t file_size = inode_ptr -> size;
-    int32_t size_to_return;
+    fs_lock();
+    int rv = snap_enter_fh(fi -> fh);
+    if (rv >= 0) {
+        rv = io_status(read_inode(rv, buf, len, offset));
+    }
+    fs_unlock();
+    return rv;
+}
+
+/**
+ * Write data to a file, allocating or buffering blocks for holes.
+ * Runs of contiguous blocks are written with one device request;
+ * partial blocks keep their old bytes.
+ *
+ * @param inum the file inode number
+ * @param buf the buffer to write
+ * @param len the number of bytes to write
+ * @param offset the offset to starting writing at
+ * @return number of bytes written if successful, or -error number
+ */
+static int write_inode(int inum, const char *buf, size_t len, off_t offset)
+{
+    Inode* inode_ptr;
+    int32_t first_block_nth, last_block_nth, needed_blocks, free_blocks;
+    int first_mapped, last_mapped, rv;
     uint8_t block_buf[BLOCK_SIZE];
-    if (fi -> fh < 0)
-        return fi -> fh;
 
-    if (offset >= file_size)
+    if (len == 0) {
         return 0;
+    }
+    if (offset + len > INT32_MAX) {
+        return -EFBIG;
+    }
+    inode_ptr = get_inode(inum);
+
+    // small writes stay in the inode; larger ones move the data out
+    if (inode_ptr -> flags & FS_FL_INLINE) {
+        if (offset + len <= FS_INLINE_MAX) {
+            memcpy(inline_data(inode_ptr) + offset, buf, len);
+            if (offset + len > inode_ptr -> size)
+                inode_ptr -> size = offset + len;
+            mark_inode(inode_ptr);
+            return len;
+        }
+        if (uninline_inode(inode_ptr) < 0) {
+            return -ENOSPC;
+        }
+    }
+    if (inode_ptr -> flags & FS_FL_COMPRESS) {
+        return cluster_write(inum, inode_ptr, buf, len, offset);
+    }
+    //a packed tail is unpacked before it is written or moves inside
+    //the file, and may be packed again at write-back
+    int buffered = delalloc || dedup_blocks || pack_tails;
+    if ((inode_ptr -> flags & FS_FL_TAIL) &&
+        offset + len > (off_t)((inode_ptr -> size - 1) / BLOCK_SIZE) * BLOCK_SIZE &&
+        tail_unpack(inode_ptr, buffered ? inum : -1) == -ENOSPC) {
+        return -ENOSPC;
+    }
 
-    if (offset + len > file_size)
-    	size_to_return = file_size - offset;
-    else
-    	size_to_return = len;
+    //only the partial first and last blocks can need their old bytes
+    first_block_nth = offset / BLOCK_SIZE;
+    last_block_nth = (offset + len - 1) / BLOCK_SIZE;
+    first_mapped = get_blk(inode_ptr, first_block_nth, FALSE) != 0;
+    last_mapped = get_blk(inode_ptr, last_block_nth, FALSE) != 0;
+    //check space up front so a failed write allocates nothing;
+    //holes are only counted when the disk is nearly full
+    free_blocks = sb.free_blocks - da_total;
+    needed_blocks = last_block_nth - first_block_nth + 1;
+    if (free_blocks < needed_blocks + 2 + needed_blocks / PTRS_PER_BLK) {
+        needed_blocks = count_holes(inode_ptr, first_block_nth, last_block_nth);
+        if (needed_blocks > 0 &&
+            free_blocks < needed_blocks + 2 + needed_blocks / PTRS_PER_BLK) {
+            return -ENOSPC;
+        }
+    }
+    //blocks shared with other files get their own copy first
+    if ((rv = unshare_blks(inode_ptr, first_block_nth, last_block_nth)) < 0) {
+        return rv;
+    }
+    //with delayed allocation, holes are filled at write-back instead;
+    //deduplicated writes and packed tails always go through write-back
+    if ((!buffered && (rv = alloc_blks(inode_ptr, first_block_nth, last_block_nth)) < 0) ||
+        ((inode_ptr -> flags & FS_FL_EXTENTS) &&
+         (rv = ext_mark_written(inode_ptr, first_block_nth, last_block_nth)) < 0)) {
+        return rv;
+    }
 
     int rest_length = len;
     int block_index_nth;
     int block_offset;
+    int chunk;
     int real_blk_idx;
+    int run;
     int buf_idx = 0;
-    block_index_nth = offset / BLOCK_SIZE;
+    block_index_nth = first_block_nth;
     block_offset = offset % BLOCK_SIZE;
 
     while (rest_length > 0) {
-    	real_blk_idx = get_blk(inode_ptr, block_index_nth, FALSE);
-        read_block(real_blk_idx, block_buf);
-        for (int k = block_offset; k < BLOCK_SIZE; k++, buf_idx++) {
-            buf[buf_idx] = block_buf[k];
+    	real_blk_idx = get_blk_run(inode_ptr, block_index_nth,
+                (rest_length + BLOCK_SIZE - 1) / BLOCK_SIZE, &run);
+        //unallocated blocks are buffered until write-back
+        if (real_blk_idx == 0) {
+            for (; run > 0 && rest_length > 0; run--) {
+                chunk = BLOCK_SIZE - block_offset;
+                if (chunk > rest_length)
+                    chunk = rest_length;
+                memcpy(da_block(inum, block_index_nth) + block_offset, buf + buf_idx, chunk);
+                buf_idx += chunk;
+                rest_length -= chunk;
+                block_index_nth++;
+                block_offset = 0;
+            }
+            continue;
         }
-        rest_length -= (BLOCK_SIZE - block_offset);
+        //whole blocks of a contiguous run are written from buf directly
+        if (block_offset == 0 && rest_length >= BLOCK_SIZE) {
+            if (run > rest_length / BLOCK_SIZE)
+                run = rest_length / BLOCK_SIZE;
+            write_data_blocks(real_blk_idx, run, (const uint8_t*)buf + buf_idx);
+            buf_idx += run * BLOCK_SIZE;
+            rest_length -= run * BLOCK_SIZE;
+            block_index_nth += run;
+            continue;
+        }
+        chunk = BLOCK_SIZE - block_offset;
+        if (chunk > rest_length)
+            chunk = rest_length;
+        //partial block: keep the bytes around the written range
+        if ((block_index_nth == first_block_nth && first_mapped) ||
+            (block_index_nth == last_block_nth && last_mapped))
+            read_block(real_blk_idx, block_buf);
+        else
+            memset(block_buf, 0, BLOCK_SIZE);
+        memcpy(block_buf + block_offset, buf + buf_idx, chunk);
+        write_data_blocks(real_blk_idx, 1, block_buf);
+        buf_idx += chunk;
+        rest_length -= chunk;
         block_index_nth++;
         block_offset = 0;
     }
-    return size_to_return;
+    if (offset + len > inode_ptr -> size)
+        inode_ptr -> size = offset + len;
+    mark_inode(inode_ptr);
+    if (da_total > DA_MAX_BLOCKS || (!delalloc && buffered))
+        da_writeback(inum);
+    return len;
 }
 
 /**
@@ -784,9 +2241,15 @@ static int fs_read(const char *path, char *buf, size_t len, off_t offset,
  *   -ENOENT  - file does not exist
  *   -ENOTDIR - component of path not a directory
  *   -EISDIR  - file is a directory
- *   -EINVAL  - if 'offset' is greater than current file length.
- *  			(POSIX semantics support the creation of files with
- *  			"holes" in them, but we don't)
+ *   -EFBIG   - write would go past the largest file size
+ *   -ENOSPC  - not enough free blocks
+ *   -EROFS   - file is in a snapshot
+ *   -EIO     - a block of the file failed its checksum
+ *
+ * Writing past the end of the file leaves a hole: blocks that are
+ * never written are not allocated and read back as zeros. Unless
+ * mounted with -sync, data for unallocated blocks is buffered and
+ * only given blocks when written back (see da_writeback).
  *
  * @param path the file path
  * @param buf the buffer to write
@@ -799,59 +2262,27 @@ static int fs_read(const char *path, char *buf, size_t len, off_t offset,
 static int fs_write(const char *path, const char *buf, size_t len,
 		     off_t offset, struct fuse_file_info *fi)
 {
-    Inode* inode_ptr = inodes + (fi -> fh);
-    int32_t addition_size, addition_block_num;
-    int32_t current_block_num, current_max_size;
-    uint8_t block_buf[BLOCK_SIZE+1];
-
-    current_block_num = get_file_block_num(inode_ptr -> size);
-    current_max_size = current_block_num * BLOCK_SIZE;
-    uint32_t old_size = inode_ptr -> size;
-    if (len + offset >= inode_ptr -> size && len + offset < current_max_size) {
-    	inode_ptr -> size = len + offset;
-    }
-    else if (len + offset >= current_max_size) {
-    	//need new allocated space
-    	addition_size = len + offset -  current_max_size;
-        if (addition_size % BLOCK_SIZE == 0)
-        	addition_block_num = addition_size / BLOCK_SIZE;
-        else 
-        	addition_block_num = addition_size / BLOCK_SIZE + 1;
-        get_blk(inode_ptr, addition_block_num + current_block_num - 1, TRUE);
-        inode_ptr -> size = len + offset;
-    }
-
-    int rest_length = len;
-    int block_index_nth;
-    int block_offset;
-    int real_blk_idx;
-    int buf_idx = 0;
-    block_index_nth = offset / BLOCK_SIZE;
-    block_offset = offset % BLOCK_SIZE;
-
-    buf_idx = 0;
-    while (rest_length > 0) {
-    	real_blk_idx = get_blk(inode_ptr, block_index_nth, FALSE);
-        for (int k = block_offset; k < BLOCK_SIZE; k++, buf_idx++) {
-        	block_buf[k] = buf[buf_idx];
-        }
-        write_block(real_blk_idx, block_buf);
-        rest_length -= (BLOCK_SIZE - block_offset);
-        block_index_nth++;
-        block_offset = 0;
+    if (fi -> fh >> 32) {
+        return -EROFS;
     }
-    mark_inode(inode_ptr);
-    flush_metadata();
-    return len;
+    fs_lock();
+    int rv = io_status(write_inode(fi -> fh, buf, len, offset));
+    defer_flush_metadata();
+    fs_unlock();
+    return rv;
 }
 
 /**
- * Open a filesystem file or directory path.
+ * Open a filesystem file or directory path. Files in a snapshot
+ * can only be opened for reading; their handle records the
+ * snapshot.
  *
  * Errors:
  *   -ENOENT  - file does not exist
  *   -ENOTDIR - component of path not a directory
  *   -EISDIR  - file is a directory
+ *   -ELOOP   - file is a symbolic link, which is not followed
+ *   -EROFS   - file in a snapshot opened for writing
  *
  * @param path the path
  * @param fuse file info data
@@ -860,13 +2291,25 @@ static int fs_write(const char *path, const char *buf, size_t len,
 static int fs_open(const char *path, struct fuse_file_info *fi)
 {
     uint8_t is_real_dir;
-    fi -> fh = translate(path, &is_real_dir);
-    if (fi -> fh < 0) {
-        return fi -> fh;
+    uint64_t gen;
+    fs_lock();
+    int inode_idx = translate(path, &is_real_dir);
+    gen = cur_snap != NULL ? cur_snap -> gen : 0;
+    int is_link = inode_idx > 0 && S_ISLNK(get_inode(inode_idx) -> mode);
+    fs_unlock();
+    if (inode_idx < 0) {
+        return inode_idx;
     }
     if (is_real_dir) {
         return -EISDIR;
     }
+    if (is_link) {
+        return -ELOOP;
+    }
+    if (gen != 0 && (fi -> flags & O_ACCMODE) != O_RDONLY) {
+        return -EROFS;
+    }
+    fi -> fh = inode_idx | gen << 32;
     return 0;
 }
 
@@ -887,6 +2330,667 @@ static int fs_release(const char *path, struct fuse_file_info *fi)
     return 0;
 }
 
+/**
+ * flush - called on each close() of an open file, including
+ * read-only and duplicated descriptors.
+ *
+ * Writes back the buffered data of this file only, now that its
+ * dirty range is known. Other files and the metadata are left to
+ * the flush timer, the dirty block threshold and fsync, as after
+ * any other write.
+ *
+ * Errors
+ *   -ENOSPC  - no room for some of the buffered blocks
+ *
+ * @param path the file name
+ * @param fi the fuse file info
+ * @return 0 if successful, or -error number
+ */
+static int fs_flush(const char *path, struct fuse_file_info *fi)
+{
+    if (fi -> fh == 0 || fi -> fh >> 32) {
+        return 0;
+    }
+    fs_lock();
+    int rv = io_status(da_writeback(fi -> fh & 0xffffffff));
+    defer_flush_metadata();
+    fs_unlock();
+    return rv;
+}
+
+/**
+ * fsync - write back all pending metadata and flush the device.
+ *
+ * @param path the file name
+ * @param datasync if non-zero, only user data should be flushed;
+ *   metadata is flushed regardless as file blocks depend on it
+ * @param fi the fuse file info
+ * @return 0 if successful, or -error number
+ */
+static int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    fs_lock();
+    flush_metadata();
+    int rv = disk->ops->flush(disk, 0, n_blocks);
+    fs_unlock();
+    return (rv == SUCCESS) ? 0 : -EIO;
+}
+
+/**
+ * fsyncdir - write back all pending metadata and flush the device.
+ *
+ * @param path the directory path
+ * @param datasync unused
+ * @param fi the fuse file info
+ * @return 0 if successful, or -error number
+ */
+static int fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return fs_fsync(path, datasync, fi);
+}
+
+/**
+ * Preallocate the holes of a pointer-mapped file from block first
+ * to last. Pointers have no room for an unwritten mark, so the new
+ * blocks are filled with zeros.
+ *
+ * @param inode_ptr the file inode
+ * @param first the first 0-based block index
+ * @param last the last 0-based block index
+ * @return 0 if successful, or -error number
+ */
+static int prealloc_ptr_blks(Inode *inode_ptr, int first, int last)
+{
+    static uint8_t zero_buf[BLOCK_SIZE];
+    int n = first, hole_end, rv;
+
+    while (n <= last) {
+        if (get_blk(inode_ptr, n, FALSE) != 0) {
+            n++;
+            continue;
+        }
+        for (hole_end = n; hole_end < last && get_blk(inode_ptr, hole_end + 1, FALSE) == 0; hole_end++)
+            ;
+        if ((rv = alloc_blks(inode_ptr, n, hole_end)) < 0)
+            return rv;
+        for (; n <= hole_end; n++)
+            write_data_blocks(get_blk(inode_ptr, n, FALSE), 1, zero_buf);
+    }
+    return 0;
+}
+
+/**
+ * fallocate - reserve blocks for a range of a file. Reserved blocks
+ * of extent-mapped files are marked unwritten and read as zeros
+ * until written; they are taken from one contiguous run of free
+ * blocks where possible, and a message is printed when no single
+ * run was large enough. Unless FALLOC_FL_KEEP_SIZE is given, the
+ * file grows to cover the range.
+ *
+ * Errors
+ *   -EOPNOTSUPP - mode other than 0 or FALLOC_FL_KEEP_SIZE, or a
+ *                 compressed file
+ *   -EINVAL     - negative offset or non-positive length
+ *   -EFBIG      - range past the largest file size
+ *   -ENOSPC     - not enough free blocks
+ *   -EROFS      - file is in a snapshot
+ *   -EIO        - a block of the file failed its checksum
+ *
+ * @param path the file path
+ * @param mode 0 or FALLOC_FL_KEEP_SIZE
+ * @param offset start of the range
+ * @param len length of the range
+ * @param fi the fuse file info
+ * @return 0 if successful, or -error number
+ */
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t len,
+        struct fuse_file_info *fi)
+{
+    Inode *inode_ptr;
+    int first, last, needed, split = 0, rv;
+
+    if (mode & ~FALLOC_FL_KEEP_SIZE) {
+        return -EOPNOTSUPP;
+    }
+    if (offset < 0 || len <= 0) {
+        return -EINVAL;
+    }
+    if (offset + len > INT32_MAX) {
+        return -EFBIG;
+    }
+    if (fi -> fh >> 32) {
+        return -EROFS;
+    }
+    fs_lock();
+    inode_ptr = get_inode(fi -> fh);
+    if (inode_ptr -> flags & FS_FL_COMPRESS) {
+        fs_unlock();
+        return -EOPNOTSUPP;
+    }
+    first = offset / BLOCK_SIZE;
+    last = (offset + len - 1) / BLOCK_SIZE;
+    if (!(inode_ptr -> flags & FS_FL_EXTENTS) && last >= MAX_PTR_BLOCKS) {
+        fs_unlock();
+        return -EFBIG;
+    }
+
+    if ((inode_ptr -> flags & FS_FL_INLINE) && offset + len > FS_INLINE_MAX &&
+        uninline_inode(inode_ptr) < 0) {
+        fs_unlock();
+        return -ENOSPC;
+    }
+    if (!(inode_ptr -> flags & FS_FL_INLINE)) {
+        //buffered blocks must be placed before ranges are reserved
+        //and a packed tail is given a block of its own
+        da_writeback(fi -> fh);
+        needed = count_holes(inode_ptr, first, last);
+        if (sb.free_blocks - da_total < needed + 2 + needed / PTRS_PER_BLK ||
+            tail_unpack(inode_ptr, -1) == -ENOSPC) {
+            fs_unlock();
+            return -ENOSPC;
+        }
+        if (inode_ptr -> flags & FS_FL_EXTENTS)
+            rv = ext_prealloc(inode_ptr, first, last, &split);
+        else
+            rv = prealloc_ptr_blks(inode_ptr, first, last);
+        if (rv < 0) {
+            defer_flush_metadata();
+            fs_unlock();
+            return rv;
+        }
+        if (split > 0) {
+            fprintf(stderr, "fallocate %s: no contiguous run free, %d extra extent(s) used\n",
+                    path, split);
+        }
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + len > inode_ptr -> size) {
+        inode_ptr -> size = offset + len;
+    }
+    mark_inode(inode_ptr);
+    defer_flush_metadata();
+    rv = io_status(0);
+    fs_unlock();
+    return rv;
+}
+
+/**
+ * lseek - find the next data or hole in a file (SEEK_DATA and
+ * SEEK_HOLE). The FUSE 2 operations table has no lseek, so this is
+ * called directly by the command line tool.
+ *
+ * Errors
+ *   -ENOENT   - file does not exist
+ *   -EISDIR   - file is a directory
+ *   -ENXIO    - offset at or past end of file, or no data after it
+ *   -EINVAL   - whence is not SEEK_DATA or SEEK_HOLE
+ *   -EIO      - a block of the file failed its checksum
+ *
+ * @param path the file path
+ * @param offset the offset to search from
+ * @param whence SEEK_DATA or SEEK_HOLE
+ * @return the offset found, or -error number
+ */
+off_t fs_lseek(const char *path, off_t offset, int whence)
+{
+    uint8_t is_real_dir;
+    Inode *inode_ptr;
+    int n, nblks, run, blk;
+    off_t found;
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+    fs_lock();
+    int inode_idx = translate(path, &is_real_dir);
+    if (inode_idx < 0) {
+        fs_unlock();
+        return inode_idx;
+    }
+    if (is_real_dir) {
+        fs_unlock();
+        return -EISDIR;
+    }
+    inode_ptr = get_inode(inode_idx);
+    if (offset < 0 || offset >= inode_ptr -> size) {
+        fs_unlock();
+        return -ENXIO;
+    }
+    if (cur_snap == NULL) {
+        da_writeback(inode_idx);
+    }
+    // inline files are all data; the end of file counts as a hole
+    found = (whence == SEEK_DATA) ? offset : inode_ptr -> size;
+    if (!(inode_ptr -> flags & FS_FL_INLINE)) {
+        nblks = get_file_block_num(inode_ptr -> size);
+        found = (whence == SEEK_DATA) ? -ENXIO : inode_ptr -> size;
+        for (n = offset / BLOCK_SIZE; n < nblks; n += run) {
+            // compressed files are searched a cluster at a time
+            if (inode_ptr -> flags & FS_FL_COMPRESS) {
+                blk = cluster_mapped(inode_ptr, n / FS_CLUSTER_BLKS);
+                run = FS_CLUSTER_BLKS - n % FS_CLUSTER_BLKS;
+            }
+            else {
+                blk = get_blk_run(inode_ptr, n, nblks - n, &run);
+            }
+            if ((blk != 0) == (whence == SEEK_DATA)) {
+                found = (off_t)n * BLOCK_SIZE;
+                if (found < offset)
+                    found = offset;
+                if (found > inode_ptr -> size)
+                    found = inode_ptr -> size;
+                break;
+            }
+        }
+    }
+    if (n_io_bad > 0) {
+        found = -EIO;
+    }
+    fs_unlock();
+    return found;
+}
+
+/**
+ * Share the blocks of a range of one file with another file,
+ * copy-on-write. Only block-aligned ranges are shared, and only
+ * where the destination range is entirely a hole; the last partial
+ * block is shared when the range ends both files, unless it is a
+ * packed tail. Holes in the source stay holes.
+ *
+ * @param inum_in the source inode number
+ * @param offset_in the offset in the source
+ * @param inum_out the destination inode number
+ * @param offset_out the offset in the destination
+ * @param len the number of bytes, not past the end of the source
+ * @return number of bytes shared from the start of the range
+ */
+static ssize_t reflink_range(int inum_in, off_t offset_in, int inum_out,
+        off_t offset_out, size_t len)
+{
+    Inode *in_ptr = get_inode(inum_in), *out_ptr = get_inode(inum_out);
+    int first_in = offset_in / BLOCK_SIZE, first = offset_out / BLOCK_SIZE;
+    int nblks = len / BLOCK_SIZE, n, run, blk;
+
+    if (offset_in % BLOCK_SIZE || offset_out % BLOCK_SIZE ||
+        (in_ptr -> flags & FS_FL_INLINE) || ((in_ptr -> flags | out_ptr -> flags) & FS_FL_COMPRESS) ||
+        (out_ptr -> flags & FS_FL_TAIL)) {
+        return 0;
+    }
+    if (len % BLOCK_SIZE && offset_in + len == in_ptr -> size &&
+        offset_out + len >= out_ptr -> size) {
+        nblks++;
+    }
+    if (nblks == 0 || (!(out_ptr -> flags & FS_FL_EXTENTS) && first + nblks > MAX_PTR_BLOCKS)) {
+        return 0;
+    }
+    if ((out_ptr -> flags & FS_FL_INLINE) &&
+        (out_ptr -> size > 0 || uninline_inode(out_ptr) < 0)) {
+        return 0;
+    }
+    // preallocated blocks are not holes here
+    for (n = first; n < first + nblks; n += run) {
+        if (out_ptr -> flags & FS_FL_EXTENTS)
+            blk = ext_map(out_ptr, n, &run, NULL);
+        else
+            blk = get_blk_run(out_ptr, n, 1, &run);
+        if (blk != 0)
+            return 0;
+        if (run > first + nblks - n)
+            run = first + nblks - n;
+    }
+    if (sb.free_blocks - da_total < 2 + nblks / PTRS_PER_BLK || refcount_create() < 0) {
+        return 0;
+    }
+
+    for (n = 0; n < nblks; n += run) {
+        blk = get_blk_run(in_ptr, first_in + n, nblks - n, &run);
+        if (blk == 0)
+            continue;
+        // packed tails are copied instead
+        if (FS_IS_FRAG(blk) || share_blk_range(blk, run) < 0)
+            break;
+        if (map_blks(out_ptr, first + n, first + n + run - 1, blk) < 0) {
+            release_blk_range(blk, run);
+            break;
+        }
+    }
+    len = (size_t)n * BLOCK_SIZE < len ? (size_t)n * BLOCK_SIZE : len;
+    if (offset_out + len > out_ptr -> size) {
+        out_ptr -> size = offset_out + len;
+    }
+    mark_inode(out_ptr);
+    return len;
+}
+
+/**
+ * copy_file_range - copy a range of one file to another inside the
+ * file system. Data is copied with large device requests; when
+ * mounted with -reflink, blocks are shared copy-on-write where
+ * possible (see reflink_range), so cloning a file only changes
+ * metadata. The source may be in a snapshot, which restores a file
+ * from it. The FUSE 2 operations table has no copy_file_range, so
+ * this is called directly by the command line tool.
+ *
+ * Errors
+ *   -ENOENT   - a file does not exist
+ *   -EISDIR   - a file is a directory
+ *   -EINVAL   - flags not 0, or overlapping ranges of one file
+ *   -EFBIG    - copy would go past the largest file size
+ *   -ENOSPC   - not enough free blocks
+ *   -EROFS    - destination is in a snapshot
+ *   -EIO      - a block of either file failed its checksum
+ *
+ * @param path_in the source file path
+ * @param offset_in the offset in the source
+ * @param path_out the destination file path
+ * @param offset_out the offset in the destination
+ * @param len the number of bytes to copy
+ * @param flags must be 0
+ * @return number of bytes copied, 0 at end of source, or -error number
+ */
+ssize_t fs_copy_file_range(const char *path_in, off_t offset_in,
+        const char *path_out, off_t offset_out, size_t len, int flags)
+{
+    uint8_t is_dir_in, is_dir_out;
+    ssize_t done = 0, rv;
+    struct snap *snap_in;
+    char *buf;
+
+    if (flags != 0 || offset_in < 0 || offset_out < 0) {
+        return -EINVAL;
+    }
+    if (snap_path(path_out, NULL) != SNAP_PATH_NONE) {
+        return -EROFS;
+    }
+    fs_lock();
+    int inum_in = translate(path_in, &is_dir_in);
+    snap_in = cur_snap;
+    int inum_out = translate(path_out, &is_dir_out);
+    if (inum_in < 0 || inum_out < 0) {
+        fs_unlock();
+        return inum_in < 0 ? inum_in : inum_out;
+    }
+    if (is_dir_in || is_dir_out) {
+        fs_unlock();
+        return -EISDIR;
+    }
+    cur_snap = snap_in;
+    int32_t size = get_inode(inum_in) -> size;
+    cur_snap = NULL;
+    if (offset_in >= size) {
+        fs_unlock();
+        return 0;
+    }
+    if (len > size - offset_in) {
+        len = size - offset_in;
+    }
+    if (snap_in == NULL && inum_in == inum_out &&
+        offset_in < offset_out + len && offset_out < offset_in + len) {
+        fs_unlock();
+        return -EINVAL;
+    }
+    if (offset_out + len > INT32_MAX) {
+        fs_unlock();
+        return -EFBIG;
+    }
+
+    // buffered data must be on disk before it can be shared or replaced
+    if (snap_in == NULL) {
+        da_writeback(inum_in);
+    }
+    da_writeback(inum_out);
+    if (reflink_copies && snap_in == NULL) {
+        done = reflink_range(inum_in, offset_in, inum_out, offset_out, len);
+    }
+    buf = malloc(COPY_CHUNK * BLOCK_SIZE);
+    while (done < len) {
+        size_t chunk = len - done < COPY_CHUNK * BLOCK_SIZE ? len - done : COPY_CHUNK * BLOCK_SIZE;
+        cur_snap = snap_in;
+        chunk = read_inode(inum_in, buf, chunk, offset_in + done);
+        cur_snap = NULL;
+        if (n_io_bad > 0) {
+            if (done == 0)
+                done = -EIO;
+            break;
+        }
+        if (chunk == 0)
+            break;
+        if ((rv = write_inode(inum_out, buf, chunk, offset_out + done)) < 0) {
+            if (done == 0)
+                done = rv;
+            break;
+        }
+        done += rv;
+    }
+    free(buf);
+    defer_flush_metadata();
+    fs_unlock();
+    return done;
+}
+
+/**
+ * scrub - verify every allocated block that has a checksum, from
+ * the first block to the last, at full speed in the calling
+ * thread. Bad blocks are reported with the inode that owns them,
+ * as by the background scrubber (-scrub), whose cursor is left
+ * alone. Not a FUSE operation, so called directly by the command
+ * line tool.
+ *
+ * Errors
+ *   -EINVAL   - the image has no checksums
+ *
+ * @return number of bad blocks found, or -error number
+ */
+int fs_scrub(void)
+{
+    fs_lock();
+    if (csum_map == NULL) {
+        fs_unlock();
+        return -EINVAL;
+    }
+    uint8_t *buf = malloc(COPY_CHUNK * FS_BLOCK_SIZE);
+    uint32_t cursor = 0;
+    int bad = 0;
+    while (cursor < n_blocks) {
+        scrub_batch(&cursor, buf, &bad);
+    }
+    free(buf);
+    fs_unlock();
+    return bad;
+}
+
+/**
+ * dedupe - share identical full data blocks across all regular
+ * files, and fill the dedup index with the rest, so that later
+ * writes with -dedup can share them too. Compressed and inline
+ * files are left alone. Creates the refcount and dedup maps if the
+ * image has none. Not a FUSE operation, so called directly by the
+ * command line tool.
+ *
+ * Errors
+ *   -ENOSPC   - no room for the maps
+ *
+ * @param scanned set to the number of data blocks read
+ * @param ratio set to the number of file data blocks per block
+ *   holding them, after the pass
+ * @return number of blocks freed, or -error number
+ */
+int fs_dedupe(int *scanned, double *ratio)
+{
+    int i, freed = 0;
+    long extra = 0;
+
+    fs_lock();
+    if (dedup_create() < 0) {
+        fs_unlock();
+        return -ENOSPC;
+    }
+    da_writeback_all();
+    *scanned = 0;
+    for (i = 0; i < n_inodes; i++) {
+        if (!FD_ISSET(i, inode_map))
+            continue;
+        struct fs_inode *in = get_inode(i);
+        if (S_ISREG(in -> mode) && !(in -> flags & (FS_FL_INLINE | FS_FL_COMPRESS)))
+            dedup_inode(in, scanned, &freed);
+    }
+    for (i = 0; i < n_blocks; i++)
+        extra += refcount_map[i];
+    *ratio = *scanned > extra ? (double)*scanned / (*scanned - extra) : 1.0;
+    flush_metadata();
+    fs_unlock();
+    return freed;
+}
+
+/**
+ * Directory lookup statistics. Not a FUSE operation, so called
+ * directly by the command line tool.
+ *
+ * @param lookups set to the number of lookups in the live file
+ *   system
+ * @param filtered set to the number of absent names answered by a
+ *   directory filter without reading the directory
+ * @param false_pos set to the number of absent names a filter let
+ *   through
+ * @param builds set to the number of filters built
+ */
+void fs_lookup_stats(long *lookups, long *filtered, long *false_pos, long *builds)
+{
+    fs_lock();
+    *lookups = bloom_lookups;
+    *filtered = bloom_filtered;
+    *false_pos = bloom_false_pos;
+    *builds = bloom_builds;
+    fs_unlock();
+}
+
+/**
+ * Write back the directory block of a batch, if it has one.
+ *
+ * @param dir_inum the directory inode number, or 0
+ * @param entries the directory block
+ */
+static void batch_put_dir(int dir_inum, uint8_t *entries)
+{
+    if (dir_inum > 0) {
+        write_block(get_inode(dir_inum) -> direct[0], entries);
+    }
+}
+
+/**
+ * create_batch - create many regular files with their contents and
+ * modification times, holding the lock once and flushing metadata
+ * once for all of them (see batch.h). Each file is created as by
+ * mknod and written as by write; a file that cannot be written is
+ * removed again. Not a FUSE operation, so called directly by the
+ * command line tool.
+ *
+ * Errors, in the status of each file
+ *   -EINVAL   - path not absolute, or mode not a regular file
+ *   -ENOENT   - parent directory does not exist
+ *   -ENOTDIR  - component of path not a directory
+ *   -EEXIST   - file already exists
+ *   -ENAMETOOLONG - name longer than FS_NAME_MAX
+ *   -ENOSPC   - no free inode, no room in the directory block, or
+ *               no room for the data
+ *   -EIO      - the directory block cannot be read
+ *   -EROFS    - path is in a snapshot
+ *
+ * @param files the files
+ * @param n number of files
+ * @return number of files created
+ */
+int fs_create_batch(struct fs_batch_file *files, int n)
+{
+    char parent_path[MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE];
+    char dir_path[MAX_PATH_TOKEN_NUM*MAX_PATH_TOKEN_SIZE];
+    char name[MAX_PATH_TOKEN_SIZE];
+    uint8_t entries[FS_BLOCK_SIZE];
+    uint8_t is_dir;
+    int i, inum, dir_inum = 0, created = 0, rv;
+    Inode *in;
+
+    fs_lock();
+    dir_path[0] = '\0';
+    for (i = 0; i < n; i++) {
+        struct fs_batch_file *f = &files[i];
+
+        if (f -> path[0] != '/' || f -> path[strlen(f -> path) - 1] == '/' ||
+            !S_ISREG(f -> mode)) {
+            f -> status = -EINVAL;
+            continue;
+        }
+        if (strlen(f -> path) >= sizeof(parent_path)) {
+            f -> status = -ENAMETOOLONG;
+            continue;
+        }
+        if (snap_path(f -> path, NULL) != SNAP_PATH_NONE) {
+            f -> status = -EROFS;
+            continue;
+        }
+        memset(parent_path, '\0', sizeof(parent_path));
+        memset(name, '\0', MAX_PATH_TOKEN_SIZE);
+        get_parent_dir(f -> path, parent_path);
+        strip_dir(f -> path, name);
+
+        //files in the same directory share one read and write of its block
+        if (dir_inum == 0 || strcmp(parent_path, dir_path) != 0) {
+            batch_put_dir(dir_inum, entries);
+            dir_inum = 0;
+            strcpy(dir_path, parent_path);
+            rv = translate(parent_path, &is_dir);
+            if (rv > 0 && !S_ISDIR(get_inode(rv) -> mode)) {
+                rv = -ENOTDIR;
+            }
+            if (rv > 0 && read_block(get_inode(rv) -> direct[0], entries) < 0) {
+                rv = -EIO;
+            }
+            if (rv < 0) {
+                f -> status = rv;
+                dir_path[0] = '\0';
+                continue;
+            }
+            dir_inum = rv;
+        }
+        if (strlen(name) > FS_NAME_MAX) {
+            f -> status = -ENAMETOOLONG;
+            continue;
+        }
+        if (find_in_dir(entries, name) >= 0) {
+            f -> status = -EEXIST;
+            continue;
+        }
+        inum = init_file_inode(f -> mode, get_inode(dir_inum) -> flags);
+        if (inum == 0) {
+            f -> status = -ENOSPC;
+            continue;
+        }
+        if (dir_add(entries, name, inum, FS_DT_REG) == DIR_FULL) {
+            return_inode(inum);
+            f -> status = -ENOSPC;
+            continue;
+        }
+        rv = write_inode(inum, f -> data, f -> len, 0);
+        if (rv < 0) {
+            dir_remove(entries, find_in_dir(entries, name));
+            release_inode(inum);
+            f -> status = io_status(rv);
+            continue;
+        }
+        bloom_note_add(dir_inum, name);
+        in = get_inode(inum);
+        if (f -> mtime != 0) {
+            in -> mtime = f -> mtime;
+        }
+        mark_inode(in);
+        f -> status = 0;
+        created++;
+    }
+    batch_put_dir(dir_inum, entries);
+    flush_metadata();
+    fs_unlock();
+    return created;
+}
+
 /**
  * statfs - get file system statistics.
  * See 'man 2 statfs' for description of 'struct statvfs'.
@@ -900,12 +3004,15 @@ static int fs_release(const char *path, struct fuse_file_info *fi)
  */
 static int fs_statfs(const char *path, struct statvfs *st)
 {
+    fs_lock();
     st->f_bsize = FS_BLOCK_SIZE;
-    st->f_blocks = sb.num_blocks - sb.inode_map_sz - sb.inode_region_sz - sb.block_map_sz - 1;  /* probably want to */
-    st->f_bfree = count_free_blk();            /* change these */
-    st->f_bavail = st->f_bfree;           /* values */
-    st->f_namemax = FS_FILENAME_SIZE - 1;
-
+    st->f_blocks = sb.num_blocks - sb.inode_map_sz - sb.inode_region_sz - sb.block_map_sz - 1;
+    st->f_bfree = sb.free_blocks - da_total;
+    st->f_bavail = st->f_bfree;
+    st->f_files = n_inodes;
+    st->f_ffree = sb.free_inodes;
+    st->f_namemax = FS_NAME_MAX;
+    fs_unlock();
     return 0;
 }
 
@@ -916,6 +3023,7 @@ static int fs_statfs(const char *path, struct statvfs *st)
  */
 struct fuse_operations fs_ops = {
     .init = fs_init,
+    .destroy = fs_destroy,
     .getattr = fs_getattr,
     .opendir = fs_opendir,
     .readdir = fs_readdir,
@@ -925,6 +3033,13 @@ struct fuse_operations fs_ops = {
     .unlink = fs_unlink,
     .rmdir = fs_rmdir,
     .rename = fs_rename,
+    .link = fs_link,
+    .symlink = fs_symlink,
+    .readlink = fs_readlink,
+    .setxattr = fs_setxattr,
+    .getxattr = fs_getxattr,
+    .listxattr = fs_listxattr,
+    .removexattr = fs_removexattr,
     .chmod = fs_chmod,
     .utime = fs_utime,
     .truncate = fs_truncate,
@@ -932,6 +3047,12 @@ struct fuse_operations fs_ops = {
     .read = fs_read,
     .write = fs_write,
     .release = fs_release,
+    .flush = fs_flush,
+    .fsync = fs_fsync,
+    .fsyncdir = fs_fsyncdir,
     .statfs = fs_statfs,
+#if FUSE_VERSION >= 29
+    .fallocate = fs_fallocate,
+#endif
 };
 
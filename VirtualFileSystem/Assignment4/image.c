@@ -91,9 +91,6 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
 {
     struct image_dev *im = dev->private;
 
-    if (offset == 0)
-        printf("ERROR? write to sector 0\n");
-    
     /* to fail a disk we close its file descriptor and set it to -1 */
     if (im->fd == -1)
         return E_UNAVAIL;
@@ -122,6 +119,15 @@ static int image_write(struct blkdev * dev, int offset, int len, void *buf)
  */
 static int image_flush(struct blkdev * dev, int offset, int len)
 {
+    struct image_dev *im = dev->private;
+
+    if (im->fd == -1)
+        return E_UNAVAIL;
+
+    if (fsync(im->fd) < 0) {
+        fprintf(stderr, "flush error on %s: %s\n", im->path, strerror(errno));
+        return E_UNAVAIL;
+    }
     return SUCCESS;
 }
 
@@ -0,0 +1,222 @@
+/*
+ * lz4.h
+ *
+ * A small LZ4 block-format codec for compressed file clusters.
+ * Compression is greedy with a single hash table probe per
+ * position, skipping faster through data that does not match, as
+ * in the reference "fast" mode; it trades ratio for speed.
+ * Decompression checks every length and offset against its
+ * buffers, so damaged data gives an error instead of overrunning.
+ *
+ * Inputs are at most 64 KiB, so match positions fit in 16 bits.
+ */
+
+#ifndef LZ4_H_
+#define LZ4_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_HASH_LOG     12
+#define LZ4_MIN_MATCH    4
+#define LZ4_LAST_LITERALS 5     /* the stream always ends in literals */
+#define LZ4_MF_LIMIT     12     /* no match starts this close to the end */
+#define LZ4_SKIP_TRIGGER 6      /* step grows every 2^6 misses */
+
+/**
+ * Read 4 bytes from any alignment.
+ */
+static uint32_t lz4_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/**
+ * Hash of 4 bytes for the match table.
+ */
+static uint32_t lz4_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/**
+ * Write a length continuation: 255 for every full 255 and then the
+ * remainder.
+ *
+ * @param dst output position
+ * @param end end of output
+ * @param len the length past 15
+ * @return the new output position, or NULL if out of space
+ */
+static uint8_t *lz4_put_len(uint8_t *dst, uint8_t *end, int len)
+{
+    for (; len >= 255; len -= 255) {
+        if (dst >= end)
+            return NULL;
+        *dst++ = 255;
+    }
+    if (dst >= end)
+        return NULL;
+    *dst++ = len;
+    return dst;
+}
+
+/**
+ * Write one sequence: literals, then a match unless mlen is 0.
+ *
+ * @param dst output position
+ * @param end end of output
+ * @param lit the literals
+ * @param nlit number of literals
+ * @param offset distance back to the match
+ * @param mlen match length, at least LZ4_MIN_MATCH, or 0 at the end
+ * @return the new output position, or NULL if out of space
+ */
+static uint8_t *lz4_put_seq(uint8_t *dst, uint8_t *end, const uint8_t *lit, int nlit,
+                            int offset, int mlen)
+{
+    int ml = mlen ? mlen - LZ4_MIN_MATCH : 0;
+    uint8_t *token = dst++;
+    if (token >= end)
+        return NULL;
+    *token = (nlit < 15 ? nlit : 15) << 4 | (ml < 15 ? ml : 15);
+    if (nlit >= 15 && (dst = lz4_put_len(dst, end, nlit - 15)) == NULL)
+        return NULL;
+    if (end - dst < nlit)
+        return NULL;
+    memcpy(dst, lit, nlit);
+    dst += nlit;
+    if (mlen == 0)
+        return dst;
+    if (end - dst < 2)
+        return NULL;
+    *dst++ = offset & 0xff;
+    *dst++ = offset >> 8;
+    if (ml >= 15 && (dst = lz4_put_len(dst, end, ml - 15)) == NULL)
+        return NULL;
+    return dst;
+}
+
+/**
+ * Compress a buffer into LZ4 block format.
+ *
+ * @param src the data, at most 64 KiB
+ * @param n number of bytes
+ * @param dst the output buffer
+ * @param cap size of dst
+ * @return compressed size, or 0 if it does not fit in cap
+ */
+static int lz4_compress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+    uint16_t table[1 << LZ4_HASH_LOG];
+    uint8_t *op = dst, *end = dst + cap;
+    int ip = 0, anchor = 0, misses = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip < n - LZ4_MF_LIMIT) {
+        uint32_t seq = lz4_read32(src + ip);
+        uint32_t h = lz4_hash(seq);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref >= ip || lz4_read32(src + ref) != seq) {
+            ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+            continue;
+        }
+        // extend backwards over literals, then forwards
+        while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+            ip--;
+            ref--;
+        }
+        int mlen = LZ4_MIN_MATCH, limit = n - LZ4_LAST_LITERALS;
+        while (ip + mlen + 8 <= limit) {
+            uint64_t x, y;
+            memcpy(&x, src + ref + mlen, 8);
+            memcpy(&y, src + ip + mlen, 8);
+            if (x != y) {
+                mlen += __builtin_ctzll(x ^ y) >> 3;    /* little-endian */
+                goto matched;
+            }
+            mlen += 8;
+        }
+        while (ip + mlen < limit && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+    matched:
+        if ((op = lz4_put_seq(op, end, src + anchor, ip - anchor, ip - ref, mlen)) == NULL)
+            return 0;
+        ip += mlen;
+        anchor = ip;
+        misses = 0;
+        if (ip < n - LZ4_MF_LIMIT)
+            table[lz4_hash(lz4_read32(src + ip - 2))] = ip - 2;
+    }
+    if ((op = lz4_put_seq(op, end, src + anchor, n - anchor, 0, 0)) == NULL)
+        return 0;
+    return op - dst;
+}
+
+/**
+ * Decompress LZ4 block format.
+ *
+ * @param src the compressed data
+ * @param n its size
+ * @param dst the output buffer
+ * @param cap size of dst
+ * @return decompressed size, or -1 if the data is damaged or does
+ *   not fit in cap
+ */
+static int lz4_decompress(const uint8_t *src, int n, uint8_t *dst, int cap)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    int len, b;
+
+    while (ip < iend) {
+        int token = *ip++;
+        len = token >> 4;
+        if (len == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                len += b = *ip++;
+            } while (b == 255);
+        }
+        if (iend - ip < len || oend - op < len)
+            return -1;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        int offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op - dst)
+            return -1;
+        len = (token & 15) + LZ4_MIN_MATCH;
+        if ((token & 15) == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                len += b = *ip++;
+            } while (b == 255);
+        }
+        if (oend - op < len)
+            return -1;
+        const uint8_t *match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else {
+            while (len-- > 0)
+                *op++ = *match++;
+        }
+    }
+    return op - dst;
+}
+
+#endif /* LZ4_H_ */
@@ -17,11 +17,23 @@
 #include <errno.h>
 #include <limits.h>
 #include <sys/types.h>
+#include <dirent.h>
 #include <fuse.h>
 #include "image.h"
+#include "batch.h"
+#include "overlay.h"
 
 #include "fsx600.h"		/* only for certain constants */
 
+/* SEEK_DATA and SEEK_HOLE are not exposed by every libc by default */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
 /*********** DO NOT MODIFY THIS FILE *************/
 
 // should be defined in string.h but is not on macos
@@ -29,6 +41,12 @@ extern char *strdup(const char* str);
 /**
  * All homework functions accessed through operations structure. */
 extern struct fuse_operations fs_ops;
+extern off_t fs_lseek(const char *path, off_t offset, int whence);
+extern ssize_t fs_copy_file_range(const char *path_in, off_t offset_in,
+        const char *path_out, off_t offset_out, size_t len, int flags);
+extern int fs_scrub(void);
+extern int fs_dedupe(int *scanned, double *ratio);
+extern void fs_lookup_stats(long *lookups, long *filtered, long *false_pos, long *builds);
 
 /**  disk block device */
 struct blkdev *disk;
@@ -37,8 +55,23 @@ struct data {
     char *image_name;
     int   part;
     int   cmd_mode;
+    int   sync_mode;
+    int   extents_mode;
+    int   compress_mode;
+    int   reflink_mode;
+    char *overlay_name;
+    int   scrub_rate;
+    int   dedup_mode;
+    int   tails_mode;
 } _data;
 int homework_part;
+int sync_metadata;
+int extents_default;
+int compress_default;
+int reflink_copies;
+int scrub_rate;
+int dedup_blocks;
+int pack_tails;
 
 /**
  * Constant: maximum path length
@@ -49,6 +82,14 @@ static void help(){
     printf("Arguments:\n");
     printf(" -cmdline : Enter an interactive REPL that provides a filesystem view into the image\n");
     printf(" -image <name.img> : Use the provided image file that contains the filesystem\n");
+    printf(" -sync : Write metadata back after every operation instead of lazily\n");
+    printf(" -extents : Map new files with extents instead of block pointers\n");
+    printf(" -compress : Compress new files\n");
+    printf(" -reflink : Let copies share data blocks copy-on-write instead of copying them\n");
+    printf(" -overlay <name> : Leave the image as it is and write changes to the delta file <name>\n");
+    printf(" -scrub <MB/s> : Verify block checksums in the background at this rate\n");
+    printf(" -dedup : Share identical data blocks when they are written\n");
+    printf(" -tails : Pack the last partial block of files into shared fragment blocks\n");
 //    printf(" -part # : Give either 1, 2 or 3 that correlates to the question in the homework being tested. This will set the homework_part global variable, which may be useful for you as your program runs.\n");
 }
 
@@ -63,6 +104,14 @@ static void help(){
 static struct fuse_opt opts[] = {
     {"-image %s", offsetof(struct data, image_name), 0},
     {"-cmdline", offsetof(struct data, cmd_mode), 1},
+    {"-sync", offsetof(struct data, sync_mode), 1},
+    {"-extents", offsetof(struct data, extents_mode), 1},
+    {"-compress", offsetof(struct data, compress_mode), 1},
+    {"-reflink", offsetof(struct data, reflink_mode), 1},
+    {"-overlay %s", offsetof(struct data, overlay_name), 0},
+    {"-scrub %d", offsetof(struct data, scrub_rate), 0},
+    {"-dedup", offsetof(struct data, dedup_mode), 1},
+    {"-tails", offsetof(struct data, tails_mode), 1},
 // PJG -- temporary
 //    {"-part %d", offsetof(struct data, part), 0},
     FUSE_OPT_END
@@ -82,7 +131,7 @@ static char *strmode(char *buf, int mode)
 {
     int mask = 0400;
     char *str = "rwxrwxrwx", *retval = buf;
-    *buf++ = S_ISDIR(mode) ? 'd' : '-';
+    *buf++ = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : '-';
     for (mask = 0400; mask != 0; str++, mask = mask >> 1)
 	*buf++ = (mask & mode) ? *str : '-';
     *buf++ = 0;
@@ -425,6 +474,119 @@ static int do_rename(char *argv[])
     return fs_ops.rename(p1, p2);
 }
 
+/**
+ * Make a hard link.
+ *
+ * @param argv argv[0] is the existing file, arg[1] is the new
+ *   name, relative to working directory
+ */
+static int do_link(char *argv[])
+{
+    char p1[MAX_PATH], p2[MAX_PATH];
+    full_path(argv[0], p1);
+    full_path(argv[1], p2);
+    return fs_ops.link(p1, p2);
+}
+
+/**
+ * Make a symbolic link.
+ *
+ * @param argv argv[0] is the link target, stored as given, arg[1]
+ *   is the link name, relative to working directory
+ */
+static int do_symlink(char *argv[])
+{
+    char path[MAX_PATH];
+    full_path(argv[1], path);
+    return fs_ops.symlink(argv[0], path);
+}
+
+/**
+ * Print the target of a symbolic link.
+ *
+ * @param argv argv[0] is the link name
+ */
+static int do_readlink(char *argv[])
+{
+    char path[MAX_PATH], target[MAX_PATH];
+    int val;
+    full_path(argv[0], path);
+    if ((val = fs_ops.readlink(path, target, sizeof(target))) == 0) {
+        printf("%s\n", target);
+    }
+    return val;
+}
+
+/**
+ * Set an extended attribute.
+ *
+ * @param argv argv[0] is the file, argv[1] the attribute name and
+ *   argv[2] the value
+ */
+static int do_setxattr(char *argv[])
+{
+    char path[MAX_PATH];
+    full_path(argv[0], path);
+#ifdef __APPLE__
+    return fs_ops.setxattr(path, argv[1], argv[2], strlen(argv[2]), 0, 0);
+#else
+    return fs_ops.setxattr(path, argv[1], argv[2], strlen(argv[2]), 0);
+#endif
+}
+
+/**
+ * Print an extended attribute.
+ *
+ * @param argv argv[0] is the file, argv[1] the attribute name
+ */
+static int do_getxattr(char *argv[])
+{
+    char path[MAX_PATH], value[FS_BLOCK_SIZE];
+    int len;
+    full_path(argv[0], path);
+#ifdef __APPLE__
+    len = fs_ops.getxattr(path, argv[1], value, sizeof(value), 0);
+#else
+    len = fs_ops.getxattr(path, argv[1], value, sizeof(value));
+#endif
+    if (len < 0) {
+        return len;
+    }
+    printf("%.*s\n", len, value);
+    return 0;
+}
+
+/**
+ * List the extended attributes of a file.
+ *
+ * @param argv argv[0] is the file
+ */
+static int do_listxattr(char *argv[])
+{
+    char path[MAX_PATH], list[MAX_PATH];
+    int len, i;
+    full_path(argv[0], path);
+    if ((len = fs_ops.listxattr(path, list, sizeof(list))) < 0) {
+        return len;
+    }
+    for (i = 0; i < len; i += strlen(list + i) + 1) {
+        printf("%s\n", list + i);
+    }
+    return 0;
+}
+
+/**
+ * Remove an extended attribute.
+ *
+ * @param argv argv[0] is the file, argv[1] the attribute name
+ */
+static int do_rmxattr(char *argv[])
+{
+    char path[MAX_PATH];
+    full_path(argv[0], path);
+    return fs_ops.removexattr(path, argv[1]);
+}
+
 /**
  * Make directory.
  *
@@ -501,6 +663,48 @@ static int do_put(char *argv[])
     return (val >= 0) ? 0 : val;
 }
 
+/**
+ * Copy a file from localdir into a filesystem file at an
+ * offset, creating the file if needed. Writing past the end
+ * of the file leaves a hole.
+ *
+ * @param argv arg[0] is local file, argv[1] is
+ *   filesystem file name, argv[2] is the offset
+ */
+static int do_putat(char *argv[])
+{
+    char *outside = argv[0], *inside = argv[1];
+    char path[MAX_PATH];
+    int len, fd, val = 0;
+    off_t offset = strtoll(argv[2], NULL, 0);
+
+    if ((fd = open(outside, O_RDONLY, 0)) < 0) {
+    	return fd;
+    }
+    full_path(inside, path);
+    if ((val = fs_ops.mknod(path, 0777 | S_IFREG, 0)) != 0 && val != -EEXIST) {
+    	close(fd);
+    	return val;
+    }
+
+    struct fuse_file_info info;
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    if ((val = fs_ops.open(path, &info)) != 0) {
+    	close(fd);
+    	return val;
+    }
+    while ((len = read(fd, blkbuf, blksiz)) > 0) {
+    	val = fs_ops.write(path, blkbuf, len, offset, &info);
+    	if (val != len) {
+    		break;
+    	}
+    	offset += len;
+    }
+    close(fd);
+    fs_ops.release(path, &info);
+    return (val >= 0) ? 0 : val;
+}
+
 /**
  * Copy a file from localdir into file system with
  * same name.
@@ -514,6 +718,174 @@ static int do_put1(char *argv[])
     return do_put(args2);
 }
 
+/** most files, and bytes of their data, sent to fs_create_batch at once */
+#define PUTDIR_BATCH_FILES 128
+#define PUTDIR_BATCH_BYTES (4 * 1024 * 1024)
+
+/**
+ * Files read by putdir and not yet created.
+ */
+struct putdir_batch {
+    struct fs_batch_file files[PUTDIR_BATCH_FILES];
+    int    n;           /* files */
+    size_t bytes;       /* bytes of their data */
+    int    created;     /* files created so far */
+    int    dirs;        /* directories created so far */
+};
+
+/**
+ * Create the files of a putdir batch, printing those that fail.
+ *
+ * @param b the batch
+ */
+static void putdir_flush(struct putdir_batch *b)
+{
+    b -> created += fs_create_batch(b -> files, b -> n);
+    for (int i = 0; i < b -> n; i++) {
+        if (b -> files[i].status != 0)
+            printf("error: %s: %s\n", b -> files[i].path, strerror(-b -> files[i].status));
+        free((char*)b -> files[i].path);
+        free((char*)b -> files[i].data);
+    }
+    b -> n = 0;
+    b -> bytes = 0;
+}
+
+/**
+ * Read a local file into a putdir batch, creating the files
+ * already in it first if it is full.
+ *
+ * @param outside the local file
+ * @param inside the file system path
+ * @param st the local file's status
+ * @param b the batch
+ */
+static void putdir_file(const char *outside, const char *inside, struct stat *st,
+                        struct putdir_batch *b)
+{
+    char *data = malloc(st -> st_size > 0 ? st -> st_size : 1);
+    size_t len = 0;
+    ssize_t n = 0;
+    int fd;
+
+    if ((fd = open(outside, O_RDONLY, 0)) < 0) {
+        printf("error: %s: %s\n", outside, strerror(errno));
+        free(data);
+        return;
+    }
+    while (len < (size_t)st -> st_size &&
+           (n = read(fd, data + len, st -> st_size - len)) > 0) {
+        len += n;
+    }
+    close(fd);
+    if (n < 0) {
+        printf("error: %s: %s\n", outside, strerror(errno));
+        free(data);
+        return;
+    }
+    if (b -> n == PUTDIR_BATCH_FILES || (b -> n > 0 && b -> bytes + len > PUTDIR_BATCH_BYTES)) {
+        putdir_flush(b);
+    }
+    struct fs_batch_file *f = &b -> files[b -> n++];
+    f -> path = strdup(inside);
+    f -> mode = S_IFREG | (st -> st_mode & 0777);
+    f -> data = data;
+    f -> len = len;
+    f -> mtime = st -> st_mtime;
+    b -> bytes += len;
+}
+
+/**
+ * Copy the contents of a local directory into a file system
+ * directory: its files first, so that they go to fs_create_batch
+ * together, and then its subdirectories, which are created and
+ * copied in turn. Entries that are neither files nor directories
+ * are skipped.
+ *
+ * @param outside the local directory
+ * @param inside the file system directory, which exists
+ * @param b the batch
+ */
+static void putdir_walk(const char *outside, const char *inside, struct putdir_batch *b)
+{
+    char out_path[MAX_PATH], in_path[MAX_PATH];
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+    int pass, val;
+
+    if ((d = opendir(outside)) == NULL) {
+        printf("error: %s: %s\n", outside, strerror(errno));
+        return;
+    }
+    for (pass = 0; pass < 2; pass++) {
+        rewinddir(d);
+        while ((de = readdir(d)) != NULL) {
+            if (strcmp(de -> d_name, ".") == 0 || strcmp(de -> d_name, "..") == 0)
+                continue;
+            snprintf(out_path, MAX_PATH, "%s/%s", outside, de -> d_name);
+            errno = 0;
+            if (snprintf(in_path, MAX_PATH, "%s/%s", strcmp(inside, "/") == 0 ? "" : inside,
+                         de -> d_name) >= MAX_PATH || lstat(out_path, &st) < 0) {
+                if (pass == 0)
+                    printf("error: %s: %s\n", out_path,
+                           strerror(errno != 0 ? errno : ENAMETOOLONG));
+                continue;
+            }
+            if (pass == 0 && S_ISREG(st.st_mode)) {
+                putdir_file(out_path, in_path, &st, b);
+            }
+            else if (pass == 0 && !S_ISDIR(st.st_mode)) {
+                printf("skipped: %s\n", out_path);
+            }
+            else if (pass == 1 && S_ISDIR(st.st_mode)) {
+                if ((val = fs_ops.mkdir(in_path, 0777)) != 0 && val != -EEXIST) {
+                    printf("error: %s: %s\n", in_path, strerror(-val));
+                    continue;
+                }
+                b -> dirs += val == 0;
+                putdir_walk(out_path, in_path, b);
+            }
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * Copy a local directory tree into the file system, creating the
+ * files in batches with fs_create_batch, with their permissions and
+ * modification times. The file system directory is created if it
+ * does not exist; files already there are left alone and reported.
+ *
+ * @param argv arg[0] is the local directory, argv[1] is the
+ *   file system directory
+ */
+static int do_putdir(char *argv[])
+{
+    char path[MAX_PATH];
+    struct putdir_batch *b;
+    struct stat st;
+    int val;
+
+    if (stat(argv[0], &st) < 0) {
+        return -errno;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        return -ENOTDIR;
+    }
+    full_path(argv[1], path);
+    if ((val = fs_ops.mkdir(path, 0777)) != 0 && val != -EEXIST) {
+        return val;
+    }
+    b = calloc(1, sizeof(*b));
+    b -> dirs = val == 0;
+    putdir_walk(argv[0], path, b);
+    putdir_flush(b);
+    printf("%d files, %d directories created\n", b -> created, b -> dirs);
+    free(b);
+    return 0;
+}
+
 /**
  * Copy a file from filesystem to localdir
  *
@@ -642,6 +1014,178 @@ static int do_truncate(char *argv[])
     return fs_ops.truncate(path, 0);
 }
 
+/**
+ * Truncate or extend file to a length.
+ *
+ * @param argv argv[0] is file name relative
+ *   to current directory, argv[1] is the length
+ */
+static int do_truncate2(char *argv[])
+{
+    char path[MAX_PATH];
+    full_path(argv[0], path);
+    return fs_ops.truncate(path, strtoll(argv[1], NULL, 0));
+}
+
+/**
+ * Reserve space for a range of a file.
+ *
+ * @param argv argv[0] is file name relative to current
+ *   directory, argv[1] is the offset, argv[2] is the length,
+ *   optional argv[3] "keep" keeps the file size
+ */
+static int _fallocate(char *argv[], int mode)
+{
+    char path[MAX_PATH];
+    struct fuse_file_info info;
+    int val;
+
+    full_path(argv[0], path);
+    memset(&info, 0, sizeof(struct fuse_file_info));
+    if ((val = fs_ops.open(path, &info)) != 0) {
+    	return val;
+    }
+    val = fs_ops.fallocate(path, mode, strtoll(argv[1], NULL, 0),
+                           strtoll(argv[2], NULL, 0), &info);
+    fs_ops.release(path, &info);
+    return val;
+}
+
+static int do_fallocate(char *argv[])
+{
+    return _fallocate(argv, 0);
+}
+
+static int do_fallocate_keep(char *argv[])
+{
+    if (strcmp(argv[3], "keep") != 0)
+        return -EINVAL;
+    return _fallocate(argv, FALLOC_FL_KEEP_SIZE);
+}
+
+/**
+ * Print the offset of the next data or hole in a file.
+ *
+ * @param argv argv[0] is file name relative to current
+ *   directory, argv[1] is "data" or "hole", argv[2] is
+ *   the offset to search from
+ */
+static int do_seek(char *argv[])
+{
+    char path[MAX_PATH];
+    int whence;
+    if (strcmp(argv[1], "data") == 0)
+        whence = SEEK_DATA;
+    else if (strcmp(argv[1], "hole") == 0)
+        whence = SEEK_HOLE;
+    else
+        return -EINVAL;
+    full_path(argv[0], path);
+    off_t off = fs_lseek(path, strtoll(argv[2], NULL, 0), whence);
+    if (off >= 0)
+        printf("%lld\n", (long long)off);
+    return off < 0 ? (int)off : 0;
+}
+
+/**
+ * Copy a file within the file system, creating or truncating
+ * the destination. The data never leaves the file system; with
+ * -reflink the copy shares the source blocks.
+ *
+ * @param argv argv[0] is source file, argv[1] is destination
+ *   file, relative to current directory
+ */
+static int do_cp(char *argv[])
+{
+    char p1[MAX_PATH], p2[MAX_PATH];
+    struct stat sb;
+    off_t offset = 0;
+    ssize_t val;
+
+    full_path(argv[0], p1);
+    full_path(argv[1], p2);
+    if ((val = fs_ops.getattr(p1, &sb)) != 0) {
+    	return val;
+    }
+    if ((val = fs_ops.mknod(p2, 0777 | S_IFREG, 0)) == -EEXIST) {
+    	val = fs_ops.truncate(p2, 0);
+    }
+    if (val != 0) {
+    	return val;
+    }
+    while (offset < sb.st_size) {
+    	val = fs_copy_file_range(p1, offset, p2, offset, sb.st_size - offset, 0);
+    	if (val <= 0) {
+    		break;
+    	}
+    	offset += val;
+    }
+    return (val >= 0) ? 0 : val;
+}
+
+/**
+ * Write everything back, then merge the overlay delta file into
+ * the image. The overlay stays in place with an empty delta.
+ *
+ * @param argv unused
+ */
+static int do_merge(char *argv[])
+{
+    int val = fs_ops.fsync("/", 0, NULL);
+    if (val == 0 && overlay_merge(disk) != SUCCESS) {
+        val = _data.overlay_name ? -EIO : -EINVAL;
+    }
+    return val;
+}
+
+/**
+ * Verify the checksums of all blocks in use and print how many
+ * failed; each bad block is reported with its owner.
+ *
+ * @param argv unused
+ */
+static int do_scrub(char *argv[])
+{
+    int bad = fs_scrub();
+    if (bad >= 0)
+        printf("%d bad blocks\n", bad);
+    return bad < 0 ? bad : 0;
+}
+
+/**
+ * Share identical data blocks across all files and print how many
+ * blocks were freed, and the ratio of file data to the blocks
+ * holding it.
+ *
+ * @param argv unused
+ */
+static int do_dedupe(char *argv[])
+{
+    int scanned;
+    double ratio;
+    int freed = fs_dedupe(&scanned, &ratio);
+    if (freed >= 0)
+        printf("%d blocks scanned, %d freed, dedup ratio %.2f\n", scanned, freed, ratio);
+    return freed < 0 ? freed : 0;
+}
+
+/**
+ * Print directory lookup statistics: how many lookups of absent
+ * names the directory filters answered, and their false positive
+ * rate.
+ *
+ * @param argv unused
+ */
+static int do_stats(char *argv[])
+{
+    long lookups, filtered, false_pos, builds;
+    fs_lookup_stats(&lookups, &filtered, &false_pos, &builds);
+    printf("lookups: %ld, absent names filtered: %ld, false positives: %ld (%.1f%%), filters built: %ld\n",
+           lookups, filtered, false_pos,
+           filtered + false_pos > 0 ? 100.0 * false_pos / (filtered + false_pos) : 0.0, builds);
+    return 0;
+}
+
 /**
  * Set access and modification time.
  *
@@ -674,18 +1218,36 @@ static struct {
     {"ls-l", 1, do_lsdashl1, "ls-l <file> - display detailed file info"},
     {"chmod", 2, do_chmod, "chmod <mode> <file> - change permissions"},
     {"rename", 2, do_rename, "rename <oldname> <newname> - rename file"},
+    {"ln", 2, do_link, "ln <file> <newname> - make a hard link"},
+    {"ln-s", 2, do_symlink, "ln-s <target> <name> - make a symbolic link"},
+    {"readlink", 1, do_readlink, "readlink <name> - print the target of a symbolic link"},
+    {"setxattr", 3, do_setxattr, "setxattr <file> <name> <value> - set an extended attribute"},
+    {"getxattr", 2, do_getxattr, "getxattr <file> <name> - print an extended attribute"},
+    {"listxattr", 1, do_listxattr, "listxattr <file> - list extended attributes"},
+    {"rmxattr", 2, do_rmxattr, "rmxattr <file> <name> - remove an extended attribute"},
     {"mkdir", 1, do_mkdir, "mkdir <dir> - create directory"},
     {"rmdir", 1, do_rmdir, "rmdir <dir> - remove directory"},
     {"rm", 1, do_rm, "rm <file> - remove file"},
     {"put", 2, do_put, "put <outside> <inside> - copy a file from localdir into file system"},
     {"put", 1, do_put1, "put <name> - ditto, but keep the same name"},
+    {"putdir", 2, do_putdir, "putdir <outside> <inside> - copy a local directory tree into file system"},
+    {"putat", 3, do_putat, "putat <outside> <inside> <offset> - write a local file into file system at offset"},
     {"get", 2, do_get, "get <inside> <outside> - retrieve a file from file system to local directory"},
     {"get", 1, do_get1, "get <name> - ditto, but keep the same name"},
     {"show", 1, do_show, "show <file> - retrieve and print a file"},
     {"statfs", 0, do_statfs, "statfs - print file system info"},
     {"blksiz", 1, do_blksiz, "blksiz - set read/write block size"},
     {"truncate", 1, do_truncate, "truncate <file> - truncate to zero length"},
+    {"truncate", 2, do_truncate2, "truncate <file> <len> - truncate or extend to len bytes"},
     {"utime", 1, do_utime, "utime <file> - set modified time to current time"},
+    {"fallocate", 3, do_fallocate, "fallocate <file> <offset> <len> - reserve space"},
+    {"fallocate", 4, do_fallocate_keep, "fallocate <file> <offset> <len> keep - ditto, but keep the file size"},
+    {"seek", 3, do_seek, "seek <file> data|hole <offset> - find next data or hole"},
+    {"cp", 2, do_cp, "cp <src> <dst> - copy a file inside the file system"},
+    {"merge", 0, do_merge, "merge - merge the -overlay delta file into the image"},
+    {"scrub", 0, do_scrub, "scrub - verify the checksums of all blocks in use"},
+    {"dedupe", 0, do_dedupe, "dedupe - share identical data blocks across all files"},
+    {"stats", 0, do_stats, "stats - print directory lookup statistics"},
     {0, 0, 0}
 };
 
@@ -808,14 +1370,27 @@ int main(int argc, char **argv)
         help();
         exit(1);
     }
+    if (_data.overlay_name && (disk = overlay_create(disk, _data.overlay_name)) == NULL) {
+        fprintf(stderr, "cannot open delta file '%s'\n", _data.overlay_name);
+        help();
+        exit(1);
+    }
 
 //    homework_part = _data.part;
     homework_part = 2; // PJG
+    sync_metadata = _data.sync_mode;
+    extents_default = _data.extents_mode;
+    compress_default = _data.compress_mode;
+    reflink_copies = _data.reflink_mode;
+    scrub_rate = _data.scrub_rate;
+    dedup_blocks = _data.dedup_mode;
+    pack_tails = _data.tails_mode;
 
     if (_data.cmd_mode) {  /* process interactive commands */
         fs_ops.init(NULL);
         _blksiz(FS_BLOCK_SIZE);
         cmdloop();
+        fs_ops.destroy(NULL);
         return 0;
     }
 
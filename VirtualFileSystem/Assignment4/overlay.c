@@ -0,0 +1,446 @@
+/*
+ * file:        overlay.c
+ * description: copy-on-write overlay block device. Blocks that have
+ *              been written live in a delta file; all others are read
+ *              from the base device, which is not written until the
+ *              delta is merged back into it.
+ *
+ * The delta file is laid out like a snapshot exception store:
+ *   block 0 - header
+ *   then groups of one index block followed by OVL_GROUP data slots.
+ * Entry i of the index block of group g holds 1 + the base block
+ * stored in slot g*OVL_GROUP+i, or 0 if the slot is not used yet.
+ * Slots are used in order, and a slot's data is written before its
+ * index entry.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "blkdev.h"
+
+// should be defined in "string.h" but is not on macos
+extern char* strdup(const char *);
+
+enum {
+    OVL_MAGIC = 0x6f766c31,                     /* delta file magic, "ovl1" */
+    OVL_GROUP = BLOCK_SIZE / sizeof(uint32_t),  /* data slots per index block */
+    OVL_PAGE = 1024                             /* entries per remap table page */
+};
+
+/** delta file header, block 0 */
+struct ovl_header {
+    uint32_t magic;             /* OVL_MAGIC */
+    uint32_t base_blocks;       /* size of the base device */
+    char pad[BLOCK_SIZE - 2 * sizeof(uint32_t)];
+};
+
+/** definition of overlay block device */
+struct overlay_dev {
+    struct blkdev *base;    // device holding blocks not in the delta
+    char *path;             // path to delta file
+    int   fd;               // file descriptor of delta file
+    int   nblks;            // number of blocks in device
+    int   n_slots;          // data slots used in delta file
+    uint32_t **remap;       // 1 + slot of each block, 0 if not in the delta;
+                            // pages of OVL_PAGE entries made on first use
+    uint32_t *index;        // 1 + base block of each slot, as on disk
+    int   index_cap;        // slots index has room for, whole groups
+};
+
+static struct blkdev_ops overlay_ops;
+
+/**
+ * Byte offset of a data slot in the delta file.
+ *
+ * @param slot the slot number
+ */
+static off_t slot_offset(int slot)
+{
+    return (off_t)(1 + (slot / OVL_GROUP) * (OVL_GROUP + 1) + 1 + slot % OVL_GROUP) * BLOCK_SIZE;
+}
+
+/**
+ * Byte offset of the index block of a group of slots.
+ *
+ * @param group the group number
+ */
+static off_t index_offset(int group)
+{
+    return (off_t)(1 + group * (OVL_GROUP + 1)) * BLOCK_SIZE;
+}
+
+/**
+ * Look up the slot holding a block.
+ *
+ * @param ov the overlay
+ * @param blk the block number
+ * @return 1 + the slot number, or 0 if the block is not in the delta
+ */
+static uint32_t ovl_lookup(struct overlay_dev *ov, int blk)
+{
+    uint32_t *page = ov->remap[blk / OVL_PAGE];
+    return page ? page[blk % OVL_PAGE] : 0;
+}
+
+/**
+ * Record the slot holding a block.
+ *
+ * @param ov the overlay
+ * @param blk the block number
+ * @param slot the slot number
+ */
+static void ovl_set(struct overlay_dev *ov, int blk, int slot)
+{
+    uint32_t **page = &ov->remap[blk / OVL_PAGE];
+    if (*page == NULL) {
+        *page = calloc(OVL_PAGE, sizeof(uint32_t));
+    }
+    (*page)[blk % OVL_PAGE] = slot + 1;
+}
+
+/**
+ * Make room in the index for one more group of slots.
+ *
+ * @param ov the overlay
+ */
+static void ovl_grow_index(struct overlay_dev *ov)
+{
+    ov->index = realloc(ov->index, (ov->index_cap + OVL_GROUP) * sizeof(uint32_t));
+    memset(ov->index + ov->index_cap, 0, OVL_GROUP * sizeof(uint32_t));
+    ov->index_cap += OVL_GROUP;
+}
+
+/**
+ * Length of the run of blocks starting at blk that are either all
+ * outside the delta, or in consecutive slots of one group, so that
+ * they can be moved with a single request.
+ *
+ * @param ov the overlay
+ * @param blk the first block number
+ * @param max the largest run wanted
+ * @param slot set to the slot of blk, or -1 if it is not in the delta
+ * @return the run length, at least 1
+ */
+static int ovl_run(struct overlay_dev *ov, int blk, int max, int *slot)
+{
+    int run = 1;
+    *slot = (int)ovl_lookup(ov, blk) - 1;
+    if (*slot < 0) {
+        while (run < max && ovl_lookup(ov, blk + run) == 0)
+            run++;
+    }
+    else {
+        while (run < max && (*slot + run) % OVL_GROUP != 0 &&
+               ovl_lookup(ov, blk + run) == *slot + run + 1)
+            run++;
+    }
+    return run;
+}
+
+/**
+ * Read or write consecutive slots of one group of the delta file.
+ *
+ * @param ov the overlay
+ * @param slot the first slot
+ * @param n number of slots
+ * @param buf the data buffer
+ * @param write 1 to write, 0 to read
+ */
+static void ovl_slot_io(struct overlay_dev *ov, int slot, int n, void *buf, int write)
+{
+    int result = write ? pwrite(ov->fd, buf, n*BLOCK_SIZE, slot_offset(slot)) :
+                         pread(ov->fd, buf, n*BLOCK_SIZE, slot_offset(slot));
+
+    /* as with image files, errors are reported and then we exit */
+    if (result != n*BLOCK_SIZE) {
+        fprintf(stderr, "%s error on %s: %s\n", write ? "write" : "read",
+                ov->path, strerror(errno));
+        assert(0);
+    }
+}
+
+/**
+ * The number of blocks in the block device.
+ *
+ * @param the block device
+ */
+static int overlay_num_blocks(struct blkdev *dev)
+{
+    struct overlay_dev *ov = dev->private;
+    return ov->nblks;
+}
+
+/**
+ * Read blocks, from the delta file where they have been written
+ * and from the base device otherwise.
+ *
+ * @param dev the block device
+ * @param first first block number
+ * @param n number of blocks to read
+ * @param buf the input buffer
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable,
+ *   E_BADADDR if the blocks are out of range
+ */
+static int overlay_read(struct blkdev *dev, int first, int n, void *buf)
+{
+    struct overlay_dev *ov = dev->private;
+    int i, run, slot, rv;
+
+    if (ov->fd == -1) {
+        return E_UNAVAIL;
+    }
+    if (first < 0 || first + n > ov->nblks) {
+        return E_BADADDR;
+    }
+    for (i = 0; i < n; i += run) {
+        run = ovl_run(ov, first + i, n - i, &slot);
+        if (slot < 0) {
+            rv = ov->base->ops->read(ov->base, first + i, run, (char*)buf + i*BLOCK_SIZE);
+            if (rv != SUCCESS)
+                return rv;
+        }
+        else {
+            ovl_slot_io(ov, slot, run, (char*)buf + i*BLOCK_SIZE, 0);
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Write blocks to the delta file. Blocks written for the first
+ * time get the next free slots, and their index entries are written
+ * after the data.
+ *
+ * @param dev the block device
+ * @param first first block number
+ * @param n number of blocks to write
+ * @param buf the output buffer
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable,
+ *   E_BADADDR if the blocks are out of range
+ */
+static int overlay_write(struct blkdev *dev, int first, int n, void *buf)
+{
+    struct overlay_dev *ov = dev->private;
+    int i, run, slot, g, first_slot = ov->n_slots;
+
+    if (ov->fd == -1) {
+        return E_UNAVAIL;
+    }
+    if (first < 0 || first + n > ov->nblks) {
+        return E_BADADDR;
+    }
+    for (i = 0; i < n; i++) {
+        if (ovl_lookup(ov, first + i) == 0) {
+            if (ov->n_slots == ov->index_cap)
+                ovl_grow_index(ov);
+            ov->index[ov->n_slots] = first + i + 1;
+            ovl_set(ov, first + i, ov->n_slots++);
+        }
+    }
+    for (i = 0; i < n; i += run) {
+        run = ovl_run(ov, first + i, n - i, &slot);
+        ovl_slot_io(ov, slot, run, (char*)buf + i*BLOCK_SIZE, 1);
+    }
+    for (g = first_slot / OVL_GROUP; first_slot < ov->n_slots &&
+         g <= (ov->n_slots - 1) / OVL_GROUP; g++) {
+        if (pwrite(ov->fd, ov->index + g*OVL_GROUP, BLOCK_SIZE, index_offset(g)) != BLOCK_SIZE) {
+            fprintf(stderr, "write error on %s: %s\n", ov->path, strerror(errno));
+            assert(0);
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * Flush the delta file; the base device is not written.
+ *
+ * @param dev the block device
+ * @param first first block number
+ * @param n number of blocks to flush
+ * @return SUCCESS if successful, E_UNAVAIL if device unavailable
+ */
+static int overlay_flush(struct blkdev *dev, int first, int n)
+{
+    struct overlay_dev *ov = dev->private;
+
+    if (ov->fd == -1)
+        return E_UNAVAIL;
+
+    if (fsync(ov->fd) < 0) {
+        fprintf(stderr, "flush error on %s: %s\n", ov->path, strerror(errno));
+        return E_UNAVAIL;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Close the block device and the base device under it.
+ *
+ * @param dev the block device
+ */
+static void overlay_close(struct blkdev *dev)
+{
+    struct overlay_dev *ov = dev->private;
+
+    if (ov->fd != -1) {
+        close(ov->fd);
+    }
+    for (int i = 0; i < (ov->nblks + OVL_PAGE - 1) / OVL_PAGE; i++) {
+        free(ov->remap[i]);
+    }
+    free(ov->remap);
+    free(ov->index);
+    free(ov->path);
+    ov->base->ops->close(ov->base);
+    free(ov);
+    dev->private = NULL;        /* crash any attempts to access */
+    free(dev);
+}
+
+/** Operations on this block device */
+static struct blkdev_ops overlay_ops = {
+    .num_blocks = overlay_num_blocks,
+    .read = overlay_read,
+    .write = overlay_write,
+    .flush = overlay_flush,
+    .close = overlay_close
+};
+
+/**
+ * Write the blocks held in the delta file back to the base device
+ * and empty the delta file. Each group of slots is read with one
+ * request and runs of consecutive base blocks are written together.
+ * If this is interrupted the delta is still whole and merging
+ * again finishes the job.
+ *
+ * @param dev the overlay block device
+ * @return SUCCESS, E_UNAVAIL if a device is unavailable, or
+ *   E_BADADDR if dev is not an overlay
+ */
+int overlay_merge(struct blkdev *dev)
+{
+    struct overlay_dev *ov = dev->private;
+    char *buf;
+    int g, i, run, cnt, rv = SUCCESS;
+
+    if (dev->ops != &overlay_ops) {
+        return E_BADADDR;
+    }
+    if (ov->fd == -1) {
+        return E_UNAVAIL;
+    }
+    buf = malloc(OVL_GROUP * BLOCK_SIZE);
+    for (g = 0; g * OVL_GROUP < ov->n_slots && rv == SUCCESS; g++) {
+        uint32_t *index = ov->index + g * OVL_GROUP;
+        cnt = ov->n_slots - g * OVL_GROUP < OVL_GROUP ? ov->n_slots - g * OVL_GROUP : OVL_GROUP;
+        ovl_slot_io(ov, g * OVL_GROUP, cnt, buf, 0);
+        for (i = 0; i < cnt && rv == SUCCESS; i += run) {
+            for (run = 1; i + run < cnt && index[i + run] == index[i] + run; run++)
+                ;
+            rv = ov->base->ops->write(ov->base, index[i] - 1, run, (char*)buf + i*BLOCK_SIZE);
+        }
+    }
+    free(buf);
+    if (rv != SUCCESS || (rv = ov->base->ops->flush(ov->base, 0, ov->nblks)) != SUCCESS) {
+        return rv;
+    }
+
+    // the base now has every block; start an empty delta
+    for (i = 0; i < (ov->nblks + OVL_PAGE - 1) / OVL_PAGE; i++) {
+        free(ov->remap[i]);
+        ov->remap[i] = NULL;
+    }
+    memset(ov->index, 0, ov->index_cap * sizeof(uint32_t));
+    ov->n_slots = 0;
+    if (ftruncate(ov->fd, BLOCK_SIZE) < 0 || fsync(ov->fd) < 0) {
+        fprintf(stderr, "can't empty delta %s: %s\n", ov->path, strerror(errno));
+        return E_UNAVAIL;
+    }
+    return SUCCESS;
+}
+
+/**
+ * Create a copy-on-write overlay on a block device. Writes go to
+ * a delta file and the base device is only read, so it stays as
+ * it was when the overlay was created. An existing delta file is
+ * reopened with the blocks it holds.
+ *
+ * @param base the base block device, closed with the overlay
+ * @param path the path to the delta file
+ * @return the block device or NULL if cannot open or read delta file
+ */
+struct blkdev *overlay_create(struct blkdev *base, char *path)
+{
+    struct blkdev *dev = malloc(sizeof(*dev));
+    struct overlay_dev *ov = calloc(1, sizeof(*ov));
+    struct ovl_header hdr;
+    int g, i;
+
+    if (dev == NULL || ov == NULL)
+        return NULL;
+
+    ov->path = strdup(path);    /* save a copy for error reporting */
+    ov->base = base;
+    ov->nblks = base->ops->num_blocks(base);
+
+    /* open or create delta file */
+    ov->fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (ov->fd < 0) {
+        fprintf(stderr, "can't open delta %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct stat sb;
+    if (fstat(ov->fd, &sb) < 0) {
+        fprintf(stderr, "can't access delta %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (sb.st_size == 0) {
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.magic = OVL_MAGIC;
+        hdr.base_blocks = ov->nblks;
+        if (pwrite(ov->fd, &hdr, BLOCK_SIZE, 0) != BLOCK_SIZE) {
+            fprintf(stderr, "can't write delta %s: %s\n", path, strerror(errno));
+            return NULL;
+        }
+    }
+    else if (pread(ov->fd, &hdr, BLOCK_SIZE, 0) != BLOCK_SIZE ||
+             hdr.magic != OVL_MAGIC || hdr.base_blocks != ov->nblks) {
+        fprintf(stderr, "%s is not a delta for a %d block device\n", path, ov->nblks);
+        return NULL;
+    }
+
+    /* reload the remap table from the index blocks, up to the first free slot */
+    ov->remap = calloc((ov->nblks + OVL_PAGE - 1) / OVL_PAGE, sizeof(uint32_t*));
+    for (g = 0; ; g++) {
+        ovl_grow_index(ov);
+        if (pread(ov->fd, ov->index + g*OVL_GROUP, BLOCK_SIZE, index_offset(g)) <= 0)
+            break;
+        for (i = 0; i < OVL_GROUP && ov->index[ov->n_slots] != 0; i++) {
+            uint32_t blk = ov->index[ov->n_slots] - 1;
+            if (blk >= ov->nblks) {
+                fprintf(stderr, "delta %s: bad block %u in slot %d\n", path, blk, ov->n_slots);
+                return NULL;
+            }
+            ovl_set(ov, blk, ov->n_slots++);
+        }
+        if (i < OVL_GROUP)
+            break;
+    }
+    /* entries past the first free slot are ignored */
+    memset(ov->index + ov->n_slots, 0, (ov->index_cap - ov->n_slots) * sizeof(uint32_t));
+
+    dev->private = ov;
+    dev->ops = &overlay_ops;
+    return dev;
+}
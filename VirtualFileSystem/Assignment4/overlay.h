@@ -0,0 +1,32 @@
+/*
+ * file:        overlay.h
+ */
+
+#ifndef OVERLAY_H_
+#define OVERLAY_H_
+
+#include "blkdev.h"
+
+/**
+ * Create a copy-on-write overlay on a block device. Writes go to
+ * a delta file and the base device is only read, so it stays as
+ * it was when the overlay was created. An existing delta file is
+ * reopened with the blocks it holds.
+ *
+ * @param base the base block device, closed with the overlay
+ * @param path the path to the delta file
+ * @return the block device or NULL if cannot open or read delta file
+ */
+extern struct blkdev *overlay_create(struct blkdev *base, char *path);
+
+/**
+ * Write the blocks held in the delta file back to the base device
+ * and empty the delta file.
+ *
+ * @param dev the overlay block device
+ * @return SUCCESS, E_UNAVAIL if a device is unavailable, or
+ *   E_BADADDR if dev is not an overlay
+ */
+extern int overlay_merge(struct blkdev *dev);
+
+#endif /* OVERLAY_H_ */
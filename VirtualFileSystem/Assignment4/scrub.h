@@ -0,0 +1,248 @@
+/*
+ * scrub.h
+ *
+ * Background scrubber. Mounted with -scrub <MB/s>, a thread walks
+ * the block map from the superblock's scrub cursor, reading
+ * allocated blocks that have a checksum in large sequential
+ * batches and verifying them against the checksum map, so errors
+ * in cold blocks are found before anything depends on them. Each
+ * batch is read under the file system lock, which is released
+ * while the thread sleeps long enough to keep to the rate. The
+ * cursor is saved in the superblock every SCRUB_SAVE_BATCHES
+ * batches and at unmount, so a pass resumes where it stopped.
+ *
+ * Bad blocks are reported with the inode that owns them; they are
+ * left as they are, and reading them still fails with -EIO.
+ */
+
+/**
+ * Check whether the scrubber verifies a block: allocated, with a
+ * checksum.
+ *
+ * @param blk the block number
+ * @return TRUE if the block is verified
+ */
+static int scrub_wanted(uint32_t blk)
+{
+    return FD_ISSET(blk, block_map) && !csum_excluded(blk) && csum_map[blk] != 0;
+}
+
+/** search for the live inodes mapping a block */
+struct scrub_match {
+    uint32_t blk;
+    int      found;
+};
+
+/**
+ * walk_inode_blocks callback for scrub_owner.
+ *
+ * @param blk a block or fragment address of the inode
+ * @param arg the scrub_match
+ */
+static void scrub_match_blk(uint32_t blk, void *arg)
+{
+    struct scrub_match *m = arg;
+    if (FS_IS_FRAG(blk))
+        blk = FS_FRAG_BLK(blk);
+    if (blk == m -> blk)
+        m -> found = TRUE;
+}
+
+/**
+ * Find what a block belongs to. Fixed metadata is named from the
+ * layout; otherwise the allocated inodes are searched for the
+ * first one mapping the block (a data, directory, pointer,
+ * extent or xattr block). A block no live inode maps is kept by a
+ * snapshot, or leaked. The search cannot see past inode and
+ * pointer blocks that fail their own checksums. Slow, but only
+ * called for bad blocks.
+ *
+ * @param blk the block number
+ * @param inum set to the owning inode, or -1
+ * @return a description of the owner
+ */
+static const char *scrub_owner(uint32_t blk, int *inum)
+{
+    struct scrub_match m = {blk, FALSE};
+    int i;
+
+    *inum = -1;
+    if (blk < block_map_base)
+        return "inode map";
+    if (blk < inode_base)
+        return "block map";
+    if (blk < inode_base + sb.inode_region_sz) {
+        *inum = (blk - inode_base) * INODES_PER_BLK;
+        return "inode table";
+    }
+    if (refcount_map != NULL && blk >= sb.refcount_map &&
+        blk < sb.refcount_map + sb.refcount_map_sz)
+        return "refcount map";
+    if (dedup_map != NULL && blk >= sb.dedup_map && blk < sb.dedup_map + sb.dedup_map_sz)
+        return "dedup map";
+    if (frag_map != NULL && blk >= sb.frag_map && blk < sb.frag_map + sb.frag_map_sz)
+        return "fragment map";
+    if (blk == sb.snap_table)
+        return "snapshot table";
+    for (i = 0; i < n_inodes; i++) {
+        if (!FD_ISSET(i, inode_map))
+            continue;
+        walk_inode_blocks(get_inode(i), scrub_match_blk, &m);
+        if (m.found || get_inode(i) -> xattr_blk == blk) {
+            *inum = i;
+            return "inode";
+        }
+    }
+    if (n_io_bad > 0)
+        return "owner unknown, bad inode or pointer blocks";
+    return n_snaps > 0 ? "snapshot" : "no owner";
+}
+
+/**
+ * Report a bad block found by the scrubber, and add it to the list
+ * kept for fs_scrub unless it is already there.
+ *
+ * @param blk the block number
+ */
+static void scrub_report(uint32_t blk)
+{
+    int i, inum;
+    const char *owner = scrub_owner(blk, &inum);
+
+    if (inum < 0)
+        fprintf(stderr, "scrub: block %u fails its checksum (%s)\n", blk, owner);
+    else if (blk >= inode_base && blk < inode_base + sb.inode_region_sz)
+        fprintf(stderr, "scrub: block %u fails its checksum (%s, inodes %d-%d)\n",
+                blk, owner, inum, inum + INODES_PER_BLK - 1);
+    else
+        fprintf(stderr, "scrub: block %u fails its checksum (%s %d)\n", blk, owner, inum);
+
+    for (i = 0; i < n_scrub_bad && scrub_bad[i].blk != blk; i++)
+        ;
+    if (i == n_scrub_bad && n_scrub_bad < SCRUB_BAD_MAX) {
+        scrub_bad[n_scrub_bad].blk = blk;
+        scrub_bad[n_scrub_bad].inum = inum;
+        n_scrub_bad++;
+    }
+}
+
+/**
+ * Verify the next batch of blocks at or after a cursor: up to
+ * COPY_CHUNK blocks starting at the first one wanted, read with one
+ * device request ending at the last one wanted. Blocks in between
+ * that are free or have no checksum are read but not checked.
+ * Caller holds the file system lock.
+ *
+ * @param cursor the block to start from; set past the batch, or to
+ *   n_blocks at the end of the device
+ * @param buf COPY_CHUNK blocks
+ * @param bad incremented for each bad block
+ * @return number of blocks read
+ */
+static int scrub_batch(uint32_t *cursor, uint8_t *buf, int *bad)
+{
+    uint32_t first = *cursor, blk;
+    int i, n;
+
+    while (first < n_blocks && !scrub_wanted(first))
+        first++;
+    if (first >= n_blocks) {
+        *cursor = n_blocks;
+        return 0;
+    }
+    n = n_blocks - first < COPY_CHUNK ? n_blocks - first : COPY_CHUNK;
+    while (!scrub_wanted(first + n - 1))
+        n--;
+    if (disk->ops->read(disk, first, n, buf) < 0) {
+        fprintf(stderr, "scrub: cannot read blocks %u-%u\n", first, first + n - 1);
+        n = 0;
+    }
+    for (i = 0; i < n; i++) {
+        blk = first + i;
+        if (scrub_wanted(blk) && crc32c_block(blk, buf + i * FS_BLOCK_SIZE) != csum_map[blk]) {
+            scrub_report(blk);
+            (*bad)++;
+        }
+    }
+    *cursor = first + (n > 0 ? n : 1);
+    return n;
+}
+
+/**
+ * The scrubber thread. Verifies a batch, then waits for as long as
+ * reading it should take at scrub_rate MB/s, with the file system
+ * lock released. After the last block it reports the pass and
+ * starts again at block 0 SCRUB_IDLE_SEC seconds later.
+ *
+ * @param arg unused
+ * @return unused - returns NULL
+ */
+static void *scrub_thread(void *arg)
+{
+    uint8_t *buf = malloc(COPY_CHUNK * FS_BLOCK_SIZE);
+    struct timespec deadline;
+    int batches = 0, bad = 0, n;
+    long ns;
+
+    fs_lock();
+    if (sb.scrub_cursor >= n_blocks)
+        sb.scrub_cursor = 0;
+    while (!flush_stop) {
+        n = scrub_batch(&sb.scrub_cursor, buf, &bad);
+        if (sb.scrub_cursor >= n_blocks) {
+            scrub_passes++;
+            fprintf(stderr, "scrub: pass %d complete, %d bad blocks\n", scrub_passes, bad);
+            sb.scrub_cursor = 0;
+            bad = 0;
+        }
+        if (++batches % SCRUB_SAVE_BATCHES == 0 || sb.scrub_cursor == 0) {
+            write_block(0, (uint8_t*)&sb);
+        }
+        n_io_bad = 0;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        ns = (long)((double)n * FS_BLOCK_SIZE * 1e9 / ((double)scrub_rate * 1024 * 1024));
+        deadline.tv_sec += ns / 1000000000 + (sb.scrub_cursor == 0 ? SCRUB_IDLE_SEC : 0);
+        deadline.tv_nsec += ns % 1000000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&scrub_cond, &fs_mutex, &deadline);
+    }
+    fs_unlock();
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Start the scrubber if it was asked for and the image has
+ * checksums.
+ */
+static void scrub_start(void)
+{
+    if (scrub_rate <= 0) {
+        return;
+    }
+    if (csum_map == NULL) {
+        fprintf(stderr, "scrub: image has no checksums, not scrubbing\n");
+        return;
+    }
+    scrub_running = TRUE;
+    pthread_create(&scrub_tid, NULL, scrub_thread, NULL);
+}
+
+/**
+ * Stop the scrubber, if running. Caller has set flush_stop and
+ * does not hold the file system lock.
+ */
+static void scrub_stop(void)
+{
+    if (scrub_running) {
+        fs_lock();
+        pthread_cond_signal(&scrub_cond);
+        fs_unlock();
+        pthread_join(scrub_tid, NULL);
+        scrub_running = FALSE;
+    }
+}
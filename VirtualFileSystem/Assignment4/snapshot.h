@@ -0,0 +1,643 @@
+/*
+ * snapshot.h
+ *
+ * Named read-only snapshots of the whole file system, seen under
+ * /.snapshots/<name>. Taking a snapshot writes one table entry; its
+ * blocks are the blocks of the image at that moment. Afterwards,
+ * blocks a snapshot still uses are never changed in place: file
+ * data is moved to new blocks by unshare_blks as for reflinked
+ * blocks, and every other block (inode table, bitmaps, directory,
+ * pointer and extent blocks) is copied out by write_block just
+ * before its first overwrite. Blocks that are not shared with a
+ * snapshot are written and freed as before.
+ *
+ * A snapshot is read through the same code as the live file
+ * system: while cur_snap is set, read_block maps each block to its
+ * copy if it has one and get_inode reads from the snapshot's
+ * inode table.
+ */
+
+#define SNAP_DIR      "/.snapshots"
+#define SNAP_DIR_LEN  (sizeof(SNAP_DIR) - 1)
+
+/** what a path names with respect to the snapshot directory */
+enum {SNAP_PATH_NONE, SNAP_PATH_DIR, SNAP_PATH_ROOT, SNAP_PATH_IN};
+
+/**
+ * Classify a path: outside SNAP_DIR, SNAP_DIR itself, the root of
+ * a snapshot, or a path inside a snapshot. The snapshot need not
+ * exist.
+ *
+ * @param path the path
+ * @param name if not NULL, set to the snapshot name, which must
+ *   have room for FS_FILENAME_SIZE+1 bytes; longer names are cut
+ *   to FS_FILENAME_SIZE characters, which no snapshot has
+ * @return one of SNAP_PATH_*
+ */
+static int snap_path(const char *path, char *name)
+{
+    const char *p = path + SNAP_DIR_LEN, *end;
+    if (strncmp(path, SNAP_DIR, SNAP_DIR_LEN) != 0 || (*p != '\0' && *p != '/')) {
+        return SNAP_PATH_NONE;
+    }
+    while (*p == '/')
+        p++;
+    if (*p == '\0') {
+        return SNAP_PATH_DIR;
+    }
+    for (end = p; *end != '\0' && *end != '/'; end++)
+        ;
+    if (name != NULL) {
+        int len = end - p < FS_FILENAME_SIZE ? end - p : FS_FILENAME_SIZE;
+        memcpy(name, p, len);
+        name[len] = '\0';
+    }
+    while (*end == '/')
+        end++;
+    return *end == '\0' ? SNAP_PATH_ROOT : SNAP_PATH_IN;
+}
+
+/**
+ * Find a snapshot by name.
+ *
+ * @param name the snapshot name
+ * @return the snapshot, or NULL if there is none
+ */
+static struct snap *snap_find(const char *name)
+{
+    for (int i = 0; i < FS_SNAP_MAX; i++) {
+        if (snaps[i] != NULL && strcmp(snap_table[i].name, name) == 0)
+            return snaps[i];
+    }
+    return NULL;
+}
+
+/**
+ * Switch to the view of the snapshot a path is in, if any, and
+ * strip /.snapshots/<name> from the path.
+ *
+ * @param path the path
+ * @return the path within the view, or NULL if the path names a
+ *   snapshot that does not exist or the snapshot directory itself
+ */
+static const char *snap_enter(const char *path)
+{
+    char name[FS_FILENAME_SIZE + 1];
+    const char *rest = path + SNAP_DIR_LEN;
+
+    cur_snap = NULL;
+    switch (snap_path(path, name)) {
+    case SNAP_PATH_NONE:
+        return path;
+    case SNAP_PATH_DIR:
+        return NULL;
+    }
+    if ((cur_snap = snap_find(name)) == NULL) {
+        return NULL;
+    }
+    while (*rest == '/')
+        rest++;
+    rest = strchr(rest, '/');
+    return rest != NULL ? rest : "/";
+}
+
+/**
+ * Switch to the view an open file handle was opened in.
+ *
+ * @param fh the file handle: inode number, and the snapshot
+ *   generation in the upper 32 bits or 0 for the live file system
+ * @return the inode number, or -ESTALE if the snapshot is gone
+ */
+static int snap_enter_fh(uint64_t fh)
+{
+    uint32_t gen = fh >> 32;
+    cur_snap = NULL;
+    for (int i = 0; gen != 0 && i < FS_SNAP_MAX; i++) {
+        if (snaps[i] != NULL && snaps[i] -> gen == gen)
+            cur_snap = snaps[i];
+    }
+    if (gen != 0 && cur_snap == NULL) {
+        return -ESTALE;
+    }
+    return (int)(fh & 0xffffffff);
+}
+
+/**
+ * Fill in a stat struct for the snapshot directory, which is
+ * read-only and changes when a snapshot is taken.
+ *
+ * @param st pointer to stat struct
+ */
+static void snap_stat_dir(struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st -> st_mode = S_IFDIR | 0555;
+    st -> st_nlink = 1;
+    for (int i = 0; i < FS_SNAP_MAX; i++) {
+        if (snaps[i] != NULL && snap_table[i].ctime > (st -> st_mtimespec).tv_sec)
+            (st -> st_mtimespec).tv_sec = snap_table[i].ctime;
+    }
+    st -> st_ctimespec = st -> st_mtimespec;
+}
+
+/**
+ * List the snapshot directory: one directory per snapshot, with
+ * the attributes of the snapshot's root directory.
+ *
+ * @param ptr  filler buf pointer
+ * @param filler filler function to call for each entry
+ */
+static void snap_readdir(void *ptr, fuse_fill_dir_t filler)
+{
+    struct stat st;
+    for (int i = 0; i < FS_SNAP_MAX; i++) {
+        if (snaps[i] == NULL)
+            continue;
+        cur_snap = snaps[i];
+        stat_inode(root_inode, &st);
+        filler(ptr, snap_table[i].name, &st, 0);
+    }
+    cur_snap = NULL;
+}
+
+/**
+ * Find the copy of a block in a snapshot.
+ *
+ * @param s the snapshot
+ * @param blk the block number as seen by the snapshot
+ * @return the block holding its contents
+ */
+static uint32_t snap_remap(struct snap *s, uint32_t blk)
+{
+    if (blk >= n_blocks || !FD_ISSET(blk, s -> copied)) {
+        return blk;
+    }
+    for (int h = blk & (s -> hcap - 1); ; h = (h + 1) & (s -> hcap - 1)) {
+        if (s -> orig[s -> hash[h]] == blk)
+            return s -> copy[s -> hash[h]];
+    }
+}
+
+/**
+ * Tell whether a snapshot still uses a block in place, so that the
+ * block may not be changed or freed.
+ *
+ * @param blk the block number
+ * @return TRUE if some snapshot uses the block
+ */
+static int snap_holds(uint32_t blk)
+{
+    for (int i = 0; i < FS_SNAP_MAX; i++) {
+        struct snap *s = snaps[i];
+        if (s != NULL && FD_ISSET(blk, s -> bmap) && !FD_ISSET(blk, s -> copied))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/**
+ * Write a block of snapshot bookkeeping. These blocks belong to no
+ * view, so they bypass the copy-out in write_block.
+ *
+ * @param blk the block number
+ * @param buf the block contents
+ */
+static void snap_write_raw(uint32_t blk, const void *buf)
+{
+    if (disk->ops->write(disk, blk, 1, (void*)buf) < 0) {
+        printf("block writing error %u\n", blk);
+        exit(1);
+    }
+    csum_set(blk, 1, buf, FALSE);
+}
+
+/**
+ * Write the snapshot table block.
+ */
+static void snap_write_table(void)
+{
+    uint8_t buf[FS_BLOCK_SIZE];
+    memset(buf, 0, FS_BLOCK_SIZE);
+    memcpy(buf, snap_table, sizeof(snap_table));
+    snap_write_raw(sb.snap_table, buf);
+}
+
+/**
+ * Record an exception in memory.
+ *
+ * @param s the snapshot
+ * @param orig the block as seen by the snapshot
+ * @param copy the block holding its contents
+ */
+static void snap_add_exc_mem(struct snap *s, uint32_t orig, uint32_t copy)
+{
+    int i, h;
+    if (s -> n_exc == s -> cap) {
+        s -> cap = s -> cap ? 2 * s -> cap : 64;
+        s -> orig = realloc(s -> orig, s -> cap * sizeof(uint32_t));
+        s -> copy = realloc(s -> copy, s -> cap * sizeof(uint32_t));
+    }
+    s -> orig[s -> n_exc] = orig;
+    s -> copy[s -> n_exc] = copy;
+    s -> n_exc++;
+    FD_SET(orig, s -> copied);
+
+    // keep the index at most half full
+    if (2 * s -> n_exc > s -> hcap) {
+        free(s -> hash);
+        s -> hcap = s -> hcap ? 2 * s -> hcap : 128;
+        s -> hash = malloc(s -> hcap * sizeof(int));
+        memset(s -> hash, 0xff, s -> hcap * sizeof(int));
+        i = 0;
+    }
+    else {
+        i = s -> n_exc - 1;
+    }
+    for (; i < s -> n_exc; i++) {
+        for (h = s -> orig[i] & (s -> hcap - 1); s -> hash[h] >= 0; h = (h + 1) & (s -> hcap - 1))
+            ;
+        s -> hash[h] = i;
+    }
+}
+
+/**
+ * Record an exception, appending it to the snapshot's chain of
+ * exception blocks on disk. A new exception block is written
+ * before it is linked into the chain.
+ *
+ * @param s the snapshot
+ * @param orig the block as seen by the snapshot
+ * @param copy the block holding its contents
+ * @return 0 if successful, or -ENOSPC if the chain could not grow
+ */
+static int snap_add_exc(struct snap *s, uint32_t orig, uint32_t copy)
+{
+    if (s -> tail_blk == 0 || s -> tail.count == FS_SNAP_EXC_PER_BLK) {
+        struct fs_snap_exc new_tail;
+        uint32_t blk = get_free_blk_near(copy);
+        if (blk == 0) {
+            return -ENOSPC;
+        }
+        memset(&new_tail, 0, sizeof(new_tail));
+        new_tail.e[0].orig = orig;
+        new_tail.e[0].copy = copy;
+        new_tail.count = 1;
+        snap_write_raw(blk, &new_tail);
+        if (s -> tail_blk != 0) {
+            s -> tail.next = blk;
+            snap_write_raw(s -> tail_blk, &s -> tail);
+        }
+        else {
+            snap_table[s -> slot].exc_blk = blk;
+            snap_write_table();
+        }
+        s -> tail = new_tail;
+        s -> tail_blk = blk;
+    }
+    else {
+        s -> tail.e[s -> tail.count].orig = orig;
+        s -> tail.e[s -> tail.count].copy = copy;
+        s -> tail.count++;
+        snap_write_raw(s -> tail_blk, &s -> tail);
+    }
+    snap_add_exc_mem(s, orig, copy);
+    return 0;
+}
+
+/**
+ * Tell whether a block must be copied out before it is written.
+ * The superblock and the refcount, checksum and dedup maps are not
+ * part of snapshots.
+ *
+ * @param blk the block number
+ * @return TRUE if some snapshot uses the block in place
+ */
+static int snap_needs_copy(uint32_t blk)
+{
+    if (blk == 0 || blk >= n_blocks ||
+        (blk >= sb.refcount_map && blk < sb.refcount_map + sb.refcount_map_sz) ||
+        (blk >= sb.csum_map && blk < sb.csum_map + sb.csum_map_sz) ||
+        (blk >= sb.dedup_map && blk < sb.dedup_map + sb.dedup_map_sz) ||
+        (blk >= sb.frag_map && blk < sb.frag_map + sb.frag_map_sz)) {
+        return FALSE;
+    }
+    return snap_holds(blk);
+}
+
+/**
+ * Copy out blocks that snapshots still use before they are
+ * overwritten. One copy serves every snapshot using a block.
+ *
+ * @param first the first block about to be written
+ * @param n number of blocks
+ */
+static void snap_preserve(uint32_t first, int n)
+{
+    uint8_t buf[FS_BLOCK_SIZE];
+    uint32_t b, copy;
+    int i;
+
+    for (b = first; b < first + n; b++) {
+        if (!snap_needs_copy(b))
+            continue;
+        if ((copy = get_free_blk_near(b)) == 0) {
+            fprintf(stderr, "snapshot: no space to keep block %u, snapshots see new contents\n", b);
+            continue;
+        }
+        if (disk->ops->read(disk, b, 1, buf) < 0) {
+            printf("block reading error %u\n", b);
+            exit(1);
+        }
+        snap_write_raw(copy, buf);
+        for (i = 0; i < FS_SNAP_MAX; i++) {
+            struct snap *s = snaps[i];
+            if (s == NULL || !FD_ISSET(b, s -> bmap) || FD_ISSET(b, s -> copied))
+                continue;
+            if (snap_add_exc(s, b, copy) < 0)
+                fprintf(stderr, "snapshot %s: no space to record block %u\n", snap_table[i].name, b);
+        }
+    }
+}
+
+/**
+ * Copy out every dirty metadata block a snapshot still uses. This
+ * runs before a flush writes them, since taking copies dirties
+ * more of the block map, which may need copying in turn.
+ */
+static void snap_preserve_dirty(void)
+{
+    int i, again = TRUE;
+    while (again) {
+        again = FALSE;
+        for (i = 0; i < dirty_len; i++) {
+            if (dirty[i] != NULL && snap_needs_copy(i)) {
+                snap_preserve(i, 1);
+                again = TRUE;
+            }
+        }
+        for (i = 0; i < icache_nslots; i++) {
+            if (icache[i].blk >= 0 && icache[i].dirty && snap_needs_copy(inode_base + icache[i].blk)) {
+                snap_preserve(inode_base + icache[i].blk, 1);
+                again = TRUE;
+            }
+        }
+    }
+}
+
+/**
+ * Return a pointer to an inode of the current snapshot view. The
+ * pointer stays valid until SNAP_ICACHE_SLOTS-1 other inode blocks
+ * of snapshots have been used.
+ *
+ * @param inum the inode number
+ * @return pointer to the inode
+ */
+static struct fs_inode *snap_get_inode(int inum)
+{
+    int blk = inum / INODES_PER_BLK, i;
+
+    assert(inum >= 0 && inum < n_inodes);
+    for (i = 0; i < SNAP_ICACHE_SLOTS; i++) {
+        if (snap_icache[i].s == cur_snap && snap_icache[i].blk == blk)
+            return snap_icache[i].inodes + inum % INODES_PER_BLK;
+    }
+    i = snap_icache_next;
+    snap_icache_next = (snap_icache_next + 1) % SNAP_ICACHE_SLOTS;
+    // a block that fails its checksum is not kept
+    snap_icache[i].s = read_block(inode_base + blk, (uint8_t*)snap_icache[i].inodes) < 0 ?
+        NULL : cur_snap;
+    snap_icache[i].blk = blk;
+    return snap_icache[i].inodes + inum % INODES_PER_BLK;
+}
+
+/**
+ * Set up the in-memory state of a snapshot in a table slot.
+ *
+ * @param slot the table slot
+ * @return the snapshot, with no exceptions and an empty block map
+ */
+static struct snap *snap_alloc(int slot)
+{
+    struct snap *s = calloc(1, sizeof(struct snap));
+    s -> gen = ++snap_gen;
+    s -> slot = slot;
+    s -> bmap = calloc(sb.block_map_sz, FS_BLOCK_SIZE);
+    s -> copied = calloc(sb.block_map_sz, FS_BLOCK_SIZE);
+    if (snap_icache == NULL) {
+        snap_icache = calloc(SNAP_ICACHE_SLOTS, sizeof(struct snap_icache_slot));
+    }
+    snaps[slot] = s;
+    n_snaps++;
+    return s;
+}
+
+/**
+ * Release the in-memory state of a snapshot.
+ *
+ * @param s the snapshot
+ */
+static void snap_free(struct snap *s)
+{
+    for (int i = 0; i < SNAP_ICACHE_SLOTS; i++) {
+        if (snap_icache[i].s == s)
+            snap_icache[i].s = NULL;
+    }
+    snaps[s -> slot] = NULL;
+    n_snaps--;
+    free(s -> bmap);
+    free(s -> copied);
+    free(s -> orig);
+    free(s -> copy);
+    free(s -> hash);
+    free(s);
+}
+
+/**
+ * Load the snapshot table and the exceptions of each snapshot at
+ * mount. A snapshot's block map is its view of the block map.
+ */
+static void snap_load(void)
+{
+    struct fs_snap_exc exc;
+    uint8_t buf[FS_BLOCK_SIZE];
+    uint32_t blk;
+
+    if (sb.snap_table == 0) {
+        return;
+    }
+    read_block(sb.snap_table, buf);
+    memcpy(snap_table, buf, sizeof(snap_table));
+    for (int i = 0; i < FS_SNAP_MAX; i++) {
+        if (snap_table[i].name[0] == '\0')
+            continue;
+        struct snap *s = snap_alloc(i);
+        for (blk = snap_table[i].exc_blk; blk != 0; blk = exc.next) {
+            read_block(blk, (uint8_t*)&exc);
+            for (int j = 0; j < exc.count && j < FS_SNAP_EXC_PER_BLK; j++)
+                snap_add_exc_mem(s, exc.e[j].orig, exc.e[j].copy);
+            s -> tail_blk = blk;
+            s -> tail = exc;
+        }
+        cur_snap = s;
+        read_blocks(block_map_base, sb.block_map_sz, (uint8_t*)s -> bmap);
+        cur_snap = NULL;
+    }
+}
+
+/**
+ * Take a snapshot of the file system as it is now. Pending
+ * metadata and buffered data are written first; after that only
+ * the table entry is written, however large the file system.
+ *
+ * Errors
+ *   -ENAMETOOLONG - name longer than FS_FILENAME_SIZE-1 characters
+ *   -EEXIST  - a snapshot with the name exists
+ *   -ENOSPC  - FS_SNAP_MAX snapshots exist, or no block for the table
+ *
+ * @param name the snapshot name
+ * @return 0 if successful, or -error number
+ */
+static int snap_create(const char *name)
+{
+    int slot, len = strlen(name);
+    uint32_t blk;
+
+    if (len >= FS_FILENAME_SIZE) {
+        return -ENAMETOOLONG;
+    }
+    if (snap_find(name) != NULL) {
+        return -EEXIST;
+    }
+    for (slot = 0; slot < FS_SNAP_MAX && snaps[slot] != NULL; slot++)
+        ;
+    if (slot == FS_SNAP_MAX) {
+        return -ENOSPC;
+    }
+    if (sb.snap_table == 0) {
+        if ((blk = get_free_blk()) == 0) {
+            return -ENOSPC;
+        }
+        memset(snap_table, 0, sizeof(snap_table));
+        sb.snap_table = blk;
+        snap_write_table();
+        write_block(0, (uint8_t*)&sb);
+    }
+
+    // the snapshot is the image as it is on disk after this
+    flush_metadata();
+    struct snap *s = snap_alloc(slot);
+    memcpy(s -> bmap, block_map, sb.block_map_sz * FS_BLOCK_SIZE);
+    memset(&snap_table[slot], 0, sizeof(struct fs_snapshot));
+    strcpy(snap_table[slot].name, name);
+    snap_table[slot].ctime = time(NULL);
+    snap_write_table();
+    return 0;
+}
+
+/**
+ * Delete a snapshot. The block map is then rebuilt, which frees the
+ * blocks that only this snapshot used.
+ *
+ * Errors
+ *   -ENOENT  - no snapshot with the name
+ *
+ * @param name the snapshot name
+ * @return 0 if successful, or -error number
+ */
+static int snap_delete(const char *name)
+{
+    struct snap *s = snap_find(name);
+    if (s == NULL) {
+        return -ENOENT;
+    }
+    // the rebuild reads inodes from disk
+    flush_metadata();
+    memset(&snap_table[s -> slot], 0, sizeof(struct fs_snapshot));
+    snap_write_table();
+    snap_free(s);
+    rebuild_maps(FALSE);
+    flush_metadata();
+    return 0;
+}
+
+/** state of the walk over one snapshot in a block map rebuild */
+struct snap_walk {
+    struct rebuild_range r; /* block map being rebuilt */
+    fd_set *held;           /* blocks the snapshot uses in place */
+};
+
+/**
+ * Mark a block reached in a snapshot view in use. Blocks with an
+ * exception are represented by their copy, which is marked anyway.
+ * A packed tail marks its whole fragment block.
+ *
+ * @param blk the block number or fragment address as seen by the
+ *   snapshot
+ * @param arg the snap_walk
+ */
+static void snap_mark_blk(uint32_t blk, void *arg)
+{
+    struct snap_walk *w = arg;
+    if (FS_IS_FRAG(blk)) {
+        blk = FS_FRAG_BLK(blk);
+    }
+    if (blk < n_blocks && FD_ISSET(blk, cur_snap -> copied)) {
+        return;
+    }
+    rebuild_mark_blk(blk, &w -> r);
+    if (blk < n_blocks) {
+        FD_SET(blk, w -> held);
+    }
+}
+
+/**
+ * Mark the blocks of all snapshots in a block map being rebuilt:
+ * the table, exception blocks and copies, and every block reached
+ * from the inodes of each snapshot. Each snapshot's block map is
+ * then cut down to the blocks it was found to use in place.
+ *
+ * @param new_map the block map being rebuilt
+ */
+static void snap_mark_blocks(fd_set *new_map)
+{
+    fd_set *imap = malloc(sb.inode_map_sz * FS_BLOCK_SIZE);
+    struct fs_snap_exc exc;
+    struct snap_walk w = {{0, 0, new_map, NULL}, NULL};
+    uint32_t blk;
+    int i, j;
+
+    if (sb.snap_table != 0) {
+        FD_SET(sb.snap_table, new_map);
+    }
+    for (i = 0; i < FS_SNAP_MAX; i++) {
+        struct snap *s = snaps[i];
+        if (s == NULL)
+            continue;
+        for (blk = snap_table[i].exc_blk; blk != 0; blk = exc.next) {
+            rebuild_mark_blk(blk, &w.r);
+            read_block(blk, (uint8_t*)&exc);
+        }
+        for (j = 0; j < s -> n_exc; j++) {
+            rebuild_mark_blk(s -> copy[j], &w.r);
+        }
+
+        w.held = calloc(sb.block_map_sz, FS_BLOCK_SIZE);
+        for (j = 0; j < inode_base + sb.inode_region_sz; j++) {
+            FD_SET(j, w.held);
+        }
+        cur_snap = s;
+        read_blocks(inode_map_base, sb.inode_map_sz, (uint8_t*)imap);
+        for (j = 0; j < n_inodes; j++) {
+            if (FD_ISSET(j, imap)) {
+                struct fs_inode in = *get_inode(j);
+                walk_inode_blocks(&in, snap_mark_blk, &w);
+                if (in.xattr_blk != 0)
+                    snap_mark_blk(in.xattr_blk, &w);
+            }
+        }
+        cur_snap = NULL;
+        free(s -> bmap);
+        s -> bmap = w.held;
+    }
+    free(imap);
+}
@@ -0,0 +1,249 @@
+/*
+ * tail.h
+ *
+ * Tail packing. Mounted with -tails, the last partial block of a
+ * pointer-mapped file is stored at write-back in just enough
+ * FS_FRAG_SIZE-byte fragments of a fragment block shared with the
+ * tails of other files (see fsx600.h), instead of in a block of
+ * its own. Tails written one after another go to the same block,
+ * so a directory of small files is packed densely and read with
+ * few distinct blocks.
+ *
+ * A packed tail is only ever the last block of its file, marked by
+ * FS_FL_TAIL. It is read in place; anything that would write it or
+ * change the file size unpacks it first, into the write-back buffer
+ * or a block of its own, and write-back may pack it again.
+ * Extent-mapped and compressed files are not packed.
+ */
+
+/** blocks after the current fragment block searched for free room */
+#define FRAG_SCAN 64
+
+/**
+ * Mark the fragment map block holding the mask of a block as dirty.
+ *
+ * @param blk the block number
+ */
+static void mark_frag(uint32_t blk)
+{
+    int b = blk / FRAG_MASKS_PER_BLK;
+    if (!frag_dirty[b]) {
+        frag_dirty[b] = TRUE;
+        n_dirty++;
+    }
+}
+
+/**
+ * Create an empty fragment map in a run of free blocks. The
+ * superblock is written at once so that a rebuild after a crash
+ * finds the map.
+ *
+ * @return 0 if successful, or -ENOSPC
+ */
+static int frag_create(void)
+{
+    int sz = (sb.num_blocks + FRAG_MASKS_PER_BLK - 1) / FRAG_MASKS_PER_BLK, got;
+    uint32_t start;
+
+    if (frag_map != NULL) {
+        return 0;
+    }
+    start = get_free_run(0, sz, &got);
+    if (got < sz) {
+        if (start != 0)
+            return_blk_range(start, got);
+        return -ENOSPC;
+    }
+    frag_map = calloc(sz, FS_BLOCK_SIZE);
+    frag_dirty = calloc(sz, 1);
+    write_blocks(start, sz, frag_map);
+    sb.frag_map = start;
+    sb.frag_map_sz = sz;
+    write_block(0, (uint8_t*)&sb);
+    return 0;
+}
+
+/**
+ * Find room for a run of fragments in a fragment block.
+ *
+ * @param mask the fragments in use
+ * @param n number of fragments wanted
+ * @return the first fragment of the run, or -1 if there is no room
+ */
+static int frag_fit(uint8_t mask, int n)
+{
+    uint8_t want = (1 << n) - 1;
+    for (int first = 0; first + n <= FS_FRAGS_PER_BLK; first++) {
+        if ((mask & (want << first)) == 0)
+            return first;
+    }
+    return -1;
+}
+
+/**
+ * Allocate a run of fragments, in the fragment block used last or
+ * one of the next few, or else in a new block after it.
+ *
+ * @param n number of fragments, less than FS_FRAGS_PER_BLK
+ * @param fresh set to TRUE if the block is new and holds no tails
+ * @return the fragment address, or 0 if there is no space
+ */
+static uint32_t frag_alloc(int n, int *fresh)
+{
+    uint32_t blk = frag_cursor;
+    int first = -1, i;
+
+    for (i = 0; i < FRAG_SCAN && blk + i < n_blocks; i++) {
+        if (frag_map[blk + i] != 0 && (first = frag_fit(frag_map[blk + i], n)) >= 0)
+            break;
+    }
+    *fresh = first < 0;
+    if (first >= 0) {
+        blk += i;
+    }
+    else {
+        if ((blk = get_free_blk_near(frag_cursor)) == 0) {
+            return 0;
+        }
+        if (blk >= FS_FRAG_BLK_MAX) {
+            return_blk(blk);
+            return 0;
+        }
+        first = 0;
+    }
+    frag_map[blk] |= ((1 << n) - 1) << first;
+    mark_frag(blk);
+    frag_cursor = blk;
+    return FS_FRAG_ADDR(blk, first, n);
+}
+
+/**
+ * Free the fragments of a packed tail, and their block once it
+ * holds no other tails.
+ *
+ * @param addr the fragment address
+ */
+static void frag_free(uint32_t addr)
+{
+    uint32_t blk = FS_FRAG_BLK(addr);
+    if (frag_map == NULL || blk >= n_blocks) {
+        return;
+    }
+    frag_map[blk] &= ~(((1 << FS_FRAG_COUNT(addr)) - 1) << FS_FRAG_FIRST(addr));
+    mark_frag(blk);
+    if (frag_map[blk] == 0) {
+        return_blk(blk);
+    }
+}
+
+/**
+ * Read a packed tail as a whole block, zero-filled past its
+ * fragments.
+ *
+ * @param addr the fragment address
+ * @param buf the block buffer
+ * @return 0 if successful, or -EIO
+ */
+static int frag_read(uint32_t addr, uint8_t *buf)
+{
+    uint8_t blk_buf[FS_BLOCK_SIZE];
+    int rv = read_block(FS_FRAG_BLK(addr), blk_buf);
+    memset(buf, 0, FS_BLOCK_SIZE);
+    memcpy(buf, blk_buf + FS_FRAG_FIRST(addr) * FS_FRAG_SIZE, FS_FRAG_COUNT(addr) * FS_FRAG_SIZE);
+    return rv;
+}
+
+/**
+ * Pack the last buffered block of a file into fragments if it is
+ * the file's partial last block and fits in less than a block of
+ * them. Called by da_writeback before blocks are allocated.
+ *
+ * @param in the file inode
+ * @param f the file's buffer
+ */
+static void tail_pack(struct fs_inode *in, struct da_file *f)
+{
+    uint8_t buf[FS_BLOCK_SIZE];
+    int len = in -> size % FS_BLOCK_SIZE, n, fresh;
+    uint32_t lblk, addr, blk;
+
+    if (!pack_tails || f -> n == 0 || len == 0 || !S_ISREG(in -> mode) ||
+        (in -> flags & (FS_FL_EXTENTS | FS_FL_COMPRESS | FS_FL_TAIL))) {
+        return;
+    }
+    lblk = f -> lblk[f -> n - 1];
+    n = (len + FS_FRAG_SIZE - 1) / FS_FRAG_SIZE;
+    if (lblk != in -> size / FS_BLOCK_SIZE || n >= FS_FRAGS_PER_BLK ||
+        get_blk(in, lblk, FALSE) != 0 || frag_create() < 0 || (addr = frag_alloc(n, &fresh)) == 0) {
+        return;
+    }
+    if (map_blks(in, lblk, lblk, addr) < 0) {
+        frag_free(addr);
+        return;
+    }
+    blk = FS_FRAG_BLK(addr);
+    if (fresh)
+        memset(buf, 0, FS_BLOCK_SIZE);
+    else
+        read_block(blk, buf);
+    memset(buf + FS_FRAG_FIRST(addr) * FS_FRAG_SIZE, 0, n * FS_FRAG_SIZE);
+    memcpy(buf + FS_FRAG_FIRST(addr) * FS_FRAG_SIZE,
+           f -> data + (size_t)(f -> n - 1) * BLOCK_SIZE, len);
+    write_data_blocks(blk, 1, buf);
+    in -> flags |= FS_FL_TAIL;
+    mark_inode(in);
+    f -> n--;
+    da_total--;
+}
+
+/**
+ * Unpack the tail of a file, before it is written or the file size
+ * changes: into the file's write-back buffer, or into a block of
+ * its own when the caller allocates blocks directly.
+ *
+ * @param in the file inode
+ * @param inum the file inode number to buffer the tail, or -1 to
+ *   give it a block
+ * @return 0 if successful, -ENOSPC, or -EIO if the tail could not
+ *   be read
+ */
+static int tail_unpack(struct fs_inode *in, int inum)
+{
+    uint8_t buf[FS_BLOCK_SIZE];
+    int lblk = (in -> size - 1) / FS_BLOCK_SIZE, rv;
+    uint32_t addr, blk = 0;
+
+    if (!(in -> flags & FS_FL_TAIL)) {
+        return 0;
+    }
+    addr = get_blk(in, lblk, FALSE);
+    if (inum < 0) {
+        uint32_t prev = lblk > 0 ? get_blk(in, lblk - 1, FALSE) : 0;
+        if ((blk = get_free_blk_near(prev + 1)) == 0)
+            return -ENOSPC;
+    }
+    rv = frag_read(addr, buf);
+    set_ptr_blk(in, lblk, blk);
+    if (inum < 0)
+        write_data_blocks(blk, 1, buf);
+    else
+        memcpy(da_block(inum, lblk), buf, FS_BLOCK_SIZE);
+    frag_free(addr);
+    in -> flags &= ~FS_FL_TAIL;
+    mark_inode(in);
+    return rv;
+}
+
+/**
+ * Write back the dirty blocks of the fragment map. Called before
+ * csum_flush, since writing them changes the checksum map.
+ */
+static void frag_flush(void)
+{
+    for (int i = 0; frag_map != NULL && i < sb.frag_map_sz; i++) {
+        if (frag_dirty[i]) {
+            write_block(sb.frag_map + i, frag_map + i * FRAG_MASKS_PER_BLK);
+            frag_dirty[i] = FALSE;
+        }
+    }
+}
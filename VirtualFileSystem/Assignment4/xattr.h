@@ -0,0 +1,324 @@
+/*
+ * xattr.h
+ *
+ * Extended attributes (see fsx600.h). An attribute is kept in the
+ * inode if it fits in what is left of its xattr[] area, and in the
+ * inode's xattr block otherwise, so that reading the small ones a
+ * file usually has needs no block at all.
+ *
+ * Xattr blocks are copied to a small cache when used. A block
+ * holding the same attributes as one an inode is given is looked
+ * for there and shared, with a reference counted in its header;
+ * files tagged alike thus share one block. A shared block is never
+ * changed in place: an inode changing its attributes moves to
+ * another block.
+ *
+ * The cache holds blocks of the live file system only; snapshot
+ * views read xattr blocks from the device.
+ */
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+/**
+ * Names of attributes that switch an empty regular file to extent
+ * mapping or compression when set, or a directory to compressing
+ * its new files, instead of being stored; the FS_MODE_ bits of
+ * mknod, mkdir and chmod never get past the kernel on a mounted
+ * file system. They read as "1" while the inode has the flag, and
+ * are not listed.
+ */
+#define XATTR_NAME_EXTENTS  "user.x600.extents"
+#define XATTR_NAME_COMPRESS "user.x600.compress"
+
+/**
+ * Find the inode flag an attribute name stands for.
+ *
+ * @param name the attribute name
+ * @return the flag, or 0 for a stored attribute
+ */
+static uint32_t xattr_flag(const char *name)
+{
+    if (strcmp(name, XATTR_NAME_EXTENTS) == 0)
+        return FS_FL_EXTENTS;
+    if (strcmp(name, XATTR_NAME_COMPRESS) == 0)
+        return FS_FL_COMPRESS;
+    return 0;
+}
+
+/**
+ * Find an attribute in an xattr area.
+ *
+ * @param area the entry list
+ * @param size the size of the area
+ * @param name the attribute name
+ * @param end set to the offset of the end of the list
+ * @return the offset of the entry, or -1
+ */
+static int xattr_find(uint8_t *area, int size, const char *name, int *end)
+{
+    int off = 0, len = strlen(name), found = -1;
+    struct fs_xattr *xe;
+
+    while (off + (int)sizeof(struct fs_xattr) <= size) {
+        xe = (struct fs_xattr*)(area + off);
+        if (xe -> name_len == 0 || off + FS_XATTR_LEN(xe -> name_len, xe -> value_len) > size)
+            break;
+        if (found < 0 && xe -> name_len == len && memcmp(xe -> name, name, len) == 0)
+            found = off;
+        off += FS_XATTR_LEN(xe -> name_len, xe -> value_len);
+    }
+    *end = off;
+    return found;
+}
+
+/**
+ * Remove an entry from an xattr area, moving the entries after it
+ * down.
+ *
+ * @param area the entry list
+ * @param size the size of the area
+ * @param off the offset of the entry
+ */
+static void xattr_remove(uint8_t *area, int size, int off)
+{
+    struct fs_xattr *xe = (struct fs_xattr*)(area + off);
+    int len = FS_XATTR_LEN(xe -> name_len, xe -> value_len);
+
+    memmove(area + off, area + off + len, size - off - len);
+    memset(area + size - len, 0, len);
+}
+
+/**
+ * Add an entry at the end of an xattr area.
+ *
+ * @param area the entry list
+ * @param size the size of the area
+ * @param name the attribute name
+ * @param value the value
+ * @param vlen the value length
+ * @return 0, or -1 if there is no room
+ */
+static int xattr_append(uint8_t *area, int size, const char *name, const char *value, int vlen)
+{
+    int end, len = strlen(name);
+    struct fs_xattr *xe;
+
+    xattr_find(area, size, name, &end);
+    if (end + FS_XATTR_LEN(len, vlen) > size)
+        return -1;
+    xe = (struct fs_xattr*)(area + end);
+    memset(xe, 0, FS_XATTR_LEN(len, vlen));
+    xe -> name_len = len;
+    xe -> value_len = vlen;
+    memcpy(xe -> name, name, len);
+    memcpy(xe -> name + len, value, vlen);
+    return 0;
+}
+
+/**
+ * Find the cache slot of an xattr block.
+ *
+ * @param blk the block number
+ * @return the slot, or NULL if the block is not cached
+ */
+static struct xattr_cache_ent *xattr_cached(uint32_t blk)
+{
+    for (int i = 0; i < XATTR_CACHE_SLOTS; i++) {
+        if (xattr_cache[i].blk == blk) {
+            xattr_cache[i].used = ++xattr_clock;
+            return &xattr_cache[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Put an xattr block in the cache, in place of the one used
+ * longest ago.
+ *
+ * @param blk the block number
+ * @param buf the block contents
+ */
+static void xattr_cache_put(uint32_t blk, const uint8_t *buf)
+{
+    struct xattr_cache_ent *e = xattr_cached(blk);
+    if (e == NULL) {
+        e = &xattr_cache[0];
+        for (int i = 1; i < XATTR_CACHE_SLOTS; i++) {
+            if (xattr_cache[i].used < e -> used)
+                e = &xattr_cache[i];
+        }
+        e -> blk = blk;
+        e -> used = ++xattr_clock;
+    }
+    memcpy(e -> data, buf, FS_BLOCK_SIZE);
+}
+
+/**
+ * Read an xattr block, from the cache if it is there.
+ *
+ * @param blk the block number
+ * @param buf FS_BLOCK_SIZE bytes for the block
+ * @return 0, or -EIO if the block fails its checksum or is not an
+ *   xattr block
+ */
+static int xattr_blk_read(uint32_t blk, uint8_t *buf)
+{
+    struct xattr_cache_ent *e = cur_snap == NULL ? xattr_cached(blk) : NULL;
+
+    if (e != NULL) {
+        memcpy(buf, e -> data, FS_BLOCK_SIZE);
+        return 0;
+    }
+    if (read_block(blk, buf) < 0 ||
+        ((struct fs_xattr_header*)buf) -> magic != FS_XATTR_MAGIC) {
+        return -EIO;
+    }
+    if (cur_snap == NULL)
+        xattr_cache_put(blk, buf);
+    return 0;
+}
+
+/**
+ * Write an xattr block through the cache.
+ *
+ * @param blk the block number
+ * @param buf the block contents
+ */
+static void xattr_blk_write(uint32_t blk, const uint8_t *buf)
+{
+    write_block(blk, buf);
+    xattr_cache_put(blk, buf);
+}
+
+/**
+ * Drop an inode's reference to its xattr block, freeing the block
+ * with the last one.
+ *
+ * @param in the inode
+ */
+static void xattr_release(struct fs_inode *in)
+{
+    uint8_t buf[FS_BLOCK_SIZE];
+    struct fs_xattr_header *h = (struct fs_xattr_header*)buf;
+    struct xattr_cache_ent *e;
+
+    if (in -> xattr_blk == 0)
+        return;
+    if (xattr_blk_read(in -> xattr_blk, buf) < 0) {
+        // its count is unknown; a map rebuild frees it if unused
+    }
+    else if (h -> refcount > 1) {
+        h -> refcount--;
+        xattr_blk_write(in -> xattr_blk, buf);
+    }
+    else {
+        if ((e = xattr_cached(in -> xattr_blk)) != NULL)
+            e -> blk = 0;
+        return_blk(in -> xattr_blk);
+    }
+    in -> xattr_blk = 0;
+    mark_inode(in);
+}
+
+/**
+ * Give an inode an xattr block holding a list of entries: a cached
+ * block that holds the same list, shared, or else its own block,
+ * rewritten in place if no other inode uses it.
+ *
+ * @param in the inode
+ * @param entries FS_XATTR_BLOCK_SPACE bytes of entries
+ * @return 0, or -ENOSPC
+ */
+static int xattr_blk_set(struct fs_inode *in, const uint8_t *entries)
+{
+    uint8_t buf[FS_BLOCK_SIZE];
+    struct fs_xattr_header *h = (struct fs_xattr_header*)buf;
+    int i, end, blk;
+
+    xattr_find((uint8_t*)entries, FS_XATTR_BLOCK_SPACE, "", &end);
+    if (end == 0) {
+        xattr_release(in);
+        return 0;
+    }
+    for (i = 0; i < XATTR_CACHE_SLOTS; i++) {
+        struct xattr_cache_ent *e = &xattr_cache[i];
+        if (e -> blk == 0 || memcmp(e -> data + sizeof(*h), entries, FS_XATTR_BLOCK_SPACE) != 0)
+            continue;
+        if (e -> blk == in -> xattr_blk)
+            return 0;
+        memcpy(buf, e -> data, FS_BLOCK_SIZE);
+        h -> refcount++;
+        blk = e -> blk;
+        xattr_blk_write(blk, buf);
+        xattr_release(in);
+        in -> xattr_blk = blk;
+        mark_inode(in);
+        return 0;
+    }
+    blk = in -> xattr_blk;
+    if (blk != 0 && (xattr_blk_read(blk, buf) < 0 || h -> refcount > 1)) {
+        blk = 0;
+    }
+    if (blk == 0 && (blk = get_free_blk()) == 0) {
+        return -ENOSPC;
+    }
+    if (blk != in -> xattr_blk) {
+        xattr_release(in);
+        in -> xattr_blk = blk;
+        mark_inode(in);
+    }
+    memset(buf, 0, sizeof(*h));
+    h -> magic = FS_XATTR_MAGIC;
+    h -> refcount = 1;
+    memcpy(buf + sizeof(*h), entries, FS_XATTR_BLOCK_SPACE);
+    xattr_blk_write(blk, buf);
+    return 0;
+}
+
+/**
+ * Copy the attributes of an inode: its xattr[] area, and the
+ * entries of its xattr block, all zeros if it has none.
+ *
+ * @param in the inode
+ * @param inl FS_XATTR_INLINE bytes for the inode's entries
+ * @param entries FS_XATTR_BLOCK_SPACE bytes for the block's entries
+ * @return 0, or -EIO
+ */
+static int xattr_load(struct fs_inode *in, uint8_t *inl, uint8_t *entries)
+{
+    uint8_t buf[FS_BLOCK_SIZE];
+
+    memcpy(inl, in -> xattr, FS_XATTR_INLINE);
+    memset(entries, 0, FS_XATTR_BLOCK_SPACE);
+    if (in -> xattr_blk != 0) {
+        if (xattr_blk_read(in -> xattr_blk, buf) < 0)
+            return -EIO;
+        memcpy(entries, buf + sizeof(struct fs_xattr_header), FS_XATTR_BLOCK_SPACE);
+    }
+    return 0;
+}
+
+/**
+ * Store attributes copied by xattr_load and changed. The block
+ * entries are stored first, as the inode is only changed if they
+ * can be.
+ *
+ * @param inum the inode number
+ * @param inl the inode's entries
+ * @param entries the block's entries
+ * @return 0, or -ENOSPC
+ */
+static int xattr_store(int inum, const uint8_t *inl, const uint8_t *entries)
+{
+    struct fs_inode *in = get_inode(inum);
+    int rv = xattr_blk_set(in, entries);
+
+    if (rv < 0)
+        return rv;
+    memcpy(in -> xattr, inl, FS_XATTR_INLINE);
+    mark_inode(in);
+    return 0;
+}